@@ -0,0 +1,296 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsAnomalyDetector.hpp"
+#include <math.h>
+#include <string.h>
+
+// minimum stdev (ms) used to standardize samples, it prevents a
+// very stable baseline from turning sub-millisecond jitter into alarms
+static const double MIN_STDEV_MS = 1.0;
+// large updates (reloads) release the lock every UPDATE_BATCH domains
+static const size_t UPDATE_BATCH = 4096;
+// standardized samples are clipped to +/- MAX_Z, hence a single
+// outlier (e.g. a retransmission) cannot raise an alarm on its own
+static const double MAX_Z = 3.0;
+
+
+DnsAnomalyDetector::DnsAnomalyDetector(double alpha,
+				       double slack,
+				       double threshold,
+				       unsigned int warmup) {
+  // at least one sample is needed to seed the baseline
+  this->warmup = (warmup > 0) ? warmup : 1;
+  set_parameters(alpha, slack, threshold);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_init(&states_lock, NULL);
+#endif
+}
+
+
+void DnsAnomalyDetector::set_parameters(double alpha, double slack, double threshold) {
+  if(alpha <= 0 || alpha > 1) {
+    throw std::string("DnsAnomalyDetector - alpha must be in (0,1]");
+  }
+  if(slack < 0 || threshold <= 0) {
+    throw std::string("DnsAnomalyDetector - slack must be >= 0 and threshold > 0");
+  }
+  this->alpha = alpha;
+  this->slack = slack;
+  this->threshold = threshold;
+}
+
+
+void DnsAnomalyDetector::add_domain(int domain_id) {
+  std::vector<int> to_add(1, domain_id);
+  add_domains(to_add);
+}
+
+
+// called with states_lock held
+int32_t DnsAnomalyDetector::find_slot(int domain_id) const {
+  if(domain_id >= 0 && domain_id < DIRECT_DOMAIN_IDS) {
+    return ((size_t) domain_id < slot_of.size()) ? slot_of[domain_id] : -1;
+  }
+  std::map<int,uint32_t>::const_iterator it = other_slots.find(domain_id);
+  return (it != other_slots.end()) ? (int32_t) it->second : -1;
+}
+
+
+// called with the exclusive states_lock held
+uint32_t DnsAnomalyDetector::add_slot(int domain_id) {
+  int32_t found = find_slot(domain_id);
+  if(found >= 0) {
+    return found;
+  }
+  uint32_t slot;
+  if(!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  }
+  else {
+    slot = slots.size();
+    slots.push_back(anomaly_state());
+    slot_domain.push_back(-1);
+  }
+  memset(&slots[slot], 0, sizeof(anomaly_state));
+  slot_domain[slot] = domain_id;
+  if(domain_id >= 0 && domain_id < DIRECT_DOMAIN_IDS) {
+    if((size_t) domain_id >= slot_of.size()) {
+      slot_of.resize(domain_id + 1, -1);
+    }
+    slot_of[domain_id] = slot;
+  }
+  else {
+    other_slots[domain_id] = slot;
+  }
+  return slot;
+}
+
+
+void DnsAnomalyDetector::add_domains(const std::vector<int> &to_add) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&states_lock);
+#endif
+  // the memory of all the new states at once
+  size_t needed = slot_domain.size() - free_slots.size() + to_add.size();
+  if(needed > slots.capacity()) {
+    slots.reserve(needed);
+    slot_domain.reserve(needed);
+  }
+  std::vector<int>::const_iterator it;
+  for(it = to_add.begin(); it != to_add.end(); it++) {
+    // an existing state is left untouched
+    add_slot(*it);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if((it - to_add.begin() + 1) % UPDATE_BATCH == 0) {
+      pthread_rwlock_unlock(&states_lock);
+      pthread_rwlock_wrlock(&states_lock);
+    }
+#endif
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&states_lock);
+#endif
+}
+
+
+void DnsAnomalyDetector::remove_domains(const std::vector<int> &to_remove) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&states_lock);
+#endif
+  std::vector<int>::const_iterator it;
+  for(it = to_remove.begin(); it != to_remove.end(); it++) {
+    int32_t slot = find_slot(*it);
+    if(slot >= 0) {
+      slot_domain[slot] = -1;
+      free_slots.push_back(slot);
+      if(*it >= 0 && *it < DIRECT_DOMAIN_IDS) {
+	slot_of[*it] = -1;
+      }
+      else {
+	other_slots.erase(*it);
+      }
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if((it - to_remove.begin() + 1) % UPDATE_BATCH == 0) {
+      pthread_rwlock_unlock(&states_lock);
+      pthread_rwlock_wrlock(&states_lock);
+    }
+#endif
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&states_lock);
+#endif
+}
+
+
+void DnsAnomalyDetector::export_states(std::vector<std::pair<int,anomaly_state> > &out) {
+  out.clear();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  // exclusive lock: states are written under the shared one
+  pthread_rwlock_wrlock(&states_lock);
+#endif
+  out.reserve(slot_domain.size() - free_slots.size());
+  // the negative ids, then slot_of in id order, then the large ids
+  std::map<int,uint32_t>::const_iterator it = other_slots.begin();
+  for(; it != other_slots.end() && it->first < 0; it++) {
+    out.push_back(std::make_pair(it->first, slots[it->second]));
+  }
+  for(size_t id = 0; id < slot_of.size(); id++) {
+    if(slot_of[id] < 0) {
+      continue;
+    }
+    out.push_back(std::make_pair((int) id, slots[slot_of[id]]));
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(out.size() % UPDATE_BATCH == 0) {
+      pthread_rwlock_unlock(&states_lock);
+      pthread_rwlock_wrlock(&states_lock);
+    }
+#endif
+  }
+  for(; it != other_slots.end(); it++) {
+    out.push_back(std::make_pair(it->first, slots[it->second]));
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&states_lock);
+#endif
+}
+
+
+void DnsAnomalyDetector::set_state(int domain_id, const anomaly_state &st) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&states_lock);
+#endif
+  slots[add_slot(domain_id)] = st;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&states_lock);
+#endif
+}
+
+
+bool DnsAnomalyDetector::update(int domain_id,
+				double latency,
+				int current_ts,
+				anomaly_event &ev) {
+  // failed queries are not latency samples
+  if(latency < 0) {
+    return false;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&states_lock);
+#endif
+  bool alarm = false;
+  int32_t slot = find_slot(domain_id);
+  if(slot >= 0) {
+    alarm = update_state(slots[slot], domain_id, latency, current_ts, ev);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&states_lock);
+#endif
+  return alarm;
+}
+
+
+bool DnsAnomalyDetector::update_state(anomaly_state &st,
+				      int domain_id,
+				      double latency,
+				      int current_ts,
+				      anomaly_event &ev) {
+  st.num_samples++;
+  if(st.num_samples <= warmup) {
+    // warm up: plain incremental mean and variance (same update
+    // as the EWMA one with weight 1/n) and no test
+    double w = 1.0 / (double) st.num_samples;
+    double diff = latency - st.ewma;
+    st.ewma += w * diff;
+    st.ewmvar = (1 - w) * (st.ewmvar + w * diff * diff);
+    return false;
+  }
+  double stdev = sqrt(st.ewmvar);
+  if(stdev < MIN_STDEV_MS) {
+    stdev = MIN_STDEV_MS;
+  }
+  double z = (latency - st.ewma) / stdev;
+  if(z > MAX_Z) {
+    z = MAX_Z;
+  }
+  if(z < -MAX_Z) {
+    z = -MAX_Z;
+  }
+  // two one-sided CUSUM tests on the standardized sample
+  st.cusum_pos = fmax(0.0, st.cusum_pos + z - slack);
+  st.cusum_neg = fmax(0.0, st.cusum_neg - z - slack);
+  if(st.cusum_pos > threshold || st.cusum_neg > threshold) {
+    ev.domain_id = domain_id;
+    ev.ts = current_ts;
+    ev.direction = (st.cusum_pos > threshold) ? 1 : -1;
+    ev.latency = latency;
+    ev.baseline_avg = st.ewma;
+    ev.baseline_stdev = sqrt(st.ewmvar);
+    ev.score = fmax(st.cusum_pos, st.cusum_neg);
+    st.num_alarms++;
+    // a change has been detected: restart the baseline
+    // from the new level (the variance too, it would still
+    // include the shift) with a new warm up seeded by this sample
+    st.cusum_pos = 0;
+    st.cusum_neg = 0;
+    st.ewma = latency;
+    st.ewmvar = 0;
+    st.num_samples = 1;
+    return true;
+  }
+  // the baseline is updated after the test (so a sample cannot
+  // mask itself) using the clipped difference
+  double diff = z * stdev;
+  st.ewma += alpha * diff;
+  st.ewmvar = (1 - alpha) * (st.ewmvar + alpha * diff * diff);
+  return false;
+}
+
+
+DnsAnomalyDetector::~DnsAnomalyDetector() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_destroy(&states_lock);
+#endif
+}
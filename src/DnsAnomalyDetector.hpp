@@ -0,0 +1,120 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSANOMALYDETECTOR_H
+#define _DNSANOMALYDETECTOR_H
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+/* anomaly_state:
+ * fixed size streaming state kept for every domain,
+ * an EWMA baseline (mean and variance) and the two
+ * one-sided CUSUM statistics computed on the standardized
+ * distance from the baseline */
+struct anomaly_state {
+  double ewma;          // baseline latency (ms)
+  double ewmvar;        // baseline variance (ms^2)
+  double cusum_pos;     // accumulated evidence of a latency increase
+  double cusum_neg;     // accumulated evidence of a latency decrease
+  uint32_t num_samples; // successful samples since the baseline (re)start
+  uint32_t num_alarms;  // alarms raised so far
+};
+
+/* anomaly_event:
+ * what the detector reports when a CUSUM statistic
+ * crosses the decision threshold */
+struct anomaly_event {
+  int domain_id;
+  int ts;
+  int direction;         // +1 latency went up, -1 latency went down
+  double latency;        // sample that triggered the alarm
+  double baseline_avg;   // baseline before the change
+  double baseline_stdev;
+  double score;          // CUSUM statistic at alarm time
+};
+
+
+/* Dns Anomaly Detector:
+ * this class keeps an anomaly_state per domain and updates it
+ * in O(1) for every latency sample (EWMA baseline + CUSUM
+ * change-point test). When a change is detected the baseline
+ * is restarted from the current sample and an event is returned
+ * to the caller.
+ * The states are kept in a preallocated vector of slots, the slot of
+ * a domain is found by indexing slot_of with the domain id (ids are
+ * the dense auto-increment ones of the database; negative ids or ids
+ * above DIRECT_DOMAIN_IDS go through the other_slots map instead)
+ * The scheduler never hands out two probes of the same domain at
+ * once, hence updates only need a shared (read) lock on the index,
+ * adding/removing domains (reload) takes the exclusive one
+ */
+class DnsAnomalyDetector{
+private:
+  double alpha;          // EWMA smoothing factor
+  double slack;          // CUSUM reference value k (in stdevs)
+  double threshold;      // CUSUM decision threshold h (in stdevs)
+  unsigned int warmup;   // samples used to build the baseline before testing
+  std::vector<anomaly_state> slots;
+  std::vector<int> slot_domain;         // domain of a slot, -1: free
+  std::vector<uint32_t> free_slots;
+  std::vector<int32_t> slot_of;         // by domain id, -1: not monitored
+  std::map<int,uint32_t> other_slots;   // ids out of slot_of
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_t states_lock;
+#endif
+  // slot of the domain, -1 if not monitored
+  int32_t find_slot(int domain_id) const;
+  // slot of the domain, a new one (fresh state) if not monitored
+  uint32_t add_slot(int domain_id);
+  bool update_state(anomaly_state &st, int domain_id, double latency,
+		    int current_ts, anomaly_event &ev);
+public:
+  static const int DIRECT_DOMAIN_IDS = 1 << 24;
+  DnsAnomalyDetector(double alpha = 0.05,
+		     double slack = 0.5,
+		     double threshold = 5.0,
+		     unsigned int warmup = 10);
+  void set_parameters(double alpha, double slack, double threshold);
+  void add_domain(int domain_id);
+  void add_domains(const std::vector<int> &to_add);
+  void remove_domains(const std::vector<int> &to_remove);
+  /* copy of all the states (checkpoint) sorted by domain id, the
+   * domains must not be added/removed concurrently, i.e. call it
+   * from the thread that adds/removes domains */
+  void export_states(std::vector<std::pair<int,anomaly_state> > &out);
+  void set_state(int domain_id, const anomaly_state &st);
+  // returns true (and fills ev) if the sample raises an alarm
+  bool update(int domain_id, double latency, int current_ts, anomaly_event &ev);
+  ~DnsAnomalyDetector();
+};
+
+#endif /* _DNSANOMALYDETECTOR_H */
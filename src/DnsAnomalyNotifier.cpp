@@ -0,0 +1,200 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsAnomalyNotifier.hpp"
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// events waiting for delivery, beyond this they are dropped
+static const size_t MAX_QUEUED_EVENTS = 4096;
+
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+// this function is not visible outside this code unit
+static void * delivery_run_wrapper(void * arg){
+  try {
+    ((DnsAnomalyNotifier *) arg)->delivery_run();
+  }
+  catch (...) {
+    std::cerr << "Error in anomaly delivery thread" << std::endl;
+  }
+  pthread_exit(NULL);
+}
+#endif
+
+
+DnsAnomalyNotifier::DnsAnomalyNotifier(DnsDbHandler &ddh, const char * hook) : ddh(ddh) {
+  num_dropped = 0;
+  if(hook != NULL) {
+    this->hook = hook;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_init(&queue_mutex, NULL);
+  pthread_cond_init(&queue_cond, NULL);
+  stopping = false;
+  int rc = pthread_create(&delivery_thread, NULL, delivery_run_wrapper, this);
+  thread_started = (rc == 0);
+  if(rc) {
+    // fall back to synchronous delivery
+    std::cerr << "Can't create anomaly delivery thread: " << strerror(rc) << std::endl;
+  }
+#endif
+}
+
+
+void DnsAnomalyNotifier::set_hook(const char * hook) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&queue_mutex);
+#endif
+  this->hook = (hook != NULL) ? hook : "";
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&queue_mutex);
+#endif
+}
+
+
+void DnsAnomalyNotifier::notify(const anomaly_event &ev, const std::string &domain_name) {
+  anomaly_notification n;
+  n.ev = ev;
+  n.domain_name = domain_name;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  if(thread_started) {
+    pthread_mutex_lock(&queue_mutex);
+    if(queue.size() < MAX_QUEUED_EVENTS) {
+      queue.push_back(n);
+      pthread_cond_signal(&queue_cond);
+    }
+    else {
+      num_dropped++;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return;
+  }
+#endif
+  deliver(n, hook);
+}
+
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+void DnsAnomalyNotifier::delivery_run() {
+  pthread_mutex_lock(&queue_mutex);
+  while(true) {
+    while(queue.empty() && !stopping) {
+      pthread_cond_wait(&queue_cond, &queue_mutex);
+    }
+    if(queue.empty() && stopping) {
+      break;
+    }
+    anomaly_notification n = queue.front();
+    queue.pop_front();
+    std::string hook_cmd = hook;
+    // the db write and the hook run without holding the queue
+    pthread_mutex_unlock(&queue_mutex);
+    try {
+      deliver(n, hook_cmd);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+    pthread_mutex_lock(&queue_mutex);
+  }
+  pthread_mutex_unlock(&queue_mutex);
+}
+#endif
+
+
+void DnsAnomalyNotifier::deliver(const anomaly_notification &n, const std::string &hook_cmd) {
+  ddh.insert_anomaly_event(n.ev);
+  if(!hook_cmd.empty()) {
+    run_hook(n, hook_cmd);
+  }
+}
+
+
+void DnsAnomalyNotifier::run_hook(const anomaly_notification &n, const std::string &hook_cmd) {
+  // the event is passed to the hook through environment variables,
+  // the environment is prepared before fork (no allocation in the child)
+  std::vector<std::string> env;
+  std::stringstream s;
+  const char * path = getenv("PATH");
+  env.push_back(std::string("PATH=") + ((path != NULL) ? path : "/usr/bin:/bin"));
+  env.push_back("DNS_ANOMALY_DOMAIN=" + n.domain_name);
+  s << "DNS_ANOMALY_DOMAIN_ID=" << n.ev.domain_id;
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_TS=" << n.ev.ts;
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_DIRECTION=" << ((n.ev.direction > 0) ? "up" : "down");
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_LATENCY=" << n.ev.latency;
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_BASELINE_AVG=" << n.ev.baseline_avg;
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_BASELINE_STDEV=" << n.ev.baseline_stdev;
+  env.push_back(s.str()); s.str("");
+  s << "DNS_ANOMALY_SCORE=" << n.ev.score;
+  env.push_back(s.str()); s.str("");
+  std::vector<char *> envp;
+  for(size_t i = 0; i < env.size(); i++) {
+    envp.push_back((char *) env[i].c_str());
+  }
+  envp.push_back(NULL);
+  pid_t pid = fork();
+  if(pid < 0) {
+    std::cerr << "Can't run anomaly hook: " << strerror(errno) << std::endl;
+    return;
+  }
+  if(pid == 0) {
+    execle("/bin/sh", "sh", "-c", hook_cmd.c_str(), (char *) NULL, &envp[0]);
+    _exit(127);
+  }
+  int status;
+  if(waitpid(pid, &status, 0) < 0 ||
+     !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::cerr << "Anomaly hook failed for " << n.domain_name << std::endl;
+  }
+}
+
+
+DnsAnomalyNotifier::~DnsAnomalyNotifier() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  if(thread_started) {
+    // pending events are delivered before the thread exits
+    pthread_mutex_lock(&queue_mutex);
+    stopping = true;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(delivery_thread, NULL);
+  }
+  if(num_dropped > 0) {
+    std::cerr << num_dropped << " anomaly events dropped (queue full)" << std::endl;
+  }
+  pthread_cond_destroy(&queue_cond);
+  pthread_mutex_destroy(&queue_mutex);
+#endif
+}
@@ -0,0 +1,78 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSANOMALYNOTIFIER_H
+#define _DNSANOMALYNOTIFIER_H
+
+#include <iostream>
+#include <deque>
+#include "DnsDbHandler.hpp"
+#include "DnsAnomalyDetector.hpp"
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+struct anomaly_notification {
+  anomaly_event ev;
+  std::string domain_name;
+};
+
+/* Dns Anomaly Notifier:
+ * this class delivers the anomaly events raised by the probing
+ * threads: every event is stored in the dns_anomalies table
+ * and, if a hook command is configured, passed to the hook
+ * (executed by /bin/sh with the event in the environment).
+ * If pthreads are present the delivery happens in a dedicated
+ * thread: notify() only appends to a bounded queue, and when
+ * the queue is full the event is dropped (and counted)
+ * rather than stalling the probes
+ */
+class DnsAnomalyNotifier{
+private:
+  DnsDbHandler &ddh;
+  std::string hook;
+  std::deque<anomaly_notification> queue;
+  unsigned long num_dropped;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_t delivery_thread;
+  pthread_mutex_t queue_mutex;
+  pthread_cond_t queue_cond;
+  bool thread_started;
+  bool stopping;
+#endif
+  void deliver(const anomaly_notification &n, const std::string &hook_cmd);
+  void run_hook(const anomaly_notification &n, const std::string &hook_cmd);
+public:
+  DnsAnomalyNotifier(DnsDbHandler &ddh, const char * hook = NULL);
+  void set_hook(const char * hook);
+  void notify(const anomaly_event &ev, const std::string &domain_name);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  void delivery_run();
+#endif
+  ~DnsAnomalyNotifier();
+};
+
+#endif /* _DNSANOMALYNOTIFIER_H */
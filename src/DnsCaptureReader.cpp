@@ -0,0 +1,449 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsCaptureReader.hpp"
+
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#if defined(HAVE_LINUX_IF_PACKET_H) && HAVE_LINUX_IF_PACKET_H == 1
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#endif
+
+#define PCAP_MAGIC_US 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_HEADER_LEN 24
+#define PCAP_RECORD_LEN 16
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_PB  2  // obsolete packet block
+#define PCAPNG_EPB 6
+#define PCAPNG_BOM 0x1A2B3C4D
+#define PCAPNG_OPT_TSRESOL 9
+
+#define RING_BLOCK_SIZE (1 << 20)
+#define RING_NUM_BLOCKS 64
+#define RING_FRAME_SIZE 2048
+#define RING_BLOCK_TIMEOUT_MS 50
+
+
+DnsCaptureReader::DnsCaptureReader() :
+  fd(-1), map(NULL), map_size(0), offset(0), pcapng(false), swapped(false),
+  ts_scale(1000), linktype(LINKTYPE_ETHERNET),
+  sock(-1), ring(NULL), ring_size(0), block_size(0), num_blocks(0),
+  cur_block(0), pkts_left(0), holding_block(false), cur_pkt(NULL) {
+}
+
+
+uint32_t DnsCaptureReader::get32(const uint8_t * p) const {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped ? __builtin_bswap32(v) : v;
+}
+
+
+uint16_t DnsCaptureReader::get16(const uint8_t * p) const {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return swapped ? __builtin_bswap16(v) : v;
+}
+
+
+void DnsCaptureReader::open_file(const char * path) {
+  close();
+  fd = open(path, O_RDONLY);
+  if(fd < 0) {
+    throw std::string("Can't open_file() - ") + path + ": " + strerror(errno);
+  }
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t) PCAP_HEADER_LEN) {
+    close();
+    throw std::string("Can't open_file() - ") + path + " is not a capture";
+  }
+  map_size = st.st_size;
+  void * m = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(m == MAP_FAILED) {
+    map = NULL;
+    close();
+    throw std::string("Can't open_file() - mmap: ") + strerror(errno);
+  }
+  map = (const uint8_t *) m;
+  // read once from the beginning to the end
+  madvise(m, map_size, MADV_SEQUENTIAL);
+  uint32_t magic;
+  memcpy(&magic, map, sizeof(magic));
+  if(magic == PCAPNG_SHB) {
+    pcapng = true;
+    offset = 0;
+    if(!read_section_header(0)) {
+      close();
+      throw std::string("Can't open_file() - ") + path + ": bad pcapng section header";
+    }
+    return;
+  }
+  swapped = (magic == __builtin_bswap32(PCAP_MAGIC_US) ||
+	     magic == __builtin_bswap32(PCAP_MAGIC_NS));
+  uint32_t m32 = get32(map);
+  if(m32 != PCAP_MAGIC_US && m32 != PCAP_MAGIC_NS) {
+    close();
+    throw std::string("Can't open_file() - ") + path + " is not a pcap or pcapng file";
+  }
+  ts_scale = (m32 == PCAP_MAGIC_NS) ? 1 : 1000;
+  linktype = get32(map + 20) & 0xffff;
+  offset = PCAP_HEADER_LEN;
+}
+
+
+int DnsCaptureReader::next_pcap(captured_packet &pkt) {
+  if(offset + PCAP_RECORD_LEN > map_size) {
+    return -1;
+  }
+  const uint8_t * rec = map + offset;
+  uint32_t caplen = get32(rec + 8);
+  if(offset + PCAP_RECORD_LEN + caplen > map_size) {
+    return -1; // truncated capture
+  }
+  pkt.ts_ns = (uint64_t) get32(rec) * 1000000000ULL + (uint64_t) get32(rec + 4) * ts_scale;
+  pkt.data = rec + PCAP_RECORD_LEN;
+  pkt.caplen = caplen;
+  pkt.linktype = linktype;
+  offset += PCAP_RECORD_LEN + caplen;
+  return 1;
+}
+
+
+// the section header at offset, block_len is 0 if not known yet
+bool DnsCaptureReader::read_section_header(size_t block_len) {
+  if(offset + 28 > map_size) {
+    return false;
+  }
+  // the byte order magic tells the byte order of the whole section
+  uint32_t bom;
+  memcpy(&bom, map + offset + 8, sizeof(bom));
+  if(bom == PCAPNG_BOM) {
+    swapped = false;
+  }
+  else if(bom == __builtin_bswap32(PCAPNG_BOM)) {
+    swapped = true;
+  }
+  else {
+    return false;
+  }
+  if(block_len == 0) {
+    block_len = get32(map + offset + 4);
+  }
+  if(block_len < 28 || offset + block_len > map_size) {
+    return false;
+  }
+  // the interfaces are numbered per section
+  if_linktypes.clear();
+  if_ts_units.clear();
+  offset += block_len;
+  return true;
+}
+
+
+void DnsCaptureReader::read_interface(const uint8_t * body, size_t body_len) {
+  if(body_len < 8) {
+    return;
+  }
+  int lt = get16(body);
+  uint64_t units = 1000000; // default resolution: us
+  size_t opt = 8;
+  while(opt + 4 <= body_len) {
+    uint16_t code = get16(body + opt);
+    uint16_t len = get16(body + opt + 2);
+    if(code == 0 || opt + 4 + len > body_len) {
+      break; // opt_endofopt
+    }
+    if(code == PCAPNG_OPT_TSRESOL && len >= 1) {
+      uint8_t res = body[opt + 4];
+      unsigned int exp = res & 0x7f;
+      if(res & 0x80) {
+	units = (exp < 64) ? (1ULL << exp) : units;
+      }
+      else {
+	units = 1;
+	for(unsigned int i = 0; i < exp && i < 19; i++) {
+	  units *= 10;
+	}
+      }
+    }
+    opt += 4 + ((len + 3) & ~3);
+  }
+  if_linktypes.push_back(lt);
+  if_ts_units.push_back(units);
+}
+
+
+int DnsCaptureReader::next_pcapng(captured_packet &pkt) {
+  while(offset + 12 <= map_size) {
+    uint32_t type;
+    memcpy(&type, map + offset, sizeof(type));
+    if(type == PCAPNG_SHB) {
+      // a new section, possibly with another byte order
+      if(!read_section_header(0)) {
+	return -1;
+      }
+      continue;
+    }
+    type = get32(map + offset);
+    uint32_t block_len = get32(map + offset + 4);
+    if(block_len < 12 || (block_len & 3) != 0 || offset + block_len > map_size) {
+      return -1; // truncated or corrupted
+    }
+    const uint8_t * body = map + offset + 8;
+    size_t body_len = block_len - 12;
+    offset += block_len;
+    if(type == PCAPNG_IDB) {
+      read_interface(body, body_len);
+    }
+    else if((type == PCAPNG_EPB || type == PCAPNG_PB) && body_len >= 20) {
+      uint32_t if_id = (type == PCAPNG_EPB) ? get32(body) : get16(body);
+      uint32_t caplen = get32(body + 12);
+      if(if_id >= if_linktypes.size() || 20 + (size_t) caplen > body_len) {
+	continue;
+      }
+      uint64_t ts = ((uint64_t) get32(body + 4) << 32) | get32(body + 8);
+      uint64_t units = if_ts_units[if_id];
+      pkt.ts_ns = (ts / units) * 1000000000ULL + (ts % units) * 1000000000ULL / units;
+      pkt.data = body + 20;
+      pkt.caplen = caplen;
+      pkt.linktype = if_linktypes[if_id];
+      return 1;
+    }
+    // other blocks (simple packets without timestamp, statistics...) are skipped
+  }
+  return -1;
+}
+
+
+void DnsCaptureReader::open_interface(const char * ifname) {
+#if defined(HAVE_LINUX_IF_PACKET_H) && HAVE_LINUX_IF_PACKET_H == 1
+  close();
+  try {
+    unsigned int ifindex = if_nametoindex(ifname);
+    if(ifindex == 0) {
+      throw std::string("unknown interface ") + ifname;
+    }
+    sock = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if(sock < 0) {
+      throw std::string("socket: ") + strerror(errno);
+    }
+    // the filter below and the matcher expect Ethernet frames
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if(ioctl(sock, SIOCGIFHWADDR, &ifr) < 0) {
+      throw std::string("SIOCGIFHWADDR: ") + strerror(errno);
+    }
+    // the loopback interface has an Ethernet header too
+    if(ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER &&
+       ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK) {
+      std::stringstream es;
+      es << ifname << " is not an Ethernet interface (ARPHRD " << ifr.ifr_hwaddr.sa_family
+	 << "), capture it to a file with tcpdump and use --pcap";
+      throw es.str();
+    }
+    linktype = LINKTYPE_ETHERNET;
+    int version = TPACKET_V3;
+    if(setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+      throw std::string("TPACKET_V3: ") + strerror(errno);
+    }
+    // udp port 53 over IPv4 (non first fragments excluded) or IPv6
+    // (without extension headers), i.e. tcpdump -dd "udp port 53"
+    struct sock_filter code[] = {
+      { 0x28, 0, 0, 12 },          // ldh [12]
+      { 0x15, 0, 6, 0x86dd },      // jeq ETHERTYPE_IPV6
+      { 0x30, 0, 0, 20 },          // ldb [20]
+      { 0x15, 0, 15, 17 },         // jeq IPPROTO_UDP
+      { 0x28, 0, 0, 54 },          // ldh [54]
+      { 0x15, 12, 0, 53 },         // jeq 53 -> accept
+      { 0x28, 0, 0, 56 },          // ldh [56]
+      { 0x15, 10, 11, 53 },        // jeq 53 -> accept, else drop
+      { 0x15, 0, 10, 0x0800 },     // jeq ETHERTYPE_IP
+      { 0x30, 0, 0, 23 },          // ldb [23]
+      { 0x15, 0, 8, 17 },          // jeq IPPROTO_UDP
+      { 0x28, 0, 0, 20 },          // ldh [20]
+      { 0x45, 6, 0, 0x1fff },      // jset fragment offset -> drop
+      { 0xb1, 0, 0, 14 },          // ldxb 4*([14]&0xf)
+      { 0x48, 0, 0, 14 },          // ldh [x+14]
+      { 0x15, 2, 0, 53 },          // jeq 53 -> accept
+      { 0x48, 0, 0, 16 },          // ldh [x+16]
+      { 0x15, 0, 1, 53 },          // jeq 53 -> accept, else drop
+      { 0x06, 0, 0, 262144 },      // accept
+      { 0x06, 0, 0, 0 }            // drop
+    };
+    struct sock_fprog filter;
+    filter.len = sizeof(code) / sizeof(code[0]);
+    filter.filter = code;
+    if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) < 0) {
+      throw std::string("SO_ATTACH_FILTER: ") + strerror(errno);
+    }
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    block_size = RING_BLOCK_SIZE;
+    num_blocks = RING_NUM_BLOCKS;
+    req.tp_block_size = block_size;
+    req.tp_block_nr = num_blocks;
+    req.tp_frame_size = RING_FRAME_SIZE;
+    req.tp_frame_nr = (block_size / RING_FRAME_SIZE) * num_blocks;
+    // a block is handed to us when full or after this time
+    req.tp_retire_blk_tov = RING_BLOCK_TIMEOUT_MS;
+    if(setsockopt(sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+      throw std::string("PACKET_RX_RING: ") + strerror(errno);
+    }
+    ring_size = (size_t) block_size * num_blocks;
+    void * m = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+    if(m == MAP_FAILED) {
+      throw std::string("mmap: ") + strerror(errno);
+    }
+    ring = (uint8_t *) m;
+    struct sockaddr_ll ll;
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_ALL);
+    ll.sll_ifindex = ifindex;
+    if(bind(sock, (struct sockaddr *) &ll, sizeof(ll)) < 0) {
+      throw std::string("bind: ") + strerror(errno);
+    }
+    cur_block = 0;
+    pkts_left = 0;
+    holding_block = false;
+  }
+  catch(std::string s) {
+    close();
+    throw std::string("Can't open_interface() -> ") + s;
+  }
+#else
+  throw std::string("Can't open_interface() - AF_PACKET rings are not supported");
+#endif
+}
+
+
+void DnsCaptureReader::release_block() {
+#if defined(HAVE_LINUX_IF_PACKET_H) && HAVE_LINUX_IF_PACKET_H == 1
+  struct tpacket_block_desc * bd =
+    (struct tpacket_block_desc *) (ring + (size_t) cur_block * block_size);
+  __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+  cur_block = (cur_block + 1) % num_blocks;
+  holding_block = false;
+#endif
+}
+
+
+int DnsCaptureReader::next_ring(captured_packet &pkt, int timeout_ms) {
+#if defined(HAVE_LINUX_IF_PACKET_H) && HAVE_LINUX_IF_PACKET_H == 1
+  while(true) {
+    if(pkts_left > 0) {
+      const struct tpacket3_hdr * hdr = (const struct tpacket3_hdr *) cur_pkt;
+      pkt.ts_ns = (uint64_t) hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+      pkt.data = cur_pkt + hdr->tp_mac;
+      pkt.caplen = hdr->tp_snaplen;
+      pkt.linktype = linktype;
+      cur_pkt += hdr->tp_next_offset;
+      pkts_left--;
+      return 1;
+    }
+    // the packets of the block are not used anymore
+    if(holding_block) {
+      release_block();
+    }
+    struct tpacket_block_desc * bd =
+      (struct tpacket_block_desc *) (ring + (size_t) cur_block * block_size);
+    if((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+      struct pollfd pfd;
+      pfd.fd = sock;
+      pfd.events = POLLIN | POLLERR;
+      pfd.revents = 0;
+      poll(&pfd, 1, timeout_ms);
+      if((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+	return 0;
+      }
+    }
+    holding_block = true;
+    pkts_left = bd->hdr.bh1.num_pkts;
+    cur_pkt = (const uint8_t *) bd + bd->hdr.bh1.offset_to_first_pkt;
+  }
+#else
+  return -1;
+#endif
+}
+
+
+int DnsCaptureReader::next(captured_packet &pkt, int timeout_ms) {
+  if(ring != NULL) {
+    return next_ring(pkt, timeout_ms);
+  }
+  if(map == NULL) {
+    return -1;
+  }
+  return pcapng ? next_pcapng(pkt) : next_pcap(pkt);
+}
+
+
+void DnsCaptureReader::close() {
+  if(map != NULL) {
+    munmap((void *) map, map_size);
+    map = NULL;
+  }
+  if(fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  if(ring != NULL) {
+    munmap(ring, ring_size);
+    ring = NULL;
+  }
+  if(sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+  map_size = 0;
+  offset = 0;
+  pcapng = false;
+  swapped = false;
+  pkts_left = 0;
+  holding_block = false;
+  if_linktypes.clear();
+  if_ts_units.clear();
+}
+
+
+DnsCaptureReader::~DnsCaptureReader() {
+  close();
+}
@@ -0,0 +1,109 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSCAPTUREREADER_H
+#define _DNSCAPTUREREADER_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "dns_latency_monitor-config.h"
+
+
+/* link layer types (pcap LINKTYPE_*) */
+enum {
+  LINKTYPE_NULL = 0,        // BSD loopback, host byte order family
+  LINKTYPE_ETHERNET = 1,
+  LINKTYPE_RAW = 101,       // starts with the IP header
+  LINKTYPE_LINUX_SLL = 113,
+  LINKTYPE_IPV4 = 228,
+  LINKTYPE_IPV6 = 229,
+  LINKTYPE_LINUX_SLL2 = 276
+};
+
+/* captured_packet:
+ * a packet as read from the capture, data points into the file
+ * mapping (or the ring), it is valid until the next call to next() */
+struct captured_packet {
+  uint64_t ts_ns;     // capture timestamp, ns since the epoch
+  const uint8_t * data;
+  uint32_t caplen;
+  int linktype;
+};
+
+
+/* Dns Capture Reader:
+ * this class reads packets without copying them, either
+ * - from a pcap or pcapng file (open_file): the file is mapped in
+ *   memory and the records are walked in place, both byte orders
+ *   and the us/ns timestamp resolutions are supported
+ * - from a network interface (open_interface): an AF_PACKET
+ *   TPACKET_V3 ring (Ethernet interfaces only), filtered in the
+ *   kernel to UDP port 53, the blocks are handed back to the kernel
+ *   once read
+ * next returns 1 with a packet, 0 if no packet arrived within
+ * timeout_ms (interface only), -1 at the end of the file
+ */
+class DnsCaptureReader{
+private:
+  // file
+  int fd;
+  const uint8_t * map;
+  size_t map_size;
+  size_t offset;
+  bool pcapng;
+  bool swapped;       // file byte order differs from ours
+  uint64_t ts_scale;  // pcap: ns per fraction unit
+  int linktype;       // pcap, interface ring
+  // pcapng, per interface of the current section
+  std::vector<int> if_linktypes;
+  std::vector<uint64_t> if_ts_units; // units per second
+  // interface ring
+  int sock;
+  uint8_t * ring;
+  size_t ring_size;
+  unsigned int block_size;
+  unsigned int num_blocks;
+  unsigned int cur_block;
+  unsigned int pkts_left;  // in the current block
+  bool holding_block;      // the current block is ours until released
+  const uint8_t * cur_pkt;
+  uint32_t get32(const uint8_t * p) const;
+  uint16_t get16(const uint8_t * p) const;
+  int next_pcap(captured_packet &pkt);
+  int next_pcapng(captured_packet &pkt);
+  bool read_section_header(size_t block_len);
+  void read_interface(const uint8_t * body, size_t body_len);
+  int next_ring(captured_packet &pkt, int timeout_ms);
+  void release_block();
+public:
+  DnsCaptureReader();
+  void open_file(const char * path);
+  void open_interface(const char * ifname);
+  int next(captured_packet &pkt, int timeout_ms = 1000);
+  void close();
+  ~DnsCaptureReader();
+};
+
+#endif /* _DNSCAPTUREREADER_H */
@@ -25,6 +25,97 @@
 #include <math.h>
 
 
+// statistics at step n from the ones at step n-1
+dns_stats DnsDbHandler::next_stats(const dns_stats &prev, double latency, int current_ts) {
+  // incremental computation of mean and stdev
+  // Formula can be found here
+  // http://math.stackexchange.com/questions/102978/incremental-computation-of-standard-deviation
+  double var_latency_nminus1 = pow(prev.latency_stdev,2.0);
+  int n = prev.num_queries + 1;
+  double avg_latency_n = (double) (prev.latency_avg * (n-1) + latency) / (double) n;
+  double var_latency_n = (n-1) * var_latency_nminus1;
+  var_latency_n += pow((latency - avg_latency_n),2.0);
+  var_latency_n += (n-1) * pow((prev.latency_avg - avg_latency_n),2.0);
+  var_latency_n = var_latency_n / (double) n;
+  dns_stats st;
+  st.latency_avg = avg_latency_n;
+  st.latency_stdev = sqrt(var_latency_n);
+  st.num_queries = n;
+  // if it is the first entry, then current_ts is the first_ts
+  st.first_ts = (prev.first_ts == 0) ? current_ts : prev.first_ts;
+  return st;
+}
+
+
+// statistics of the union of the samples of a and b (b is the newest)
+dns_stats DnsDbHandler::merge_stats(const dns_stats &a, const dns_stats &b) {
+  if(a.num_queries == 0) {
+    return b;
+  }
+  if(b.num_queries == 0) {
+    return a;
+  }
+  // pairwise update of mean and variance (Chan et al.)
+  double n_a = a.num_queries;
+  double n_b = b.num_queries;
+  double n = n_a + n_b;
+  double delta = b.latency_avg - a.latency_avg;
+  double m2 = pow(a.latency_stdev, 2.0) * n_a + pow(b.latency_stdev, 2.0) * n_b;
+  m2 += delta * delta * n_a * n_b / n;
+  dns_stats st;
+  st.latency_avg = a.latency_avg + delta * n_b / n;
+  st.latency_stdev = sqrt(m2 / n);
+  st.num_queries = a.num_queries + b.num_queries;
+  st.first_ts = (a.first_ts == 0) ? b.first_ts : a.first_ts;
+  return st;
+}
+
+
+// one more response in prev
+response_stats DnsDbHandler::next_response_stats(const response_stats &prev,
+						 const response_metrics &m, int current_ts) {
+  response_stats st = prev;
+  st.size = next_stats(prev.size, m.size, current_ts);
+  int32_t n = st.size.num_queries;
+  st.size_max = (m.size > prev.size_max) ? m.size : prev.size_max;
+  st.num_truncated += m.truncated ? 1 : 0;
+  st.num_edns += m.edns ? 1 : 0;
+  st.answers_avg += (m.num_answers - prev.answers_avg) / n;
+  st.authorities_avg += (m.num_authorities - prev.authorities_avg) / n;
+  st.additionals_avg += (m.num_additionals - prev.additionals_avg) / n;
+  st.num_signed += (m.num_signatures > 0) ? 1 : 0;
+  if(m.validation_ms >= 0) {
+    st.validation = next_stats(prev.validation, m.validation_ms, current_ts);
+  }
+  st.num_bogus += (m.validated == 0) ? 1 : 0;
+  return st;
+}
+
+
+// statistics of the responses of a and b (b is the newest)
+response_stats DnsDbHandler::merge_response_stats(const response_stats &a,
+						  const response_stats &b) {
+  double n_a = a.size.num_queries;
+  double n_b = b.size.num_queries;
+  response_stats st;
+  st.size = merge_stats(a.size, b.size);
+  st.size_max = (a.size_max > b.size_max) ? a.size_max : b.size_max;
+  st.num_truncated = a.num_truncated + b.num_truncated;
+  st.num_edns = a.num_edns + b.num_edns;
+  st.answers_avg = 0;
+  st.authorities_avg = 0;
+  st.additionals_avg = 0;
+  if(n_a + n_b > 0) {
+    st.answers_avg = (a.answers_avg * n_a + b.answers_avg * n_b) / (n_a + n_b);
+    st.authorities_avg = (a.authorities_avg * n_a + b.authorities_avg * n_b) / (n_a + n_b);
+    st.additionals_avg = (a.additionals_avg * n_a + b.additionals_avg * n_b) / (n_a + n_b);
+  }
+  st.num_signed = a.num_signed + b.num_signed;
+  st.validation = merge_stats(a.validation, b.validation);
+  st.num_bogus = a.num_bogus + b.num_bogus;
+  return st;
+}
+
 
 DnsDbHandler::DnsDbHandler(const char *db_name,
 			   const char *server,
@@ -76,6 +167,8 @@ DnsDbHandler::DnsDbHandler(const char *db_name,
     s << "`first_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
     s << "`last_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
     s << "PRIMARY KEY (`domain_id`), ";
+    // the rows written since a checkpoint (read_dns_stats)
+    s << "KEY `last_ts` (`last_ts`), ";
     s << "CONSTRAINT `domain_stats_ibfk_1` FOREIGN KEY (`domain_id`) REFERENCES `top_domains` (`id`) ";
     s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
     query = db_conn.query(s.str());
@@ -83,8 +176,137 @@ DnsDbHandler::DnsDbHandler(const char *db_name,
     if (!res) {
       throw std::string("Can't create DnsDbHandler() - Failed to create domain_stats table");
     }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `dns_anomalies` ( ";
+    s << "`id` int(11) NOT NULL AUTO_INCREMENT, ";
+    s << "`domain_id` mediumint(9) NOT NULL, ";
+    s << "`ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "`direction` tinyint(4) NOT NULL, ";
+    s << "`latency` float DEFAULT NULL, ";
+    s << "`baseline_avg` float DEFAULT NULL, ";
+    s << "`baseline_stdev` float DEFAULT NULL, ";
+    s << "`score` float DEFAULT NULL, ";
+    s << "PRIMARY KEY (`id`), ";
+    s << "KEY `domain_ts` (`domain_id`,`ts`), ";
+    s << "CONSTRAINT `dns_anomalies_ibfk_1` FOREIGN KEY (`domain_id`) REFERENCES `top_domains` (`id`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create dns_anomalies table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `probe_stage_stats` ( ";
+    s << "`ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "`stage` varchar(16) NOT NULL, ";
+    s << "`count` int(11) NOT NULL, ";
+    s << "`avg_us` float DEFAULT NULL, ";
+    s << "`p50_us` float DEFAULT NULL, ";
+    s << "`p90_us` float DEFAULT NULL, ";
+    s << "`p99_us` float DEFAULT NULL, ";
+    s << "`max_us` float DEFAULT NULL, ";
+    s << "PRIMARY KEY (`ts`,`stage`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create probe_stage_stats table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `nsset_stats` ( ";
+    s << "`nsset_hash` bigint(20) unsigned NOT NULL, ";
+    s << "`ns_names` text NOT NULL, ";
+    s << "`latency_avg` float DEFAULT NULL, ";
+    s << "`latency_stdev` float DEFAULT NULL, ";
+    s << "`num_queries` int(11) NOT NULL, ";
+    s << "`first_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "`last_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "PRIMARY KEY (`nsset_hash`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create nsset_stats table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `domain_nssets` ( ";
+    s << "`domain_id` mediumint(9) NOT NULL, ";
+    s << "`nsset_hash` bigint(20) unsigned NOT NULL, ";
+    s << "`ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "PRIMARY KEY (`domain_id`), ";
+    s << "KEY `nsset` (`nsset_hash`), ";
+    s << "CONSTRAINT `domain_nssets_ibfk_1` FOREIGN KEY (`domain_id`) REFERENCES `top_domains` (`id`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create domain_nssets table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `resolvers` ( ";
+    s << "`id` smallint(6) NOT NULL AUTO_INCREMENT, ";
+    s << "`address` varchar(64) NOT NULL, ";
+    s << "PRIMARY KEY (`id`), ";
+    s << "UNIQUE KEY `address` (`address`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create resolvers table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `resolver_stats` ( ";
+    s << "`domain_id` mediumint(9) NOT NULL, ";
+    s << "`resolver_id` smallint(6) NOT NULL, ";
+    s << "`latency_avg` float DEFAULT NULL, ";
+    s << "`latency_stdev` float DEFAULT NULL, ";
+    s << "`num_queries` int(11) NOT NULL, ";
+    s << "`num_failures` int(11) NOT NULL, ";
+    s << "`first_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "`last_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "PRIMARY KEY (`domain_id`,`resolver_id`), ";
+    s << "KEY `resolver` (`resolver_id`), ";
+    s << "CONSTRAINT `resolver_stats_ibfk_1` FOREIGN KEY (`domain_id`) REFERENCES `top_domains` (`id`), ";
+    s << "CONSTRAINT `resolver_stats_ibfk_2` FOREIGN KEY (`resolver_id`) REFERENCES `resolvers` (`id`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create resolver_stats table");
+    }
+    s.str("");
+    s << "CREATE TABLE IF NOT EXISTS  `response_stats` ( ";
+    s << "`domain_id` mediumint(9) NOT NULL, ";
+    s << "`num_responses` int(11) NOT NULL, ";
+    s << "`size_avg` float DEFAULT NULL, ";
+    s << "`size_stdev` float DEFAULT NULL, ";
+    s << "`size_max` int(11) NOT NULL, ";
+    s << "`num_truncated` int(11) NOT NULL, ";
+    s << "`num_edns` int(11) NOT NULL, ";
+    s << "`answers_avg` float DEFAULT NULL, ";
+    s << "`authorities_avg` float DEFAULT NULL, ";
+    s << "`additionals_avg` float DEFAULT NULL, ";
+    s << "`num_signed` int(11) NOT NULL, ";
+    s << "`validation_avg` float DEFAULT NULL, ";
+    s << "`validation_stdev` float DEFAULT NULL, ";
+    s << "`num_validated` int(11) NOT NULL, ";
+    s << "`num_bogus` int(11) NOT NULL, ";
+    s << "`first_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "`last_ts` timestamp NOT NULL DEFAULT '0000-00-00 00:00:00', ";
+    s << "PRIMARY KEY (`domain_id`), ";
+    s << "CONSTRAINT `response_stats_ibfk_1` FOREIGN KEY (`domain_id`) REFERENCES `top_domains` (`id`) ";
+    s << ") ENGINE=InnoDB DEFAULT CHARSET=latin1; ";
+    query = db_conn.query(s.str());
+    res = query.execute();
+    if (!res) {
+      throw std::string("Can't create DnsDbHandler() - Failed to create response_stats table");
+    }
     #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
     pthread_mutex_init(&db_conn_mutex, NULL);
+    pthread_mutex_init(&stats_mutex, NULL);
+    pthread_mutex_init(&nsset_mutex, NULL);
+    pthread_mutex_init(&resolver_mutex, NULL);
+    pthread_mutex_init(&response_mutex, NULL);
     #endif
   }
   catch(std::string s){
@@ -110,6 +332,10 @@ std::map<int,std::string> DnsDbHandler::get_top_n_domains(unsigned int n) {
   s << "ORDER BY rank ASC ";
   s << "LIMIT " << n;
   try{
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    // the list can be reloaded while the probes use the connection
+    pthread_mutex_lock(&db_conn_mutex);
+#endif
     mysqlpp::Query query = db_conn.query(s.str());
     mysqlpp::UseQueryResult res = query.use();
     if (res) {
@@ -118,14 +344,23 @@ std::map<int,std::string> DnsDbHandler::get_top_n_domains(unsigned int n) {
 	top_domains.insert(std::make_pair(row["id"] , row["domain"]));
       }
     }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
   }
   catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
     std::stringstream es;
     es << "Can't get_top_n_domains() -> " << e.what();
     throw es.str();
   }
   // default
   catch(...) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
     throw std::string("Can't get_top_n_domains()");
   }
   return top_domains;
@@ -136,71 +371,77 @@ std::map<int,std::string> DnsDbHandler::get_top_n_domains(unsigned int n) {
 void DnsDbHandler::update_dns_stats(int domain_id,
 				    double latency,
 				    int current_ts) {
+  dns_stats prev;
+  memset(&prev, 0, sizeof(prev));
+  update_dns_stats(domain_id, next_stats(prev, latency, current_ts), current_ts);
+}
+
+
+void DnsDbHandler::update_dns_stats(int domain_id,
+				    const dns_stats &batch,
+				    int current_ts) {
   try {
-    // check if there is already an entry for the current domain,
-    // in case retrieve the statistics at the previous step
-    // i.e. avg, variance, stdev at step n-1
     std::stringstream s;
-    s << "SELECT latency_avg, latency_stdev, num_queries, UNIX_TIMESTAMP(first_ts) as unix_ts ";
-    s << "FROM domain_stats ";
-    s << "WHERE domain_id = " << domain_id;
-#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
-    // ask for db_connection resource
-    pthread_mutex_lock(&db_conn_mutex);
-    //debug std::cout << domain_id << " reads table start" << std::endl;
-#endif
-    mysqlpp::Query query = db_conn.query(s.str());
-    mysqlpp::StoreQueryResult res = query.store();
-#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
-    //debug  std::cout << domain_id << " reads table stop" << std::endl;
-    // release mutex on db_conn 
-    pthread_mutex_unlock(&db_conn_mutex);
-#endif
     double avg_latency_nminus1 = 0;
     double stdev_latency_nminus1 = 0;
     int nminus1 = 0;
     long int first_ts = 0;
-    if (res) {  
-      // domain_id is a primary key, query cannot 
-      // retrieve more than one result
-      if(res.num_rows() == 1) {
-	avg_latency_nminus1 = res[0]["latency_avg"];
-	stdev_latency_nminus1 = res[0]["latency_stdev"];
-	nminus1 = res[0]["num_queries"];
-	first_ts = res[0]["unix_ts"];
-      }
-      // else, the row is empty
+    dns_stats st;
+    if(get_cached_stats(domain_id, st)) {
+      avg_latency_nminus1 = st.latency_avg;
+      stdev_latency_nminus1 = st.latency_stdev;
+      nminus1 = st.num_queries;
+      first_ts = st.first_ts;
     }
     else {
-      std::stringstream es;
-      es << "Failed to get domain_stats table: " << query.error() << std::endl;
-      throw es.str();
+      // check if there is already an entry for the current domain,
+      // in case retrieve the statistics at the previous step
+      // i.e. avg, variance, stdev at step n-1
+      s << "SELECT latency_avg, latency_stdev, num_queries, UNIX_TIMESTAMP(first_ts) as unix_ts ";
+      s << "FROM domain_stats ";
+      s << "WHERE domain_id = " << domain_id;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      // ask for db_connection resource
+      pthread_mutex_lock(&db_conn_mutex);
+      //debug std::cout << domain_id << " reads table start" << std::endl;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      mysqlpp::StoreQueryResult res = query.store();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      //debug  std::cout << domain_id << " reads table stop" << std::endl;
+      // release mutex on db_conn 
+      pthread_mutex_unlock(&db_conn_mutex);
+#endif
+      if (res) {  
+        // domain_id is a primary key, query cannot 
+        // retrieve more than one result
+        if(res.num_rows() == 1) {
+	  avg_latency_nminus1 = res[0]["latency_avg"];
+	  stdev_latency_nminus1 = res[0]["latency_stdev"];
+	  nminus1 = res[0]["num_queries"];
+	  first_ts = res[0]["unix_ts"];
+        }
+        // else, the row is empty
+      }
+      else {
+        std::stringstream es;
+        es << "Failed to get domain_stats table: " << query.error() << std::endl;
+        throw es.str();
+      }
     }
-    // if it is the first entry, then current_ts is the first_ts
-    if(first_ts == 0) {
-      first_ts = current_ts;
-    }
-    // incremental computation of mean and stdev
-    // Formula can be found here
-    // http://math.stackexchange.com/questions/102978/incremental-computation-of-standard-deviation
-    double var_latency_nminus1 = pow(stdev_latency_nminus1,2.0);
-    int n = nminus1 + 1;
-    double avg_latency_n = 0;   // avg, variance, stdev at step n
-    double var_latency_n = 0; 
-    double stdev_latency_n = 0;
-    avg_latency_n = (double) (avg_latency_nminus1 * (n-1) + latency) / (double) n;
-    var_latency_n = (n-1) * var_latency_nminus1;
-    var_latency_n += pow((latency - avg_latency_n),2.0);
-    var_latency_n += (n-1) * pow((avg_latency_nminus1 - avg_latency_n),2.0);
-    var_latency_n = var_latency_n / (double) n;
-    stdev_latency_n = sqrt(var_latency_n);
+    dns_stats prev;
+    prev.latency_avg = avg_latency_nminus1;
+    prev.latency_stdev = stdev_latency_nminus1;
+    prev.num_queries = nminus1;
+    prev.first_ts = first_ts;
+    st = merge_stats(prev, batch);
     // inserting new stats in database
     s.str(""); // cleaning stringstream  buffer
     s << "INSERT INTO domain_stats";
     s << "(domain_id, latency_avg, latency_stdev, num_queries, first_ts, last_ts) ";
     s << "VALUES(" << domain_id << ", ";
-    s << avg_latency_n << ", " << stdev_latency_n << ", " << n << ", ";
-    s << "FROM_UNIXTIME(" << first_ts << "), " << "FROM_UNIXTIME(" << current_ts << ") ) ";
+    s << st.latency_avg << ", " << st.latency_stdev << ", " << st.num_queries << ", ";
+    s << "FROM_UNIXTIME(" << st.first_ts << "), " << "FROM_UNIXTIME(" << current_ts << ") ) ";
     // if the entry already exists we do not have to update the domain_id and first_ts
     s << "ON DUPLICATE KEY UPDATE ";
     s << "latency_avg=VALUES(latency_avg), latency_stdev=VALUES(latency_stdev), ";
@@ -210,13 +451,15 @@ void DnsDbHandler::update_dns_stats(int domain_id,
     pthread_mutex_lock(&db_conn_mutex);
     //debug std::cout << domain_id << " writes table start" << std::endl;
 #endif
-    query = db_conn.query(s.str());
+    mysqlpp::Query query = db_conn.query(s.str());
     query.exec();
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
     //debug std::cout << domain_id << " writes table stop" << std::endl;
     // release mutex on db_conn 
     pthread_mutex_unlock(&db_conn_mutex);
 #endif
+    // step n becomes the cached n-1 (once it is in the db)
+    set_cached_stats(domain_id, st, current_ts);
   }
   // release mutex on db_conn if an exception is thrown
   catch(std::string ex_string) {
@@ -248,7 +491,654 @@ void DnsDbHandler::update_dns_stats(int domain_id,
 }
 
 
+void DnsDbHandler::update_nsset_stats(uint64_t nsset_hash,
+				      const std::string &ns_names,
+				      const dns_stats &batch,
+				      int current_ts) {
+  // one update at the time (the cache entry is read, then written)
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&nsset_mutex);
+#endif
+  bool conn_locked = false;
+  try {
+    std::stringstream s;
+    dns_stats prev;
+    memset(&prev, 0, sizeof(prev));
+    std::map<uint64_t,dns_stats>::const_iterator it = nsset_cache.find(nsset_hash);
+    if(it != nsset_cache.end()) {
+      prev = it->second;
+    }
+    else {
+      // statistics of a previous run, if any
+      s << "SELECT latency_avg, latency_stdev, num_queries, UNIX_TIMESTAMP(first_ts) as unix_ts ";
+      s << "FROM nsset_stats WHERE nsset_hash = " << nsset_hash;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&db_conn_mutex);
+      conn_locked = true;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      mysqlpp::StoreQueryResult res = query.store();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&db_conn_mutex);
+      conn_locked = false;
+#endif
+      if(!res) {
+	std::stringstream es;
+	es << "Failed to get nsset_stats table: " << query.error() << std::endl;
+	throw es.str();
+      }
+      if(res.num_rows() == 1) {
+	prev.latency_avg = res[0]["latency_avg"];
+	prev.latency_stdev = res[0]["latency_stdev"];
+	prev.num_queries = res[0]["num_queries"];
+	prev.first_ts = res[0]["unix_ts"];
+      }
+    }
+    dns_stats st = merge_stats(prev, batch);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&db_conn_mutex);
+    conn_locked = true;
+#endif
+    mysqlpp::Query query = db_conn.query();
+    // server names are not trusted, they come from the network
+    std::string escaped;
+    query.escape_string(&escaped, ns_names.data(), ns_names.size());
+    s.str("");
+    s << "INSERT INTO nsset_stats";
+    s << "(nsset_hash, ns_names, latency_avg, latency_stdev, num_queries, first_ts, last_ts) ";
+    s << "VALUES(" << nsset_hash << ", '" << escaped << "', ";
+    s << st.latency_avg << ", " << st.latency_stdev << ", " << st.num_queries << ", ";
+    s << "FROM_UNIXTIME(" << st.first_ts << "), " << "FROM_UNIXTIME(" << current_ts << ") ) ";
+    s << "ON DUPLICATE KEY UPDATE ";
+    s << "latency_avg=VALUES(latency_avg), latency_stdev=VALUES(latency_stdev), ";
+    s << "num_queries=VALUES(num_queries), last_ts=VALUES(last_ts)";
+    query.exec(s.str());
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+    conn_locked = false;
+#endif
+    nsset_cache[nsset_hash] = st;
+  }
+  catch(std::string ex_string) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+    pthread_mutex_unlock(&nsset_mutex);
+#endif
+    throw std::string("Can't update_nsset_stats() -> ") + ex_string;
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+    pthread_mutex_unlock(&nsset_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't update_nsset_stats() -> " << e.what();
+    throw es.str();
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&nsset_mutex);
+#endif
+}
+
+
+void DnsDbHandler::set_domain_nsset(int domain_id, uint64_t nsset_hash, int current_ts) {
+  std::stringstream s;
+  s << "INSERT INTO domain_nssets (domain_id, nsset_hash, ts) VALUES(";
+  s << domain_id << ", " << nsset_hash << ", FROM_UNIXTIME(" << current_ts << ")) ";
+  s << "ON DUPLICATE KEY UPDATE nsset_hash=VALUES(nsset_hash), ts=VALUES(ts)";
+  try {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&db_conn_mutex);
+#endif
+    mysqlpp::Query query = db_conn.query(s.str());
+    query.exec();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't set_domain_nsset() -> " << e.what();
+    throw es.str();
+  }
+}
+
+
+int DnsDbHandler::get_resolver_id(const std::string &address) {
+  int resolver_id = -1;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&db_conn_mutex);
+#endif
+  try {
+    mysqlpp::Query query = db_conn.query();
+    std::string escaped;
+    query.escape_string(&escaped, address.data(), address.size());
+    std::stringstream s;
+    s << "INSERT IGNORE INTO resolvers (address) VALUES('" << escaped << "')";
+    query.exec(s.str());
+    s.str("");
+    s << "SELECT id FROM resolvers WHERE address = '" << escaped << "'";
+    query = db_conn.query(s.str());
+    mysqlpp::StoreQueryResult res = query.store();
+    if(!res || res.num_rows() != 1) {
+      std::stringstream es;
+      es << "Failed to get resolvers table: " << query.error() << std::endl;
+      throw es.str();
+    }
+    resolver_id = res[0]["id"];
+  }
+  catch(std::string ex_string) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    throw std::string("Can't get_resolver_id() -> ") + ex_string;
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't get_resolver_id() -> " << e.what();
+    throw es.str();
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&db_conn_mutex);
+#endif
+  return resolver_id;
+}
+
+
+// rows per statement of update_resolver_stats and update_response_stats
+static const size_t RESOLVER_STATS_ROWS = 1000;
+
+void DnsDbHandler::update_resolver_stats(const std::map<std::pair<int,int>,resolver_stats> &batch,
+					 int current_ts) {
+  typedef std::map<std::pair<int,int>,resolver_stats> resolver_map;
+  bool conn_locked = false;
+  try {
+    // the statistics of a previous run of the pairs not cached yet
+    std::vector<std::pair<int,int> > missing;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&resolver_mutex);
+#endif
+    resolver_map::const_iterator it;
+    for(it = batch.begin(); it != batch.end(); it++) {
+      if(resolver_cache.find(it->first) == resolver_cache.end()) {
+	missing.push_back(it->first);
+      }
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&resolver_mutex);
+#endif
+    resolver_map previous;
+    for(size_t i = 0; i < missing.size(); i += RESOLVER_STATS_ROWS) {
+      std::stringstream s;
+      s << "SELECT domain_id, resolver_id, latency_avg, latency_stdev, num_queries, ";
+      s << "num_failures, UNIX_TIMESTAMP(first_ts) as unix_ts FROM resolver_stats ";
+      s << "WHERE (domain_id, resolver_id) IN (";
+      for(size_t j = i; j < missing.size() && j < i + RESOLVER_STATS_ROWS; j++) {
+	s << ((j > i) ? ", (" : "(") << missing[j].first << ", " << missing[j].second << ")";
+      }
+      s << ")";
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&db_conn_mutex);
+      conn_locked = true;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      mysqlpp::StoreQueryResult res = query.store();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&db_conn_mutex);
+      conn_locked = false;
+#endif
+      if(!res) {
+	std::stringstream es;
+	es << "Failed to get resolver_stats table: " << query.error() << std::endl;
+	throw es.str();
+      }
+      for(size_t r = 0; r < res.num_rows(); r++) {
+	resolver_stats &prev = previous[std::make_pair((int) res[r]["domain_id"],
+						       (int) res[r]["resolver_id"])];
+	prev.latency.latency_avg = res[r]["latency_avg"];
+	prev.latency.latency_stdev = res[r]["latency_stdev"];
+	prev.latency.num_queries = res[r]["num_queries"];
+	prev.latency.first_ts = res[r]["unix_ts"];
+	prev.num_failures = res[r]["num_failures"];
+      }
+    }
+    // the new statistics, in the cache and then in the table
+    std::vector<std::pair<std::pair<int,int>,resolver_stats> > rows;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&resolver_mutex);
+#endif
+    for(it = batch.begin(); it != batch.end(); it++) {
+      resolver_stats prev;
+      memset(&prev, 0, sizeof(prev));
+      resolver_map::const_iterator p = resolver_cache.find(it->first);
+      if(p != resolver_cache.end()) {
+	prev = p->second;
+      }
+      else if((p = previous.find(it->first)) != previous.end()) {
+	prev = p->second;
+      }
+      resolver_stats st;
+      st.latency = merge_stats(prev.latency, it->second.latency);
+      if(prev.latency.first_ts != 0) {
+	// failures only count in first_ts
+	st.latency.first_ts = prev.latency.first_ts;
+      }
+      st.num_failures = prev.num_failures + it->second.num_failures;
+      resolver_cache[it->first] = st;
+      rows.push_back(std::make_pair(it->first, st));
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&resolver_mutex);
+#endif
+    for(size_t i = 0; i < rows.size(); i += RESOLVER_STATS_ROWS) {
+      std::stringstream s;
+      s << "INSERT INTO resolver_stats";
+      s << "(domain_id, resolver_id, latency_avg, latency_stdev, num_queries, num_failures, ";
+      s << "first_ts, last_ts) VALUES";
+      for(size_t j = i; j < rows.size() && j < i + RESOLVER_STATS_ROWS; j++) {
+	const resolver_stats &st = rows[j].second;
+	s << ((j > i) ? ", (" : "(");
+	s << rows[j].first.first << ", " << rows[j].first.second << ", ";
+	s << st.latency.latency_avg << ", " << st.latency.latency_stdev << ", ";
+	s << st.latency.num_queries << ", " << st.num_failures << ", ";
+	s << "FROM_UNIXTIME(" << st.latency.first_ts << "), ";
+	s << "FROM_UNIXTIME(" << current_ts << ") )";
+      }
+      s << " ON DUPLICATE KEY UPDATE ";
+      s << "latency_avg=VALUES(latency_avg), latency_stdev=VALUES(latency_stdev), ";
+      s << "num_queries=VALUES(num_queries), num_failures=VALUES(num_failures), ";
+      s << "last_ts=VALUES(last_ts)";
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&db_conn_mutex);
+      conn_locked = true;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      query.exec();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&db_conn_mutex);
+      conn_locked = false;
+#endif
+    }
+  }
+  catch(std::string ex_string) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+#endif
+    throw std::string("Can't update_resolver_stats() -> ") + ex_string;
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+#endif
+    std::stringstream es;
+    es << "Can't update_resolver_stats() -> " << e.what();
+    throw es.str();
+  }
+}
+
+
+void DnsDbHandler::update_response_stats(const std::map<int,response_stats> &batch,
+					 int current_ts) {
+  typedef std::map<int,response_stats> response_map;
+  bool conn_locked = false;
+  try {
+    // the statistics of a previous run of the domains not cached yet
+    std::vector<int> missing;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&response_mutex);
+#endif
+    response_map::const_iterator it;
+    for(it = batch.begin(); it != batch.end(); it++) {
+      if(response_cache.find(it->first) == response_cache.end()) {
+	missing.push_back(it->first);
+      }
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&response_mutex);
+#endif
+    response_map previous;
+    for(size_t i = 0; i < missing.size(); i += RESOLVER_STATS_ROWS) {
+      std::stringstream s;
+      s << "SELECT domain_id, num_responses, size_avg, size_stdev, size_max, num_truncated, ";
+      s << "num_edns, answers_avg, authorities_avg, additionals_avg, num_signed, ";
+      s << "validation_avg, validation_stdev, num_validated, num_bogus, ";
+      s << "UNIX_TIMESTAMP(first_ts) as unix_ts FROM response_stats ";
+      s << "WHERE domain_id IN (";
+      for(size_t j = i; j < missing.size() && j < i + RESOLVER_STATS_ROWS; j++) {
+	s << ((j > i) ? ", " : "") << missing[j];
+      }
+      s << ")";
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&db_conn_mutex);
+      conn_locked = true;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      mysqlpp::StoreQueryResult res = query.store();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&db_conn_mutex);
+      conn_locked = false;
+#endif
+      if(!res) {
+	std::stringstream es;
+	es << "Failed to get response_stats table: " << query.error() << std::endl;
+	throw es.str();
+      }
+      for(size_t r = 0; r < res.num_rows(); r++) {
+	response_stats &prev = previous[(int) res[r]["domain_id"]];
+	prev.size.num_queries = res[r]["num_responses"];
+	prev.size.latency_avg = res[r]["size_avg"];
+	prev.size.latency_stdev = res[r]["size_stdev"];
+	prev.size.first_ts = res[r]["unix_ts"];
+	prev.size_max = res[r]["size_max"];
+	prev.num_truncated = res[r]["num_truncated"];
+	prev.num_edns = res[r]["num_edns"];
+	prev.answers_avg = res[r]["answers_avg"];
+	prev.authorities_avg = res[r]["authorities_avg"];
+	prev.additionals_avg = res[r]["additionals_avg"];
+	prev.num_signed = res[r]["num_signed"];
+	prev.validation.num_queries = res[r]["num_validated"];
+	prev.validation.latency_avg = res[r]["validation_avg"];
+	prev.validation.latency_stdev = res[r]["validation_stdev"];
+	prev.validation.first_ts = prev.size.first_ts;
+	prev.num_bogus = res[r]["num_bogus"];
+      }
+    }
+    // the new statistics, in the cache and then in the table
+    std::vector<std::pair<int,response_stats> > rows;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&response_mutex);
+#endif
+    for(it = batch.begin(); it != batch.end(); it++) {
+      response_stats prev;
+      memset(&prev, 0, sizeof(prev));
+      response_map::const_iterator p = response_cache.find(it->first);
+      if(p != response_cache.end()) {
+	prev = p->second;
+      }
+      else if((p = previous.find(it->first)) != previous.end()) {
+	prev = p->second;
+      }
+      response_stats st = merge_response_stats(prev, it->second);
+      response_cache[it->first] = st;
+      rows.push_back(std::make_pair(it->first, st));
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&response_mutex);
+#endif
+    for(size_t i = 0; i < rows.size(); i += RESOLVER_STATS_ROWS) {
+      std::stringstream s;
+      s << "INSERT INTO response_stats";
+      s << "(domain_id, num_responses, size_avg, size_stdev, size_max, num_truncated, ";
+      s << "num_edns, answers_avg, authorities_avg, additionals_avg, num_signed, ";
+      s << "validation_avg, validation_stdev, num_validated, num_bogus, first_ts, last_ts) VALUES";
+      for(size_t j = i; j < rows.size() && j < i + RESOLVER_STATS_ROWS; j++) {
+	const response_stats &st = rows[j].second;
+	s << ((j > i) ? ", (" : "(") << rows[j].first << ", " << st.size.num_queries << ", ";
+	s << st.size.latency_avg << ", " << st.size.latency_stdev << ", ";
+	s << st.size_max << ", " << st.num_truncated << ", " << st.num_edns << ", ";
+	s << st.answers_avg << ", " << st.authorities_avg << ", " << st.additionals_avg << ", ";
+	s << st.num_signed << ", ";
+	s << st.validation.latency_avg << ", " << st.validation.latency_stdev << ", ";
+	s << st.validation.num_queries << ", " << st.num_bogus << ", ";
+	s << "FROM_UNIXTIME(" << st.size.first_ts << "), ";
+	s << "FROM_UNIXTIME(" << current_ts << ") )";
+      }
+      s << " ON DUPLICATE KEY UPDATE ";
+      s << "num_responses=VALUES(num_responses), size_avg=VALUES(size_avg), ";
+      s << "size_stdev=VALUES(size_stdev), size_max=VALUES(size_max), ";
+      s << "num_truncated=VALUES(num_truncated), num_edns=VALUES(num_edns), ";
+      s << "answers_avg=VALUES(answers_avg), authorities_avg=VALUES(authorities_avg), ";
+      s << "additionals_avg=VALUES(additionals_avg), num_signed=VALUES(num_signed), ";
+      s << "validation_avg=VALUES(validation_avg), validation_stdev=VALUES(validation_stdev), ";
+      s << "num_validated=VALUES(num_validated), num_bogus=VALUES(num_bogus), ";
+      s << "last_ts=VALUES(last_ts)";
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&db_conn_mutex);
+      conn_locked = true;
+#endif
+      mysqlpp::Query query = db_conn.query(s.str());
+      query.exec();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&db_conn_mutex);
+      conn_locked = false;
+#endif
+    }
+  }
+  catch(std::string ex_string) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+#endif
+    throw std::string("Can't update_response_stats() -> ") + ex_string;
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    if(conn_locked) {
+      pthread_mutex_unlock(&db_conn_mutex);
+    }
+#endif
+    std::stringstream es;
+    es << "Can't update_response_stats() -> " << e.what();
+    throw es.str();
+  }
+}
+
+
+bool DnsDbHandler::get_cached_stats(int domain_id, dns_stats &st) {
+  bool found = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&stats_mutex);
+#endif
+  std::map<int,cached_stats>::const_iterator it = stats_cache.find(domain_id);
+  if(it != stats_cache.end()) {
+    st = it->second.stats;
+    found = true;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&stats_mutex);
+#endif
+  return found;
+}
+
+
+void DnsDbHandler::set_cached_stats(int domain_id, const dns_stats &st, int64_t last_ts) {
+  cached_stats c;
+  c.stats = st;
+  c.last_ts = last_ts;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&stats_mutex);
+#endif
+  stats_cache[domain_id] = c;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+
+void DnsDbHandler::swap_cached_stats(std::map<int,cached_stats> &rows) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&stats_mutex);
+#endif
+  stats_cache.swap(rows);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+
+void DnsDbHandler::export_cached_stats(std::map<int,cached_stats> &out) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&stats_mutex);
+#endif
+  out = stats_cache;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+
+void DnsDbHandler::read_dns_stats(int64_t since, std::map<int,cached_stats> &rows) {
+  rows.clear();
+  std::stringstream s;
+  s << "SELECT domain_id, latency_avg, latency_stdev, num_queries, UNIX_TIMESTAMP(first_ts) as unix_ts, ";
+  s << "UNIX_TIMESTAMP(last_ts) as unix_last_ts ";
+  s << "FROM domain_stats";
+  if(since > 0) {
+    s << " WHERE last_ts >= FROM_UNIXTIME(" << since << ")";
+  }
+  try{
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&db_conn_mutex);
+#endif
+    mysqlpp::Query query = db_conn.query(s.str());
+    mysqlpp::UseQueryResult res = query.use();
+    if (res) {
+      cached_stats c;
+      while (mysqlpp::Row row = res.fetch_row()) {
+	c.stats.latency_avg = row["latency_avg"];
+	c.stats.latency_stdev = row["latency_stdev"];
+	c.stats.num_queries = row["num_queries"];
+	c.stats.first_ts = (long int) row["unix_ts"];
+	c.last_ts = (long int) row["unix_last_ts"];
+	rows.insert(rows.end(), std::make_pair((int) row["domain_id"], c));
+      }
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't read_dns_stats() -> " << e.what();
+    throw es.str();
+  }
+  // default
+  catch(...) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    throw std::string("Can't read_dns_stats()");
+  }
+}
+
+
+void DnsDbHandler::load_dns_stats() {
+  std::map<int,cached_stats> loaded;
+  try {
+    read_dns_stats(0, loaded);
+  }
+  catch(std::string e) {
+    throw std::string("Can't load_dns_stats() -> ") + e;
+  }
+  swap_cached_stats(loaded);
+}
+
+
+void DnsDbHandler::insert_anomaly_event(const anomaly_event &ev) {
+  std::stringstream s;
+  s << "INSERT INTO dns_anomalies";
+  s << "(domain_id, ts, direction, latency, baseline_avg, baseline_stdev, score) ";
+  s << "VALUES(" << ev.domain_id << ", FROM_UNIXTIME(" << ev.ts << "), ";
+  s << ev.direction << ", " << ev.latency << ", " << ev.baseline_avg << ", ";
+  s << ev.baseline_stdev << ", " << ev.score << ")";
+  try {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&db_conn_mutex);
+#endif
+    mysqlpp::Query query = db_conn.query(s.str());
+    query.exec();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't insert_anomaly_event() -> " << e.what();
+    throw es.str();
+  }
+  // default
+  catch(...) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    throw std::string("Can't insert_anomaly_event()");
+  }
+}
+
+
+void DnsDbHandler::insert_stage_stats(int current_ts,
+				      const std::vector<stage_summary> &stages) {
+  if(stages.empty()) {
+    return;
+  }
+  std::stringstream s;
+  s << "INSERT INTO probe_stage_stats";
+  s << "(ts, stage, count, avg_us, p50_us, p90_us, p99_us, max_us) VALUES";
+  for(size_t i = 0; i < stages.size(); i++) {
+    const stage_summary &ss = stages[i];
+    s << ((i > 0) ? ", " : " ");
+    s << "(FROM_UNIXTIME(" << current_ts << "), '" << ss.stage << "', ";
+    s << ss.count << ", " << ss.avg_us << ", " << ss.p50_us << ", ";
+    s << ss.p90_us << ", " << ss.p99_us << ", " << ss.max_us << ")";
+  }
+  s << " ON DUPLICATE KEY UPDATE count=VALUES(count), avg_us=VALUES(avg_us), ";
+  s << "p50_us=VALUES(p50_us), p90_us=VALUES(p90_us), p99_us=VALUES(p99_us), max_us=VALUES(max_us)";
+  try {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&db_conn_mutex);
+#endif
+    mysqlpp::Query query = db_conn.query(s.str());
+    query.exec();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+  }
+  catch(std::exception& e) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    std::stringstream es;
+    es << "Can't insert_stage_stats() -> " << e.what();
+    throw es.str();
+  }
+  // default
+  catch(...) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&db_conn_mutex);
+#endif
+    throw std::string("Can't insert_stage_stats()");
+  }
+}
+
+
 DnsDbHandler::~DnsDbHandler() {
   db_conn.disconnect();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_destroy(&stats_mutex);
+  pthread_mutex_destroy(&nsset_mutex);
+  pthread_mutex_destroy(&resolver_mutex);
+  pthread_mutex_destroy(&response_mutex);
+#endif
 }
 
@@ -26,8 +26,14 @@
 
 #include <iostream>
 #include <vector>
+#include <map>
+#include <stdint.h>
 #include <mysql++.h>
 
+#include "DnsAnomalyDetector.hpp"
+#include "DnsProbeProfiler.hpp"
+#include "DnsResponseParser.hpp"
+
 #include "dns_latency_monitor-config.h"
 
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
@@ -36,11 +42,68 @@
 
 
 
+/* dns_stats:
+ * the statistics of a domain at the last step, i.e. what is
+ * needed to update domain_stats incrementally */
+struct dns_stats {
+  double latency_avg;
+  double latency_stdev;
+  int32_t num_queries;
+  int64_t first_ts;
+};
+
+/* cached_stats:
+ * a row of domain_stats as cached: the statistics and the time of
+ * their last sample, which tells the newer of two copies of a row
+ * (e.g. a checkpoint and the table) */
+struct cached_stats {
+  dns_stats stats;
+  int64_t last_ts;
+};
+
+/* resolver_stats:
+ * the statistics of a domain through one of the compared resolvers:
+ * the latency statistics only count the answered queries, the
+ * failed ones are counted apart */
+struct resolver_stats {
+  dns_stats latency;
+  int32_t num_failures;
+};
+
+/* response_stats:
+ * what the responses to the probes of a domain looked like, the
+ * averages of the sizes and validation times are kept as dns_stats
+ * (their num_queries: responses, validated responses) */
+struct response_stats {
+  dns_stats size;           // bytes
+  int32_t size_max;
+  int32_t num_truncated;
+  int32_t num_edns;         // with an OPT record
+  double answers_avg;
+  double authorities_avg;
+  double additionals_avg;
+  int32_t num_signed;       // with RRSIG records
+  dns_stats validation;     // ms
+  int32_t num_bogus;        // a signature did not verify
+};
+
+
 /* DnsDbHandler:
  * this class provides two main features
  * - it manages the connection the mysql database (and the concurrency)
  * - it updates the statistics per domain using incremental
- *   avg and stdev computation
+ *   avg and stdev computation, the statistics at step n-1 are
+ *   cached in memory so that an update is a single write
+ *   (the cache is filled by load_dns_stats(), a checkpoint, or
+ *   one read per domain on the first update)
+ * - it stores the anomaly events raised by the detector
+ *   and the probe pipeline stage statistics
+ * - in NS-set dedup mode, it keeps the same statistics per NS-set
+ *   (nsset_stats) and the NS-set of every domain (domain_nssets)
+ * - when several resolvers are compared, the statistics of every
+ *   domain per resolver (resolver_stats, resolvers)
+ * - the size, flags, section counts and DNSSEC validation cost of
+ *   the responses of every domain (response_stats)
  */
 class DnsDbHandler{
 private:
@@ -49,6 +112,23 @@ private:
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
   pthread_mutex_t db_conn_mutex;
 #endif
+  std::map<int,cached_stats> stats_cache;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t stats_mutex;
+#endif
+  std::map<uint64_t,dns_stats> nsset_cache;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t nsset_mutex;
+#endif
+  std::map<std::pair<int,int>,resolver_stats> resolver_cache; // (domain_id, resolver_id)
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t resolver_mutex;
+#endif
+  std::map<int,response_stats> response_cache;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t response_mutex;
+#endif
+  bool get_cached_stats(int domain_id, dns_stats &st);
 public:
   DnsDbHandler(const char * db_name,
 	       const char * server = NULL,
@@ -59,6 +139,39 @@ public:
 	       );
   std::map<int,std::string> get_top_n_domains(unsigned int n = 10);
   void update_dns_stats(int domain_id, double latency, int current_ts);
+  // add a batch of samples of the domain at once
+  void update_dns_stats(int domain_id, const dns_stats &batch, int current_ts);
+  static dns_stats next_stats(const dns_stats &prev, double latency, int current_ts);
+  static dns_stats merge_stats(const dns_stats &a, const dns_stats &b);
+  // the same two steps for the response statistics
+  static response_stats next_response_stats(const response_stats &prev,
+					     const response_metrics &m, int current_ts);
+  static response_stats merge_response_stats(const response_stats &a,
+					      const response_stats &b);
+  // fill the cache with the whole domain_stats table
+  void load_dns_stats();
+  /* the rows of domain_stats with last_ts >= since (the cache is
+   * not changed), since = 0: the whole table */
+  void read_dns_stats(int64_t since, std::map<int,cached_stats> &rows);
+  void set_cached_stats(int domain_id, const dns_stats &st, int64_t last_ts);
+  // the cache becomes rows, rows gets the former cache (bulk fill)
+  void swap_cached_stats(std::map<int,cached_stats> &rows);
+  void export_cached_stats(std::map<int,cached_stats> &out);
+  // add a batch of samples of the NS-set at once
+  void update_nsset_stats(uint64_t nsset_hash, const std::string &ns_names,
+			  const dns_stats &batch, int current_ts);
+  void set_domain_nsset(int domain_id, uint64_t nsset_hash, int current_ts);
+  // id of the resolver with this address (added if new)
+  int get_resolver_id(const std::string &address);
+  /* add the samples of many (domain_id, resolver_id) pairs at once,
+   * a few statements per call */
+  void update_resolver_stats(const std::map<std::pair<int,int>,resolver_stats> &batch,
+			     int current_ts);
+  /* add the responses of many domains at once (batch: the samples
+   * since the last call, by domain_id), a few statements per call */
+  void update_response_stats(const std::map<int,response_stats> &batch, int current_ts);
+  void insert_anomaly_event(const anomaly_event &ev);
+  void insert_stage_stats(int current_ts, const std::vector<stage_summary> &stages);
   ~DnsDbHandler();
 };
 
@@ -0,0 +1,167 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsLatencyHistogram.hpp"
+
+#include <math.h>
+#include <stdio.h>
+
+
+DnsLatencyHistogram::DnsLatencyHistogram() : buckets(NUM_BUCKETS, 0) {
+  clear();
+}
+
+
+unsigned int DnsLatencyHistogram::bucket_index(uint64_t ns) {
+  const uint64_t sub_buckets = 1ULL << SUB_BUCKET_BITS;
+  if(ns < sub_buckets) {
+    return (unsigned int) ns;
+  }
+  unsigned int msb = 63 - __builtin_clzll(ns);
+  unsigned int shift = msb - SUB_BUCKET_BITS;
+  return ((shift + 1) << SUB_BUCKET_BITS) | (unsigned int) ((ns >> shift) & (sub_buckets - 1));
+}
+
+
+uint64_t DnsLatencyHistogram::bucket_value(unsigned int index) {
+  const uint64_t sub_buckets = 1ULL << SUB_BUCKET_BITS;
+  if(index < sub_buckets) {
+    return index;
+  }
+  unsigned int shift = (index >> SUB_BUCKET_BITS) - 1;
+  uint64_t lower = (sub_buckets | (index & (sub_buckets - 1))) << shift;
+  return lower + ((1ULL << shift) - 1);
+}
+
+
+void DnsLatencyHistogram::merge(const DnsLatencyHistogram &other) {
+  for(unsigned int i = 0; i < NUM_BUCKETS; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  sum += other.sum;
+  sum_squares += other.sum_squares;
+  min = (other.min < min) ? other.min : min;
+  max = (other.max > max) ? other.max : max;
+}
+
+
+void DnsLatencyHistogram::clear() {
+  buckets.assign(NUM_BUCKETS, 0);
+  count = 0;
+  sum = 0;
+  sum_squares = 0;
+  min = UINT64_MAX;
+  max = 0;
+}
+
+
+uint64_t DnsLatencyHistogram::get_count() const {
+  return count;
+}
+
+
+uint64_t DnsLatencyHistogram::get_min() const {
+  return (count > 0) ? min : 0;
+}
+
+
+uint64_t DnsLatencyHistogram::get_max() const {
+  return max;
+}
+
+
+double DnsLatencyHistogram::get_mean() const {
+  return (count > 0) ? sum / count : 0;
+}
+
+
+double DnsLatencyHistogram::get_stdev() const {
+  if(count == 0) {
+    return 0;
+  }
+  double mean = sum / count;
+  double var = sum_squares / count - mean * mean;
+  return (var > 0) ? sqrt(var) : 0;
+}
+
+
+uint64_t DnsLatencyHistogram::value_at_percentile(double percentile) const {
+  if(count == 0) {
+    return 0;
+  }
+  uint64_t rank = (uint64_t) ceil(percentile / 100.0 * count);
+  rank = (rank < 1) ? 1 : rank;
+  uint64_t seen = 0;
+  for(unsigned int i = 0; i < NUM_BUCKETS; i++) {
+    seen += buckets[i];
+    if(seen >= rank) {
+      // the bucket bound, but never beyond the largest value seen
+      uint64_t v = bucket_value(i);
+      return (v < max) ? v : max;
+    }
+  }
+  return max;
+}
+
+
+void DnsLatencyHistogram::write_distribution(std::ostream &out,
+					     unsigned int ticks_per_half_distance) const {
+  char line[128];
+  out << "       Value     Percentile TotalCount 1/(1-Percentile)\n\n";
+  if(count > 0) {
+    // percentiles 0, then ticks_per_half_distance steps per halving of 100 - p
+    double percentile = 0;
+    uint64_t seen = 0;
+    unsigned int i = 0;
+    while(true) {
+      uint64_t rank = (uint64_t) ceil(percentile / 100.0 * count);
+      rank = (rank < 1) ? 1 : rank;
+      while(seen < rank && i < NUM_BUCKETS) {
+	seen += buckets[i++];
+      }
+      uint64_t v = (i > 0) ? bucket_value(i - 1) : 0;
+      v = (v < max) ? v : max;
+      if(seen >= count) {
+	snprintf(line, sizeof(line), "%12.3f %14.12f %10llu\n", v / 1e6, 1.0,
+		 (unsigned long long) seen);
+	out << line;
+	break;
+      }
+      snprintf(line, sizeof(line), "%12.3f %14.12f %10llu %14.2f\n", v / 1e6,
+	       percentile / 100.0, (unsigned long long) seen, 100.0 / (100.0 - percentile));
+      out << line;
+      double halvings = floor(log2(100.0 / (100.0 - percentile))) + 1;
+      percentile += 100.0 / (ticks_per_half_distance * pow(2.0, halvings));
+    }
+  }
+  snprintf(line, sizeof(line), "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+	   get_mean() / 1e6, get_stdev() / 1e6);
+  out << line;
+  snprintf(line, sizeof(line), "#[Max     = %12.3f, Total count    = %12llu]\n",
+	   max / 1e6, (unsigned long long) count);
+  out << line;
+  snprintf(line, sizeof(line), "#[Buckets = %12u, SubBuckets     = %12u]\n",
+	   64 - SUB_BUCKET_BITS + 1, 1U << SUB_BUCKET_BITS);
+  out << line;
+}
@@ -0,0 +1,79 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSLATENCYHISTOGRAM_H
+#define _DNSLATENCYHISTOGRAM_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+
+/* Dns Latency Histogram:
+ * this class counts latencies (ns) in log2 buckets of 2^SUB_BUCKET_BITS
+ * linear sub-buckets (the DnsProbeProfiler layout with a finer
+ * resolution, ~0.1%), so that any percentile can be read back with a
+ * bounded relative error, whatever the range of the values
+ * it is not thread safe: every thread records in its own histogram,
+ * the histograms are then merged
+ * write_distribution prints the percentile distribution in the
+ * HdrHistogram text format (.hgrm), that its plotting tools read
+ */
+class DnsLatencyHistogram{
+public:
+  static const unsigned int SUB_BUCKET_BITS = 10;
+  static const unsigned int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+private:
+  std::vector<uint64_t> buckets;
+  uint64_t count;
+  double sum;
+  double sum_squares;
+  uint64_t min;
+  uint64_t max;
+public:
+  DnsLatencyHistogram();
+  static unsigned int bucket_index(uint64_t ns);
+  // highest value counted in the bucket
+  static uint64_t bucket_value(unsigned int index);
+  void record(uint64_t ns) {
+    buckets[bucket_index(ns)]++;
+    count++;
+    sum += ns;
+    sum_squares += (double) ns * ns;
+    min = (ns < min) ? ns : min;
+    max = (ns > max) ? ns : max;
+  }
+  void merge(const DnsLatencyHistogram &other);
+  void clear();
+  uint64_t get_count() const;
+  uint64_t get_min() const;
+  uint64_t get_max() const;
+  double get_mean() const;
+  double get_stdev() const;
+  // smallest value v such that percentile % of the values are <= v
+  uint64_t value_at_percentile(double percentile) const;
+  // values in ms, ticks_per_half_distance as in HdrHistogram
+  void write_distribution(std::ostream &out, unsigned int ticks_per_half_distance = 5) const;
+};
+
+#endif /* _DNSLATENCYHISTOGRAM_H */
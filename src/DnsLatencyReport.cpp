@@ -0,0 +1,754 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsLatencyReport.hpp"
+
+#include <map>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+
+/* reduction kernels:
+ * sum and sum of squares (in double, of x - shift, to keep the
+ * precision), min and max of n floats */
+struct float_summary {
+  double sum;
+  double sumsq;
+  float min;
+  float max;
+};
+
+static void reduce_scalar(const float * v, size_t n, double shift, float_summary &s) {
+  for(size_t i = 0; i < n; i++) {
+    double d = v[i] - shift;
+    s.sum += d;
+    s.sumsq += d * d;
+    s.min = (v[i] < s.min) ? v[i] : s.min;
+    s.max = (v[i] > s.max) ? v[i] : s.max;
+  }
+}
+
+#if defined(HAVE_X86_SIMD)
+
+// SSE2 is always there on x86-64: 4 floats at the time
+static void reduce_sse2(const float * v, size_t n, double shift, float_summary &s) {
+  __m128d k = _mm_set1_pd(shift);
+  __m128d sum0 = _mm_setzero_pd(), sum1 = _mm_setzero_pd();
+  __m128d sq0 = _mm_setzero_pd(), sq1 = _mm_setzero_pd();
+  __m128 mn = _mm_set1_ps(s.min), mx = _mm_set1_ps(s.max);
+  size_t i = 0;
+  for(; i + 4 <= n; i += 4) {
+    __m128 x = _mm_loadu_ps(v + i);
+    mn = _mm_min_ps(mn, x);
+    mx = _mm_max_ps(mx, x);
+    __m128d lo = _mm_sub_pd(_mm_cvtps_pd(x), k);
+    __m128d hi = _mm_sub_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), k);
+    sum0 = _mm_add_pd(sum0, lo);
+    sum1 = _mm_add_pd(sum1, hi);
+    sq0 = _mm_add_pd(sq0, _mm_mul_pd(lo, lo));
+    sq1 = _mm_add_pd(sq1, _mm_mul_pd(hi, hi));
+  }
+  double d[2];
+  _mm_storeu_pd(d, _mm_add_pd(sum0, sum1));
+  s.sum += d[0] + d[1];
+  _mm_storeu_pd(d, _mm_add_pd(sq0, sq1));
+  s.sumsq += d[0] + d[1];
+  float f[4];
+  _mm_storeu_ps(f, mn);
+  s.min = std::min(std::min(f[0], f[1]), std::min(f[2], f[3]));
+  _mm_storeu_ps(f, mx);
+  s.max = std::max(std::max(f[0], f[1]), std::max(f[2], f[3]));
+  reduce_scalar(v + i, n - i, shift, s);
+}
+
+// 8 floats at the time
+__attribute__((target("avx2")))
+static void reduce_avx2(const float * v, size_t n, double shift, float_summary &s) {
+  __m256d k = _mm256_set1_pd(shift);
+  __m256d sum0 = _mm256_setzero_pd(), sum1 = _mm256_setzero_pd();
+  __m256d sq0 = _mm256_setzero_pd(), sq1 = _mm256_setzero_pd();
+  __m256 mn = _mm256_set1_ps(s.min), mx = _mm256_set1_ps(s.max);
+  size_t i = 0;
+  for(; i + 8 <= n; i += 8) {
+    __m256 x = _mm256_loadu_ps(v + i);
+    mn = _mm256_min_ps(mn, x);
+    mx = _mm256_max_ps(mx, x);
+    __m256d lo = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), k);
+    __m256d hi = _mm256_sub_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), k);
+    sum0 = _mm256_add_pd(sum0, lo);
+    sum1 = _mm256_add_pd(sum1, hi);
+    sq0 = _mm256_add_pd(sq0, _mm256_mul_pd(lo, lo));
+    sq1 = _mm256_add_pd(sq1, _mm256_mul_pd(hi, hi));
+  }
+  double d[4];
+  _mm256_storeu_pd(d, _mm256_add_pd(sum0, sum1));
+  s.sum += (d[0] + d[1]) + (d[2] + d[3]);
+  _mm256_storeu_pd(d, _mm256_add_pd(sq0, sq1));
+  s.sumsq += (d[0] + d[1]) + (d[2] + d[3]);
+  float f[8];
+  _mm256_storeu_ps(f, mn);
+  for(int j = 0; j < 8; j++) {
+    s.min = (f[j] < s.min) ? f[j] : s.min;
+  }
+  _mm256_storeu_ps(f, mx);
+  for(int j = 0; j < 8; j++) {
+    s.max = (f[j] > s.max) ? f[j] : s.max;
+  }
+  reduce_scalar(v + i, n - i, shift, s);
+}
+
+#endif
+
+static void reduce(const float * v, size_t n, double shift, float_summary &s) {
+#if defined(HAVE_X86_SIMD)
+  static const bool has_avx2 = __builtin_cpu_supports("avx2");
+  if(has_avx2) {
+    reduce_avx2(v, n, shift, s);
+  }
+  else {
+    reduce_sse2(v, n, shift, s);
+  }
+#else
+  reduce_scalar(v, n, shift, s);
+#endif
+}
+
+
+/* response_sums:
+ * the response columns of the samples of a group summed up */
+struct response_sums {
+  uint64_t count;
+  uint64_t size;
+  uint16_t max_size;
+  uint64_t truncated;
+  uint64_t edns;
+  uint64_t dnssec_ok;
+  uint64_t error_rcodes;
+  uint64_t answers;
+  uint64_t authorities;
+  uint64_t additionals;
+  uint64_t validated;
+  uint64_t validation_failures;
+  uint64_t num_validations;
+  double validation_ms;
+  response_sums() {
+    memset(this, 0, sizeof(*this));
+  }
+  void add(const sample_block &blk, uint32_t i) {
+    uint16_t f = blk.flags[i];
+    count++;
+    size += blk.sizes[i];
+    max_size = (blk.sizes[i] > max_size) ? blk.sizes[i] : max_size;
+    truncated += (f & SAMPLE_TRUNCATED) ? 1 : 0;
+    edns += (f & SAMPLE_EDNS) ? 1 : 0;
+    dnssec_ok += (f & SAMPLE_DNSSEC_OK) ? 1 : 0;
+    error_rcodes += (blk.rcodes[i] != 0) ? 1 : 0;
+    answers += blk.num_answers[i];
+    authorities += blk.num_authorities[i];
+    additionals += blk.num_additionals[i];
+    validated += (f & SAMPLE_VALIDATED) ? 1 : 0;
+    validation_failures += (f & SAMPLE_VALIDATION_FAILED) ? 1 : 0;
+    if(blk.validation_ms[i] >= 0) {
+      num_validations++;
+      validation_ms += blk.validation_ms[i];
+    }
+  }
+  void merge(const response_sums &o) {
+    count += o.count;
+    size += o.size;
+    max_size = (o.max_size > max_size) ? o.max_size : max_size;
+    truncated += o.truncated;
+    edns += o.edns;
+    dnssec_ok += o.dnssec_ok;
+    error_rcodes += o.error_rcodes;
+    answers += o.answers;
+    authorities += o.authorities;
+    additionals += o.additionals;
+    validated += o.validated;
+    validation_failures += o.validation_failures;
+    num_validations += o.num_validations;
+    validation_ms += o.validation_ms;
+  }
+};
+
+
+/* group_table:
+ * the latencies of the samples of a thread by (window, domain),
+ * open addressing on the key, groups in order of creation */
+struct latency_group {
+  uint64_t key;            // window index << 32 | domain id
+  uint64_t failures;
+  std::vector<float> values;
+  response_sums responses;
+};
+
+struct group_table {
+  std::vector<int32_t> slots; // index in groups, -1: free
+  uint64_t mask;
+  std::vector<latency_group> groups;
+  group_table() : slots(1024, -1), mask(1023) {
+  }
+  static uint64_t hash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key ^ (key >> 32);
+  }
+  void grow() {
+    std::vector<int32_t> bigger(slots.size() * 2, -1);
+    mask = bigger.size() - 1;
+    for(size_t g = 0; g < groups.size(); g++) {
+      uint64_t i = hash(groups[g].key) & mask;
+      while(bigger[i] >= 0) {
+	i = (i + 1) & mask;
+      }
+      bigger[i] = g;
+    }
+    slots.swap(bigger);
+  }
+  // index in groups, created if missing
+  int32_t get(uint64_t key) {
+    uint64_t i = hash(key) & mask;
+    while(slots[i] >= 0) {
+      if(groups[slots[i]].key == key) {
+	return slots[i];
+      }
+      i = (i + 1) & mask;
+    }
+    if(2 * (groups.size() + 1) > slots.size()) {
+      grow();
+      return get(key);
+    }
+    slots[i] = groups.size();
+    latency_group g;
+    g.key = key;
+    g.failures = 0;
+    groups.push_back(g);
+    return slots[i];
+  }
+};
+
+
+// a partition of the blocks
+struct scan_task {
+  const std::vector<sample_block> * blocks;
+  size_t first;
+  size_t last;
+  unsigned int window;
+  uint32_t from;
+  uint32_t to;
+  bool responses;          // sum up the response columns too
+  group_table table;
+};
+
+// domain ids below this are looked up in an array (see scan)
+#define DIRECT_DOMAIN_IDS (1 << 22)
+
+static void scan(scan_task &t) {
+  /* the groups of the current window by domain id: the blocks are in
+   * time order, so most samples need one array access instead of a
+   * probe in the (much bigger) table of all the windows */
+  std::vector<int32_t> window_groups;
+  std::vector<uint32_t> touched;
+  uint64_t current_w = UINT64_MAX;
+  for(size_t b = t.first; b < t.last; b++) {
+    const sample_block &blk = (*t.blocks)[b];
+    if(blk.count == 0 || blk.max_ts < t.from || blk.min_ts >= t.to) {
+      continue; // out of the time range
+    }
+    for(uint32_t i = 0; i < blk.count; i++) {
+      uint32_t ts = blk.ts[i];
+      if(ts < t.from || ts >= t.to) {
+	continue;
+      }
+      uint64_t w = (t.window > 0) ? ts / t.window : 0;
+      uint32_t domain = (uint32_t) blk.domain_ids[i];
+      if(w != current_w) {
+	for(size_t d = 0; d < touched.size(); d++) {
+	  window_groups[touched[d]] = -1;
+	}
+	touched.clear();
+	current_w = w;
+      }
+      int32_t g;
+      if(domain < DIRECT_DOMAIN_IDS) {
+	if(domain >= window_groups.size()) {
+	  window_groups.resize(domain + 1, -1);
+	}
+	g = window_groups[domain];
+	if(g < 0) {
+	  g = t.table.get((w << 32) | domain);
+	  window_groups[domain] = g;
+	  touched.push_back(domain);
+	}
+      }
+      else {
+	g = t.table.get((w << 32) | domain);
+      }
+      float latency = blk.latencies[i];
+      if(latency < 0) {
+	t.table.groups[g].failures++;
+      }
+      else {
+	t.table.groups[g].values.push_back(latency);
+	if(t.responses && blk.flags != NULL && (blk.flags[i] & SAMPLE_HAS_METRICS)) {
+	  t.table.groups[g].responses.add(blk, i);
+	}
+      }
+    }
+  }
+}
+
+
+// a partition of the groups
+struct reduce_task {
+  std::vector<std::vector<latency_group *> > * parts; // per group, one per thread
+  std::vector<report_row> * rows;
+  const std::vector<double> * percentiles;
+  unsigned int window;
+  uint32_t from;
+  size_t first;
+  size_t step;
+};
+
+static void set_responses(report_row &row, const response_sums &rs) {
+  double n = (rs.count > 0) ? rs.count : 1;
+  row.num_responses = rs.count;
+  row.mean_size = rs.size / n;
+  row.max_size = rs.max_size;
+  row.truncated = rs.truncated;
+  row.edns = rs.edns;
+  row.dnssec_ok = rs.dnssec_ok;
+  row.error_rcodes = rs.error_rcodes;
+  row.mean_answers = rs.answers / n;
+  row.mean_authorities = rs.authorities / n;
+  row.mean_additionals = rs.additionals / n;
+  row.validated = rs.validated;
+  row.validation_failures = rs.validation_failures;
+  row.mean_validation_ms = (rs.num_validations > 0) ? rs.validation_ms / rs.num_validations : 0;
+}
+
+static void reduce_groups(reduce_task &t) {
+  std::vector<float> merged;
+  for(size_t r = t.first; r < t.rows->size(); r += t.step) {
+    std::vector<latency_group *> &parts = (*t.parts)[r];
+    report_row &row = (*t.rows)[r];
+    uint64_t key = parts[0]->key;
+    row.domain_id = (int32_t) (uint32_t) key;
+    row.window_start = (t.window > 0) ? (uint32_t) (key >> 32) * t.window : t.from;
+    row.failures = 0;
+    // the values of a group from all the threads
+    std::vector<float> * values = &parts[0]->values;
+    if(parts.size() > 1) {
+      merged.clear();
+      for(size_t p = 0; p < parts.size(); p++) {
+	merged.insert(merged.end(), parts[p]->values.begin(), parts[p]->values.end());
+      }
+      values = &merged;
+    }
+    response_sums rs;
+    for(size_t p = 0; p < parts.size(); p++) {
+      row.failures += parts[p]->failures;
+      rs.merge(parts[p]->responses);
+    }
+    set_responses(row, rs);
+    size_t n = values->size();
+    row.count = n;
+    row.percentiles.assign(t.percentiles->size(), 0);
+    if(n == 0) {
+      row.mean = row.stdev = 0;
+      row.min = row.max = 0;
+      continue;
+    }
+    float_summary s;
+    s.sum = s.sumsq = 0;
+    s.min = s.max = (*values)[0];
+    double shift = (*values)[0];
+    reduce(&(*values)[0], n, shift, s);
+    double m = s.sum / n;
+    double var = s.sumsq / n - m * m;
+    row.mean = shift + m;
+    row.stdev = (var > 0) ? sqrt(var) : 0;
+    row.min = s.min;
+    row.max = s.max;
+    // nearest rank, the percentiles are in increasing order
+    size_t done = 0;
+    for(size_t p = 0; p < t.percentiles->size(); p++) {
+      double rank = ceil((*t.percentiles)[p] / 100.0 * n);
+      size_t k = (rank < 1) ? 0 : (size_t) rank - 1;
+      k = (k >= n) ? n - 1 : k;
+      if(k >= done) {
+	std::nth_element(values->begin() + done, values->begin() + k, values->end());
+	done = k;
+      }
+      row.percentiles[p] = (*values)[k];
+    }
+  }
+}
+
+
+static bool row_order(const report_row &a, const report_row &b) {
+  if(a.domain_id != b.domain_id) {
+    return a.domain_id < b.domain_id;
+  }
+  return a.window_start < b.window_start;
+}
+
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+// these functions are not visible outside this code unit
+static void * scan_wrapper(void * arg) {
+  scan((*(scan_task *) arg));
+  return NULL;
+}
+
+static void * reduce_wrapper(void * arg) {
+  reduce_groups((*(reduce_task *) arg));
+  return NULL;
+}
+#endif
+
+
+DnsLatencyReport::DnsLatencyReport() : window(3600), from(0), to(UINT32_MAX),
+				       with_responses(false) {
+  percentiles.push_back(50);
+  percentiles.push_back(90);
+  percentiles.push_back(99);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  num_threads = (cpus > 0) ? cpus : 1;
+}
+
+
+void DnsLatencyReport::add_sample_file(const char * path) {
+  DnsSampleLog * log = new DnsSampleLog();
+  try {
+    log->open_read(path);
+  }
+  catch(std::string s) {
+    delete log;
+    throw std::string("Can't add_sample_file() -> ") + s;
+  }
+  logs.push_back(log);
+  blocks.insert(blocks.end(), log->get_blocks().begin(), log->get_blocks().end());
+}
+
+
+void DnsLatencyReport::add_csv_block(std::vector<int32_t> * ids, std::vector<uint32_t> * ts,
+				     std::vector<float> * latencies) {
+  csv_domain_ids.push_back(ids);
+  csv_ts.push_back(ts);
+  csv_latencies.push_back(latencies);
+  if(ids->empty()) {
+    return;
+  }
+  sample_block b;
+  memset(&b, 0, sizeof(b)); // no response columns
+  b.count = ids->size();
+  b.min_ts = *std::min_element(ts->begin(), ts->end());
+  b.max_ts = *std::max_element(ts->begin(), ts->end());
+  b.domain_ids = &(*ids)[0];
+  b.ts = &(*ts)[0];
+  b.latencies = &(*latencies)[0];
+  blocks.push_back(b);
+}
+
+
+const char * DnsLatencyReport::parse_time(const char * p, uint32_t &ts) {
+  char * end;
+  long v = strtol(p, &end, 10);
+  if(end == p) {
+    return NULL;
+  }
+  if(*end != '-') {
+    ts = (uint32_t) v;
+    return end;
+  }
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char * rest = strptime(p, "%Y-%m-%d %H:%M:%S", &tm);
+  if(rest == NULL) {
+    return NULL;
+  }
+  ts = (uint32_t) timegm(&tm);
+  return rest;
+}
+
+
+void DnsLatencyReport::add_csv_file(const char * path) {
+  std::ifstream in(path);
+  if(!in) {
+    throw std::string("Can't add_csv_file() - can't open ") + path;
+  }
+  std::vector<int32_t> * ids = new std::vector<int32_t>();
+  std::vector<uint32_t> * ts = new std::vector<uint32_t>();
+  std::vector<float> * latencies = new std::vector<float>();
+  std::string line;
+  uint64_t line_num = 0;
+  while(std::getline(in, line)) {
+    line_num++;
+    const char * p = line.c_str();
+    char * end;
+    long id = strtol(p, &end, 10);
+    if(end == p || (*end != ',' && *end != '\t')) {
+      continue; // header or empty line
+    }
+    uint32_t sample_ts;
+    const char * q = parse_time(end + 1, sample_ts);
+    if(q == NULL || (*q != ',' && *q != '\t')) {
+      std::cerr << path << ":" << line_num << ": bad timestamp" << std::endl;
+      continue;
+    }
+    // NULL (\N) latencies are failures
+    double latency = (q[1] == '\\' || strncmp(q + 1, "NULL", 4) == 0) ? -1 : strtod(q + 1, NULL);
+    ids->push_back(id);
+    ts->push_back(sample_ts);
+    latencies->push_back(latency);
+    if(ids->size() == DnsSampleLog::SAMPLES_PER_BLOCK) {
+      add_csv_block(ids, ts, latencies);
+      ids = new std::vector<int32_t>();
+      ts = new std::vector<uint32_t>();
+      latencies = new std::vector<float>();
+    }
+  }
+  add_csv_block(ids, ts, latencies);
+}
+
+
+void DnsLatencyReport::set_window(unsigned int seconds) {
+  window = seconds;
+}
+
+
+void DnsLatencyReport::set_range(uint32_t from, uint32_t to) {
+  this->from = from;
+  this->to = to;
+}
+
+
+void DnsLatencyReport::set_percentiles(const std::vector<double> &percentiles) {
+  for(size_t i = 0; i < percentiles.size(); i++) {
+    if(percentiles[i] <= 0 || percentiles[i] > 100) {
+      throw std::string("Can't set_percentiles() - percentiles are in (0, 100]");
+    }
+  }
+  this->percentiles = percentiles;
+  std::sort(this->percentiles.begin(), this->percentiles.end());
+}
+
+
+void DnsLatencyReport::set_threads(unsigned int num_threads) {
+  this->num_threads = (num_threads > 0) ? num_threads : 1;
+}
+
+
+void DnsLatencyReport::set_response_metrics(bool enable) {
+  with_responses = enable;
+}
+
+
+uint64_t DnsLatencyReport::num_samples() const {
+  uint64_t n = 0;
+  for(size_t i = 0; i < blocks.size(); i++) {
+    n += blocks[i].count;
+  }
+  return n;
+}
+
+
+void DnsLatencyReport::compute(std::vector<report_row> &rows) {
+  rows.clear();
+  // scan: contiguous ranges of blocks, balanced on the samples
+  unsigned int n = num_threads;
+  std::vector<scan_task> scans(n);
+  uint64_t total = num_samples();
+  uint64_t per_thread = total / n + 1;
+  size_t b = 0;
+  for(unsigned int t = 0; t < n; t++) {
+    scans[t].blocks = &blocks;
+    scans[t].window = window;
+    scans[t].from = from;
+    scans[t].to = to;
+    scans[t].responses = with_responses;
+    scans[t].first = b;
+    uint64_t taken = 0;
+    while(b < blocks.size() && (taken < per_thread || t == n - 1)) {
+      taken += blocks[b].count;
+      b++;
+    }
+    scans[t].last = b;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  std::vector<pthread_t> threads(n);
+  std::vector<bool> started(n, false);
+  for(unsigned int t = 1; t < n; t++) {
+    started[t] = (pthread_create(&threads[t], NULL, scan_wrapper, &scans[t]) == 0);
+    if(!started[t]) {
+      scan(scans[t]);
+    }
+  }
+  scan(scans[0]);
+  for(unsigned int t = 1; t < n; t++) {
+    if(started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+#else
+  for(unsigned int t = 0; t < n; t++) {
+    scan(scans[t]);
+  }
+#endif
+  // the parts of every group, in (window, domain) order
+  std::map<uint64_t,std::vector<latency_group *> > groups;
+  for(unsigned int t = 0; t < n; t++) {
+    std::vector<latency_group> &g = scans[t].table.groups;
+    for(size_t i = 0; i < g.size(); i++) {
+      groups[g[i].key].push_back(&g[i]);
+    }
+  }
+  std::vector<std::vector<latency_group *> > parts;
+  parts.reserve(groups.size());
+  std::map<uint64_t,std::vector<latency_group *> >::iterator it;
+  for(it = groups.begin(); it != groups.end(); it++) {
+    parts.push_back(std::vector<latency_group *>());
+    parts.back().swap(it->second);
+  }
+  groups.clear();
+  // reduce: the groups are interleaved among the threads
+  rows.resize(parts.size());
+  std::vector<reduce_task> reduces(n);
+  for(unsigned int t = 0; t < n; t++) {
+    reduces[t].parts = &parts;
+    reduces[t].rows = &rows;
+    reduces[t].percentiles = &percentiles;
+    reduces[t].window = window;
+    reduces[t].from = from;
+    reduces[t].first = t;
+    reduces[t].step = n;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  for(unsigned int t = 1; t < n; t++) {
+    started[t] = (pthread_create(&threads[t], NULL, reduce_wrapper, &reduces[t]) == 0);
+    if(!started[t]) {
+      reduce_groups(reduces[t]);
+    }
+  }
+  reduce_groups(reduces[0]);
+  for(unsigned int t = 1; t < n; t++) {
+    if(started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+#else
+  for(unsigned int t = 0; t < n; t++) {
+    reduce_groups(reduces[t]);
+  }
+#endif
+  std::stable_sort(rows.begin(), rows.end(), row_order);
+}
+
+
+void DnsLatencyReport::write_csv(std::ostream &out, const std::vector<report_row> &rows) const {
+  out << "domain_id,window_start,count,failures,mean,stdev,min,max";
+  for(size_t p = 0; p < percentiles.size(); p++) {
+    out << ",p" << percentiles[p];
+  }
+  if(with_responses) {
+    out << ",responses,mean_size,max_size,truncated,edns,dnssec_ok,error_rcodes"
+	<< ",mean_answers,mean_authorities,mean_additionals"
+	<< ",validated,validation_failures,mean_validation_ms";
+  }
+  out << std::endl;
+  for(size_t r = 0; r < rows.size(); r++) {
+    const report_row &row = rows[r];
+    out << row.domain_id << "," << row.window_start << "," << row.count << ","
+	<< row.failures << "," << row.mean << "," << row.stdev << ","
+	<< row.min << "," << row.max;
+    for(size_t p = 0; p < row.percentiles.size(); p++) {
+      out << "," << row.percentiles[p];
+    }
+    if(with_responses) {
+      out << "," << row.num_responses << "," << row.mean_size << "," << row.max_size
+	  << "," << row.truncated << "," << row.edns << "," << row.dnssec_ok
+	  << "," << row.error_rcodes << "," << row.mean_answers
+	  << "," << row.mean_authorities << "," << row.mean_additionals
+	  << "," << row.validated << "," << row.validation_failures
+	  << "," << row.mean_validation_ms;
+    }
+    out << "\n";
+  }
+}
+
+
+void DnsLatencyReport::write_json(std::ostream &out, const std::vector<report_row> &rows) const {
+  out << "[";
+  for(size_t r = 0; r < rows.size(); r++) {
+    const report_row &row = rows[r];
+    out << ((r > 0) ? ",\n " : "\n ");
+    out << "{\"domain_id\":" << row.domain_id << ",\"window_start\":" << row.window_start
+	<< ",\"count\":" << row.count << ",\"failures\":" << row.failures
+	<< ",\"mean\":" << row.mean << ",\"stdev\":" << row.stdev
+	<< ",\"min\":" << row.min << ",\"max\":" << row.max;
+    for(size_t p = 0; p < row.percentiles.size(); p++) {
+      out << ",\"p" << percentiles[p] << "\":" << row.percentiles[p];
+    }
+    if(with_responses) {
+      out << ",\"responses\":" << row.num_responses << ",\"mean_size\":" << row.mean_size
+	  << ",\"max_size\":" << row.max_size << ",\"truncated\":" << row.truncated
+	  << ",\"edns\":" << row.edns << ",\"dnssec_ok\":" << row.dnssec_ok
+	  << ",\"error_rcodes\":" << row.error_rcodes
+	  << ",\"mean_answers\":" << row.mean_answers
+	  << ",\"mean_authorities\":" << row.mean_authorities
+	  << ",\"mean_additionals\":" << row.mean_additionals
+	  << ",\"validated\":" << row.validated
+	  << ",\"validation_failures\":" << row.validation_failures
+	  << ",\"mean_validation_ms\":" << row.mean_validation_ms;
+    }
+    out << "}";
+  }
+  out << "\n]" << std::endl;
+}
+
+
+DnsLatencyReport::~DnsLatencyReport() {
+  for(size_t i = 0; i < logs.size(); i++) {
+    delete logs[i];
+  }
+  for(size_t i = 0; i < csv_domain_ids.size(); i++) {
+    delete csv_domain_ids[i];
+    delete csv_ts[i];
+    delete csv_latencies[i];
+  }
+}
@@ -0,0 +1,120 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSLATENCYREPORT_H
+#define _DNSLATENCYREPORT_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+
+#include "DnsSampleLog.hpp"
+#include "dns_latency_monitor-config.h"
+
+
+/* report_row:
+ * the aggregates of one domain in one time window */
+struct report_row {
+  int domain_id;
+  uint32_t window_start;   // seconds since the epoch
+  uint64_t count;          // answered queries
+  uint64_t failures;
+  double mean;             // ms, over the answered queries
+  double stdev;
+  float min;
+  float max;
+  std::vector<float> percentiles; // as set_percentiles
+  // response metrics (set_response_metrics), over the answered
+  // queries recorded with their metrics (num_responses)
+  uint64_t num_responses;
+  double mean_size;        // bytes
+  uint16_t max_size;
+  uint64_t truncated;      // TC
+  uint64_t edns;
+  uint64_t dnssec_ok;      // DO
+  uint64_t error_rcodes;   // rcode != NOERROR
+  double mean_answers;
+  double mean_authorities;
+  double mean_additionals;
+  uint64_t validated;      // all signatures verified
+  uint64_t validation_failures;
+  double mean_validation_ms; // over the responses whose signatures were verified
+};
+
+
+/* Dns Latency Report:
+ * this class computes per-domain, per-window aggregates over the
+ * recorded latency samples, read from DnsSampleLog files (mapped
+ * in memory) or from CSV exports (domain_id,ts,latency, comma or tab
+ * separated, ts as unix time or "YYYY-MM-DD HH:MM:SS" UTC)
+ * compute works in two parallel phases:
+ * - scan: the blocks are partitioned among the threads, every
+ *   thread groups the latencies of its blocks by (domain, window)
+ * - reduce: the groups are partitioned among the threads, the
+ *   count/mean/stdev/min/max of a group are computed by a SIMD
+ *   kernel (AVX2 or SSE2, chosen at run time) and the exact
+ *   percentiles (nearest rank) by selection
+ * windows are aligned to the epoch (e.g. 3600: UTC hours), a window
+ * of 0 puts the whole time range in one window
+ * with set_response_metrics the scan also sums up the response columns
+ * of the samples (version 2 sample files only) and the rows have their
+ * averages and counts
+ */
+class DnsLatencyReport{
+private:
+  std::vector<DnsSampleLog *> logs;
+  // columns of the samples read from csv files
+  std::vector<std::vector<int32_t> *> csv_domain_ids;
+  std::vector<std::vector<uint32_t> *> csv_ts;
+  std::vector<std::vector<float> *> csv_latencies;
+  std::vector<sample_block> blocks;
+  unsigned int window;
+  uint32_t from;
+  uint32_t to;
+  std::vector<double> percentiles;
+  unsigned int num_threads;
+  bool with_responses;
+  void add_csv_block(std::vector<int32_t> * ids, std::vector<uint32_t> * ts,
+		     std::vector<float> * latencies);
+public:
+  DnsLatencyReport();
+  /* unix time or "YYYY-MM-DD HH:MM:SS" (UTC), returns the end of
+   * the time in p or NULL if p does not start with a time */
+  static const char * parse_time(const char * p, uint32_t &ts);
+  void add_sample_file(const char * path);
+  void add_csv_file(const char * path);
+  void set_window(unsigned int seconds);
+  // samples with from <= ts < to
+  void set_range(uint32_t from, uint32_t to);
+  void set_percentiles(const std::vector<double> &percentiles);
+  void set_threads(unsigned int num_threads);
+  void set_response_metrics(bool enable);
+  uint64_t num_samples() const;
+  // rows sorted by domain and window
+  void compute(std::vector<report_row> &rows);
+  void write_csv(std::ostream &out, const std::vector<report_row> &rows) const;
+  void write_json(std::ostream &out, const std::vector<report_row> &rows) const;
+  ~DnsLatencyReport();
+};
+
+#endif /* _DNSLATENCYREPORT_H */
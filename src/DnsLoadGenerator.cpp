@@ -0,0 +1,615 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsLoadGenerator.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/prctl.h>
+
+#include "DnsProbeProfiler.hpp"
+#include "DnsResponseParser.hpp"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+// the random first label of the prefixed queries: "\x0a" + 10 letters
+#define PREFIX_OFFSET (DnsResponseParser::HEADER_SIZE + 1)
+#define PREFIX_LEN 10
+// room for a query in a send batch
+#define MAX_QUERY_SIZE 512
+// a larger socket buffer absorbs the bursts of the schedule
+#define SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+// queries sent on a socket before moving to the next one
+#define SOCKET_CHUNK 1024
+// shortest sleep of a sending thread, i.e. longest batching delay
+#define SEND_QUANTUM_NS 100000ULL
+
+
+static inline uint64_t xorshift64(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+
+static uint64_t realtime_offset() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t real = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  return real - DnsProbeProfiler::now_ns();
+}
+
+
+load_thread::load_thread(unsigned int index) : index(index) {
+  rng = 0x9E3779B97F4A7C15ULL * (index + 1);
+  memset(&counters, 0, sizeof(counters));
+}
+
+
+load_thread::~load_thread() {
+  for(size_t i = 0; i < transports.size(); i++) {
+    delete transports[i];
+  }
+}
+
+
+DnsLoadGenerator::DnsLoadGenerator() : target_len(0), prefix_threshold(0), timeout_ms(1000),
+				       qps(0), duration(0), elapsed(0), num_threads(0),
+				       sockets_per_thread(0) {
+  memset(&target, 0, sizeof(target));
+  memset(&counters, 0, sizeof(counters));
+}
+
+
+void DnsLoadGenerator::set_target(DnsResolver &dr, const std::string &server) {
+  size_t len = 0;
+  struct sockaddr_storage * ss = dr.server_address(server, &len);
+  if(ss == NULL) {
+    throw std::string("Can't set_target() - invalid server address ") + server;
+  }
+  memcpy(&target, ss, len);
+  target_len = len;
+  target_name = server;
+  LDNS_FREE(ss);
+}
+
+
+void DnsLoadGenerator::set_domains(DnsResolver &dr, const std::vector<std::string> &names,
+				   const std::vector<double> &weights) {
+  domains.clear();
+  queries.clear();
+  prefixed_queries.clear();
+  std::vector<double> w;
+  for(size_t i = 0; i < names.size(); i++) {
+    std::vector<uint8_t> q, pq;
+    if(!dr.query_wire(names[i], q) || !dr.query_wire("aaaaaaaaaa." + names[i], pq) ||
+       pq.size() > MAX_QUERY_SIZE) {
+      std::cerr << names[i] << " cannot be encoded" << std::endl;
+      continue;
+    }
+    domains.push_back(names[i]);
+    queries.push_back(q);
+    prefixed_queries.push_back(pq);
+    w.push_back((i < weights.size() && weights[i] > 0) ? weights[i] : 1.0);
+  }
+  size_t n = domains.size();
+  if(n == 0) {
+    throw std::string("Can't set_domains() - no domain to query");
+  }
+  // alias method (Vose): one uniform draw picks a column, a second
+  // one the column domain or its alias
+  double total = 0;
+  for(size_t i = 0; i < n; i++) {
+    total += w[i];
+  }
+  std::vector<double> scaled(n);
+  std::vector<size_t> small, large;
+  for(size_t i = 0; i < n; i++) {
+    scaled[i] = w[i] * n / total;
+    if(scaled[i] < 1.0) {
+      small.push_back(i);
+    }
+    else {
+      large.push_back(i);
+    }
+  }
+  alias_threshold.assign(n, UINT32_MAX);
+  alias_index.resize(n);
+  for(size_t i = 0; i < n; i++) {
+    alias_index[i] = i;
+  }
+  while(!small.empty() && !large.empty()) {
+    size_t s = small.back();
+    small.pop_back();
+    size_t l = large.back();
+    alias_threshold[s] = (uint32_t) (scaled[s] * 4294967295.0);
+    alias_index[s] = l;
+    scaled[l] -= 1.0 - scaled[s];
+    if(scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+}
+
+
+void DnsLoadGenerator::read_mix(const char * path, std::vector<std::string> &names,
+				std::vector<double> &weights) {
+  std::ifstream in(path);
+  if(!in) {
+    throw std::string("Can't read_mix() - can't open ") + path;
+  }
+  std::string line;
+  while(std::getline(in, line)) {
+    size_t hash = line.find('#');
+    if(hash != std::string::npos) {
+      line.erase(hash);
+    }
+    std::istringstream fields(line);
+    std::string name;
+    double weight = 1.0;
+    if(!(fields >> name)) {
+      continue;
+    }
+    if(!(fields >> weight)) {
+      weight = 1.0;
+    }
+    names.push_back(name);
+    weights.push_back(weight);
+  }
+}
+
+
+void DnsLoadGenerator::set_random_prefix(double fraction) {
+  fraction = (fraction < 0) ? 0 : ((fraction > 1) ? 1 : fraction);
+  prefix_threshold = (uint32_t) (fraction * 4294967295.0);
+}
+
+
+void DnsLoadGenerator::set_timeout(unsigned int timeout_ms) {
+  this->timeout_ms = (timeout_ms > 0) ? timeout_ms : 1;
+}
+
+
+inline uint32_t DnsLoadGenerator::pick_domain(uint64_t r) const {
+  uint32_t column = (uint32_t) ((r >> 32) % alias_threshold.size());
+  return ((uint32_t) r <= alias_threshold[column]) ? column : alias_index[column];
+}
+
+
+void DnsLoadGenerator::open_sockets(load_thread &t) {
+  for(unsigned int s = 0; s < sockets_per_thread; s++) {
+    DnsUdpTransport * tr = new DnsUdpTransport();
+    t.transports.push_back(tr);
+    tr->open(IO_BACKEND_EPOLL, &target, target_len);
+    int size = SOCKET_BUFFER_SIZE;
+    setsockopt(tr->get_socket(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(tr->get_socket(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+  load_thread::in_flight free_id;
+  free_id.intended_ns = 0;
+  free_id.sent_ns = 0;
+  t.pending.assign(sockets_per_thread, std::vector<load_thread::in_flight>(65536, free_id));
+  t.next_id.assign(sockets_per_thread, 0);
+  t.oldest_id.assign(sockets_per_thread, 0);
+}
+
+
+/* the queries of the thread due by now, a batch per socket at most
+ * (round robin): returns true if some are left, i.e. the thread is
+ * behind the schedule */
+bool DnsLoadGenerator::send_due(load_thread &t, uint64_t &next, uint64_t num_queries,
+				uint64_t start_ns, unsigned int &socket, uint8_t * batch) {
+  struct iovec iovs[BATCH_SIZE];
+  uint64_t intended[BATCH_SIZE];
+  uint64_t now = DnsProbeProfiler::now_ns();
+  for(size_t b = 0; b < t.transports.size() && next < num_queries; b++) {
+    // query next is the (next * num_threads + index)-th of the run
+    unsigned int n = 0;
+    while(n < BATCH_SIZE && next + n < num_queries) {
+      uint64_t k = (next + n) * num_threads + t.index;
+      uint64_t due = start_ns + (uint64_t) (k * 1e9 / qps);
+      if(due > now) {
+	break;
+      }
+      intended[n] = due;
+      uint64_t r = xorshift64(t.rng);
+      uint32_t d = pick_domain(r);
+      r = xorshift64(t.rng);
+      bool prefixed = (uint32_t) r < prefix_threshold;
+      const std::vector<uint8_t> &q = prefixed ? prefixed_queries[d] : queries[d];
+      uint8_t * buf = batch + n * MAX_QUERY_SIZE;
+      memcpy(buf, &q[0], q.size());
+      uint16_t id = t.next_id[socket] + n;
+      buf[0] = id >> 8;
+      buf[1] = id & 0xFF;
+      if(prefixed) {
+	r >>= 32;
+	for(unsigned int c = 0; c < PREFIX_LEN; c++) {
+	  buf[PREFIX_OFFSET + c] = 'a' + (r % 26);
+	  r = (c == 4) ? xorshift64(t.rng) : r / 26;
+	}
+      }
+      iovs[n].iov_base = buf;
+      iovs[n].iov_len = q.size();
+      n++;
+    }
+    if(n == 0) {
+      return false;
+    }
+    uint64_t sent_ns = DnsProbeProfiler::now_ns();
+    int sent = t.transports[socket]->send_queries(iovs, n);
+    if(sent < 0) {
+      // e.g. ECONNREFUSED of an earlier query: the query is lost
+      t.counters.send_errors++;
+      sent = 1;
+    }
+    else {
+      std::vector<load_thread::in_flight> &pending = t.pending[socket];
+      for(int i = 0; i < sent; i++) {
+	load_thread::in_flight &f = pending[(uint16_t) (t.next_id[socket] + i)];
+	if(f.sent_ns != 0) {
+	  give_up(t, f, sent_ns); // the id wrapped around, never answered
+	}
+	f.intended_ns = intended[i];
+	f.sent_ns = sent_ns;
+      }
+      if(sent > 0) {
+	t.counters.first_send_ns = (t.counters.first_send_ns == 0) ? sent_ns : t.counters.first_send_ns;
+	t.counters.last_send_ns = sent_ns;
+      }
+      t.counters.sent += sent;
+      if(sent > 0 && sent_ns - intended[0] > t.counters.max_send_lag_ns) {
+	t.counters.max_send_lag_ns = sent_ns - intended[0];
+      }
+    }
+    uint16_t first_id = t.next_id[socket];
+    t.next_id[socket] += sent;
+    next += sent;
+    if(((first_id ^ t.next_id[socket]) & ~(SOCKET_CHUNK - 1)) != 0) {
+      socket = (socket + 1) % t.transports.size();
+    }
+    if(sent < (int) n) {
+      return true; // socket buffer full, receive first
+    }
+    now = DnsProbeProfiler::now_ns();
+  }
+  if(next >= num_queries) {
+    return false;
+  }
+  uint64_t k = next * num_threads + t.index;
+  return start_ns + (uint64_t) (k * 1e9 / qps) <= now;
+}
+
+
+// everything received on the sockets of the thread
+void DnsLoadGenerator::receive(load_thread &t, uint8_t * buffers, uint64_t clock_offset) {
+  size_t lens[BATCH_SIZE];
+  uint64_t rx_real[BATCH_SIZE];
+  for(size_t s = 0; s < t.transports.size(); s++) {
+    // a short batch empties the socket
+    int n = BATCH_SIZE;
+    while(n == (int) BATCH_SIZE) {
+      n = t.transports[s]->receive_responses(buffers, DnsUdpTransport::RECV_BUFFER_SIZE,
+					     BATCH_SIZE, lens, rx_real);
+      if(n <= 0) {
+	break;
+      }
+      uint64_t now = DnsProbeProfiler::now_ns();
+      for(int i = 0; i < n; i++) {
+	const uint8_t * wire = buffers + i * DnsUdpTransport::RECV_BUFFER_SIZE;
+	if(lens[i] < DnsResponseParser::HEADER_SIZE) {
+	  t.counters.malformed++;
+	  continue;
+	}
+	uint16_t id = (wire[0] << 8) | wire[1];
+	load_thread::in_flight &f = t.pending[s][id];
+	if(f.sent_ns == 0) {
+	  t.counters.unexpected++;
+	  continue;
+	}
+	response_metrics m;
+	if(!DnsResponseParser::parse(wire, lens[i], id, m)) {
+	  t.counters.malformed++;
+	  f.sent_ns = 0;
+	  continue;
+	}
+	// the kernel timestamp, unless a clock step made it inconsistent
+	uint64_t rx = rx_real[i] - clock_offset;
+	if(rx_real[i] == 0 || rx < f.sent_ns || rx > now) {
+	  rx = now;
+	}
+	t.corrected.record(rx - f.intended_ns);
+	t.uncorrected.record(rx - f.sent_ns);
+	f.sent_ns = 0;
+	t.counters.answered++;
+	switch(m.rcode) {
+	case 0: t.counters.noerror++; break;
+	case 2: t.counters.servfail++; break;
+	case 3: t.counters.nxdomain++; break;
+	default: t.counters.other_rcode++; break;
+	}
+	t.counters.truncated += m.truncated ? 1 : 0;
+      }
+    }
+  }
+}
+
+
+// a lost query: its latency is at least the time it waited
+void DnsLoadGenerator::give_up(load_thread &t, load_thread::in_flight &f, uint64_t now) {
+  t.counters.timeouts++;
+  t.corrected.record(now - f.intended_ns);
+  t.uncorrected.record(now - f.sent_ns);
+  f.sent_ns = 0;
+}
+
+
+// the queries older than the timeout are given up
+void DnsLoadGenerator::expire(load_thread &t, uint64_t now) {
+  uint64_t timeout_ns = (uint64_t) timeout_ms * 1000000ULL;
+  for(size_t s = 0; s < t.transports.size(); s++) {
+    std::vector<load_thread::in_flight> &pending = t.pending[s];
+    while(t.oldest_id[s] != t.next_id[s]) {
+      load_thread::in_flight &f = pending[t.oldest_id[s]];
+      if(f.sent_ns != 0) {
+	if(now - f.sent_ns < timeout_ns) {
+	  break;
+	}
+	give_up(t, f, now);
+      }
+      t.oldest_id[s]++;
+    }
+  }
+}
+
+
+void DnsLoadGenerator::run_thread(load_thread &t, uint64_t start_ns) {
+  uint64_t total = (uint64_t) (qps * duration);
+  uint64_t num_queries = (total > t.index) ? (total - t.index + num_threads - 1) / num_threads : 0;
+  uint64_t next = 0;
+  unsigned int socket = 0;
+  std::vector<uint8_t> batch(BATCH_SIZE * MAX_QUERY_SIZE);
+  std::vector<uint8_t> buffers(BATCH_SIZE * DnsUdpTransport::RECV_BUFFER_SIZE);
+  // the default 50 us timer slack would delay every sleeping send
+  prctl(PR_SET_TIMERSLACK, 1000UL, 0, 0, 0);
+  uint64_t clock_offset = realtime_offset();
+  uint64_t last_expire = start_ns;
+  uint64_t timeout_ns = (uint64_t) timeout_ms * 1000000ULL;
+  while(true) {
+    bool behind = send_due(t, next, num_queries, start_ns, socket, &batch[0]);
+    receive(t, &buffers[0], clock_offset);
+    uint64_t now = DnsProbeProfiler::now_ns();
+    if(now - last_expire >= 1000000ULL) {
+      expire(t, now);
+      clock_offset = realtime_offset();
+      last_expire = now;
+    }
+    if(next >= num_queries) {
+      bool done = true;
+      for(size_t s = 0; s < t.transports.size() && done; s++) {
+	done = (t.oldest_id[s] == t.next_id[s]);
+      }
+      if(done || now > start_ns + (uint64_t) (duration * 1e9) + 2 * timeout_ns) {
+	// what is still in flight will not be answered
+	for(size_t s = 0; s < t.pending.size(); s++) {
+	  for(size_t id = 0; id < t.pending[s].size(); id++) {
+	    if(t.pending[s][id].sent_ns != 0) {
+	      give_up(t, t.pending[s][id], now);
+	    }
+	  }
+	}
+	break;
+      }
+    }
+    if(behind) {
+      continue;
+    }
+    /* sleep until the next query is due, at least SEND_QUANTUM_NS so
+     * that the sends go in batches (their delay is in the corrected
+     * latency), at most 1 ms: the responses wait in the sockets with
+     * their kernel timestamps */
+    uint64_t wait_ns = 1000000ULL;
+    if(next < num_queries) {
+      uint64_t k = next * num_threads + t.index;
+      uint64_t due = start_ns + (uint64_t) (k * 1e9 / qps);
+      wait_ns = (due > now) ? due - now : 0;
+      wait_ns = (wait_ns > 1000000ULL) ? 1000000ULL : wait_ns;
+      wait_ns = (wait_ns < SEND_QUANTUM_NS) ? SEND_QUANTUM_NS : wait_ns;
+    }
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = wait_ns;
+    nanosleep(&ts, NULL);
+  }
+}
+
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+struct load_thread_args {
+  DnsLoadGenerator * generator;
+  load_thread * thread;
+  uint64_t start_ns;
+};
+
+// this function is not visible outside this code unit
+static void * load_thread_wrapper(void * arg) {
+  load_thread_args * a = (load_thread_args *) arg;
+  a->generator->run_thread(*a->thread, a->start_ns);
+  return NULL;
+}
+#endif
+
+
+void DnsLoadGenerator::run(double qps, double duration, unsigned int num_threads) {
+  if(domains.empty() || target_len == 0) {
+    throw std::string("Can't run() DnsLoadGenerator - no target or no domain");
+  }
+  if(!(qps > 0) || !(duration > 0)) {
+    throw std::string("Can't run() DnsLoadGenerator - qps and duration must be positive");
+  }
+  if(num_threads > MAX_THREADS) {
+    std::stringstream e;
+    e << "Can't run() DnsLoadGenerator - at most " << MAX_THREADS << " threads";
+    throw e.str();
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  num_threads = (num_threads > 0) ? num_threads : 1;
+#else
+  num_threads = 1;
+#endif
+  // the ids of a socket must not wrap within twice the timeout
+  double sockets = ceil(qps / num_threads * 2 * timeout_ms / 1000.0 / 65536.0);
+  if(sockets > MAX_SOCKETS_PER_THREAD) {
+    std::stringstream e;
+    e << "Can't run() DnsLoadGenerator - " << qps << " qps would need " << sockets
+      << " sockets per thread, at most " << MAX_SOCKETS_PER_THREAD
+      << " (more threads or a shorter timeout)";
+    throw e.str();
+  }
+  this->num_threads = num_threads;
+  this->qps = qps;
+  this->duration = duration;
+  sockets_per_thread = (sockets > 0) ? (unsigned int) sockets : 1;
+  std::vector<load_thread *> threads;
+  try {
+    for(unsigned int i = 0; i < this->num_threads; i++) {
+      threads.push_back(new load_thread(i));
+      open_sockets(*threads.back());
+    }
+  }
+  catch(std::string e) {
+    for(size_t i = 0; i < threads.size(); i++) {
+      delete threads[i];
+    }
+    throw std::string("Can't run() DnsLoadGenerator -> ") + e;
+  }
+  // a little time to start the threads before the first query is due
+  uint64_t start_ns = DnsProbeProfiler::now_ns() + 10000000ULL;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  std::vector<pthread_t> ids(this->num_threads);
+  std::vector<load_thread_args> args(this->num_threads);
+  std::vector<bool> started(this->num_threads, false);
+  for(unsigned int i = 1; i < this->num_threads; i++) {
+    args[i].generator = this;
+    args[i].thread = threads[i];
+    args[i].start_ns = start_ns;
+    started[i] = (pthread_create(&ids[i], NULL, load_thread_wrapper, &args[i]) == 0);
+    if(!started[i]) {
+      std::cerr << "Can't start load thread " << i << std::endl;
+    }
+  }
+#endif
+  run_thread(*threads[0], start_ns);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  for(unsigned int i = 1; i < this->num_threads; i++) {
+    if(started[i]) {
+      pthread_join(ids[i], NULL);
+    }
+  }
+#endif
+  elapsed = (DnsProbeProfiler::now_ns() - start_ns) / 1e9;
+  memset(&counters, 0, sizeof(counters));
+  corrected.clear();
+  uncorrected.clear();
+  for(size_t i = 0; i < threads.size(); i++) {
+    const load_counters &c = threads[i]->counters;
+    counters.sent += c.sent;
+    counters.answered += c.answered;
+    counters.timeouts += c.timeouts;
+    counters.unexpected += c.unexpected;
+    counters.malformed += c.malformed;
+    counters.send_errors += c.send_errors;
+    counters.noerror += c.noerror;
+    counters.nxdomain += c.nxdomain;
+    counters.servfail += c.servfail;
+    counters.other_rcode += c.other_rcode;
+    counters.truncated += c.truncated;
+    if(c.max_send_lag_ns > counters.max_send_lag_ns) {
+      counters.max_send_lag_ns = c.max_send_lag_ns;
+    }
+    if(c.first_send_ns != 0 && (counters.first_send_ns == 0 || c.first_send_ns < counters.first_send_ns)) {
+      counters.first_send_ns = c.first_send_ns;
+    }
+    if(c.last_send_ns > counters.last_send_ns) {
+      counters.last_send_ns = c.last_send_ns;
+    }
+    corrected.merge(threads[i]->corrected);
+    uncorrected.merge(threads[i]->uncorrected);
+    delete threads[i];
+  }
+}
+
+
+void DnsLoadGenerator::write_report(std::ostream &out) const {
+  char line[256];
+  const double percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+  out << "# Load test of " << target_name << ": " << qps << " qps for " << duration
+      << " s, " << num_threads << " thread(s) x " << sockets_per_thread << " socket(s), "
+      << domains.size() << " domain(s)\n";
+  // the rate actually sent (the sends may have run past the duration):
+  // sent - 1 intervals between the first and the last send
+  double span = (counters.last_send_ns - counters.first_send_ns) / 1e9;
+  double sent_qps = (span > 0) ? (counters.sent - 1) / span : 0.0;
+  snprintf(line, sizeof(line), "# sent %llu in %.3f s (%.0f qps), run %.3f s, answered %llu, "
+	   "timeouts %llu, unexpected %llu, malformed %llu, send errors %llu\n",
+	   (unsigned long long) counters.sent, span, sent_qps, elapsed,
+	   (unsigned long long) counters.answered, (unsigned long long) counters.timeouts,
+	   (unsigned long long) counters.unexpected, (unsigned long long) counters.malformed,
+	   (unsigned long long) counters.send_errors);
+  out << line;
+  snprintf(line, sizeof(line), "# rcodes: NOERROR %llu, NXDOMAIN %llu, SERVFAIL %llu, other %llu; "
+	   "truncated %llu\n",
+	   (unsigned long long) counters.noerror, (unsigned long long) counters.nxdomain,
+	   (unsigned long long) counters.servfail, (unsigned long long) counters.other_rcode,
+	   (unsigned long long) counters.truncated);
+  out << line;
+  snprintf(line, sizeof(line), "# worst send lag behind the schedule: %.3f ms\n",
+	   counters.max_send_lag_ns / 1e6);
+  out << line;
+  const DnsLatencyHistogram * h[2] = { &corrected, &uncorrected };
+  const char * titles[2] = { "from the intended send time (corrected)",
+			     "from the actual send time (uncorrected)" };
+  for(int i = 0; i < 2; i++) {
+    out << "# latency (ms) " << titles[i] << ":";
+    for(size_t p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+      snprintf(line, sizeof(line), " p%g %.3f", percentiles[p],
+	       h[i]->value_at_percentile(percentiles[p]) / 1e6);
+      out << line;
+    }
+    snprintf(line, sizeof(line), " max %.3f\n", h[i]->get_max() / 1e6);
+    out << line;
+  }
+  out << "# percentile distribution of the corrected latency (ms):\n";
+  corrected.write_distribution(out);
+}
@@ -0,0 +1,152 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSLOADGENERATOR_H
+#define _DNSLOADGENERATOR_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "DnsResolver.hpp"
+#include "DnsUdpTransport.hpp"
+#include "DnsLatencyHistogram.hpp"
+#include "dns_latency_monitor-config.h"
+
+
+/* load_counters:
+ * what happened to the queries of a load run */
+struct load_counters {
+  uint64_t sent;
+  uint64_t answered;
+  uint64_t timeouts;    // no response within the timeout
+  uint64_t unexpected;  // responses to no pending query (late, duplicated)
+  uint64_t malformed;
+  uint64_t send_errors;
+  uint64_t noerror;
+  uint64_t nxdomain;
+  uint64_t servfail;
+  uint64_t other_rcode;
+  uint64_t truncated;
+  uint64_t max_send_lag_ns; // worst delay of a send behind the schedule
+  uint64_t first_send_ns;   // span of the sends, 0: nothing sent
+  uint64_t last_send_ns;
+};
+
+
+/* load_thread:
+ * the state of a sending thread: its sockets, the queries in
+ * flight on each of them (indexed by DNS id, the ids of a socket are
+ * given in sequence so the oldest query is found in constant time)
+ * and its own counters and histograms, merged at the end */
+struct load_thread {
+  struct in_flight {
+    uint64_t intended_ns;
+    uint64_t sent_ns;       // 0: the id is free
+  };
+  unsigned int index;
+  std::vector<DnsUdpTransport *> transports;
+  std::vector<std::vector<in_flight> > pending;
+  std::vector<uint16_t> next_id;
+  std::vector<uint16_t> oldest_id;
+  uint64_t rng;
+  load_counters counters;
+  // the lost queries are in both, at the time they were given up
+  DnsLatencyHistogram corrected;   // from the intended send time
+  DnsLatencyHistogram uncorrected; // from the actual send time
+  load_thread(unsigned int index);
+  ~load_thread();
+};
+
+
+/* Dns Load Generator:
+ * this class load tests a resolver with the queries of the probes
+ * (built by a DnsResolver, EDNS options included) sent by the
+ * DnsUdpTransports, in batches (sendmmsg/recvmmsg)
+ * the schedule is open loop: query k is due at start + k / qps
+ * whatever happened to the previous ones, and its latency is
+ * measured from that intended time (and the kernel receive
+ * timestamp), so a sender or server stall shows up in the latency
+ * of all the queries it delayed (no coordinated omission); the
+ * latency from the actual send time is kept as well, for comparison
+ * a query that gets no response within the timeout counts in the
+ * latencies too, for the time it waited until it was given up
+ * the domains are drawn from a weighted mix (alias method); a
+ * fraction of the queries can get a random first label, to miss the
+ * resolver cache as the probes do
+ * every thread has its own sockets, enough of them so that the 16 bit
+ * DNS ids of a socket do not wrap within twice the timeout
+ */
+class DnsLoadGenerator{
+private:
+  struct sockaddr_storage target;
+  socklen_t target_len;
+  std::string target_name;
+  std::vector<std::string> domains;
+  std::vector<std::vector<uint8_t> > queries;          // by domain
+  std::vector<std::vector<uint8_t> > prefixed_queries; // by domain, random first label
+  // alias method tables
+  std::vector<uint32_t> alias_threshold;
+  std::vector<uint32_t> alias_index;
+  uint32_t prefix_threshold;  // random_prefix * 2^32
+  unsigned int timeout_ms;
+  // of the last run
+  double qps;
+  double duration;
+  double elapsed;
+  unsigned int num_threads;
+  unsigned int sockets_per_thread;
+  load_counters counters;
+  DnsLatencyHistogram corrected;
+  DnsLatencyHistogram uncorrected;
+  uint32_t pick_domain(uint64_t r) const;
+  void open_sockets(load_thread &t);
+  bool send_due(load_thread &t, uint64_t &next, uint64_t num_queries, uint64_t start_ns,
+		unsigned int &socket, uint8_t * batch);
+  void receive(load_thread &t, uint8_t * buffers, uint64_t clock_offset);
+  void give_up(load_thread &t, load_thread::in_flight &f, uint64_t now);
+  void expire(load_thread &t, uint64_t now);
+public:
+  static const unsigned int BATCH_SIZE = 64;
+  static const unsigned int MAX_THREADS = 256;
+  static const unsigned int MAX_SOCKETS_PER_THREAD = 256;
+  DnsLoadGenerator();
+  // server: as DnsResolver::server_address
+  void set_target(DnsResolver &dr, const std::string &server);
+  // weights: relative frequencies of the domains
+  void set_domains(DnsResolver &dr, const std::vector<std::string> &names,
+		   const std::vector<double> &weights);
+  // "domain [weight]" per line (default weight 1, # comments)
+  static void read_mix(const char * path, std::vector<std::string> &names,
+		       std::vector<double> &weights);
+  // fraction of the queries with a random first label
+  void set_random_prefix(double fraction);
+  void set_timeout(unsigned int timeout_ms);
+  void run(double qps, double duration, unsigned int num_threads = 1);
+  void run_thread(load_thread &t, uint64_t start_ns);
+  void write_report(std::ostream &out) const;
+};
+
+#endif /* _DNSLOADGENERATOR_H */
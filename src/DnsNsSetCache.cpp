@@ -0,0 +1,302 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsNsSetCache.hpp"
+#include <algorithm>
+
+
+static uint64_t hash_key(const std::string &key) {
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i = 0; i < key.size(); i++) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+DnsNsSetCache::DnsNsSetCache(unsigned int max_age, unsigned int negative_ttl) {
+  this->max_age = max_age;
+  this->negative_ttl = negative_ttl;
+  stopping = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_init(&cache_lock, NULL);
+  pthread_mutex_init(&probe_mutex, NULL);
+  pthread_mutex_init(&request_mutex, NULL);
+  pthread_cond_init(&request_cond, NULL);
+#endif
+}
+
+
+int DnsNsSetCache::get_nsset(int domain_id, const std::string &domain_name, std::time_t now) {
+  int nsset_id = NSSET_NOT_CACHED;
+  bool refresh = true;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&cache_lock);
+#endif
+  std::map<int,domain_nsset>::const_iterator it = domains.find(domain_id);
+  if(it != domains.end()) {
+    nsset_id = it->second.nsset_id;
+    std::time_t ttl = (nsset_id == NSSET_NONE) ? negative_ttl : max_age - max_age / 8;
+    refresh = (now - it->second.fetched >= ttl);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+  if(refresh) {
+    request(domain_id, domain_name);
+  }
+  return nsset_id;
+}
+
+
+void DnsNsSetCache::request(int domain_id, const std::string &domain_name) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&request_mutex);
+#endif
+  if(requested.insert(domain_id).second) {
+    requests.push_back(std::make_pair(domain_id, domain_name));
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_cond_signal(&request_cond);
+#endif
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&request_mutex);
+#endif
+}
+
+
+bool DnsNsSetCache::next_request(int &domain_id, std::string &domain_name, bool wait) {
+  bool found = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&request_mutex);
+#endif
+  while(!found && !stopping) {
+    if(requests.empty()) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      if(wait) {
+	pthread_cond_wait(&request_cond, &request_mutex);
+	continue;
+      }
+#endif
+      break;
+    }
+    domain_id = requests.front().first;
+    domain_name = requests.front().second;
+    requests.pop_front();
+    // removed (remove_domains) since it was requested: skipped
+    found = (requested.erase(domain_id) == 1);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&request_mutex);
+#endif
+  return found;
+}
+
+
+void DnsNsSetCache::stop_requests() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&request_mutex);
+#endif
+  stopping = true;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&request_cond);
+  pthread_mutex_unlock(&request_mutex);
+#endif
+}
+
+
+int DnsNsSetCache::set_nsset(int domain_id,
+			     const std::vector<std::string> &ns_names,
+			     std::time_t now) {
+  std::vector<std::string> sorted(ns_names);
+  std::sort(sorted.begin(), sorted.end());
+  std::string key;
+  for(size_t i = 0; i < sorted.size(); i++) {
+    key += (i > 0) ? "," : "";
+    key += sorted[i];
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&cache_lock);
+#endif
+  std::map<std::string,int>::const_iterator k_it = nsset_ids.find(key);
+  int nsset_id;
+  if(sorted.empty()) {
+    // cached as well (for negative_ttl), not to look it up at every probe
+    nsset_id = NSSET_NONE;
+  }
+  else if(k_it != nsset_ids.end()) {
+    nsset_id = k_it->second;
+  }
+  else {
+    nsset_id = nsset_keys.size();
+    nsset_ids.insert(std::make_pair(key, nsset_id));
+    nsset_keys.push_back(key);
+    nsset_hashes.push_back(hash_key(key));
+  }
+  domain_nsset d;
+  d.nsset_id = nsset_id;
+  d.fetched = now;
+  domains[domain_id] = d;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+  return nsset_id;
+}
+
+
+std::string DnsNsSetCache::get_nsset_key(int nsset_id) {
+  std::string key;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&cache_lock);
+#endif
+  if(nsset_id >= 0 && (size_t) nsset_id < nsset_keys.size()) {
+    key = nsset_keys[nsset_id];
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+  return key;
+}
+
+
+uint64_t DnsNsSetCache::get_nsset_hash(int nsset_id) {
+  uint64_t h = 0;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&cache_lock);
+#endif
+  if(nsset_id >= 0 && (size_t) nsset_id < nsset_hashes.size()) {
+    h = nsset_hashes[nsset_id];
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+  return h;
+}
+
+
+size_t DnsNsSetCache::num_nssets() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&cache_lock);
+#endif
+  size_t n = nsset_keys.size();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+  return n;
+}
+
+
+bool DnsNsSetCache::claim_group_probe(int nsset_id, double due, double period) {
+  if(nsset_id < 0) {
+    return true;
+  }
+  bool claimed = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&probe_mutex);
+#endif
+  if((size_t) nsset_id >= last_group_probe.size()) {
+    last_group_probe.resize(nsset_id + 1, -1e300);
+  }
+  /* due times of the same domain are exactly one period apart,
+   * the slack absorbs the rounding (a group of one domain must
+   * be probed at every period) */
+  if(due - last_group_probe[nsset_id] >= period - 0.001) {
+    last_group_probe[nsset_id] = due;
+    claimed = true;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&probe_mutex);
+#endif
+  return claimed;
+}
+
+
+void DnsNsSetCache::remove_domains(const std::vector<int> &to_remove) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&cache_lock);
+#endif
+  std::vector<int>::const_iterator it;
+  for(it = to_remove.begin(); it != to_remove.end(); it++) {
+    domains.erase(*it);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+  pthread_mutex_lock(&request_mutex);
+#endif
+  for(it = to_remove.begin(); it != to_remove.end(); it++) {
+    requested.erase(*it);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&request_mutex);
+#endif
+}
+
+
+void DnsNsSetCache::export_entries(std::vector<std::string> &keys,
+				   std::vector<std::pair<int,domain_nsset> > &entries) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_rdlock(&cache_lock);
+#endif
+  keys = nsset_keys;
+  entries.assign(domains.begin(), domains.end());
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+}
+
+
+void DnsNsSetCache::restore_entries(const std::vector<std::string> &keys,
+				    const std::vector<std::pair<int,domain_nsset> > &entries) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_wrlock(&cache_lock);
+#endif
+  // the ids are kept: they are the ones of the entries
+  nsset_ids.clear();
+  nsset_keys = keys;
+  nsset_hashes.resize(keys.size());
+  for(size_t i = 0; i < keys.size(); i++) {
+    nsset_ids.insert(std::make_pair(keys[i], (int) i));
+    nsset_hashes[i] = hash_key(keys[i]);
+  }
+  domains.clear();
+  for(size_t i = 0; i < entries.size(); i++) {
+    int nsset_id = entries[i].second.nsset_id;
+    if(nsset_id == NSSET_NONE || (nsset_id >= 0 && (size_t) nsset_id < keys.size())) {
+      domains.insert(domains.end(), entries[i]);
+    }
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_unlock(&cache_lock);
+#endif
+}
+
+
+DnsNsSetCache::~DnsNsSetCache() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_destroy(&cache_lock);
+  pthread_mutex_destroy(&probe_mutex);
+  pthread_mutex_destroy(&request_mutex);
+  pthread_cond_destroy(&request_cond);
+#endif
+}
@@ -0,0 +1,118 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSNSSETCACHE_H
+#define _DNSNSSETCACHE_H
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <ctime>
+#include <stdint.h>
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+// get_nsset() results that are not an nsset_id
+static const int NSSET_NONE = -1;       // lookup done, no NS found (or failed)
+static const int NSSET_NOT_CACHED = -2; // not looked up yet, requested
+
+/* Dns NS-set Cache:
+ * this class maps every domain to the set of its authoritative
+ * name servers (NS-set): NS-sets are identified by the sorted
+ * list of the server names and numbered in order of appearance,
+ * so domains hosted by the same provider share the nsset_id.
+ * get_nsset never waits for a lookup: a domain that is not cached
+ * yet is queued (next_request) for the prefetch threads, which
+ * look it up and set_nsset, and NSSET_NOT_CACHED is returned.
+ * Entries are refreshed the same way shortly before they expire
+ * (after max_age seconds, negative_ttl for NSSET_NONE, so that a
+ * transient lookup failure does not last), the old NS-set being
+ * returned meanwhile
+ * Reads take the shared side of a rwlock and a map lookup, the
+ * writes (lookups, reloads) are rare
+ * In NS-set dedup mode it also tracks the last probe sent to
+ * every NS-set (claim_group_probe)
+ */
+class DnsNsSetCache{
+public:
+  struct domain_nsset {
+    int nsset_id;
+    std::time_t fetched;
+  };
+private:
+  std::map<int,domain_nsset> domains;
+  std::map<std::string,int> nsset_ids;  // "ns1,ns2,..." -> id
+  std::vector<std::string> nsset_keys;  // id -> "ns1,ns2,..."
+  std::vector<uint64_t> nsset_hashes;   // id -> hash of the key
+  std::vector<double> last_group_probe; // id -> due time, see claim_group_probe
+  unsigned int max_age;
+  unsigned int negative_ttl;
+  // lookups wanted by get_nsset (requested: the domains queued)
+  std::deque<std::pair<int,std::string> > requests;
+  std::set<int> requested;
+  bool stopping;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_rwlock_t cache_lock;
+  pthread_mutex_t probe_mutex;
+  pthread_mutex_t request_mutex;
+  pthread_cond_t request_cond;
+#endif
+  void request(int domain_id, const std::string &domain_name);
+public:
+  DnsNsSetCache(unsigned int max_age = 86400, unsigned int negative_ttl = 300);
+  /* NSSET_NOT_CACHED if the domain was never looked up, an unknown
+   * or expiring entry is requested (the lookup is not done here) */
+  int get_nsset(int domain_id, const std::string &domain_name, std::time_t now);
+  /* the next domain to look up: with wait, blocks until there is
+   * one; false if there is none or stop_requests was called */
+  bool next_request(int &domain_id, std::string &domain_name, bool wait);
+  void stop_requests();
+  /* ns_names do not need to be sorted, returns the nsset_id
+   * (NSSET_NONE if ns_names is empty) */
+  int set_nsset(int domain_id, const std::vector<std::string> &ns_names, std::time_t now);
+  std::string get_nsset_key(int nsset_id);
+  // stable identifier of the NS-set (FNV-1a of the key)
+  uint64_t get_nsset_hash(int nsset_id);
+  size_t num_nssets();
+  /* true if no probe due at most one period before due has been
+   * sent to nsset_id yet: the caller then probes for the group */
+  bool claim_group_probe(int nsset_id, double due, double period);
+  void remove_domains(const std::vector<int> &to_remove);
+  /* copy of the cache (checkpoint): the NS-set keys by nsset_id and
+   * the entries of the domains, sorted by domain id */
+  void export_entries(std::vector<std::string> &keys,
+		      std::vector<std::pair<int,domain_nsset> > &entries);
+  /* the cache becomes an exported copy (restart), the entries of the
+   * domains not monitored anymore can be removed afterwards */
+  void restore_entries(const std::vector<std::string> &keys,
+		       const std::vector<std::pair<int,domain_nsset> > &entries);
+  ~DnsNsSetCache();
+};
+
+#endif /* _DNSNSSETCACHE_H */
@@ -0,0 +1,451 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsPassiveMatcher.hpp"
+
+#include <string.h>
+#include <ctype.h>
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_IPV6 0x86dd
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88a8
+#define IPPROTO_UDP_NUM 17
+#define DNS_PORT 53
+#define DNS_HEADER_LEN 12
+#define MAX_NAME_LEN 255
+
+
+// FNV-1a 64
+static uint64_t hash_name(const char * name, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i = 0; i < len; i++) {
+    h ^= (uint8_t) name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+static inline uint16_t load16(const uint8_t * p) {
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+
+DnsPassiveMatcher::DnsPassiveMatcher(unsigned int table_bits, unsigned int timeout_ms) :
+  num_pending(0), last_sweep(0), domain_mask(0), domain_label_counts(0) {
+  if(table_bits < 4 || table_bits > 28) {
+    throw std::string("Can't create DnsPassiveMatcher() - table_bits out of range");
+  }
+  table.resize((size_t) 1 << table_bits);
+  memset(&table[0], 0, table.size() * sizeof(pending_query));
+  mask = table.size() - 1;
+  timeout_ns = (uint64_t) timeout_ms * 1000000ULL;
+  memset(&counters, 0, sizeof(counters));
+}
+
+
+void DnsPassiveMatcher::set_domains(const std::map<int,std::string> &domains) {
+  domain_ids.clear();
+  domain_names.clear();
+  domain_label_counts = 0;
+  // at most half of the slots are used
+  size_t size = 16;
+  while(size < 2 * domains.size()) {
+    size *= 2;
+  }
+  domain_slot free_slot;
+  free_slot.hash = 0;
+  free_slot.index = -1;
+  domain_table.assign(size, free_slot);
+  domain_mask = size - 1;
+  std::map<int,std::string>::const_iterator it;
+  for(it = domains.begin(); it != domains.end(); it++) {
+    std::string name = it->second;
+    while(!name.empty() && name[name.size() - 1] == '.') {
+      name.erase(name.size() - 1);
+    }
+    for(size_t c = 0; c < name.size(); c++) {
+      name[c] = tolower(name[c]);
+    }
+    if(name.empty()) {
+      continue;
+    }
+    uint64_t h = hash_name(name.data(), name.size());
+    uint64_t i = h & domain_mask;
+    while(domain_table[i].index >= 0 && domain_names[domain_table[i].index] != name) {
+      i = (i + 1) & domain_mask;
+    }
+    if(domain_table[i].index >= 0) {
+      continue; // same name twice
+    }
+    domain_table[i].hash = h;
+    domain_table[i].index = domain_ids.size();
+    domain_ids.push_back(it->first);
+    domain_names.push_back(name);
+    size_t labels = 1;
+    for(size_t c = 0; c < name.size(); c++) {
+      labels += (name[c] == '.');
+    }
+    domain_label_counts |= 1ULL << ((labels < 63) ? labels : 63);
+  }
+}
+
+
+size_t DnsPassiveMatcher::num_domains() const {
+  return domain_ids.size();
+}
+
+
+int DnsPassiveMatcher::domain_id(size_t domain_index) const {
+  return domain_ids[domain_index];
+}
+
+
+uint64_t DnsPassiveMatcher::hash_key(const pending_query &q) {
+  uint64_t w[4];
+  memcpy(w, q.client, 16);
+  memcpy(w + 2, q.server, 16);
+  uint64_t h = ((uint64_t) q.client_port << 32) | ((uint64_t) q.server_port << 16) | q.id;
+  for(int i = 0; i < 4; i++) {
+    h = (h ^ w[i]) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+
+bool DnsPassiveMatcher::same_key(const pending_query &a, const pending_query &b) {
+  return a.id == b.id && a.client_port == b.client_port && a.server_port == b.server_port &&
+    a.family == b.family && memcmp(a.client, b.client, 16) == 0 &&
+    memcmp(a.server, b.server, 16) == 0;
+}
+
+
+bool DnsPassiveMatcher::expired(const pending_query &q, uint64_t now) const {
+  return now > q.ts_ns && now - q.ts_ns > timeout_ns;
+}
+
+
+void DnsPassiveMatcher::insert(const pending_query &q) {
+  uint64_t i = hash_key(q) & mask;
+  int64_t reuse = -1;
+  // linear probing, up to the first free slot
+  while(table[i].family != 0) {
+    if(same_key(table[i], q)) {
+      // retransmission: the latency is measured from the last one
+      table[i].ts_ns = q.ts_ns;
+      return;
+    }
+    if(reuse < 0 && expired(table[i], q.ts_ns)) {
+      reuse = i;
+    }
+    i = (i + 1) & mask;
+  }
+  if(reuse >= 0) {
+    // an expired query leaves its slot, the chain stays contiguous
+    counters.expired++;
+    table[reuse] = q;
+    return;
+  }
+  if(num_pending >= table.size() / 2) {
+    counters.dropped++;
+    return;
+  }
+  table[i] = q;
+  num_pending++;
+}
+
+
+bool DnsPassiveMatcher::remove(const pending_query &q, uint64_t &query_ts) {
+  uint64_t i = hash_key(q) & mask;
+  while(true) {
+    if(table[i].family == 0) {
+      return false;
+    }
+    if(same_key(table[i], q)) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  query_ts = table[i].ts_ns;
+  bool answered_in_time = !expired(table[i], q.ts_ns);
+  if(!answered_in_time) {
+    counters.expired++;
+  }
+  // backward shift deletion: no tombstones on the probe chains
+  uint64_t j = i;
+  while(true) {
+    j = (j + 1) & mask;
+    if(table[j].family == 0) {
+      break;
+    }
+    uint64_t k = hash_key(table[j]) & mask;
+    // move j into the hole unless its home slot k is in (i, j]
+    bool in_between = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if(!in_between) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].family = 0;
+  num_pending--;
+  return answered_in_time;
+}
+
+
+void DnsPassiveMatcher::sweep(uint64_t now) {
+  // rebuild the table with the queries still waiting for a response
+  std::vector<pending_query> alive;
+  for(size_t i = 0; i < table.size(); i++) {
+    if(table[i].family != 0) {
+      if(expired(table[i], now)) {
+	counters.expired++;
+      }
+      else {
+	alive.push_back(table[i]);
+      }
+    }
+  }
+  memset(&table[0], 0, table.size() * sizeof(pending_query));
+  num_pending = 0;
+  for(size_t i = 0; i < alive.size(); i++) {
+    insert(alive[i]);
+  }
+  last_sweep = now;
+}
+
+
+// index of the monitored domain of the question name, -1 if none
+int DnsPassiveMatcher::domain_of(const uint8_t * dns, size_t len) const {
+  if(load16(dns + 4) == 0) {
+    return -1; // no question
+  }
+  char name[MAX_NAME_LEN + 1];
+  size_t name_len = 0;
+  uint8_t starts[MAX_NAME_LEN / 2 + 1];
+  size_t num_labels = 0;
+  size_t pos = DNS_HEADER_LEN;
+  while(true) {
+    if(pos >= len) {
+      return -1;
+    }
+    uint8_t label_len = dns[pos];
+    if(label_len == 0) {
+      break;
+    }
+    // the question name is never compressed (nothing to point to)
+    if(label_len > 63 || pos + 1 + label_len > len ||
+       name_len + label_len + 1 > MAX_NAME_LEN) {
+      return -1;
+    }
+    if(name_len > 0) {
+      name[name_len++] = '.';
+    }
+    starts[num_labels++] = name_len;
+    for(size_t c = 0; c < label_len; c++) {
+      uint8_t ch = dns[pos + 1 + c];
+      name[name_len++] = (ch >= 'A' && ch <= 'Z') ? ch + ('a' - 'A') : ch;
+    }
+    pos += 1 + label_len;
+  }
+  // the longest monitored suffix, only the lengths (in labels)
+  // of some monitored domain are looked up
+  for(size_t l = 0; l < num_labels; l++) {
+    size_t labels = num_labels - l;
+    if((domain_label_counts & (1ULL << ((labels < 63) ? labels : 63))) == 0) {
+      continue;
+    }
+    const char * suffix = name + starts[l];
+    size_t suffix_len = name_len - starts[l];
+    uint64_t h = hash_name(suffix, suffix_len);
+    for(uint64_t i = h & domain_mask; domain_table[i].index >= 0; i = (i + 1) & domain_mask) {
+      if(domain_table[i].hash == h) {
+	const std::string &d = domain_names[domain_table[i].index];
+	if(d.size() == suffix_len && memcmp(d.data(), suffix, suffix_len) == 0) {
+	  return domain_table[i].index;
+	}
+      }
+    }
+  }
+  return -1;
+}
+
+
+bool DnsPassiveMatcher::process(const captured_packet &pkt, dns_exchange &ex) {
+  counters.packets++;
+  if(pkt.ts_ns > last_sweep + timeout_ns) {
+    sweep(pkt.ts_ns);
+  }
+  const uint8_t * p = pkt.data;
+  size_t len = pkt.caplen;
+  // link layer
+  uint16_t ethertype = 0;
+  switch(pkt.linktype) {
+  case LINKTYPE_ETHERNET:
+    if(len < 14) {
+      return false;
+    }
+    ethertype = load16(p + 12);
+    p += 14;
+    len -= 14;
+    // up to two VLAN tags
+    for(int v = 0; v < 2 && (ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ); v++) {
+      if(len < 4) {
+	return false;
+      }
+      ethertype = load16(p + 2);
+      p += 4;
+      len -= 4;
+    }
+    break;
+  case LINKTYPE_LINUX_SLL:
+    if(len < 16) {
+      return false;
+    }
+    ethertype = load16(p + 14);
+    p += 16;
+    len -= 16;
+    break;
+  case LINKTYPE_LINUX_SLL2:
+    if(len < 20) {
+      return false;
+    }
+    ethertype = load16(p);
+    p += 20;
+    len -= 20;
+    break;
+  case LINKTYPE_NULL:
+    if(len < 4) {
+      return false;
+    }
+    p += 4;
+    len -= 4;
+    // the family is in the byte order of the capturing host
+    if(len > 0) {
+      ethertype = ((p[0] >> 4) == 6) ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+    }
+    break;
+  case LINKTYPE_RAW:
+  case LINKTYPE_IPV4:
+  case LINKTYPE_IPV6:
+    if(len > 0) {
+      ethertype = ((p[0] >> 4) == 6) ? ETHERTYPE_IPV6 : ETHERTYPE_IPV4;
+    }
+    break;
+  default:
+    return false;
+  }
+  // network layer
+  pending_query q;
+  memset(&q, 0, sizeof(q));
+  const uint8_t * src;
+  const uint8_t * dst;
+  size_t addr_len;
+  if(ethertype == ETHERTYPE_IPV4) {
+    if(len < 20 || (p[0] >> 4) != 4) {
+      return false;
+    }
+    size_t ihl = (p[0] & 0x0f) * 4;
+    // only whole datagrams: no fragments
+    if(ihl < 20 || len < ihl || p[9] != IPPROTO_UDP_NUM || (load16(p + 6) & 0x3fff) != 0) {
+      return false;
+    }
+    src = p + 12;
+    dst = p + 16;
+    addr_len = 4;
+    q.family = 4;
+    p += ihl;
+    len -= ihl;
+  }
+  else if(ethertype == ETHERTYPE_IPV6) {
+    // no extension headers
+    if(len < 40 || (p[0] >> 4) != 6 || p[6] != IPPROTO_UDP_NUM) {
+      return false;
+    }
+    src = p + 8;
+    dst = p + 24;
+    addr_len = 16;
+    q.family = 6;
+    p += 40;
+    len -= 40;
+  }
+  else {
+    return false;
+  }
+  // transport and DNS header
+  if(len < 8 + DNS_HEADER_LEN) {
+    return false;
+  }
+  uint16_t src_port = load16(p);
+  uint16_t dst_port = load16(p + 2);
+  const uint8_t * dns = p + 8;
+  size_t dns_len = len - 8;
+  // standard queries only
+  if(((dns[2] >> 3) & 0x0f) != 0) {
+    return false;
+  }
+  q.id = load16(dns);
+  bool response = (dns[2] & 0x80) != 0;
+  // queries to the DNS port, responses from it (not mDNS, LLMNR...)
+  if(response ? (src_port != DNS_PORT) : (dst_port != DNS_PORT)) {
+    return false;
+  }
+  if(!response) {
+    counters.queries++;
+    memcpy(q.client, src, addr_len);
+    memcpy(q.server, dst, addr_len);
+    q.client_port = src_port;
+    q.server_port = dst_port;
+    q.ts_ns = pkt.ts_ns;
+    insert(q);
+    return false;
+  }
+  counters.responses++;
+  memcpy(q.client, dst, addr_len);
+  memcpy(q.server, src, addr_len);
+  q.client_port = dst_port;
+  q.server_port = src_port;
+  q.ts_ns = pkt.ts_ns;
+  uint64_t query_ts;
+  if(!remove(q, query_ts) || pkt.ts_ns < query_ts) {
+    counters.unmatched++;
+    return false;
+  }
+  counters.matched++;
+  int domain_index = domain_of(dns, dns_len);
+  if(domain_index < 0) {
+    counters.ignored++;
+    return false;
+  }
+  ex.domain_id = domain_ids[domain_index];
+  ex.domain_index = domain_index;
+  ex.ts_ns = query_ts;
+  ex.latency_ms = (double) (pkt.ts_ns - query_ts) / 1000000.0;
+  return true;
+}
+
+
+const passive_counters &DnsPassiveMatcher::get_counters() const {
+  return counters;
+}
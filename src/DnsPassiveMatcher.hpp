@@ -0,0 +1,119 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSPASSIVEMATCHER_H
+#define _DNSPASSIVEMATCHER_H
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "DnsCaptureReader.hpp"
+
+
+/* dns_exchange:
+ * a query matched with its response */
+struct dns_exchange {
+  int domain_id;      // monitored domain the name belongs to
+  unsigned int domain_index; // of the domain, 0 .. num_domains()-1
+  uint64_t ts_ns;     // capture time of the query
+  double latency_ms;
+};
+
+/* passive_counters:
+ * what happened to the packets given to the matcher */
+struct passive_counters {
+  uint64_t packets;
+  uint64_t queries;
+  uint64_t responses;
+  uint64_t matched;    // responses matched to a query
+  uint64_t unmatched;  // responses without query (or after the timeout)
+  uint64_t expired;    // queries never answered within the timeout
+  uint64_t dropped;    // queries not tracked, the table was full
+  uint64_t ignored;    // matched, but not under a monitored domain
+};
+
+
+/* Dns Passive Matcher:
+ * this class measures the latency of observed DNS traffic:
+ * every query (UDP to port 53 over IPv4/IPv6, Ethernet, SLL, raw IP
+ * or loopback captures) is kept in an open addressing hash table keyed
+ * by client address/port, server address/port and transaction id,
+ * the response with the same key completes the exchange
+ * a query that is not answered within timeout_ms expires: its slot
+ * can be reused and the table is swept once per timeout period
+ * (capture time), so the state is bounded by the table size
+ * the question name of the response is mapped to the longest
+ * monitored domain it belongs to (e.g. www.example.com ->
+ * example.com), other names are ignored
+ * the packets are parsed in place, nothing is allocated per packet,
+ * the domain names are in a second open addressing table (by hash)
+ */
+class DnsPassiveMatcher{
+private:
+  struct pending_query {
+    uint8_t client[16];
+    uint8_t server[16];
+    uint16_t client_port;
+    uint16_t server_port;
+    uint16_t id;
+    uint8_t family;       // 0: free slot
+    uint64_t ts_ns;
+  };
+  std::vector<pending_query> table;
+  uint64_t mask;
+  uint64_t num_pending;
+  uint64_t timeout_ns;
+  uint64_t last_sweep;
+  passive_counters counters;
+  // monitored domains, by hash of the lower case name
+  struct domain_slot {
+    uint64_t hash;
+    int32_t index;        // in domain_ids/domain_names, -1: free slot
+  };
+  std::vector<domain_slot> domain_table;
+  uint64_t domain_mask;
+  std::vector<int> domain_ids;
+  std::vector<std::string> domain_names;
+  uint64_t domain_label_counts; // bit n: a domain has n labels
+  static uint64_t hash_key(const pending_query &q);
+  static bool same_key(const pending_query &a, const pending_query &b);
+  bool expired(const pending_query &q, uint64_t now) const;
+  void insert(const pending_query &q);
+  bool remove(const pending_query &q, uint64_t &query_ts);
+  void sweep(uint64_t now);
+  int domain_of(const uint8_t * dns, size_t len) const; // index or -1
+public:
+  // the table has 2^table_bits slots, at most half of them are used
+  DnsPassiveMatcher(unsigned int table_bits = 18, unsigned int timeout_ms = 5000);
+  void set_domains(const std::map<int,std::string> &domains);
+  size_t num_domains() const;
+  int domain_id(size_t domain_index) const;
+  // true if pkt is a response completing an exchange
+  bool process(const captured_packet &pkt, dns_exchange &ex);
+  const passive_counters &get_counters() const;
+};
+
+#endif /* _DNSPASSIVEMATCHER_H */
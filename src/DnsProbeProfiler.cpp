@@ -0,0 +1,290 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsProbeProfiler.hpp"
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+// histograms of the calling thread (one profiler per process)
+static __thread DnsProbeProfiler::thread_histograms * tls_histograms = NULL;
+
+static const char * STAGE_NAMES[NUM_PROBE_STAGES] = {
+  "schedule", "rate_limit", "build", "lock_wait", "network",
+  "parse", "aggregate", "enqueue", "db_flush"
+};
+
+
+void probe_timing::clear() {
+  memset(start, 0, sizeof(start));
+  memset(end, 0, sizeof(end));
+}
+
+
+DnsProbeProfiler::DnsProbeProfiler() {
+  trace_file = NULL;
+  trace_sample = 0;
+  num_probes = 0;
+  first_trace_event = true;
+  last_buckets.assign(NUM_PROBE_STAGES * NUM_BUCKETS, 0);
+  last_count.assign(NUM_PROBE_STAGES, 0);
+  last_sum.assign(NUM_PROBE_STAGES, 0);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_init(&registry_mutex, NULL);
+  pthread_mutex_init(&trace_mutex, NULL);
+#endif
+}
+
+
+// same clock as DnsProbeScheduler::now()
+uint64_t DnsProbeProfiler::now_ns() {
+#ifdef __MACH__
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000000ULL + (uint64_t) tv.tv_usec * 1000ULL;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+
+const char * DnsProbeProfiler::stage_name(probe_stage s) {
+  return STAGE_NAMES[s];
+}
+
+
+unsigned int DnsProbeProfiler::bucket_index(uint64_t ns) {
+  const uint64_t sub_buckets = 1ULL << SUB_BUCKET_BITS;
+  if(ns < sub_buckets) {
+    return (unsigned int) ns;
+  }
+  unsigned int msb = 63 - __builtin_clzll(ns);
+  unsigned int shift = msb - SUB_BUCKET_BITS;
+  return ((shift + 1) << SUB_BUCKET_BITS) | (unsigned int) ((ns >> shift) & (sub_buckets - 1));
+}
+
+
+// middle of the bucket
+uint64_t DnsProbeProfiler::bucket_value(unsigned int index) {
+  const uint64_t sub_buckets = 1ULL << SUB_BUCKET_BITS;
+  if(index < sub_buckets) {
+    return index;
+  }
+  unsigned int shift = (index >> SUB_BUCKET_BITS) - 1;
+  uint64_t lower = (sub_buckets | (index & (sub_buckets - 1))) << shift;
+  return lower + ((1ULL << shift) >> 1);
+}
+
+
+DnsProbeProfiler::thread_histograms * DnsProbeProfiler::local_histograms() {
+  if(tls_histograms == NULL) {
+    thread_histograms * h = new thread_histograms;
+    for(unsigned int s = 0; s < NUM_PROBE_STAGES; s++) {
+      for(unsigned int b = 0; b < NUM_BUCKETS; b++) {
+	h->stages[s].buckets[b].store(0, std::memory_order_relaxed);
+      }
+      h->stages[s].count.store(0, std::memory_order_relaxed);
+      h->stages[s].sum_ns.store(0, std::memory_order_relaxed);
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&registry_mutex);
+#endif
+    h->thread_id = threads.size() + 1;
+    threads.push_back(h);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&registry_mutex);
+#endif
+    tls_histograms = h;
+  }
+  return tls_histograms;
+}
+
+
+void DnsProbeProfiler::enable_trace(const char * path, unsigned int sample_every) {
+  if(path == NULL) {
+    return;
+  }
+  trace_file = fopen(path, "w");
+  if(trace_file == NULL) {
+    throw std::string("Can't open trace file ") + path;
+  }
+  trace_sample = (sample_every > 0) ? sample_every : 1;
+  fprintf(trace_file, "[\n");
+}
+
+
+// the owner thread is the only writer: relaxed load + store, no lock
+static inline void relaxed_add(std::atomic<uint64_t> &v, uint64_t n) {
+  v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+void DnsProbeProfiler::record_probe(const probe_timing &timing,
+				    const std::string &domain_name) {
+  thread_histograms * h = local_histograms();
+  for(unsigned int s = 0; s < NUM_PROBE_STAGES; s++) {
+    if(timing.start[s] == 0 || timing.end[s] < timing.start[s]) {
+      continue;
+    }
+    uint64_t ns = timing.end[s] - timing.start[s];
+    stage_histogram &sh = h->stages[s];
+    relaxed_add(sh.buckets[bucket_index(ns)], 1);
+    relaxed_add(sh.count, 1);
+    relaxed_add(sh.sum_ns, ns);
+  }
+  if(trace_file != NULL &&
+     num_probes.fetch_add(1, std::memory_order_relaxed) % trace_sample == 0) {
+    write_trace(timing, domain_name, h->thread_id);
+  }
+}
+
+
+// this function is not visible outside this code unit
+// a JSON string body: quotes, backslashes, control characters and
+// non-ASCII bytes (names may not be UTF-8) are escaped
+static std::string json_escape(const std::string &in) {
+  std::string out;
+  out.reserve(in.size());
+  for(size_t i = 0; i < in.size(); i++) {
+    unsigned char c = in[i];
+    if(c == '"' || c == '\\') {
+      out += '\\';
+      out += (char) c;
+    }
+    else if(c < 0x20 || c >= 0x7f) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "\\u%04x", c);
+      out += hex;
+    }
+    else {
+      out += (char) c;
+    }
+  }
+  return out;
+}
+
+
+void DnsProbeProfiler::write_trace(const probe_timing &timing,
+				   const std::string &domain_name,
+				   unsigned long thread_id) {
+  // names come from top_domains, anything can be in there
+  std::string domain = json_escape(domain_name);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&trace_mutex);
+#endif
+  for(unsigned int s = 0; s < NUM_PROBE_STAGES; s++) {
+    if(timing.start[s] == 0 || timing.end[s] < timing.start[s]) {
+      continue;
+    }
+    // complete events, timestamps in microseconds
+    fprintf(trace_file,
+	    "%s{\"name\":\"%s\",\"cat\":\"probe\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+	    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"domain\":\"%s\"}}",
+	    first_trace_event ? "" : ",\n",
+	    STAGE_NAMES[s], thread_id,
+	    (double) timing.start[s] / 1000.0,
+	    (double) (timing.end[s] - timing.start[s]) / 1000.0,
+	    domain.c_str());
+    first_trace_event = false;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&trace_mutex);
+#endif
+}
+
+
+void DnsProbeProfiler::snapshot(std::vector<stage_summary> &out) {
+  out.clear();
+  std::vector<uint64_t> merged(NUM_BUCKETS);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&registry_mutex);
+#endif
+  for(unsigned int s = 0; s < NUM_PROBE_STAGES; s++) {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    for(unsigned int b = 0; b < NUM_BUCKETS; b++) {
+      merged[b] = 0;
+    }
+    for(size_t t = 0; t < threads.size(); t++) {
+      stage_histogram &sh = threads[t]->stages[s];
+      for(unsigned int b = 0; b < NUM_BUCKETS; b++) {
+	merged[b] += sh.buckets[b].load(std::memory_order_relaxed);
+      }
+      count += sh.count.load(std::memory_order_relaxed);
+      sum += sh.sum_ns.load(std::memory_order_relaxed);
+    }
+    // only what happened since the previous snapshot
+    uint64_t * last = &last_buckets[s * NUM_BUCKETS];
+    uint64_t bucket_count = 0;
+    for(unsigned int b = 0; b < NUM_BUCKETS; b++) {
+      uint64_t v = merged[b];
+      merged[b] -= last[b];
+      last[b] = v;
+      bucket_count += merged[b];
+    }
+    uint64_t delta_count = count - last_count[s];
+    uint64_t delta_sum = sum - last_sum[s];
+    last_count[s] = count;
+    last_sum[s] = sum;
+    stage_summary ss;
+    ss.stage = STAGE_NAMES[s];
+    ss.count = delta_count;
+    ss.avg_us = (delta_count > 0) ? (double) delta_sum / (double) delta_count / 1000.0 : 0;
+    ss.p50_us = ss.p90_us = ss.p99_us = ss.max_us = 0;
+    // percentiles on the bucket counts (the counters are read
+    // while the probes run, they may be a few samples apart)
+    uint64_t seen = 0;
+    for(unsigned int b = 0; b < NUM_BUCKETS && bucket_count > 0; b++) {
+      if(merged[b] == 0) {
+	continue;
+      }
+      seen += merged[b];
+      double v = (double) bucket_value(b) / 1000.0;
+      if(ss.p50_us == 0 && seen * 100 >= bucket_count * 50) { ss.p50_us = v; }
+      if(ss.p90_us == 0 && seen * 100 >= bucket_count * 90) { ss.p90_us = v; }
+      if(ss.p99_us == 0 && seen * 100 >= bucket_count * 99) { ss.p99_us = v; }
+      ss.max_us = v;
+    }
+    out.push_back(ss);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&registry_mutex);
+#endif
+}
+
+
+DnsProbeProfiler::~DnsProbeProfiler() {
+  if(trace_file != NULL) {
+    fprintf(trace_file, "\n]\n");
+    fclose(trace_file);
+  }
+  for(size_t t = 0; t < threads.size(); t++) {
+    delete threads[t];
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_destroy(&trace_mutex);
+  pthread_mutex_destroy(&registry_mutex);
+#endif
+}
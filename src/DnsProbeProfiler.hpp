@@ -0,0 +1,134 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSPROBEPROFILER_H
+#define _DNSPROBEPROFILER_H
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <stdio.h>
+#include <stdint.h>
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+/* stages of the probe pipeline, in order */
+enum probe_stage {
+  STAGE_SCHEDULE = 0, // lag between the deadline and the pick up
+  STAGE_RATE_LIMIT,   // time spent deferred by the rate limiter
+  STAGE_BUILD,        // query name / packet construction
+  STAGE_LOCK_WAIT,    // waiting for the resolver (measuring_mutex)
+  STAGE_NETWORK,      // query sent -> response received
+  STAGE_PARSE,        // response handling
+  STAGE_AGGREGATE,    // anomaly detector update
+  STAGE_ENQUEUE,      // anomaly event hand-off
+  STAGE_DB_FLUSH,     // domain_stats update
+  NUM_PROBE_STAGES
+};
+
+/* probe_timing:
+ * start/end timestamps (ns, see DnsProbeProfiler::now_ns) of every
+ * stage of one probe, a stage that did not run has start == 0 */
+struct probe_timing {
+  uint64_t start[NUM_PROBE_STAGES];
+  uint64_t end[NUM_PROBE_STAGES];
+  probe_timing() { clear(); }
+  void clear();
+  void set(probe_stage s, uint64_t start_ns, uint64_t end_ns) {
+    start[s] = start_ns;
+    end[s] = end_ns;
+  }
+};
+
+/* stage_summary:
+ * what is exported for every stage (durations in microseconds) */
+struct stage_summary {
+  const char * stage;
+  uint64_t count;
+  double avg_us;
+  double p50_us;
+  double p90_us;
+  double p99_us;
+  double max_us;
+};
+
+
+/* Dns Probe Profiler:
+ * this class collects the duration of every stage of every probe
+ * in per-thread histograms (log2 buckets with 8 linear sub-buckets,
+ * i.e. ~12% resolution): a probing thread only writes its own
+ * histograms, without locks, and snapshot() merges all of them
+ * (returning the difference with the previous snapshot).
+ * Optionally one probe every trace_sample is also written to a
+ * Chrome trace / perfetto JSON file.
+ * There must be a single profiler per process (the per-thread
+ * histograms are found through a thread-local pointer)
+ */
+class DnsProbeProfiler{
+public:
+  static const unsigned int SUB_BUCKET_BITS = 3;
+  static const unsigned int NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+  struct stage_histogram {
+    std::atomic<uint64_t> buckets[NUM_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+  };
+  struct thread_histograms {
+    stage_histogram stages[NUM_PROBE_STAGES];
+    unsigned long thread_id;
+  };
+private:
+  std::vector<thread_histograms *> threads;
+  // merged counts at the previous snapshot
+  std::vector<uint64_t> last_buckets;
+  std::vector<uint64_t> last_count;
+  std::vector<uint64_t> last_sum;
+  FILE * trace_file;
+  unsigned int trace_sample;
+  std::atomic<uint64_t> num_probes;
+  bool first_trace_event;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t registry_mutex;
+  pthread_mutex_t trace_mutex;
+#endif
+  thread_histograms * local_histograms();
+  void write_trace(const probe_timing &timing, const std::string &domain_name,
+		   unsigned long thread_id);
+public:
+  DnsProbeProfiler();
+  static uint64_t now_ns();
+  static const char * stage_name(probe_stage s);
+  static unsigned int bucket_index(uint64_t ns);
+  static uint64_t bucket_value(unsigned int index);
+  // trace one probe every sample_every into path (JSON)
+  void enable_trace(const char * path, unsigned int sample_every);
+  void record_probe(const probe_timing &timing, const std::string &domain_name);
+  void snapshot(std::vector<stage_summary> &out);
+  ~DnsProbeProfiler();
+};
+
+#endif /* _DNSPROBEPROFILER_H */
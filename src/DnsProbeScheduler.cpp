@@ -0,0 +1,367 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsProbeScheduler.hpp"
+#include <math.h>
+#include <time.h>
+#include <sys/time.h>
+
+// large updates (reloads) release the lock every UPDATE_BATCH
+// domains, so the probes never wait for the whole update
+static const size_t UPDATE_BATCH = 4096;
+
+
+DnsProbeScheduler::DnsProbeScheduler(double period, unsigned int cycles) {
+  this->period = period;
+  this->max_cycles = cycles;
+  next_generation = 1;
+  num_running = 0;
+  num_deferred = 0;
+  stopping = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_init(&schedule_mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#ifndef __MACH__
+  // timed waits use the same (monotonic) clock as now()
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+  pthread_cond_init(&schedule_cond, &attr);
+  pthread_condattr_destroy(&attr);
+#endif
+}
+
+
+double DnsProbeScheduler::now() {
+#ifdef __MACH__
+  // no monotonic clock for pthread_cond_timedwait on OS X
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+#endif
+}
+
+
+void DnsProbeScheduler::lock() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&schedule_mutex);
+#endif
+}
+
+
+void DnsProbeScheduler::unlock() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&schedule_mutex);
+#endif
+}
+
+
+// called with the lock held, it may return before the deadline
+void DnsProbeScheduler::wait_until(double deadline) {
+  struct timespec ts;
+  ts.tv_sec = (time_t) deadline;
+  ts.tv_nsec = (long) ((deadline - (double) ts.tv_sec) * 1000000000.0);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  if(deadline <= 0) {
+    pthread_cond_wait(&schedule_cond, &schedule_mutex);
+  }
+  else {
+    pthread_cond_timedwait(&schedule_cond, &schedule_mutex, &ts);
+  }
+#else
+  if(deadline <= 0) {
+    // nothing can change without threads but a reload
+    deadline = now() + 1;
+  }
+  double delta = deadline - now();
+  if(delta > 0) {
+    ts.tv_sec = (time_t) delta;
+    ts.tv_nsec = (long) ((delta - (double) ts.tv_sec) * 1000000000.0);
+    nanosleep(&ts, NULL);
+  }
+#endif
+}
+
+
+void DnsProbeScheduler::configure(double period, unsigned int cycles) {
+  lock();
+  this->period = period;
+  this->max_cycles = cycles;
+  unlock();
+}
+
+
+void DnsProbeScheduler::insert_domain(int domain_id,
+				      const std::string &domain_name,
+				      double deadline,
+				      unsigned int cycles_left) {
+  domain_entry d;
+  d.domain_name = domain_name;
+  d.generation = next_generation++;
+  d.cycles_left = cycles_left;
+  d.deadline = deadline;
+  domains[domain_id] = d;
+  heap_entry h;
+  h.deadline = deadline;
+  h.due = deadline;
+  h.deferred_since = 0;
+  h.domain_id = domain_id;
+  h.generation = d.generation;
+  heap.push(h);
+}
+
+
+void DnsProbeScheduler::add_domains(const std::map<int,std::string> &to_add,
+				    double first_deadline,
+				    const std::map<int,double> * deadlines) {
+  lock();
+  double step = (to_add.empty()) ? 0 : period / (double) to_add.size();
+  double deadline = first_deadline;
+  size_t n = 0;
+  std::map<int,std::string>::const_iterator it;
+  std::map<int,domain_entry>::iterator d_it;
+  for(it = to_add.begin(); it != to_add.end(); it++) {
+    d_it = domains.find(it->first);
+    if(d_it != domains.end()) {
+      // already scheduled: keep the timer, update the name
+      d_it->second.domain_name = it->second;
+      continue;
+    }
+    std::map<int,double>::const_iterator dl_it;
+    if(deadlines != NULL && (dl_it = deadlines->find(it->first)) != deadlines->end()) {
+      insert_domain(it->first, it->second, dl_it->second, max_cycles);
+    }
+    else {
+      insert_domain(it->first, it->second, deadline, max_cycles);
+      deadline += step;
+    }
+    if(++n % UPDATE_BATCH == 0) {
+      // let the probing threads in between batches
+      unlock();
+      lock();
+    }
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+void DnsProbeScheduler::add_domain(int domain_id,
+				   const std::string &domain_name,
+				   double deadline,
+				   unsigned int cycles_left) {
+  lock();
+  insert_domain(domain_id, domain_name, deadline, cycles_left);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+void DnsProbeScheduler::remove_domains(const std::vector<int> &to_remove) {
+  lock();
+  std::vector<int>::const_iterator it;
+  size_t n = 0;
+  for(it = to_remove.begin(); it != to_remove.end(); it++) {
+    // the heap entry becomes stale and is discarded when popped
+    domains.erase(*it);
+    if(++n % UPDATE_BATCH == 0) {
+      unlock();
+      lock();
+    }
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+void DnsProbeScheduler::export_deadlines(std::map<int,double> &out) {
+  out.clear();
+  lock();
+  std::map<int,domain_entry>::const_iterator it;
+  for(it = domains.begin(); it != domains.end(); it++) {
+    out.insert(out.end(), std::make_pair(it->first, it->second.deadline));
+  }
+  unlock();
+}
+
+
+double DnsProbeScheduler::get_period() {
+  lock();
+  double p = period;
+  unlock();
+  return p;
+}
+
+
+// called with the lock held
+bool DnsProbeScheduler::all_done() {
+  return max_cycles > 0 && domains.empty() && num_running == 0;
+}
+
+
+bool DnsProbeScheduler::next_probe(probe_task &task) {
+  lock();
+  while(true) {
+    if(stopping || all_done()) {
+      unlock();
+      return false;
+    }
+    // discard the entries of removed (or re-added) domains
+    std::map<int,domain_entry>::iterator d_it = domains.end();
+    while(!heap.empty()) {
+      d_it = domains.find(heap.top().domain_id);
+      if(d_it != domains.end() && d_it->second.generation == heap.top().generation) {
+	break;
+      }
+      heap.pop();
+    }
+    if(heap.empty()) {
+      // nothing scheduled: wait for probes in progress or new domains
+      wait_until(0);
+      continue;
+    }
+    double deadline = heap.top().deadline;
+    if(deadline > now()) {
+      wait_until(deadline);
+      continue;
+    }
+    task.domain_id = heap.top().domain_id;
+    task.domain_name = d_it->second.domain_name;
+    task.deadline = heap.top().due;
+    task.deferred_since = heap.top().deferred_since;
+    task.generation = heap.top().generation;
+    heap.pop();
+    num_running++;
+    unlock();
+    return true;
+  }
+}
+
+
+void DnsProbeScheduler::probe_done(const probe_task &task) {
+  lock();
+  num_running--;
+  std::map<int,domain_entry>::iterator d_it = domains.find(task.domain_id);
+  if(d_it != domains.end() && d_it->second.generation == task.generation) {
+    bool last_cycle = false;
+    if(d_it->second.cycles_left > 0) {
+      d_it->second.cycles_left--;
+      last_cycle = (d_it->second.cycles_left == 0);
+    }
+    if(last_cycle) {
+      domains.erase(d_it);
+    }
+    else {
+      heap_entry h;
+      h.deadline = task.deadline + period;
+      // if we fell behind, skip the missed slots but keep the phase
+      double t = now();
+      if(h.deadline < t) {
+	h.deadline += ceil((t - h.deadline) / period) * period;
+      }
+      h.due = h.deadline;
+      h.deferred_since = 0;
+      h.domain_id = task.domain_id;
+      h.generation = task.generation;
+      heap.push(h);
+      d_it->second.deadline = h.deadline;
+    }
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+void DnsProbeScheduler::defer_probe(const probe_task &task, double until) {
+  lock();
+  num_running--;
+  num_deferred++;
+  std::map<int,domain_entry>::iterator d_it = domains.find(task.domain_id);
+  if(d_it != domains.end() && d_it->second.generation == task.generation) {
+    heap_entry h;
+    h.deadline = until;
+    h.due = task.deadline;
+    h.deferred_since = (task.deferred_since > 0) ? task.deferred_since : now();
+    h.domain_id = task.domain_id;
+    h.generation = task.generation;
+    heap.push(h);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+unsigned long DnsProbeScheduler::get_num_deferred() {
+  lock();
+  unsigned long n = num_deferred;
+  unlock();
+  return n;
+}
+
+
+bool DnsProbeScheduler::finished() {
+  lock();
+  bool done = all_done();
+  unlock();
+  return done;
+}
+
+
+size_t DnsProbeScheduler::size() {
+  lock();
+  size_t n = domains.size();
+  unlock();
+  return n;
+}
+
+
+void DnsProbeScheduler::stop() {
+  lock();
+  stopping = true;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_broadcast(&schedule_cond);
+#endif
+  unlock();
+}
+
+
+DnsProbeScheduler::~DnsProbeScheduler() {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_cond_destroy(&schedule_cond);
+  pthread_mutex_destroy(&schedule_mutex);
+#endif
+}
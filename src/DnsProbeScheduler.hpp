@@ -0,0 +1,127 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSPROBESCHEDULER_H
+#define _DNSPROBESCHEDULER_H
+
+#include <iostream>
+#include <map>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <stdint.h>
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+/* probe_task:
+ * a probe handed out by the scheduler, deadline is the time
+ * (scheduler clock, seconds) at which the probe was due,
+ * deferred_since is when it was first picked up if it has
+ * been deferred (0 otherwise) */
+struct probe_task {
+  int domain_id;
+  std::string domain_name;
+  double deadline;
+  double deferred_since;
+  uint32_t generation;
+};
+
+/* Dns Probe Scheduler:
+ * this class keeps the probing schedule of all the domains,
+ * i.e. a min-heap of deadlines (one entry per domain) shared by
+ * the probing threads: next_probe() blocks until the earliest
+ * probe is due, probe_done() re-arms the domain one period after
+ * its previous deadline (so the phase of every domain is kept),
+ * defer_probe() hands a probe back to be retried later (e.g. rate
+ * limited) without changing its deadline.
+ * Domains can be added and removed while the probes run: removed
+ * domains are dropped from the map and their heap entries are
+ * discarded lazily (the generation tells stale entries apart)
+ */
+class DnsProbeScheduler{
+private:
+  struct domain_entry {
+    std::string domain_name;
+    uint32_t generation;
+    unsigned int cycles_left; // 0 means infinite
+    double deadline;          // next probe (or the one in progress)
+  };
+  struct heap_entry {
+    double deadline;       // when the probe can run
+    double due;            // when the probe was due (phase)
+    double deferred_since;
+    int domain_id;
+    uint32_t generation;
+    bool operator>(const heap_entry &e) const { return deadline > e.deadline; }
+  };
+  std::map<int,domain_entry> domains;
+  std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry> > heap;
+  double period;            // seconds between two probes of the same domain
+  unsigned int max_cycles;  // 0 means infinite
+  uint32_t next_generation;
+  unsigned int num_running; // probes handed out and not done yet
+  unsigned long num_deferred;
+  bool stopping;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t schedule_mutex;
+  pthread_cond_t schedule_cond;
+#endif
+  void lock();
+  void unlock();
+  void wait_until(double deadline);
+  void insert_domain(int domain_id, const std::string &domain_name,
+		     double deadline, unsigned int cycles_left);
+  bool all_done();
+public:
+  DnsProbeScheduler(double period = 60, unsigned int cycles = 0);
+  // current time on the scheduler clock (monotonic where available)
+  static double now();
+  void configure(double period, unsigned int cycles);
+  /* add (or rename) domains, the new ones are spread uniformly
+   * over one period starting at first_deadline, unless a deadline
+   * is given for them in deadlines (e.g. restored from a checkpoint) */
+  void add_domains(const std::map<int,std::string> &to_add, double first_deadline,
+		   const std::map<int,double> * deadlines = NULL);
+  /* add one domain with an explicit deadline */
+  void add_domain(int domain_id, const std::string &domain_name,
+		  double deadline, unsigned int cycles_left);
+  void remove_domains(const std::vector<int> &to_remove);
+  void export_deadlines(std::map<int,double> &out);
+  double get_period();
+  // returns false when there is nothing left to probe (or stop was called)
+  bool next_probe(probe_task &task);
+  void probe_done(const probe_task &task);
+  void defer_probe(const probe_task &task, double until);
+  unsigned long get_num_deferred();
+  // true when all domains completed their cycles
+  bool finished();
+  size_t size();
+  void stop();
+  ~DnsProbeScheduler();
+};
+
+#endif /* _DNSPROBESCHEDULER_H */
@@ -0,0 +1,118 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsRateLimiter.hpp"
+#include "DnsProbeProfiler.hpp"
+
+
+void token_bucket::configure(double rate, unsigned int burst) {
+  interval_ns = (rate > 0) ? (uint64_t) (1000000000.0 / rate) : 0;
+  tolerance_ns = (burst > 1) ? (burst - 1) * interval_ns : 0;
+  tat.store(0, std::memory_order_relaxed);
+}
+
+
+uint64_t token_bucket::reserve(uint64_t now) {
+  if(interval_ns == 0) {
+    return 0;
+  }
+  uint64_t t = tat.load(std::memory_order_relaxed);
+  uint64_t next;
+  do {
+    next = ((t > now) ? t : now) + interval_ns;
+  } while(!tat.compare_exchange_weak(t, next, std::memory_order_relaxed));
+  // t is the value the reservation was made on
+  uint64_t allowed_at = (t > tolerance_ns) ? t - tolerance_ns : 0;
+  return (allowed_at > now) ? allowed_at - now : 0;
+}
+
+
+DnsRateLimiter::DnsRateLimiter() {
+  nsset = new token_bucket[NUM_NSSET_BUCKETS];
+  enabled = false;
+  nsset_enabled = false;
+}
+
+
+void DnsRateLimiter::configure(double global_rate,
+			       double destination_rate,
+			       double nsset_rate,
+			       unsigned int burst) {
+  global.configure(global_rate, burst);
+  for(unsigned int i = 0; i < NUM_DESTINATION_BUCKETS; i++) {
+    destination[i].configure(destination_rate, burst);
+  }
+  for(unsigned int i = 0; i < NUM_NSSET_BUCKETS; i++) {
+    nsset[i].configure(nsset_rate, burst);
+  }
+  enabled = (global_rate > 0 || destination_rate > 0 || nsset_rate > 0);
+  nsset_enabled = (nsset_rate > 0);
+}
+
+
+bool DnsRateLimiter::limits_nssets() const {
+  return nsset_enabled;
+}
+
+
+// FNV-1a
+uint32_t DnsRateLimiter::hash_key(const std::string &key) {
+  uint32_t h = 2166136261U;
+  for(size_t i = 0; i < key.size(); i++) {
+    h ^= (unsigned char) key[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+double DnsRateLimiter::acquire(const std::vector<uint32_t> &destination_keys, int nsset_id) {
+  if(!enabled) {
+    return 0;
+  }
+  uint64_t now = DnsProbeProfiler::now_ns();
+  uint64_t wait = 0;
+  uint64_t w;
+  for(size_t i = 0; i < destination_keys.size(); i++) {
+    w = global.reserve(now);
+    if(w > wait) {
+      wait = w;
+    }
+    w = destination[destination_keys[i] % NUM_DESTINATION_BUCKETS].reserve(now);
+    if(w > wait) {
+      wait = w;
+    }
+  }
+  if(nsset_id >= 0) {
+    w = nsset[nsset_id % NUM_NSSET_BUCKETS].reserve(now);
+    if(w > wait) {
+      wait = w;
+    }
+  }
+  return (double) wait / 1000000000.0;
+}
+
+
+DnsRateLimiter::~DnsRateLimiter() {
+  delete [] nsset;
+}
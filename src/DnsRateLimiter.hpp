@@ -0,0 +1,94 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSRATELIMITER_H
+#define _DNSRATELIMITER_H
+
+#include <iostream>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include "dns_latency_monitor-config.h"
+
+
+/* token_bucket:
+ * a token bucket implemented as GCRA (generic cell rate algorithm):
+ * the whole state is the theoretical arrival time (tat) of the next
+ * query, a single atomic word updated with compare-and-swap, so
+ * reserving a token is O(1) and lock-free */
+struct token_bucket {
+  std::atomic<uint64_t> tat; // ns, profiler clock
+  uint64_t interval_ns;      // 1/rate, 0 means unlimited
+  uint64_t tolerance_ns;     // (burst - 1) * interval
+  token_bucket() : tat(0), interval_ns(0), tolerance_ns(0) {}
+  void configure(double rate, unsigned int burst);
+  /* reserve the next token, returns the ns to wait before
+   * using it (0: available now) */
+  uint64_t reserve(uint64_t now);
+};
+
+
+/* Dns Rate Limiter:
+ * this class limits the probing rate with three kinds of token
+ * buckets: a global one, one per destination (the server our
+ * queries are sent to) and one per NS-set (the authoritative
+ * servers of the probed domain, i.e. the provider).
+ * Per destination and per NS-set buckets live in fixed arrays
+ * indexed by key (hashed): no allocation and no lock on the send
+ * path, two keys sharing a slot share the (stricter) limit.
+ * (the nsset_id itself comes from DnsNsSetCache, a read lock and
+ * a map lookup per probe, the NS lookups are done off the probe
+ * path by the prefetch threads)
+ * acquire() reserves one token in every bucket and returns how
+ * long to wait before sending: a deferred probe already owns its
+ * tokens, so it is deferred once and does not compete again
+ * (when several buckets are involved the ones with the shortest
+ * wait keep a token unused for a while, i.e. they err on the
+ * conservative side)
+ */
+class DnsRateLimiter{
+public:
+  static const unsigned int NUM_DESTINATION_BUCKETS = 1024;
+  static const unsigned int NUM_NSSET_BUCKETS = 65536;
+private:
+  token_bucket global;
+  token_bucket destination[NUM_DESTINATION_BUCKETS];
+  token_bucket * nsset; // NUM_NSSET_BUCKETS, on the heap
+  bool enabled;
+  bool nsset_enabled;
+public:
+  DnsRateLimiter();
+  /* rates in queries per second (0: no limit), the buckets
+   * must be configured before the probes start */
+  void configure(double global_rate, double destination_rate,
+		 double nsset_rate, unsigned int burst = 10);
+  static uint32_t hash_key(const std::string &key);
+  // true if the NS-set of the domains is needed
+  bool limits_nssets() const;
+  /* one query to every destination (a token of the global bucket
+   * each), nsset_id < 0 means no NS-set; returns the seconds to wait */
+  double acquire(const std::vector<uint32_t> &destination_keys, int nsset_id);
+  ~DnsRateLimiter();
+};
+
+#endif /* _DNSRATELIMITER_H */
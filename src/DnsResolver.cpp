@@ -26,6 +26,10 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
  
 #ifdef __MACH__
 #include <mach/clock.h>
@@ -44,7 +48,7 @@ void DnsResolver::current_utc_time(struct timespec *ts) {
   ts->tv_sec = mts.tv_sec;
   ts->tv_nsec = mts.tv_nsec;
 #else
-  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  clock_gettime(CLOCK_MONOTONIC_RAW, ts);
 #endif
 }
  
@@ -56,9 +60,24 @@ DnsResolver::DnsResolver() {
     if(s != LDNS_STATUS_OK){
       throw std::string("Can't create DnsResolver()");
     }
+    edns_udp_size = 0;
+    dnssec_ok = false;
+    validate_signatures = false;
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
     pthread_mutex_init(&measuring_mutex, NULL);
+    pthread_mutex_init(&key_mutex, NULL);
+    pthread_mutex_init(&servers_mutex, NULL);
+    pthread_mutex_init(&key_fetch_mutex, NULL);
 #endif
+    server_generation = 0;
+    // the keys are needed whole: DO bit and TCP fallback (the default)
+    s = ldns_resolver_new_frm_file(&key_resolver, NULL);
+    if(s != LDNS_STATUS_OK){
+      ldns_resolver_deep_free(resolver);
+      throw std::string("Can't create DnsResolver()");
+    }
+    ldns_resolver_set_dnssec(key_resolver, true);
+    ldns_resolver_set_edns_udp_size(key_resolver, 1232);
   }
   catch(std::string s){
     throw s;
@@ -66,21 +85,92 @@ DnsResolver::DnsResolver() {
 }
 
 
-double DnsResolver::query_nameserver(const std::string domain_name) { 
+io_backend DnsResolver::set_io_backend(io_backend b) {
+  if(b == IO_BACKEND_LDNS || ldns_resolver_nameserver_count(resolver) == 0) {
+    transport.close();
+    return transport.get_backend();
+  }
+  size_t server_len = 0;
+  struct sockaddr_storage * server =
+    ldns_rdf2native_sockaddr_storage(ldns_resolver_nameservers(resolver)[0],
+				     ldns_resolver_port(resolver), &server_len);
+  if(server == NULL) {
+    std::cerr << "Can't use the " << DnsUdpTransport::backend_name(b)
+	      << " backend, unsupported nameserver address" << std::endl;
+    return transport.get_backend();
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&measuring_mutex);
+#endif
+  try {
+    transport.open(b, server, server_len);
+  }
+  catch(std::string e) {
+    // stay with ldns
+    std::cerr << e << std::endl;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&measuring_mutex);
+#endif
+  LDNS_FREE(server);
+  return transport.get_backend();
+}
+
+
+void DnsResolver::set_edns(uint16_t udp_size, bool dnssec_ok, bool validate) {
+  validate_signatures = validate;
+  this->dnssec_ok = dnssec_ok || validate;
+  if(this->dnssec_ok && udp_size == 0) {
+    udp_size = 1232; // no IP fragmentation on common paths
+  }
+  // a bigger response would not fit in the transport buffers
+  if(udp_size > DnsUdpTransport::RECV_BUFFER_SIZE) {
+    udp_size = DnsUdpTransport::RECV_BUFFER_SIZE;
+  }
+  edns_udp_size = udp_size;
+  ldns_resolver_set_edns_udp_size(resolver, edns_udp_size);
+  ldns_resolver_set_dnssec(resolver, this->dnssec_ok);
+  if(edns_udp_size > 0) {
+    // a truncated response is measured as is, like with the transports
+    ldns_resolver_set_fallback(resolver, false);
+  }
+}
+
+
+double DnsResolver::query_nameserver(const std::string domain_name, probe_timing * timing,
+				     response_metrics * metrics) { 
   ldns_rdf * domain = NULL;
   ldns_pkt * response_packet = NULL;
   long double time_diff = -1.0; 
+  // stage timestamps (profiler clock), only taken if requested
+  uint64_t t_build = (timing != NULL) ? DnsProbeProfiler::now_ns() : 0;
   domain = ldns_dname_new_frm_str(domain_name.c_str());
   if(domain == NULL) {
     std::cerr << domain_name << " cannot be parsed" << std::endl;
     return -1;
   }
+  if(metrics != NULL) {
+    DnsResponseParser::clear(*metrics);
+  }
+  if(transport.get_backend() != IO_BACKEND_LDNS) {
+    return query_transport(domain_name, domain, timing, t_build, metrics);
+  }
   // timespec - nanoseconds resolution
   struct timespec ts_before;
   struct timespec ts_after;
+  uint64_t t_lock = 0;
+  if(timing != NULL) {
+    t_lock = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_BUILD, t_build, t_lock);
+  }
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
   pthread_mutex_lock(&measuring_mutex);
 #endif
+  uint64_t t_send = 0;
+  if(timing != NULL) {
+    t_send = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_LOCK_WAIT, t_lock, t_send);
+  }
   current_utc_time(&ts_before);
   response_packet = ldns_resolver_query(resolver,
 					domain,
@@ -89,6 +179,11 @@ double DnsResolver::query_nameserver(const std::string domain_name) {
 					LDNS_RD);         // recursion desired
   // http://www.iana.org/assignments/dns-parameters/dns-parameters.xhtml
   current_utc_time(&ts_after);
+  uint64_t t_parse = 0;
+  if(timing != NULL) {
+    t_parse = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_NETWORK, t_send, t_parse);
+  }
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
   pthread_mutex_unlock(&measuring_mutex);
 #endif
@@ -96,6 +191,12 @@ double DnsResolver::query_nameserver(const std::string domain_name) {
     std::cerr << "Query for " << domain_name << " failed" << std::endl;
   }
   else{
+    if(metrics != NULL) {
+      metrics_from_pkt(response_packet, *metrics);
+      if(validate_signatures) {
+	validate(response_packet, *metrics);
+      }
+    }
     // free memory allocated for packet
     ldns_pkt_free(response_packet);
     // time elapsed adjusted code from:
@@ -114,12 +215,654 @@ double DnsResolver::query_nameserver(const std::string domain_name) {
   }
   // free memory allocated for domain
   ldns_rdf_deep_free(domain);
+  if(timing != NULL) {
+    timing->set(STAGE_PARSE, t_parse, DnsProbeProfiler::now_ns());
+  }
   //debug std::cerr << "Query for " << domain_name << " " << time_diff << std::endl;
   return time_diff;
 }
 
+// A query for domain (freed here) with a random id, in wire format
+ldns_status DnsResolver::build_query(ldns_rdf * domain, uint8_t ** wire, size_t * wire_len,
+				     uint16_t * id) {
+  // the packet takes ownership of domain
+  ldns_pkt * query = ldns_pkt_query_new(domain, LDNS_RR_TYPE_A, LDNS_RR_CLASS_IN, LDNS_RD);
+  if(query == NULL) {
+    ldns_rdf_deep_free(domain);
+    return LDNS_STATUS_MEM_ERR;
+  }
+  *id = ldns_get_random();
+  ldns_pkt_set_id(query, *id);
+  if(edns_udp_size > 0) {
+    ldns_pkt_set_edns_udp_size(query, edns_udp_size);
+    ldns_pkt_set_edns_do(query, dnssec_ok);
+  }
+  ldns_status s = ldns_pkt2wire(wire, query, wire_len);
+  ldns_pkt_free(query);
+  return s;
+}
+
+
+// query_nameserver through the transport, domain is freed here
+double DnsResolver::query_transport(const std::string &domain_name, ldns_rdf * domain,
+				    probe_timing * timing, uint64_t t_build,
+				    response_metrics * metrics) {
+  uint8_t * wire = NULL;
+  size_t wire_len = 0;
+  uint16_t id = 0;
+  if(build_query(domain, &wire, &wire_len, &id) != LDNS_STATUS_OK) {
+    std::cerr << domain_name << " cannot be encoded" << std::endl;
+    return -1;
+  }
+  struct timeval tv = ldns_resolver_timeout(resolver);
+  int timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  uint8_t response[DnsUdpTransport::RECV_BUFFER_SIZE];
+  double latency = -1.0;
+  uint64_t t_lock = 0;
+  if(timing != NULL) {
+    t_lock = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_BUILD, t_build, t_lock);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&measuring_mutex);
+#endif
+  uint64_t t_send = 0;
+  if(timing != NULL) {
+    t_send = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_LOCK_WAIT, t_lock, t_send);
+  }
+  int len = transport.exchange(wire, wire_len, id, response, sizeof(response),
+			       timeout_ms, &latency);
+  uint64_t t_parse = 0;
+  if(timing != NULL) {
+    t_parse = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_NETWORK, t_send, t_parse);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&measuring_mutex);
+#endif
+  LDNS_FREE(wire);
+  response_metrics m;
+  if(len < 0 || !DnsResponseParser::parse(response, len, id, m)) {
+    std::cerr << "Query for " << domain_name << " failed" << std::endl;
+    latency = -1.0;
+  }
+  else if(metrics != NULL) {
+    if(validate_signatures) {
+      validate_wire(response, len, m);
+    }
+    *metrics = m;
+  }
+  if(timing != NULL) {
+    timing->set(STAGE_PARSE, t_parse, DnsProbeProfiler::now_ns());
+  }
+  return latency;
+}
+
+
+bool DnsResolver::query_wire(const std::string domain_name, std::vector<uint8_t> &wire) {
+  ldns_rdf * domain = ldns_dname_new_frm_str(domain_name.c_str());
+  if(domain == NULL) {
+    return false;
+  }
+  uint8_t * w = NULL;
+  size_t len = 0;
+  uint16_t id = 0;
+  if(build_query(domain, &w, &len, &id) != LDNS_STATUS_OK) {
+    return false;
+  }
+  wire.assign(w, w + len);
+  LDNS_FREE(w);
+  return true;
+}
+
+
+struct sockaddr_storage * DnsResolver::server_address(const std::string &server,
+							size_t * len) {
+  if(server == "system") {
+    if(ldns_resolver_nameserver_count(resolver) == 0) {
+      return NULL;
+    }
+    return ldns_rdf2native_sockaddr_storage(ldns_resolver_nameservers(resolver)[0],
+					    ldns_resolver_port(resolver), len);
+  }
+  std::string address = server;
+  uint16_t port = 53;
+  size_t sep = server.find('#');
+  if(sep != std::string::npos) {
+    address = server.substr(0, sep);
+    int p = atoi(server.substr(sep + 1).c_str());
+    if(p <= 0 || p > 65535) {
+      return NULL;
+    }
+    port = (uint16_t) p;
+  }
+  ldns_rdf * rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_A, address.c_str());
+  if(rdf == NULL) {
+    rdf = ldns_rdf_new_frm_str(LDNS_RDF_TYPE_AAAA, address.c_str());
+  }
+  if(rdf == NULL) {
+    return NULL;
+  }
+  struct sockaddr_storage * ss = ldns_rdf2native_sockaddr_storage(rdf, port, len);
+  ldns_rdf_deep_free(rdf);
+  return ss;
+}
+
+
+// this function is not visible outside this code unit
+static void delete_transports(std::vector<DnsUdpTransport *> &set) {
+  for(size_t i = 0; i < set.size(); i++) {
+    delete set[i];
+  }
+  set.clear();
+}
+
+
+void DnsResolver::open_server_set(const std::vector<struct sockaddr_storage> &addrs,
+				  const std::vector<size_t> &lens,
+				  std::vector<DnsUdpTransport *> &set) {
+  set.clear();
+  try {
+    for(size_t i = 0; i < addrs.size(); i++) {
+      DnsUdpTransport * t = new DnsUdpTransport();
+      set.push_back(t);
+      // the responses are waited for with poll, see query_servers
+      t->open(IO_BACKEND_EPOLL, &addrs[i], lens[i]);
+    }
+  }
+  catch(std::string e) {
+    delete_transports(set);
+    throw e;
+  }
+}
+
+
+size_t DnsResolver::set_servers(const std::vector<std::string> &servers) {
+  std::vector<struct sockaddr_storage> addrs;
+  std::vector<size_t> lens;
+  std::vector<DnsUdpTransport *> transports;
+  try {
+    for(size_t i = 0; i < servers.size(); i++) {
+      size_t len = 0;
+      struct sockaddr_storage * ss = server_address(servers[i], &len);
+      if(ss == NULL) {
+	throw std::string("invalid server address ") + servers[i];
+      }
+      addrs.push_back(*ss);
+      lens.push_back(len);
+      LDNS_FREE(ss);
+    }
+    // the first set is opened here, so that the errors show up now
+    open_server_set(addrs, lens, transports);
+  }
+  catch(std::string e) {
+    throw std::string("Can't set_servers() -> ") + e;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&servers_mutex);
+#endif
+  for(size_t i = 0; i < free_server_sets.size(); i++) {
+    delete_transports(free_server_sets[i]);
+  }
+  free_server_sets.assign(1, transports);
+  server_addrs = addrs;
+  server_addr_lens = lens;
+  server_names = servers;
+  server_generation++;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&servers_mutex);
+#endif
+  return server_names.size();
+}
+
+
+size_t DnsResolver::num_servers() const {
+  return server_names.size();
+}
+
+
+void DnsResolver::query_servers(const std::string domain_name, std::vector<double> &latencies,
+				probe_timing * timing, response_metrics * metrics) {
+  size_t n = server_names.size();
+  latencies.assign(n, -1.0);
+  if(metrics != NULL) {
+    DnsResponseParser::clear(*metrics);
+  }
+  uint64_t t_build = (timing != NULL) ? DnsProbeProfiler::now_ns() : 0;
+  ldns_rdf * domain = ldns_dname_new_frm_str(domain_name.c_str());
+  if(domain == NULL) {
+    std::cerr << domain_name << " cannot be parsed" << std::endl;
+    return;
+  }
+  uint8_t * wire = NULL;
+  size_t wire_len = 0;
+  uint16_t id = 0;
+  if(build_query(domain, &wire, &wire_len, &id) != LDNS_STATUS_OK) {
+    std::cerr << domain_name << " cannot be encoded" << std::endl;
+    return;
+  }
+  struct timeval tv = ldns_resolver_timeout(resolver);
+  int timeout_ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  uint8_t response[DnsUdpTransport::RECV_BUFFER_SIZE];
+  // the response of server 0, verified once the lock is released
+  std::vector<uint8_t> signed_response;
+  // pending[k]: index of the server polled in pfds[k]
+  std::vector<struct pollfd> pfds;
+  std::vector<size_t> pending;
+  uint64_t t_lock = 0;
+  if(timing != NULL) {
+    t_lock = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_BUILD, t_build, t_lock);
+  }
+  // a free set of sockets, or a new one: no lock during the wait
+  std::vector<DnsUdpTransport *> set;
+  std::vector<struct sockaddr_storage> addrs;
+  std::vector<size_t> lens;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&servers_mutex);
+#endif
+  unsigned int generation = server_generation;
+  if(!free_server_sets.empty()) {
+    set.swap(free_server_sets.back());
+    free_server_sets.pop_back();
+  }
+  else {
+    addrs = server_addrs;
+    lens = server_addr_lens;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&servers_mutex);
+#endif
+  if(set.empty()) {
+    try {
+      open_server_set(addrs, lens, set);
+    }
+    catch(std::string e) {
+      std::cerr << "Can't query_servers() -> " << e << std::endl;
+      LDNS_FREE(wire);
+      return;
+    }
+  }
+  n = set.size();
+  uint64_t t_send = DnsProbeProfiler::now_ns();
+  if(timing != NULL) {
+    timing->set(STAGE_LOCK_WAIT, t_lock, t_send);
+  }
+  // the same query is on the wire to every server before waiting
+  for(size_t i = 0; i < n; i++) {
+    if(set[i]->send_query(wire, wire_len)) {
+      struct pollfd pfd;
+      pfd.fd = set[i]->get_socket();
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      pfds.push_back(pfd);
+      pending.push_back(i);
+    }
+  }
+  uint64_t deadline = t_send + (uint64_t) timeout_ms * 1000000ULL;
+  while(!pfds.empty()) {
+    uint64_t now = DnsProbeProfiler::now_ns();
+    if(now >= deadline) {
+      break;
+    }
+    int r = poll(&pfds[0], pfds.size(), (int) ((deadline - now + 999999) / 1000000));
+    if(r < 0 && errno != EINTR) {
+      break;
+    }
+    // a server is done when it answered or failed
+    size_t k = 0;
+    while(k < pfds.size()) {
+      int len = 0;
+      size_t i = pending[k];
+      if(pfds[k].revents != 0) {
+	double latency = -1.0;
+	len = set[i]->receive_response(id, response, sizeof(response), &latency);
+	response_metrics m;
+	if(len > 0 && DnsResponseParser::parse(response, len, id, m)) {
+	  latencies[i] = latency;
+	  if(i == 0 && metrics != NULL) {
+	    *metrics = m;
+	    if(validate_signatures && m.num_signatures > 0) {
+	      signed_response.assign(response, response + len);
+	    }
+	  }
+	}
+      }
+      if(len != 0) {
+	pfds.erase(pfds.begin() + k);
+	pending.erase(pending.begin() + k);
+      }
+      else {
+	pfds[k].revents = 0;
+	k++;
+      }
+    }
+  }
+  uint64_t t_parse = 0;
+  if(timing != NULL) {
+    t_parse = DnsProbeProfiler::now_ns();
+    timing->set(STAGE_NETWORK, t_send, t_parse);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&servers_mutex);
+#endif
+  if(generation == server_generation) {
+    free_server_sets.push_back(set);
+  }
+  else {
+    delete_transports(set);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&servers_mutex);
+#endif
+  LDNS_FREE(wire);
+  if(!signed_response.empty()) {
+    validate_wire(&signed_response[0], signed_response.size(), *metrics);
+  }
+  for(size_t i = 0; i < n; i++) {
+    if(latencies[i] < 0) {
+      std::cerr << "Query for " << domain_name << " to " << server_names[i]
+		<< " failed" << std::endl;
+    }
+  }
+  if(timing != NULL) {
+    // the responses are parsed as they arrive
+    timing->set(STAGE_PARSE, t_parse, DnsProbeProfiler::now_ns());
+  }
+}
+
+
+bool DnsResolver::lookup_ns(const std::string domain_name,
+			    std::vector<std::string> &ns_names) {
+  ns_names.clear();
+  ldns_rdf * domain = ldns_dname_new_frm_str(domain_name.c_str());
+  if(domain == NULL) {
+    return false;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  // the resolver is shared with the measurements
+  pthread_mutex_lock(&measuring_mutex);
+#endif
+  ldns_pkt * response_packet = ldns_resolver_query(resolver, domain,
+						   LDNS_RR_TYPE_NS,
+						   LDNS_RR_CLASS_IN,
+						   LDNS_RD);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&measuring_mutex);
+#endif
+  ldns_rdf_deep_free(domain);
+  if(response_packet == NULL) {
+    return false;
+  }
+  ldns_rr_list * ns_list = ldns_pkt_rr_list_by_type(response_packet,
+						    LDNS_RR_TYPE_NS,
+						    LDNS_SECTION_ANSWER);
+  if(ns_list != NULL) {
+    for(size_t i = 0; i < ldns_rr_list_rr_count(ns_list); i++) {
+      char * name = ldns_rdf2str(ldns_rr_rdf(ldns_rr_list_rr(ns_list, i), 0));
+      if(name != NULL) {
+	std::string n(name);
+	free(name);
+	// names are compared case insensitive
+	for(size_t c = 0; c < n.size(); c++) {
+	  n[c] = tolower(n[c]);
+	}
+	ns_names.push_back(n);
+      }
+    }
+    ldns_rr_list_deep_free(ns_list);
+  }
+  ldns_pkt_free(response_packet);
+  return !ns_names.empty();
+}
+
+
+void DnsResolver::metrics_from_pkt(const ldns_pkt * pkt, response_metrics &m) {
+  DnsResponseParser::clear(m);
+  m.size = ldns_pkt_size(pkt);
+  m.truncated = ldns_pkt_tc(pkt);
+  m.edns = ldns_pkt_edns(pkt);
+  m.rcode = ldns_pkt_get_rcode(pkt) | ((uint16_t) ldns_pkt_edns_extended_rcode(pkt) << 4);
+  m.dnssec_ok = ldns_pkt_edns_do(pkt);
+  m.edns_udp_size = m.edns ? ldns_pkt_edns_udp_size(pkt) : 0;
+  m.num_answers = ldns_pkt_ancount(pkt);
+  m.num_authorities = ldns_pkt_nscount(pkt);
+  // ldns takes the OPT record out of the additionals
+  m.num_additionals = ldns_pkt_arcount(pkt) + (m.edns ? 1 : 0);
+  ldns_rr_list * sections[3] = { ldns_pkt_answer(pkt), ldns_pkt_authority(pkt),
+				 ldns_pkt_additional(pkt) };
+  for(int s = 0; s < 3; s++) {
+    for(size_t i = 0; i < ldns_rr_list_rr_count(sections[s]); i++) {
+      if(ldns_rr_get_type(ldns_rr_list_rr(sections[s], i)) == LDNS_RR_TYPE_RRSIG) {
+	m.num_signatures++;
+      }
+    }
+  }
+}
+
+
+// lower case name of the signer zone, the key_cache key
+std::string DnsResolver::zone_name(const ldns_rdf * signer) {
+  std::string zone;
+  char * name = ldns_rdf2str(signer);
+  if(name == NULL) {
+    return zone;
+  }
+  zone = name;
+  free(name);
+  for(size_t c = 0; c < zone.size(); c++) {
+    zone[c] = tolower(zone[c]);
+  }
+  return zone;
+}
+
+
+/* the DNSKEYs of zone if they are missing or expired and no other
+ * thread is fetching them: called without any lock held */
+void DnsResolver::fetch_zone_keys(const std::string &zone) {
+  time_t now = time(NULL);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&key_mutex);
+#endif
+  std::map<std::string,zone_keys>::iterator it = key_cache.find(zone);
+  bool fetch = (it == key_cache.end() || (now >= it->second.expires && !it->second.fetching));
+  if(fetch) {
+    if(it == key_cache.end()) {
+      zone_keys zk;
+      zk.keys = NULL;
+      zk.expires = 0;
+      it = key_cache.insert(std::make_pair(zone, zk)).first;
+    }
+    it->second.fetching = true;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&key_mutex);
+#endif
+  if(!fetch) {
+    return;
+  }
+  ldns_rr_list * keys = NULL;
+  ldns_rdf * signer = ldns_dname_new_frm_str(zone.c_str());
+  if(signer != NULL) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&key_fetch_mutex);
+#endif
+    ldns_pkt * response_packet = ldns_resolver_query(key_resolver, signer,
+						     LDNS_RR_TYPE_DNSKEY,
+						     LDNS_RR_CLASS_IN,
+						     LDNS_RD);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&key_fetch_mutex);
+#endif
+    // a truncated set (TCP failed too) would verify some signatures only
+    if(response_packet != NULL && !ldns_pkt_tc(response_packet) &&
+       ldns_pkt_get_rcode(response_packet) == LDNS_RCODE_NOERROR) {
+      keys = ldns_pkt_rr_list_by_type(response_packet, LDNS_RR_TYPE_DNSKEY,
+				      LDNS_SECTION_ANSWER);
+    }
+    if(response_packet != NULL) {
+      ldns_pkt_free(response_packet);
+    }
+    ldns_rdf_deep_free(signer);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&key_mutex);
+#endif
+  zone_keys &zk = key_cache[zone];
+  if(zk.keys != NULL) {
+    ldns_rr_list_deep_free(zk.keys);
+  }
+  zk.keys = keys;
+  // a failure is cached as well, for a short time
+  zk.expires = time(NULL) + ((keys != NULL) ? KEY_CACHE_TTL : KEY_NEGATIVE_TTL);
+  zk.fetching = false;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&key_mutex);
+#endif
+}
+
+
+void DnsResolver::validate(const ldns_pkt * pkt, response_metrics &m) {
+  if(m.num_signatures == 0 || m.truncated) {
+    return; // nothing to verify or an incomplete response
+  }
+  uint64_t spent = 0;
+  bool verified = false;
+  bool failed = false;
+  bool missing_keys = false;
+  ldns_pkt_section sections[2] = { LDNS_SECTION_ANSWER, LDNS_SECTION_AUTHORITY };
+  ldns_rr_list * sigs[2];
+  std::vector<std::string> zones[2];
+  // the keys are fetched first, without holding key_mutex
+  for(int s = 0; s < 2; s++) {
+    sigs[s] = ldns_pkt_rr_list_by_type(pkt, LDNS_RR_TYPE_RRSIG, sections[s]);
+    for(size_t i = 0; sigs[s] != NULL && i < ldns_rr_list_rr_count(sigs[s]); i++) {
+      zones[s].push_back(zone_name(ldns_rr_rrsig_signame(ldns_rr_list_rr(sigs[s], i))));
+      fetch_zone_keys(zones[s][i]);
+    }
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&key_mutex);
+#endif
+  for(int s = 0; s < 2; s++) {
+    if(sigs[s] == NULL) {
+      continue;
+    }
+    for(size_t i = 0; i < ldns_rr_list_rr_count(sigs[s]); i++) {
+      ldns_rr * sig = ldns_rr_list_rr(sigs[s], i);
+      // expired keys are still used while they are being refreshed
+      std::map<std::string,zone_keys>::const_iterator it = key_cache.find(zones[s][i]);
+      ldns_rr_list * keys = (it != key_cache.end()) ? it->second.keys : NULL;
+      if(keys == NULL) {
+	missing_keys = true;
+	continue;
+      }
+      // the records covered by this signature
+      ldns_rr_type covered = ldns_rdf2rr_type(ldns_rr_rrsig_typecovered(sig));
+      ldns_rr_list * rrset = ldns_pkt_rr_list_by_name_and_type(pkt, ldns_rr_owner(sig),
+							       covered, sections[s]);
+      if(rrset == NULL) {
+	failed = true;
+	continue;
+      }
+      ldns_rr_list * good_keys = ldns_rr_list_new();
+      uint64_t t = DnsProbeProfiler::now_ns();
+      ldns_status st = ldns_verify_rrsig_keylist(rrset, sig, keys, good_keys);
+      spent += DnsProbeProfiler::now_ns() - t;
+      ldns_rr_list_free(good_keys);
+      ldns_rr_list_deep_free(rrset);
+      if(st == LDNS_STATUS_OK) {
+	verified = true;
+      }
+      else {
+	failed = true;
+      }
+    }
+    ldns_rr_list_deep_free(sigs[s]);
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&key_mutex);
+#endif
+  if(verified || failed) {
+    m.validation_ms = spent / 1000000.0;
+  }
+  if(failed) {
+    m.validated = 0;
+  }
+  else if(verified && !missing_keys) {
+    m.validated = 1;
+  }
+}
+
+
+// validate for a response in wire format, only then parsed by ldns
+void DnsResolver::validate_wire(const uint8_t * wire, size_t len, response_metrics &m) {
+  if(m.num_signatures == 0 || m.truncated) {
+    return;
+  }
+  ldns_pkt * pkt = NULL;
+  if(ldns_wire2pkt(&pkt, wire, len) != LDNS_STATUS_OK) {
+    m.validated = 0;
+    return;
+  }
+  validate(pkt, m);
+  ldns_pkt_free(pkt);
+}
+
+
+std::string DnsResolver::destination() {
+  std::string dest;
+  if(!server_names.empty()) {
+    return server_names[0];
+  }
+  if(ldns_resolver_nameserver_count(resolver) > 0) {
+    char * addr = ldns_rdf2str(ldns_resolver_nameservers(resolver)[0]);
+    if(addr != NULL) {
+      dest = addr;
+      free(addr);
+    }
+  }
+  return dest;
+}
+
+
+std::string DnsResolver::server_name(const std::string &server) {
+  if(server != "system") {
+    return server;
+  }
+  std::string name;
+  if(ldns_resolver_nameserver_count(resolver) > 0) {
+    char * addr = ldns_rdf2str(ldns_resolver_nameservers(resolver)[0]);
+    if(addr != NULL) {
+      name = addr;
+      free(addr);
+    }
+  }
+  if(name.empty()) {
+    return server;
+  }
+  if(ldns_resolver_port(resolver) != 53) {
+    char port[8];
+    snprintf(port, sizeof(port), "#%u", (unsigned int) ldns_resolver_port(resolver));
+    name += port;
+  }
+  return name;
+}
+
+
 DnsResolver::~DnsResolver() {
+  std::map<std::string,zone_keys>::iterator it;
+  for(it = key_cache.begin(); it != key_cache.end(); it++) {
+    if(it->second.keys != NULL) {
+      ldns_rr_list_deep_free(it->second.keys);
+    }
+  }
+  for(size_t i = 0; i < free_server_sets.size(); i++) {
+    delete_transports(free_server_sets[i]);
+  }
   ldns_resolver_deep_free(resolver);
+  ldns_resolver_deep_free(key_resolver);
 }
 
 
@@ -25,7 +25,14 @@
 #define _DNSRESOLVER_H
 
 #include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <time.h>
 #include <ldns/ldns.h>
+#include "DnsProbeProfiler.hpp"
+#include "DnsUdpTransport.hpp"
+#include "DnsResponseParser.hpp"
 #include "dns_latency_monitor-config.h"
 
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
@@ -35,11 +42,54 @@
 /* Dns resolver:
  * this class is a wrapper around the ldns dns querying functionalities
  * query_nameserver query the domain_name provided and returns the
- * latency in milliseconds
+ * latency in milliseconds, if timing is provided the
+ * build/lock_wait/network/parse stages are timestamped in it
+ * by default ldns sends the queries, set_io_backend moves them to
+ * a DnsUdpTransport (epoll or io_uring) connected to the first
+ * nameserver: ldns then only builds and parses the packets, and
+ * every query is a single attempt of ldns_resolver_timeout
+ * set_servers configures a list of recursive resolvers to compare:
+ * query_servers sends the same query to all of them at the same
+ * moment and waits for the responses concurrently (one epoll
+ * transport per server), each latency is measured on its own socket
+ * so a slow server does not affect the measurements of the others;
+ * every concurrent query_servers takes a set of sockets of its own
+ * (opened on demand, kept for reuse), so the threads sharing the
+ * resolver do not wait for each other's responses
+ * set_edns adds an EDNS0 OPT record (payload size, DO bit) to the
+ * queries; if metrics are requested the response is described in a
+ * response_metrics: read in place by DnsResponseParser with the
+ * epoll/io_uring transports, from the packet ldns builds anyway
+ * with the ldns backend. With validation on, the RRSIGs of the
+ * answer and authority sections are verified with the DNSKEYs of
+ * their signer (fetched once per KEY_CACHE_TTL and cached), the time
+ * spent in the verification alone is reported; the keys are fetched
+ * on a resolver of their own (TCP fallback on, as DNSKEY sets are
+ * often truncated over UDP) by the first probe that needs them, with
+ * no lock held, the other probes meanwhile validate without them;
+ * a failed fetch is retried after KEY_NEGATIVE_TTL
  */
 class DnsResolver{
 private:
   ldns_resolver * resolver;
+  ldns_resolver * key_resolver; // DNSKEY fetches
+  DnsUdpTransport transport;
+  std::vector<std::string> server_names;
+  // addresses of server_names, one transport set is opened per query_servers
+  std::vector<struct sockaddr_storage> server_addrs;
+  std::vector<size_t> server_addr_lens;
+  std::vector<std::vector<DnsUdpTransport *> > free_server_sets;
+  unsigned int server_generation; // sets of a previous set_servers are closed
+  uint16_t edns_udp_size;   // 0: no OPT record
+  bool dnssec_ok;
+  bool validate_signatures;
+  // DNSKEYs by signer name (NULL: could not be fetched)
+  struct zone_keys {
+    ldns_rr_list * keys;
+    time_t expires;
+    bool fetching;      // a thread is fetching them (single flight)
+  };
+  std::map<std::string,zone_keys> key_cache;
   // get current utc time
   void current_utc_time(struct timespec *ts);
   /* the query-latency measurements is in a 
@@ -48,10 +98,55 @@ private:
    * query another server at the same moment */
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
   pthread_mutex_t measuring_mutex;
+  // key_cache and the verifications that use its keys
+  pthread_mutex_t key_mutex;
+  // key_resolver
+  pthread_mutex_t key_fetch_mutex;
+  // free_server_sets
+  pthread_mutex_t servers_mutex;
 #endif
+  void open_server_set(const std::vector<struct sockaddr_storage> &addrs,
+		       const std::vector<size_t> &lens,
+		       std::vector<DnsUdpTransport *> &set);
+  ldns_status build_query(ldns_rdf * domain, uint8_t ** wire, size_t * wire_len,
+			  uint16_t * id);
+  double query_transport(const std::string &domain_name, ldns_rdf * domain,
+			 probe_timing * timing, uint64_t t_build,
+			 response_metrics * metrics);
+  void metrics_from_pkt(const ldns_pkt * pkt, response_metrics &m);
+  static std::string zone_name(const ldns_rdf * signer);
+  void fetch_zone_keys(const std::string &zone);
+  void validate(const ldns_pkt * pkt, response_metrics &m);
+  void validate_wire(const uint8_t * wire, size_t len, response_metrics &m);
 public:
+  static const unsigned int KEY_CACHE_TTL = 3600; // seconds
+  static const unsigned int KEY_NEGATIVE_TTL = 60; // seconds, after a failed fetch
   DnsResolver();
-  double query_nameserver(const std::string domain_name);
+  // returns the backend actually in use
+  io_backend set_io_backend(io_backend b);
+  /* udp_size 0: plain queries (dnssec_ok then implies 1232),
+   * validate implies dnssec_ok */
+  void set_edns(uint16_t udp_size, bool dnssec_ok, bool validate = false);
+  double query_nameserver(const std::string domain_name, probe_timing * timing = NULL,
+			  response_metrics * metrics = NULL);
+  /* server: "system" (first nameserver of resolv.conf) or
+   * address[#port], NULL if invalid (free with LDNS_FREE) */
+  struct sockaddr_storage * server_address(const std::string &server, size_t * len);
+  // the query a probe of domain_name sends (EDNS included), any id
+  bool query_wire(const std::string domain_name, std::vector<uint8_t> &wire);
+  /* servers: as server_address, returns the number of servers */
+  size_t set_servers(const std::vector<std::string> &servers);
+  size_t num_servers() const;
+  // latencies[i]: latency of server i, -1 if it failed, metrics: of server 0
+  void query_servers(const std::string domain_name, std::vector<double> &latencies,
+		     probe_timing * timing = NULL, response_metrics * metrics = NULL);
+  // names of the authoritative servers of domain_name (NS records)
+  bool lookup_ns(const std::string domain_name, std::vector<std::string> &ns_names);
+  // the server queries are sent to (first nameserver or server)
+  std::string destination();
+  /* "system" replaced by the address (and #port if not 53) of the
+   * first nameserver, any other server as is */
+  std::string server_name(const std::string &server);
   ~DnsResolver();
 };
 
@@ -0,0 +1,118 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsResponseParser.hpp"
+
+#include <string.h>
+
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_TYPE_OPT 41
+#define DNS_TYPE_RRSIG 46
+#define EDNS_FLAG_DO 0x8000
+
+
+static inline uint16_t load16(const uint8_t * p) {
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+
+// offset after the name at pos, 0 if it does not fit in len
+static size_t skip_name(const uint8_t * wire, size_t len, size_t pos) {
+  while(pos < len) {
+    uint8_t label_len = wire[pos];
+    if(label_len == 0) {
+      return pos + 1;
+    }
+    if((label_len & 0xC0) == 0xC0) {
+      // a pointer ends the name
+      return (pos + 2 <= len) ? pos + 2 : 0;
+    }
+    if(label_len & 0xC0) {
+      return 0; // extended label types are not used
+    }
+    pos += 1 + label_len;
+  }
+  return 0;
+}
+
+
+void DnsResponseParser::clear(response_metrics &m) {
+  memset(&m, 0, sizeof(m));
+  m.validation_ms = -1;
+  m.validated = -1;
+}
+
+
+bool DnsResponseParser::parse(const uint8_t * wire, size_t len, uint16_t id,
+			      response_metrics &m) {
+  clear(m);
+  if(len < HEADER_SIZE || len > 0xFFFF) {
+    return false;
+  }
+  uint16_t flags = load16(wire + 2);
+  if(load16(wire) != id || !(flags & DNS_FLAG_QR)) {
+    return false;
+  }
+  m.size = (uint16_t) len;
+  m.rcode = flags & 0x000F;
+  m.truncated = (flags & DNS_FLAG_TC) != 0;
+  uint16_t num_questions = load16(wire + 4);
+  m.num_answers = load16(wire + 6);
+  m.num_authorities = load16(wire + 8);
+  m.num_additionals = load16(wire + 10);
+  size_t pos = HEADER_SIZE;
+  for(uint16_t q = 0; q < num_questions; q++) {
+    pos = skip_name(wire, len, pos);
+    if(pos == 0 || pos + 4 > len) {
+      return m.truncated;
+    }
+    pos += 4; // type, class
+  }
+  unsigned int num_records = m.num_answers + m.num_authorities + m.num_additionals;
+  for(unsigned int r = 0; r < num_records; r++) {
+    pos = skip_name(wire, len, pos);
+    // type, class, ttl, rdlength
+    if(pos == 0 || pos + 10 > len) {
+      return m.truncated;
+    }
+    uint16_t type = load16(wire + pos);
+    uint16_t rdlength = load16(wire + pos + 8);
+    if(pos + 10 + rdlength > len) {
+      return m.truncated;
+    }
+    if(type == DNS_TYPE_RRSIG) {
+      m.num_signatures++;
+    }
+    else if(type == DNS_TYPE_OPT && r >= (unsigned int) (m.num_answers + m.num_authorities)) {
+      // class: udp payload size, ttl: extended rcode, version, flags
+      m.edns = true;
+      m.edns_udp_size = load16(wire + pos + 2);
+      m.rcode |= (uint16_t) wire[pos + 4] << 4;
+      m.dnssec_ok = (load16(wire + pos + 6) & EDNS_FLAG_DO) != 0;
+    }
+    pos += 10 + rdlength;
+  }
+  return true;
+}
@@ -0,0 +1,69 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSRESPONSEPARSER_H
+#define _DNSRESPONSEPARSER_H
+
+#include <iostream>
+#include <stdint.h>
+#include <stddef.h>
+
+
+/* response_metrics:
+ * what a probe learns from the response besides the latency
+ * the section counts are the ones of the header (the OPT record
+ * is one of the additionals) */
+struct response_metrics {
+  uint16_t size;            // bytes of the DNS message
+  uint16_t rcode;           // extended by the OPT record, if any
+  bool truncated;           // TC flag
+  bool edns;                // the response has an OPT record
+  bool dnssec_ok;           // DO flag of the response OPT record
+  uint16_t edns_udp_size;   // advertised by the server
+  uint16_t num_answers;
+  uint16_t num_authorities;
+  uint16_t num_additionals;
+  uint16_t num_signatures;  // RRSIG records, all sections
+  double validation_ms;     // time spent verifying the signatures, < 0: not validated
+  int validated;            // 1: all signatures verified, 0: one failed, -1: not validated
+};
+
+
+/* Dns Response Parser:
+ * this class reads the metrics of a response in wire format where it
+ * lies (no ldns_pkt, nothing allocated): the header, then every
+ * record is skipped over (compressed names are not followed) only
+ * looking at its type, so the OPT record and the RRSIGs are found
+ * a truncated response (TC) may end in the middle of a record,
+ * its metrics are the ones of the records that are complete
+ */
+class DnsResponseParser{
+public:
+  static const size_t HEADER_SIZE = 12;
+  // false if wire is not a well formed response to query id
+  static bool parse(const uint8_t * wire, size_t len, uint16_t id,
+		    response_metrics &m);
+  static void clear(response_metrics &m);
+};
+
+#endif /* _DNSRESPONSEPARSER_H */
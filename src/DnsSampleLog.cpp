@@ -0,0 +1,358 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsSampleLog.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define SAMPLE_FILE_MAGIC_V1 "DNSSMPL1"
+#define SAMPLE_FILE_MAGIC_V2 "DNSSMPL2"
+#define SAMPLE_FILE_MAGIC_LEN 8
+#define SAMPLE_BLOCK_MAGIC_V1 0x4b4c4253 // "SBLK"
+#define SAMPLE_BLOCK_MAGIC_V2 0x324b4253 // "SBK2"
+// bytes of a sample in a block
+#define SAMPLE_SIZE_V1 12
+#define SAMPLE_SIZE_V2 28
+
+// block header on disk
+struct sample_block_header {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t min_ts;
+  uint32_t max_ts;
+};
+
+
+DnsSampleLog::DnsSampleLog() : fd(-1), version(2), map(NULL), map_size(0) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_init(&log_mutex, NULL);
+#endif
+}
+
+
+void DnsSampleLog::open_append(const char * path) {
+  close();
+  fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if(fd < 0) {
+    throw std::string("Can't open_append() - ") + path + ": " + strerror(errno);
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size == 0) {
+    version = 2;
+    if(write(fd, SAMPLE_FILE_MAGIC_V2, SAMPLE_FILE_MAGIC_LEN) != SAMPLE_FILE_MAGIC_LEN) {
+      close();
+      throw std::string("Can't open_append() - ") + path + ": " + strerror(errno);
+    }
+  }
+  else {
+    // an existing file keeps its version
+    char magic[SAMPLE_FILE_MAGIC_LEN];
+    if(pread(fd, magic, SAMPLE_FILE_MAGIC_LEN, 0) != SAMPLE_FILE_MAGIC_LEN) {
+      close();
+      throw std::string("Can't open_append() - ") + path + " is not a sample file";
+    }
+    if(memcmp(magic, SAMPLE_FILE_MAGIC_V2, SAMPLE_FILE_MAGIC_LEN) == 0) {
+      version = 2;
+    }
+    else if(memcmp(magic, SAMPLE_FILE_MAGIC_V1, SAMPLE_FILE_MAGIC_LEN) == 0) {
+      version = 1;
+      std::cerr << path << " is a version 1 sample file, "
+		<< "the response metrics are not recorded" << std::endl;
+    }
+    else {
+      close();
+      throw std::string("Can't open_append() - ") + path + " is not a sample file";
+    }
+  }
+  domain_ids.reserve(SAMPLES_PER_BLOCK);
+  ts.reserve(SAMPLES_PER_BLOCK);
+  latencies.reserve(SAMPLES_PER_BLOCK);
+  if(version >= 2) {
+    validation_ms.reserve(SAMPLES_PER_BLOCK);
+    flags.reserve(SAMPLES_PER_BLOCK);
+    sizes.reserve(SAMPLES_PER_BLOCK);
+    rcodes.reserve(SAMPLES_PER_BLOCK);
+    num_answers.reserve(SAMPLES_PER_BLOCK);
+    num_authorities.reserve(SAMPLES_PER_BLOCK);
+    num_additionals.reserve(SAMPLES_PER_BLOCK);
+  }
+}
+
+
+// called with log_mutex held
+void DnsSampleLog::write_block() {
+  if(domain_ids.empty()) {
+    return;
+  }
+  sample_block_header h;
+  h.magic = (version >= 2) ? SAMPLE_BLOCK_MAGIC_V2 : SAMPLE_BLOCK_MAGIC_V1;
+  h.count = domain_ids.size();
+  h.min_ts = ts[0];
+  h.max_ts = ts[0];
+  for(size_t i = 1; i < ts.size(); i++) {
+    h.min_ts = (ts[i] < h.min_ts) ? ts[i] : h.min_ts;
+    h.max_ts = (ts[i] > h.max_ts) ? ts[i] : h.max_ts;
+  }
+  struct iovec iov[11];
+  iov[0].iov_base = &h;
+  iov[0].iov_len = sizeof(h);
+  iov[1].iov_base = &domain_ids[0];
+  iov[1].iov_len = h.count * sizeof(int32_t);
+  iov[2].iov_base = &ts[0];
+  iov[2].iov_len = h.count * sizeof(uint32_t);
+  iov[3].iov_base = &latencies[0];
+  iov[3].iov_len = h.count * sizeof(float);
+  int num_iov = 4;
+  if(version >= 2) {
+    // the 4 byte columns first, the next block header stays aligned
+    iov[4].iov_base = &validation_ms[0];
+    iov[4].iov_len = h.count * sizeof(float);
+    std::vector<uint16_t> * columns[] = {&flags, &sizes, &rcodes, &num_answers,
+					 &num_authorities, &num_additionals};
+    for(int c = 0; c < 6; c++) {
+      iov[5 + c].iov_base = &(*columns[c])[0];
+      iov[5 + c].iov_len = h.count * sizeof(uint16_t);
+    }
+    num_iov = 11;
+  }
+  // where the block starts, to cut a partial block off
+  off_t start = lseek(fd, 0, SEEK_END);
+  struct iovec * v = iov;
+  int error = 0;
+  // writev may write part of the block (signal, full disk...)
+  while(num_iov > 0) {
+    ssize_t written = writev(fd, v, num_iov);
+    if(written < 0) {
+      if(errno == EINTR) {
+	continue;
+      }
+      error = errno;
+      break;
+    }
+    if(written == 0) {
+      error = EIO;
+      break;
+    }
+    while(num_iov > 0 && (size_t) written >= v->iov_len) {
+      written -= v->iov_len;
+      v++;
+      num_iov--;
+    }
+    if(num_iov > 0) {
+      v->iov_base = (uint8_t *) v->iov_base + written;
+      v->iov_len -= written;
+    }
+  }
+  domain_ids.clear();
+  ts.clear();
+  latencies.clear();
+  validation_ms.clear();
+  flags.clear();
+  sizes.clear();
+  rcodes.clear();
+  num_answers.clear();
+  num_authorities.clear();
+  num_additionals.clear();
+  if(error != 0) {
+    // the next blocks must not follow a cut one (the readers stop there)
+    if(start >= 0 && ftruncate(fd, start) < 0) {
+      std::cerr << "Can't write_block() - ftruncate: " << strerror(errno) << std::endl;
+    }
+    throw std::string("Can't write_block() - ") + strerror(error);
+  }
+}
+
+
+void DnsSampleLog::append(int domain_id, uint32_t sample_ts, float latency,
+			  const response_metrics * metrics) {
+  if(fd < 0) {
+    return;
+  }
+  uint16_t f = 0;
+  if(metrics != NULL && latency >= 0) {
+    f = SAMPLE_HAS_METRICS;
+    f |= metrics->truncated ? SAMPLE_TRUNCATED : 0;
+    f |= metrics->edns ? SAMPLE_EDNS : 0;
+    f |= metrics->dnssec_ok ? SAMPLE_DNSSEC_OK : 0;
+    f |= (metrics->validated == 1) ? SAMPLE_VALIDATED : 0;
+    f |= (metrics->validated == 0) ? SAMPLE_VALIDATION_FAILED : 0;
+  }
+  else {
+    metrics = NULL;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&log_mutex);
+#endif
+  domain_ids.push_back(domain_id);
+  ts.push_back(sample_ts);
+  latencies.push_back(latency);
+  if(version >= 2) {
+    flags.push_back(f);
+    validation_ms.push_back((metrics != NULL) ? metrics->validation_ms : -1);
+    sizes.push_back((metrics != NULL) ? metrics->size : 0);
+    rcodes.push_back((metrics != NULL) ? metrics->rcode : 0);
+    num_answers.push_back((metrics != NULL) ? metrics->num_answers : 0);
+    num_authorities.push_back((metrics != NULL) ? metrics->num_authorities : 0);
+    num_additionals.push_back((metrics != NULL) ? metrics->num_additionals : 0);
+  }
+  try {
+    if(domain_ids.size() >= SAMPLES_PER_BLOCK) {
+      write_block();
+    }
+  }
+  catch(std::string s) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&log_mutex);
+#endif
+    throw std::string("Can't append() -> ") + s;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+
+void DnsSampleLog::flush() {
+  if(fd < 0) {
+    return;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_lock(&log_mutex);
+#endif
+  try {
+    write_block();
+  }
+  catch(std::string s) {
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&log_mutex);
+#endif
+    throw std::string("Can't flush() -> ") + s;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_unlock(&log_mutex);
+#endif
+}
+
+
+void DnsSampleLog::open_read(const char * path) {
+  close();
+  int rfd = open(path, O_RDONLY);
+  if(rfd < 0) {
+    throw std::string("Can't open_read() - ") + path + ": " + strerror(errno);
+  }
+  struct stat st;
+  if(fstat(rfd, &st) < 0 || st.st_size < SAMPLE_FILE_MAGIC_LEN) {
+    ::close(rfd);
+    throw std::string("Can't open_read() - ") + path + " is not a sample file";
+  }
+  map_size = st.st_size;
+  void * m = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, rfd, 0);
+  ::close(rfd);
+  if(m == MAP_FAILED) {
+    map_size = 0;
+    throw std::string("Can't open_read() - mmap: ") + strerror(errno);
+  }
+  map = (const uint8_t *) m;
+  int file_version;
+  if(memcmp(map, SAMPLE_FILE_MAGIC_V2, SAMPLE_FILE_MAGIC_LEN) == 0) {
+    file_version = 2;
+  }
+  else if(memcmp(map, SAMPLE_FILE_MAGIC_V1, SAMPLE_FILE_MAGIC_LEN) == 0) {
+    file_version = 1;
+  }
+  else {
+    close();
+    throw std::string("Can't open_read() - ") + path + " is not a sample file";
+  }
+  uint32_t block_magic = (file_version >= 2) ? SAMPLE_BLOCK_MAGIC_V2 : SAMPLE_BLOCK_MAGIC_V1;
+  size_t sample_size = (file_version >= 2) ? SAMPLE_SIZE_V2 : SAMPLE_SIZE_V1;
+  size_t offset = SAMPLE_FILE_MAGIC_LEN;
+  while(offset + sizeof(sample_block_header) <= map_size) {
+    sample_block_header h;
+    memcpy(&h, map + offset, sizeof(h));
+    size_t len = sizeof(h) + (size_t) h.count * sample_size;
+    if(h.magic != block_magic || offset + len > map_size) {
+      break; // cut by a crash
+    }
+    sample_block b;
+    memset(&b, 0, sizeof(b));
+    b.count = h.count;
+    b.min_ts = h.min_ts;
+    b.max_ts = h.max_ts;
+    const uint8_t * columns = map + offset + sizeof(h);
+    size_t n = h.count;
+    b.domain_ids = (const int32_t *) columns;
+    b.ts = (const uint32_t *) (columns + n * 4);
+    b.latencies = (const float *) (columns + n * 8);
+    if(file_version >= 2) {
+      b.validation_ms = (const float *) (columns + n * 12);
+      b.flags = (const uint16_t *) (columns + n * 16);
+      b.sizes = (const uint16_t *) (columns + n * 18);
+      b.rcodes = (const uint16_t *) (columns + n * 20);
+      b.num_answers = (const uint16_t *) (columns + n * 22);
+      b.num_authorities = (const uint16_t *) (columns + n * 24);
+      b.num_additionals = (const uint16_t *) (columns + n * 26);
+    }
+    blocks.push_back(b);
+    offset += len;
+  }
+}
+
+
+const std::vector<sample_block> &DnsSampleLog::get_blocks() const {
+  return blocks;
+}
+
+
+void DnsSampleLog::close() {
+  if(fd >= 0) {
+    try {
+      flush();
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+    ::close(fd);
+    fd = -1;
+  }
+  if(map != NULL) {
+    munmap((void *) map, map_size);
+    map = NULL;
+    map_size = 0;
+  }
+  blocks.clear();
+}
+
+
+DnsSampleLog::~DnsSampleLog() {
+  close();
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_destroy(&log_mutex);
+#endif
+}
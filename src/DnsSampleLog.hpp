@@ -0,0 +1,125 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSSAMPLELOG_H
+#define _DNSSAMPLELOG_H
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "DnsResponseParser.hpp"
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+#include <pthread.h>
+#endif
+
+
+// sample_block flags
+#define SAMPLE_HAS_METRICS       0x01 // the response columns are set
+#define SAMPLE_TRUNCATED         0x02 // TC
+#define SAMPLE_EDNS              0x04 // OPT record
+#define SAMPLE_DNSSEC_OK         0x08 // DO
+#define SAMPLE_VALIDATED         0x10 // all signatures verified
+#define SAMPLE_VALIDATION_FAILED 0x20 // a signature did not verify
+
+
+/* sample_block:
+ * up to SAMPLES_PER_BLOCK samples stored by column, the samples
+ * are in the order they were recorded (min_ts/max_ts let a scan
+ * skip the blocks out of its time range)
+ * the response columns (flags onwards) are NULL in the blocks of a
+ * version 1 file or of a csv file, and only meaningful in the samples
+ * flagged SAMPLE_HAS_METRICS (answered probes, see response_metrics) */
+struct sample_block {
+  uint32_t count;
+  uint32_t min_ts;
+  uint32_t max_ts;
+  const int32_t * domain_ids;
+  const uint32_t * ts;        // seconds since the epoch
+  const float * latencies;    // ms, < 0: the query failed
+  const uint16_t * flags;
+  const uint16_t * sizes;     // bytes of the response
+  const uint16_t * rcodes;
+  const uint16_t * num_answers;
+  const uint16_t * num_authorities;
+  const uint16_t * num_additionals;
+  const float * validation_ms; // < 0: not validated
+};
+
+
+/* Dns Sample Log:
+ * this class keeps every latency sample in a local columnar file,
+ * for the offline reports (dns-latency-report):
+ * - the monitor appends the samples (append), they are buffered and
+ *   written one whole block at the time (or on flush), a block that
+ *   cannot be written whole is cut off the file
+ * - a reader maps the file in memory (open_read) and sees it as a
+ *   list of blocks whose columns point into the mapping
+ * file layout: "DNSSMPL2", then the blocks, each one being a header
+ * (magic, count, min_ts, max_ts) followed by the domain_id, ts,
+ * latency and validation_ms columns of count 4 byte values each, then
+ * the flags, size, rcode, answers, authorities and additionals columns
+ * of count 2 byte values each; a block cut by a crash ends the file
+ * the files of version 1 ("DNSSMPL1", blocks of the first three
+ * columns only) are read as well, and appended to in version 1
+ */
+class DnsSampleLog{
+private:
+  int fd;
+  // writer
+  int version;
+  std::vector<int32_t> domain_ids;
+  std::vector<uint32_t> ts;
+  std::vector<float> latencies;
+  std::vector<float> validation_ms;
+  std::vector<uint16_t> flags;
+  std::vector<uint16_t> sizes;
+  std::vector<uint16_t> rcodes;
+  std::vector<uint16_t> num_answers;
+  std::vector<uint16_t> num_authorities;
+  std::vector<uint16_t> num_additionals;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t log_mutex;
+#endif
+  void write_block();
+  // reader
+  const uint8_t * map;
+  size_t map_size;
+  std::vector<sample_block> blocks;
+public:
+  static const uint32_t SAMPLES_PER_BLOCK = 65536;
+  DnsSampleLog();
+  void open_append(const char * path);
+  // metrics: the response of an answered probe, NULL if unknown
+  void append(int domain_id, uint32_t ts, float latency,
+	      const response_metrics * metrics = NULL);
+  void flush();
+  void open_read(const char * path);
+  const std::vector<sample_block> &get_blocks() const;
+  void close();
+  ~DnsSampleLog();
+};
+
+#endif /* _DNSSAMPLELOG_H */
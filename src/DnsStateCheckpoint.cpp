@@ -0,0 +1,228 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsStateCheckpoint.hpp"
+#include <sstream>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static const char CHECKPOINT_MAGIC[8] = {'D','N','S','L','M','C','K','P'};
+static const uint32_t CHECKPOINT_VERSION = 3;
+
+
+// this function is not visible outside this code unit
+// FNV-1a on 64 bit words (then on the trailing bytes), checking
+// a 1M-domain checkpoint must not dominate the restart time
+static uint64_t fnv1a(const unsigned char * data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  uint64_t w;
+  size_t i = 0;
+  for(; i + sizeof(w) <= len; i += sizeof(w)) {
+    memcpy(&w, data + i, sizeof(w));
+    h ^= w;
+    h *= 1099511628211ULL;
+  }
+  for(; i < len; i++) {
+    h ^= data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+DnsStateCheckpoint::DnsStateCheckpoint() {
+  mapping = NULL;
+  mapping_size = 0;
+  header = NULL;
+  records = NULL;
+}
+
+
+double DnsStateCheckpoint::wall_clock() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (double) tv.tv_sec + (double) tv.tv_usec / 1000000.0;
+}
+
+
+void DnsStateCheckpoint::save(const std::string &path,
+			      const std::vector<checkpoint_record> &records,
+			      const std::vector<std::string> &nsset_keys,
+			      double period) {
+  std::string tmp_path = path + ".tmp";
+  size_t records_size = records.size() * sizeof(checkpoint_record);
+  size_t nssets_size = 0;
+  for(size_t i = 0; i < nsset_keys.size(); i++) {
+    nssets_size += nsset_keys[i].size() + 1;
+  }
+  size_t size = sizeof(checkpoint_header) + records_size + nssets_size;
+  int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    throw std::string("Can't save checkpoint - ") + tmp_path + ": " + strerror(errno);
+  }
+  if(ftruncate(fd, size) != 0) {
+    std::string err = strerror(errno);
+    ::close(fd);
+    throw std::string("Can't save checkpoint - ftruncate: ") + err;
+  }
+  void * m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if(m == MAP_FAILED) {
+    throw std::string("Can't save checkpoint - mmap: ") + strerror(errno);
+  }
+  checkpoint_header * h = (checkpoint_header *) m;
+  unsigned char * data = (unsigned char *) m + sizeof(checkpoint_header);
+  if(records_size > 0) {
+    memcpy(data, &records[0], records_size);
+  }
+  unsigned char * keys = data + records_size;
+  for(size_t i = 0; i < nsset_keys.size(); i++) {
+    memcpy(keys, nsset_keys[i].c_str(), nsset_keys[i].size() + 1);
+    keys += nsset_keys[i].size() + 1;
+  }
+  memset(h, 0, sizeof(checkpoint_header));
+  memcpy(h->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  h->version = CHECKPOINT_VERSION;
+  h->record_size = sizeof(checkpoint_record);
+  h->num_records = records.size();
+  h->period = period;
+  h->saved_at = wall_clock();
+  h->num_nssets = nsset_keys.size();
+  h->nssets_size = nssets_size;
+  h->checksum = fnv1a(data, records_size + nssets_size);
+  int rc = msync(m, size, MS_SYNC);
+  munmap(m, size);
+  if(rc != 0) {
+    throw std::string("Can't save checkpoint - msync: ") + strerror(errno);
+  }
+  // the previous checkpoint is replaced only by a complete one
+  if(rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw std::string("Can't save checkpoint - rename: ") + strerror(errno);
+  }
+}
+
+
+bool DnsStateCheckpoint::open(const std::string &path) {
+  close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(checkpoint_header)) {
+    ::close(fd);
+    std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+    return false;
+  }
+  mapping_size = st.st_size;
+  mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if(mapping == MAP_FAILED) {
+    mapping = NULL;
+    return false;
+  }
+  header = (const checkpoint_header *) mapping;
+  records = (const checkpoint_record *) ((const unsigned char *) mapping + sizeof(checkpoint_header));
+  size_t data_size = mapping_size - sizeof(checkpoint_header);
+  std::string problem;
+  if(memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0) {
+    problem = "not a checkpoint";
+  }
+  else if(header->version != CHECKPOINT_VERSION ||
+	  header->record_size != sizeof(checkpoint_record)) {
+    problem = "unsupported version";
+  }
+  else if(header->num_records * sizeof(checkpoint_record) + header->nssets_size != data_size) {
+    problem = "wrong length";
+  }
+  else if(fnv1a((const unsigned char *) records, data_size) != header->checksum) {
+    problem = "wrong checksum";
+  }
+  else if(header->nssets_size > 0 &&
+	  ((const char *) mapping)[mapping_size - 1] != '\0') {
+    problem = "unterminated NS-set keys";
+  }
+  if(!problem.empty()) {
+    std::cerr << "Checkpoint " << path << " ignored: " << problem << std::endl;
+    close();
+    return false;
+  }
+  return true;
+}
+
+
+size_t DnsStateCheckpoint::size() const {
+  return (header != NULL) ? header->num_records : 0;
+}
+
+
+double DnsStateCheckpoint::period() const {
+  return (header != NULL) ? header->period : 0;
+}
+
+
+double DnsStateCheckpoint::saved_at() const {
+  return (header != NULL) ? header->saved_at : 0;
+}
+
+
+const checkpoint_record & DnsStateCheckpoint::record(size_t i) const {
+  return records[i];
+}
+
+
+void DnsStateCheckpoint::get_nsset_keys(std::vector<std::string> &keys) const {
+  keys.clear();
+  if(header == NULL) {
+    return;
+  }
+  keys.reserve(header->num_nssets);
+  const char * p = (const char *) (records + header->num_records);
+  const char * end = p + header->nssets_size;
+  while(p < end && keys.size() < header->num_nssets) {
+    keys.push_back(std::string(p));
+    p += keys.back().size() + 1;
+  }
+}
+
+
+void DnsStateCheckpoint::close() {
+  if(mapping != NULL) {
+    munmap(mapping, mapping_size);
+  }
+  mapping = NULL;
+  mapping_size = 0;
+  header = NULL;
+  records = NULL;
+}
+
+
+DnsStateCheckpoint::~DnsStateCheckpoint() {
+  close();
+}
@@ -0,0 +1,110 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSSTATECHECKPOINT_H
+#define _DNSSTATECHECKPOINT_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include "DnsDbHandler.hpp"
+#include "DnsAnomalyDetector.hpp"
+#include "dns_latency_monitor-config.h"
+
+
+/* checkpoint_record:
+ * the in-process state of one domain, fixed size so that
+ * the file is an array that can be used in place once mapped
+ * the stats are the cached domain_stats row with the time of its
+ * last sample: domain_stats keeps being written after the checkpoint,
+ * at restart a row of the table wins if it is newer */
+struct checkpoint_record {
+  int32_t domain_id;
+  uint32_t flags;         // CHECKPOINT_HAS_* below
+  double next_deadline;   // unix time (s) of the next probe
+  anomaly_state anomaly;
+  dns_stats stats;
+  int64_t stats_last_ts;  // unix time of the last sample in stats
+  int32_t nsset_id;       // index in the NS-set keys, or NSSET_NONE
+  int32_t unused;
+  int64_t nsset_fetched;  // unix time of the NS lookup
+};
+
+static const uint32_t CHECKPOINT_HAS_DEADLINE = 0x1;
+static const uint32_t CHECKPOINT_HAS_STATS    = 0x2;
+static const uint32_t CHECKPOINT_HAS_ANOMALY  = 0x4;
+static const uint32_t CHECKPOINT_HAS_NSSET    = 0x8;
+
+/* checkpoint_header:
+ * the version has to be increased every time
+ * checkpoint_record changes */
+struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t num_records;
+  double period;          // probing period when the file was written
+  double saved_at;        // unix time
+  uint64_t checksum;      // FNV-1a of the records and NS-set keys
+  uint64_t num_nssets;
+  uint64_t nssets_size;   // bytes of the NS-set keys
+};
+
+
+/* Dns State Checkpoint:
+ * this class reads and writes the versioned checkpoint file
+ * (a header followed by an array of checkpoint_record, then the
+ * keys of the NS-sets of DnsNsSetCache in nsset_id order, each one
+ * ended by a NUL).
+ * save() writes a temporary file through a shared mapping and
+ * renames it, so a crash never leaves a partial checkpoint behind;
+ * open() maps a file read-only and validates it (magic, version,
+ * record size, length and checksum), the records are then read
+ * in place from the mapping
+ */
+class DnsStateCheckpoint{
+private:
+  void * mapping;
+  size_t mapping_size;
+  const checkpoint_header * header;
+  const checkpoint_record * records;
+public:
+  DnsStateCheckpoint();
+  static double wall_clock();
+  static void save(const std::string &path,
+		   const std::vector<checkpoint_record> &records,
+		   const std::vector<std::string> &nsset_keys,
+		   double period);
+  // returns false if the file is missing or not valid
+  bool open(const std::string &path);
+  size_t size() const;
+  double period() const;
+  double saved_at() const;
+  const checkpoint_record & record(size_t i) const;
+  void get_nsset_keys(std::vector<std::string> &keys) const;
+  void close();
+  ~DnsStateCheckpoint();
+};
+
+#endif /* _DNSSTATECHECKPOINT_H */
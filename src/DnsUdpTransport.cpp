@@ -0,0 +1,694 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DnsUdpTransport.hpp"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && HAVE_SYS_EPOLL_H == 1
+#include <sys/epoll.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#endif
+
+#define IO_URING_ENTRIES 8
+#define SEND_TAG 1
+#define RECV_TAG 2
+
+
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void exchange_clock::start() {
+  tx_real = clock_ns(CLOCK_REALTIME);
+  tx_mono = clock_ns(CLOCK_MONOTONIC);
+}
+
+
+double exchange_clock::latency_ms(uint64_t rx_kernel) const {
+  uint64_t user = clock_ns(CLOCK_MONOTONIC) - tx_mono;
+  if(rx_kernel >= tx_real && rx_kernel - tx_real <= user) {
+    return (double) (rx_kernel - tx_real) / 1000000.0;
+  }
+  return (double) user / 1000000.0;
+}
+
+
+// SCM_TIMESTAMPNS in the control data of a received message, 0 if none
+static uint64_t rx_timestamp(struct msghdr * msg) {
+  for(struct cmsghdr * c = CMSG_FIRSTHDR(msg); c != NULL; c = CMSG_NXTHDR(msg, c)) {
+    if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+  }
+  return 0;
+}
+
+
+static bool matches_id(const uint8_t * packet, size_t len, uint16_t id) {
+  return len >= 2 && ((packet[0] << 8) | packet[1]) == id;
+}
+
+
+DnsUdpTransport::DnsUdpTransport() {
+  backend = IO_BACKEND_LDNS;
+  sock = -1;
+  epoll_fd = -1;
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+  ring_fd = -1;
+  sq_ring = MAP_FAILED;
+  sq_ring_size = 0;
+  cq_ring = MAP_FAILED;
+  sqes = (struct io_uring_sqe *) MAP_FAILED;
+  sqes_size = 0;
+  buf_ring = (struct io_uring_buf_ring *) MAP_FAILED;
+  buf_ring_size = 0;
+  recv_buffers = NULL;
+  recv_armed = false;
+#endif
+}
+
+
+io_backend DnsUdpTransport::open(io_backend requested,
+				 const struct sockaddr_storage * server,
+				 socklen_t server_len) {
+  close();
+  if(requested == IO_BACKEND_LDNS) {
+    return backend;
+  }
+  sock = socket(server->ss_family, SOCK_DGRAM, 0);
+  if(sock < 0) {
+    throw std::string("Can't open() DnsUdpTransport -> ") + strerror(errno);
+  }
+  int on = 1;
+  if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0 ||
+     setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 ||
+     connect(sock, (const struct sockaddr *) server, server_len) < 0) {
+    std::string err = strerror(errno);
+    close();
+    throw std::string("Can't open() DnsUdpTransport -> ") + err;
+  }
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+  if(requested == IO_BACKEND_IO_URING || requested == IO_BACKEND_AUTO) {
+    if(setup_io_uring()) {
+      backend = IO_BACKEND_IO_URING;
+      return backend;
+    }
+    teardown_io_uring();
+    if(requested == IO_BACKEND_IO_URING) {
+      std::cerr << "io_uring not supported by the kernel, using epoll" << std::endl;
+    }
+  }
+#else
+  if(requested == IO_BACKEND_IO_URING) {
+    std::cerr << "io_uring support not compiled in, using epoll" << std::endl;
+  }
+#endif
+  if(!setup_epoll()) {
+    close();
+    throw std::string("Can't open() DnsUdpTransport -> no epoll support");
+  }
+  backend = IO_BACKEND_EPOLL;
+  return backend;
+}
+
+
+io_backend DnsUdpTransport::get_backend() const {
+  return backend;
+}
+
+
+int DnsUdpTransport::exchange(const uint8_t * query, size_t query_len, uint16_t id,
+			      uint8_t * response, size_t response_size,
+			      int timeout_ms, double * latency_ms) {
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+  if(backend == IO_BACKEND_IO_URING) {
+    int ret = exchange_io_uring(query, query_len, id, response, response_size,
+				timeout_ms, latency_ms);
+    if(backend == IO_BACKEND_IO_URING) {
+      return ret;
+    }
+    // the ring failed (e.g. multishot receive not supported):
+    // exchange_io_uring has switched to epoll, retry with it
+  }
+#endif
+  if(backend == IO_BACKEND_EPOLL) {
+    return exchange_epoll(query, query_len, id, response, response_size,
+			  timeout_ms, latency_ms);
+  }
+  return -1;
+}
+
+
+bool DnsUdpTransport::setup_epoll() {
+#if defined(HAVE_SYS_EPOLL_H) && HAVE_SYS_EPOLL_H == 1
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if(epoll_fd < 0) {
+    return false;
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = sock;
+  if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+    ::close(epoll_fd);
+    epoll_fd = -1;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+int DnsUdpTransport::exchange_epoll(const uint8_t * query, size_t query_len, uint16_t id,
+				    uint8_t * response, size_t response_size,
+				    int timeout_ms, double * latency_ms) {
+#if defined(HAVE_SYS_EPOLL_H) && HAVE_SYS_EPOLL_H == 1
+  if(!send_query(query, query_len)) {
+    return -1;
+  }
+  uint64_t deadline = tx_clock.tx_mono + (uint64_t) timeout_ms * 1000000ULL;
+  while(true) {
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    if(now >= deadline) {
+      return -1;
+    }
+    struct epoll_event ev;
+    int n = epoll_wait(epoll_fd, &ev, 1, (int) ((deadline - now + 999999) / 1000000));
+    if(n < 0 && errno != EINTR) {
+      return -1;
+    }
+    if(n <= 0) {
+      continue;
+    }
+    int len = receive_response(id, response, response_size, latency_ms);
+    if(len != 0) {
+      return len;
+    }
+  }
+#else
+  return -1;
+#endif
+}
+
+
+bool DnsUdpTransport::send_query(const uint8_t * query, size_t query_len) {
+  if(backend != IO_BACKEND_EPOLL) {
+    return false;
+  }
+  tx_clock.start();
+  return send(sock, query, query_len, 0) >= 0;
+}
+
+
+int DnsUdpTransport::receive_response(uint16_t id, uint8_t * response, size_t response_size,
+				      double * latency_ms) {
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  // read everything queued, responses to older queries are dropped
+  while(true) {
+    struct iovec iov;
+    iov.iov_base = response;
+    iov.iov_len = response_size;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t len = recvmsg(sock, &msg, 0);
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+	return 0;
+      }
+      return -1; // e.g. ECONNREFUSED
+    }
+    if(len > 0 && matches_id(response, len, id)) {
+      *latency_ms = tx_clock.latency_ms(rx_timestamp(&msg));
+      return (int) len;
+    }
+  }
+}
+
+
+#define MAX_BATCH 64
+
+int DnsUdpTransport::send_queries(const struct iovec * queries, unsigned int n) {
+  if(backend != IO_BACKEND_EPOLL) {
+    return -1;
+  }
+  struct mmsghdr msgs[MAX_BATCH];
+  n = (n > MAX_BATCH) ? MAX_BATCH : n;
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  for(unsigned int i = 0; i < n; i++) {
+    msgs[i].msg_hdr.msg_iov = (struct iovec *) &queries[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int sent = sendmmsg(sock, msgs, n, 0);
+  if(sent < 0) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  }
+  return sent;
+}
+
+
+int DnsUdpTransport::receive_responses(uint8_t * buffers, size_t buffer_size, unsigned int n,
+				       size_t * lens, uint64_t * rx_real_ns) {
+  if(backend != IO_BACKEND_EPOLL) {
+    return -1;
+  }
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  char control[MAX_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  n = (n > MAX_BATCH) ? MAX_BATCH : n;
+  memset(msgs, 0, n * sizeof(struct mmsghdr));
+  for(unsigned int i = 0; i < n; i++) {
+    iovs[i].iov_base = buffers + i * buffer_size;
+    iovs[i].iov_len = buffer_size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+  int received = recvmmsg(sock, msgs, n, MSG_DONTWAIT, NULL);
+  if(received < 0) {
+    // e.g. ECONNREFUSED: nothing listens on the server port
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+  }
+  for(int i = 0; i < received; i++) {
+    lens[i] = msgs[i].msg_len;
+    rx_real_ns[i] = rx_timestamp(&msgs[i].msg_hdr);
+  }
+  return received;
+}
+
+
+int DnsUdpTransport::get_socket() const {
+  return sock;
+}
+
+
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+
+/* The ring is set up with the raw system calls (no liburing):
+ * - the socket is the fixed file 0
+ * - NUM_RECV_BUFFERS buffers are provided to the kernel in buffer
+ *   group 0 (a mapped buffer ring), the multishot recvmsg picks one
+ *   for every datagram and we hand it back once it is parsed
+ * - sends are flagged IOSQE_CQE_SKIP_SUCCESS, only the receives
+ *   (and failed sends) produce completions */
+bool DnsUdpTransport::setup_io_uring() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &p);
+  if(ring_fd < 0) {
+    return false;
+  }
+  // a single mmap for both rings, timeouts passed to io_uring_enter
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    return false;
+  }
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if(cq_ring_size > sq_ring_size) {
+    sq_ring_size = cq_ring_size;
+  }
+  sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if(sq_ring == MAP_FAILED) {
+    return false;
+  }
+  cq_ring = sq_ring; // single mmap
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED) {
+    return false;
+  }
+  uint8_t * sq = (uint8_t *) sq_ring;
+  sq_head = (unsigned *) (sq + p.sq_off.head);
+  sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+  sq_array = (unsigned *) (sq + p.sq_off.array);
+  sq_entries = p.sq_entries;
+  sq_pending = 0;
+  uint8_t * cq = (uint8_t *) cq_ring;
+  cq_head = (unsigned *) (cq + p.cq_off.head);
+  cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  int fds[1] = { sock };
+  if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES, fds, 1) < 0) {
+    return false;
+  }
+
+  buf_ring_size = NUM_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  buf_ring = (struct io_uring_buf_ring *) mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+					       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(buf_ring == MAP_FAILED) {
+    return false;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) buf_ring;
+  reg.ring_entries = NUM_RECV_BUFFERS;
+  reg.bgid = 0;
+  if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    return false;
+  }
+  recv_buffers = new uint8_t[NUM_RECV_BUFFERS * RECV_BUFFER_SIZE];
+  for(unsigned int i = 0; i < NUM_RECV_BUFFERS; i++) {
+    recycle_buffer(i);
+  }
+  // only the lengths are used by a multishot recvmsg
+  memset(&recv_msg, 0, sizeof(recv_msg));
+  recv_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+
+  /* arm the receive now: kernels without multishot recvmsg reject
+   * it immediately, and we can still fall back to epoll */
+  arm_recv();
+  if(enter(0, 0) < 0) {
+    return false;
+  }
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  if(head != tail) {
+    // nothing has been sent yet: any completion is an error
+    __atomic_store_n(cq_head, tail, __ATOMIC_RELEASE);
+    recv_armed = false;
+    return false;
+  }
+  return true;
+}
+
+
+// wait for the end of the armed receive, the kernel may write in the buffers until then
+void DnsUdpTransport::cancel_recv() {
+  struct io_uring_sqe * sqe = get_sqe();
+  if(sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = RECV_TAG;
+  sqe->user_data = 0;
+  for(int attempt = 0; recv_armed && attempt < 10; attempt++) {
+    if(enter(1, 100) < 0) {
+      break;
+    }
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+      struct io_uring_cqe * cqe = &cqes[head & *cq_mask];
+      if(cqe->user_data == RECV_TAG && !(cqe->flags & IORING_CQE_F_MORE)) {
+	recv_armed = false;
+      }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+
+
+void DnsUdpTransport::teardown_io_uring() {
+  if(recv_armed && sq_ring != MAP_FAILED && sqes != MAP_FAILED) {
+    cancel_recv();
+  }
+  if(ring_fd >= 0) {
+    ::close(ring_fd);
+    ring_fd = -1;
+  }
+  if(recv_buffers != NULL) {
+    delete [] recv_buffers;
+    recv_buffers = NULL;
+  }
+  if(buf_ring != MAP_FAILED) {
+    munmap(buf_ring, buf_ring_size);
+    buf_ring = (struct io_uring_buf_ring *) MAP_FAILED;
+  }
+  if(sqes != MAP_FAILED) {
+    munmap(sqes, sqes_size);
+    sqes = (struct io_uring_sqe *) MAP_FAILED;
+  }
+  if(sq_ring != MAP_FAILED) {
+    munmap(sq_ring, sq_ring_size);
+    sq_ring = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+  }
+  recv_armed = false;
+}
+
+
+struct io_uring_sqe * DnsUdpTransport::get_sqe() {
+  unsigned tail = *sq_tail + sq_pending;
+  if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    return NULL;
+  }
+  struct io_uring_sqe * sqe = &sqes[tail & *sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[tail & *sq_mask] = tail & *sq_mask;
+  sq_pending++;
+  return sqe;
+}
+
+
+// submit the pending sqes and wait for min_complete completions
+int DnsUdpTransport::enter(unsigned int min_complete, int timeout_ms) {
+  unsigned int to_submit = sq_pending;
+  __atomic_store_n(sq_tail, *sq_tail + sq_pending, __ATOMIC_RELEASE);
+  sq_pending = 0;
+  unsigned int flags = 0;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if(min_complete > 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+    flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  }
+  int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+		    (min_complete > 0) ? &arg : NULL, sizeof(arg));
+  if(ret < 0 && (errno == ETIME || errno == EINTR)) {
+    return 0;
+  }
+  return ret;
+}
+
+
+void DnsUdpTransport::arm_recv() {
+  struct io_uring_sqe * sqe = get_sqe();
+  if(sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = 0; // fixed file index
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->addr = (uint64_t) (uintptr_t) &recv_msg;
+  sqe->len = 1;
+  sqe->buf_group = 0;
+  sqe->user_data = RECV_TAG;
+  recv_armed = true;
+}
+
+
+void DnsUdpTransport::recycle_buffer(unsigned int bid) {
+  /* we are the only producer of the buffer ring. In C++ the bufs
+   * flexible array of io_uring_buf_ring is not at offset 0 (empty
+   * struct of size 1 in __DECLARE_FLEX_ARRAY), index the ring as a
+   * plain array instead */
+  unsigned short tail = buf_ring->tail;
+  struct io_uring_buf * bufs = (struct io_uring_buf *) buf_ring;
+  struct io_uring_buf * buf = &bufs[tail & (NUM_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t) (uintptr_t) (recv_buffers + bid * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n(&buf_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+
+int DnsUdpTransport::exchange_io_uring(const uint8_t * query, size_t query_len, uint16_t id,
+				       uint8_t * response, size_t response_size,
+				       int timeout_ms, double * latency_ms) {
+  if(query_len > sizeof(send_buffer)) {
+    return -1;
+  }
+  // the kernel may read the query after io_uring_enter returns
+  memcpy(send_buffer, query, query_len);
+  if(!recv_armed) {
+    arm_recv();
+  }
+  struct io_uring_sqe * sqe = get_sqe();
+  if(sqe == NULL) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_CQE_SKIP_SUCCESS;
+  sqe->addr = (uint64_t) (uintptr_t) send_buffer;
+  sqe->len = query_len;
+  sqe->user_data = SEND_TAG;
+
+  exchange_clock &clk = tx_clock;
+  clk.start();
+  uint64_t deadline = clk.tx_mono + (uint64_t) timeout_ms * 1000000ULL;
+  int result = -1;
+  bool done = false;
+  bool unsupported = false;
+  while(!done) {
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    if(now >= deadline) {
+      break;
+    }
+    if(!recv_armed) {
+      arm_recv();
+    }
+    if(enter(1, (int) ((deadline - now + 999999) / 1000000)) < 0) {
+      break;
+    }
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != tail; head++) {
+      struct io_uring_cqe * cqe = &cqes[head & *cq_mask];
+      if(cqe->user_data == SEND_TAG) {
+	// only failed sends complete
+	done = true;
+	continue;
+      }
+      if(!(cqe->flags & IORING_CQE_F_MORE)) {
+	recv_armed = false;
+      }
+      if(cqe->res < 0) {
+	if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+	  unsupported = true;
+	  done = true;
+	}
+	else if(cqe->res != -ENOBUFS) {
+	  done = true; // e.g. ECONNREFUSED
+	}
+	continue;
+      }
+      if(!(cqe->flags & IORING_CQE_F_BUFFER)) {
+	continue;
+      }
+      unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      uint8_t * buf = recv_buffers + bid * RECV_BUFFER_SIZE;
+      struct io_uring_recvmsg_out * out = (struct io_uring_recvmsg_out *) buf;
+      size_t header = sizeof(*out) + recv_msg.msg_namelen + recv_msg.msg_controllen;
+      if(!done && (size_t) cqe->res >= header) {
+	uint8_t * payload = buf + header;
+	size_t len = (size_t) cqe->res - header;
+	if(matches_id(payload, len, id)) {
+	  struct msghdr msg;
+	  memset(&msg, 0, sizeof(msg));
+	  msg.msg_control = buf + sizeof(*out) + recv_msg.msg_namelen;
+	  msg.msg_controllen = out->controllen;
+	  *latency_ms = clk.latency_ms(rx_timestamp(&msg));
+	  if(len > response_size) {
+	    len = response_size;
+	  }
+	  memcpy(response, payload, len);
+	  result = (int) len;
+	  done = true;
+	}
+      }
+      recycle_buffer(bid);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  if(unsupported) {
+    teardown_io_uring();
+    if(setup_epoll()) {
+      std::cerr << "io_uring receive not supported by the kernel, using epoll" << std::endl;
+      backend = IO_BACKEND_EPOLL;
+    }
+    else {
+      backend = IO_BACKEND_LDNS;
+    }
+  }
+  return result;
+}
+
+#endif
+
+
+const char * DnsUdpTransport::backend_name(io_backend b) {
+  switch(b) {
+  case IO_BACKEND_LDNS:
+    return "ldns";
+  case IO_BACKEND_EPOLL:
+    return "epoll";
+  case IO_BACKEND_IO_URING:
+    return "io_uring";
+  default:
+    return "auto";
+  }
+}
+
+
+bool DnsUdpTransport::parse_backend(const char * name, io_backend &b) {
+  for(int i = IO_BACKEND_LDNS; i <= IO_BACKEND_AUTO; i++) {
+    if(strcmp(name, backend_name((io_backend) i)) == 0) {
+      b = (io_backend) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void DnsUdpTransport::close() {
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+  teardown_io_uring();
+#endif
+  if(epoll_fd >= 0) {
+    ::close(epoll_fd);
+    epoll_fd = -1;
+  }
+  if(sock >= 0) {
+    ::close(sock);
+    sock = -1;
+  }
+  backend = IO_BACKEND_LDNS;
+}
+
+
+DnsUdpTransport::~DnsUdpTransport() {
+  close();
+}
@@ -0,0 +1,162 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef _DNSUDPTRANSPORT_H
+#define _DNSUDPTRANSPORT_H
+
+#include <iostream>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "dns_latency_monitor-config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+#include <linux/io_uring.h>
+#endif
+
+/* how queries are sent and responses received */
+enum io_backend {
+  IO_BACKEND_LDNS = 0, // ldns_resolver_query (blocking, no transport)
+  IO_BACKEND_EPOLL,    // non-blocking socket: send + epoll_wait + recvmsg
+  IO_BACKEND_IO_URING, // send + multishot recvmsg, one io_uring_enter
+  IO_BACKEND_AUTO      // io_uring if available, otherwise epoll
+};
+
+
+/* exchange_clock:
+ * send timestamps of a query: the kernel receive timestamp is
+ * CLOCK_REALTIME, it is only trusted if it is consistent with the
+ * monotonic time measured in user space (no clock step in between) */
+struct exchange_clock {
+  uint64_t tx_real;
+  uint64_t tx_mono;
+  void start();
+  double latency_ms(uint64_t rx_kernel) const;
+};
+
+
+/* Dns Udp Transport:
+ * this class owns a UDP socket connected to one server and
+ * exchanges wire-format queries and responses on it.
+ * The io_uring backend keeps a multishot recvmsg armed on the socket
+ * (registered as a fixed file) with a ring of provided buffers, so
+ * a query costs a single io_uring_enter that submits the send and
+ * waits for the response. If the kernel does not support it, the
+ * transport falls back to epoll (at open or at the first exchange).
+ * Both backends use the kernel receive timestamp (SO_TIMESTAMPNS)
+ * so the wake up of the process is not part of the latency.
+ * send_query/receive_response are the two non-blocking halves of
+ * an exchange (epoll backend only): they let the caller wait on
+ * the sockets of several transports at once.
+ * send_queries/receive_responses move batches of datagrams with one
+ * system call (sendmmsg/recvmmsg, epoll backend only), for the
+ * load generator: matching the responses is up to the caller.
+ * A transport is not thread safe: the DnsResolver uses it while
+ * holding its measuring_mutex
+ */
+class DnsUdpTransport{
+public:
+  static const unsigned int RECV_BUFFER_SIZE = 4096;
+  static const unsigned int NUM_RECV_BUFFERS = 16;
+private:
+  io_backend backend;
+  int sock;
+  int epoll_fd;
+  exchange_clock tx_clock; // of the last query sent
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_LINUX_IO_URING_H == 1
+  // io_uring state (see setup_io_uring)
+  int ring_fd;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  struct io_uring_sqe * sqes;
+  size_t sqes_size;
+  unsigned int sq_entries;
+  unsigned int sq_pending; // sqes filled but not yet visible to the kernel
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_cqe * cqes;
+  struct io_uring_buf_ring * buf_ring;
+  size_t buf_ring_size;
+  uint8_t * recv_buffers;
+  struct msghdr recv_msg;
+  bool recv_armed;
+  uint8_t send_buffer[RECV_BUFFER_SIZE];
+  bool setup_io_uring();
+  void teardown_io_uring();
+  struct io_uring_sqe * get_sqe();
+  int enter(unsigned int min_complete, int timeout_ms);
+  void arm_recv();
+  void cancel_recv();
+  void recycle_buffer(unsigned int bid);
+  int exchange_io_uring(const uint8_t * query, size_t query_len, uint16_t id,
+			uint8_t * response, size_t response_size,
+			int timeout_ms, double * latency_ms);
+#endif
+  bool setup_epoll();
+  int exchange_epoll(const uint8_t * query, size_t query_len, uint16_t id,
+		     uint8_t * response, size_t response_size,
+		     int timeout_ms, double * latency_ms);
+public:
+  DnsUdpTransport();
+  // returns the backend actually in use (it may fall back)
+  io_backend open(io_backend requested, const struct sockaddr_storage * server,
+		  socklen_t server_len);
+  io_backend get_backend() const;
+  /* send query (whose DNS id is id) and wait up to timeout_ms for
+   * the response with the same id, responses to other ids (e.g.
+   * late ones) are discarded. Returns the length of the response
+   * copied in response or -1, latency_ms is the time between the
+   * send and the kernel receive timestamp */
+  int exchange(const uint8_t * query, size_t query_len, uint16_t id,
+	       uint8_t * response, size_t response_size,
+	       int timeout_ms, double * latency_ms);
+  // send query now, false on error
+  bool send_query(const uint8_t * query, size_t query_len);
+  /* the response with id to the last query sent, if it has been
+   * received: returns its length, 0 if not received yet, -1 on error */
+  int receive_response(uint16_t id, uint8_t * response, size_t response_size,
+		       double * latency_ms);
+  /* send the n queries in one call: returns how many were sent,
+   * fewer than n if the socket buffer is full, -1 on error */
+  int send_queries(const struct iovec * queries, unsigned int n);
+  /* up to n datagrams already received, without waiting: the i-th
+   * is copied at buffers + i * buffer_size, lens[i] is its length
+   * and rx_real_ns[i] its kernel receive timestamp (CLOCK_REALTIME,
+   * 0 if missing). Returns how many, 0 if none, -1 on error */
+  int receive_responses(uint8_t * buffers, size_t buffer_size, unsigned int n,
+			size_t * lens, uint64_t * rx_real_ns);
+  int get_socket() const;
+  static const char * backend_name(io_backend b);
+  static bool parse_backend(const char * name, io_backend &b);
+  void close();
+  ~DnsUdpTransport();
+};
+
+#endif /* _DNSUDPTRANSPORT_H */
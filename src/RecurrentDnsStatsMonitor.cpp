@@ -25,10 +25,54 @@
 #include <ctime>
 #include <exception>
 #include <vector>
+#include <signal.h>
+#include <math.h>
+#include <unistd.h>
 
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
 #include <pthread.h>
 #endif
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+// set by request_reload() (signal handler), consumed by the run loop
+static volatile sig_atomic_t reload_requested = 0;
+
+// NS lookups for the NS-set cache (limits, dedup): threads, or per probe
+static const unsigned int NSSET_PREFETCH_THREADS = 4;
+static const unsigned int NSSET_LOOKUPS_PER_PROBE = 2;
+// seconds between two writes of the nsset_stats, resolver_stats and response_stats samples
+static const unsigned int BATCH_FLUSH_INTERVAL = 10;
+/* seconds between the timestamp of a sample and the write of its
+ * domain_stats row, at most (rows older than a checkpoint are in it,
+ * the domains missing in both are read at their first sample) */
+static const int64_t CHECKPOINT_STATS_SLACK = 60;
+
+
+probe_shard::probe_shard(unsigned int index, int cpu, DnsDbHandler * ddh, bool own_ddh)
+  : index(index), cpu(cpu), dr(), ddh(ddh), own_ddh(own_ddh), scheduler(), dad() {
+  destination_keys.assign(1, DnsRateLimiter::hash_key(dr.destination()));
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_init(&batch_mutex, NULL);
+#endif
+}
+
+
+probe_shard::~probe_shard() {
+  if(own_ddh) {
+    delete ddh;
+  }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_destroy(&batch_mutex);
+#endif
+}
+
+
+// NULL for the parameters not provided
+static const char * optional_str(const std::string &s) {
+  return s.empty() ? NULL : s.c_str();
+}
 
 
 RecurrentDnsStatsMonitor::RecurrentDnsStatsMonitor(const char * db_name,
@@ -36,18 +80,695 @@ RecurrentDnsStatsMonitor::RecurrentDnsStatsMonitor(const char * db_name,
 						   const char * user,
 						   const char * password,
 						   const char * socket,
-						   unsigned int port) 
-  try : ddh(db_name, server, user, password, socket, port), dr() {
-  // get top 10 domains from database
-  top_domains = ddh.get_top_n_domains(10);
+						   unsigned int port,
+						   unsigned int num_domains) 
+  try : ddh(db_name, server, user, password, socket, port), dan(ddh), limiter(), nsc() {
+  // get top domains from database
+  reload_ddh = NULL;
+  max_num_domains = num_domains;
+  top_domains = ddh.get_top_n_domains(max_num_domains);
   dns_test_frequency = 60; // default 
   max_num_cycles = 0; // default    
-  // database handler and dns resolve are constructed in the initialization list
+  checkpoint_interval = 60; // default
+  last_checkpoint = 0;
+  stage_stats_interval = 60; // default
+  last_stage_stats = DnsProbeScheduler::now();
+  // the shards open their own connections with the same parameters
+  this->db_name = db_name;
+  db_server = (server != NULL) ? server : "";
+  db_user = (user != NULL) ? user : "";
+  db_password = (password != NULL) ? password : "";
+  db_socket = (socket != NULL) ? socket : "";
+  db_port = port;
+  num_shards = 1; // default
+  pin_shards = false;
+  anomaly_alpha = 0.05; // defaults of DnsAnomalyDetector
+  anomaly_slack = 0.5;
+  anomaly_threshold = 5.0;
+  backend = IO_BACKEND_LDNS;
+  nsset_dedup = false;
+  record_samples = false;
+  edns_udp_size = 0;
+  edns_dnssec_ok = false;
+  edns_validate = false;
+  record_responses = false;
+  domain_sample_every = 10;
+  num_probes_sent = 0;
+  num_probes_skipped = 0;
+  num_ns_lookups = 0;
+  last_probes_sent = 0;
+  last_probes_skipped = 0;
+  last_ns_lookups = 0;
+  last_batch_flush = DnsProbeScheduler::now();
+  // database handler is constructed in the initialization list
 }
 catch(std::string s){
   throw std::string("Error in RecurrentDnsStatsMonitor() -> ") + s;
 }
 
+
+void RecurrentDnsStatsMonitor::set_shards(unsigned int num_shards, bool pin) {
+  this->num_shards = (num_shards > 0) ? num_shards : 1;
+  pin_shards = pin;
+}
+
+
+unsigned int RecurrentDnsStatsMonitor::shard_of(int domain_id) const {
+  // multiplicative hash: consecutive ids are spread over the shards
+  return (uint32_t) ((uint32_t) domain_id * 2654435761U) % shards.size();
+}
+
+
+void RecurrentDnsStatsMonitor::create_shards() {
+  try {
+    // the cpus the process is allowed on (taskset, cgroup cpusets)
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if(pin_shards && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+      for(int c = 0; c < CPU_SETSIZE; c++) {
+	if(CPU_ISSET(c, &allowed)) {
+	  cpus.push_back(c);
+	}
+      }
+    }
+#endif
+    if(pin_shards && cpus.empty()) {
+      std::cerr << "Can't get the cpus to pin the shards to, not pinned" << std::endl;
+    }
+    for(unsigned int i = 0; i < num_shards; i++) {
+      int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+      probe_shard * shard;
+      if(num_shards == 1) {
+	// a single shard uses the monitor connection
+	shard = new probe_shard(i, cpu, &ddh, false);
+      }
+      else {
+	DnsDbHandler * shard_ddh = new DnsDbHandler(db_name.c_str(),
+						    optional_str(db_server),
+						    optional_str(db_user),
+						    optional_str(db_password),
+						    optional_str(db_socket),
+						    db_port);
+	shard = new probe_shard(i, cpu, shard_ddh, true);
+      }
+      shards.push_back(shard);
+      shard->dad.set_parameters(anomaly_alpha, anomaly_slack, anomaly_threshold);
+      shard->dr.set_edns(edns_udp_size, edns_dnssec_ok, edns_validate);
+      io_backend used = shard->dr.set_io_backend(backend);
+      if(i == 0) {
+	std::cout << "Queries sent with the " << DnsUdpTransport::backend_name(used)
+		  << " backend" << std::endl;
+      }
+      if(!resolvers.empty()) {
+	shard->dr.set_servers(resolvers);
+	shard->destination_keys.clear();
+	for(size_t r = 0; r < resolvers.size(); r++) {
+	  shard->destination_keys.push_back(DnsRateLimiter::hash_key(resolvers[r]));
+	}
+	if(i == 0) {
+	  std::cout << "Comparing " << resolvers.size() << " resolvers" << std::endl;
+	}
+      }
+    }
+    // every domain gets its own detector state before any thread starts
+    std::vector<std::vector<int> > ids(shards.size());
+    std::map<int,std::string>::const_iterator it;
+    for(it = top_domains.begin(); it != top_domains.end(); it++) {
+      ids[shard_of(it->first)].push_back(it->first);
+    }
+    for(size_t i = 0; i < shards.size(); i++) {
+      shards[i]->dad.add_domains(ids[i]);
+    }
+  }
+  catch(std::string s){
+    throw std::string("Error in create_shards() -> ") + s;
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::set_anomaly_detection(double alpha,
+						     double slack,
+						     double threshold,
+						     const char * hook) {
+  try {
+    // validated here, applied to the shards when they are created
+    DnsAnomalyDetector check;
+    check.set_parameters(alpha, slack, threshold);
+    anomaly_alpha = alpha;
+    anomaly_slack = slack;
+    anomaly_threshold = threshold;
+    dan.set_hook(hook);
+  }
+  catch(std::string s){
+    throw std::string("Error in set_anomaly_detection() -> ") + s;
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::set_checkpoint(const char * path, unsigned int interval) {
+  checkpoint_path = (path != NULL) ? path : "";
+  checkpoint_interval = (interval > 0) ? interval : 1;
+}
+
+
+void RecurrentDnsStatsMonitor::set_sample_log(const char * path) {
+  samples.open_append(path);
+  record_samples = true;
+}
+
+
+void RecurrentDnsStatsMonitor::save_checkpoint() {
+  if(checkpoint_path.empty() || shards.empty()) {
+    return;
+  }
+  // merge the state of all the shards
+  size_t n = shards.size();
+  std::vector<std::vector<std::pair<int,anomaly_state> > > states(n);
+  std::vector<std::map<int,double> > deadlines(n);
+  std::vector<size_t> st_pos(n, 0);
+  std::vector<std::map<int,cached_stats> > stats(n);
+  std::vector<std::map<int,cached_stats>::const_iterator> c_pos(n);
+  for(size_t i = 0; i < n; i++) {
+    shards[i]->dad.export_states(states[i]);
+    shards[i]->scheduler.export_deadlines(deadlines[i]);
+    shards[i]->ddh->export_cached_stats(stats[i]);
+    c_pos[i] = stats[i].begin();
+  }
+  std::vector<std::string> nsset_keys;
+  std::vector<std::pair<int,DnsNsSetCache::domain_nsset> > nssets;
+  nsc.export_entries(nsset_keys, nssets);
+  size_t ns_pos = 0;
+  // deadlines are stored as wall clock times (the monotonic
+  // clock does not survive a reboot)
+  double wall_offset = DnsStateCheckpoint::wall_clock() - DnsProbeScheduler::now();
+  std::vector<checkpoint_record> records;
+  records.reserve(top_domains.size());
+  checkpoint_record r;
+  std::map<int,std::string>::const_iterator it;
+  for(it = top_domains.begin(); it != top_domains.end(); it++) {
+    memset(&r, 0, sizeof(r));
+    r.domain_id = it->first;
+    unsigned int sh = shard_of(it->first);
+    std::map<int,double>::const_iterator dl_it = deadlines[sh].find(it->first);
+    if(dl_it != deadlines[sh].end()) {
+      r.next_deadline = dl_it->second + wall_offset;
+      r.flags |= CHECKPOINT_HAS_DEADLINE;
+    }
+    // both lists are sorted by domain id
+    std::vector<std::pair<int,anomaly_state> > &st = states[sh];
+    while(st_pos[sh] < st.size() && st[st_pos[sh]].first < it->first) {
+      st_pos[sh]++;
+    }
+    if(st_pos[sh] < st.size() && st[st_pos[sh]].first == it->first) {
+      r.anomaly = st[st_pos[sh]].second;
+      r.flags |= CHECKPOINT_HAS_ANOMALY;
+    }
+    while(c_pos[sh] != stats[sh].end() && c_pos[sh]->first < it->first) {
+      c_pos[sh]++;
+    }
+    if(c_pos[sh] != stats[sh].end() && c_pos[sh]->first == it->first) {
+      r.stats = c_pos[sh]->second.stats;
+      r.stats_last_ts = c_pos[sh]->second.last_ts;
+      r.flags |= CHECKPOINT_HAS_STATS;
+    }
+    while(ns_pos < nssets.size() && nssets[ns_pos].first < it->first) {
+      ns_pos++;
+    }
+    r.nsset_id = NSSET_NONE;
+    if(ns_pos < nssets.size() && nssets[ns_pos].first == it->first) {
+      r.nsset_id = nssets[ns_pos].second.nsset_id;
+      r.nsset_fetched = nssets[ns_pos].second.fetched;
+      r.flags |= CHECKPOINT_HAS_NSSET;
+    }
+    records.push_back(r);
+  }
+  DnsStateCheckpoint::save(checkpoint_path, records, nsset_keys,
+			   shards[0]->scheduler.get_period());
+  last_checkpoint = DnsProbeScheduler::now();
+}
+
+
+void RecurrentDnsStatsMonitor::check_checkpoint() {
+  if(checkpoint_path.empty() ||
+     DnsProbeScheduler::now() - last_checkpoint < checkpoint_interval) {
+    return;
+  }
+  try {
+    save_checkpoint();
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    // do not retry at every probe
+    last_checkpoint = DnsProbeScheduler::now();
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::schedule_domains() {
+  double start = DnsProbeScheduler::now();
+  size_t n = shards.size();
+  std::vector<std::map<int,double> > deadlines(n);
+  // the domain_stats cache of every shard, filled at once
+  std::vector<std::map<int,cached_stats> > caches(n);
+  DnsStateCheckpoint cp;
+  if(!checkpoint_path.empty() && cp.open(checkpoint_path)) {
+    /* the stats of the checkpoint are only replaced by the rows of
+     * domain_stats written since (a sample can be written a few
+     * seconds after its timestamp: CHECKPOINT_STATS_SLACK) */
+    std::map<int,cached_stats> rows;
+    int64_t since = (int64_t) floor(cp.saved_at()) - CHECKPOINT_STATS_SLACK;
+    ddh.read_dns_stats((since > 0) ? since : 1, rows);
+    size_t num_rows = rows.size();
+    double mono_now = DnsProbeScheduler::now();
+    double wall_now = DnsStateCheckpoint::wall_clock();
+    // the phases only hold for the period they were computed with
+    bool same_period = fabs(cp.period() - dns_test_frequency) < 1e-6;
+    if(!same_period) {
+      std::cout << "Checkpoint period " << cp.period() << " s differs from "
+		<< dns_test_frequency << " s: probes spread over one period" << std::endl;
+    }
+    std::vector<std::string> nsset_keys;
+    cp.get_nsset_keys(nsset_keys);
+    std::vector<std::pair<int,DnsNsSetCache::domain_nsset> > nssets;
+    DnsNsSetCache::domain_nsset ns;
+    cached_stats c;
+    size_t num_restored = 0;
+    size_t num_newer = 0;
+    // the records, the domains and the rows are sorted by domain id
+    std::map<int,std::string>::const_iterator d_it = top_domains.begin();
+    std::map<int,cached_stats>::iterator row_it = rows.begin();
+    for(size_t i = 0; i < cp.size(); i++) {
+      const checkpoint_record &r = cp.record(i);
+      while(d_it != top_domains.end() && d_it->first < r.domain_id) {
+	d_it++;
+      }
+      if(d_it == top_domains.end() || d_it->first != r.domain_id) {
+	continue; // not monitored anymore
+      }
+      probe_shard &shard = *shards[shard_of(r.domain_id)];
+      while(row_it != rows.end() && row_it->first < r.domain_id) {
+	row_it++;
+      }
+      bool has_row = (row_it != rows.end() && row_it->first == r.domain_id);
+      if(has_row) {
+	const cached_stats &row = row_it->second;
+	if(!(r.flags & CHECKPOINT_HAS_STATS) ||
+	   row.last_ts > r.stats_last_ts ||
+	   (row.last_ts == r.stats_last_ts && row.stats.num_queries > r.stats.num_queries)) {
+	  caches[shard.index].insert(caches[shard.index].end(), *row_it);
+	  num_newer++;
+	}
+	else {
+	  has_row = false;
+	}
+	// the rows left are the ones of the domains missing in the checkpoint
+	rows.erase(row_it++);
+      }
+      if(!has_row && (r.flags & CHECKPOINT_HAS_STATS)) {
+	c.stats = r.stats;
+	c.last_ts = r.stats_last_ts;
+	caches[shard.index].insert(caches[shard.index].end(),
+				   std::make_pair((int) r.domain_id, c));
+      }
+      if(r.flags & CHECKPOINT_HAS_ANOMALY) {
+	shard.dad.set_state(r.domain_id, r.anomaly);
+      }
+      if((r.flags & CHECKPOINT_HAS_DEADLINE) && same_period) {
+	double deadline = r.next_deadline - wall_now + mono_now;
+	// skip the probes missed while down, keeping the phase
+	if(deadline < mono_now) {
+	  deadline += ceil((mono_now - deadline) / dns_test_frequency) * dns_test_frequency;
+	}
+	deadlines[shard.index].insert(deadlines[shard.index].end(),
+				      std::make_pair((int) r.domain_id, deadline));
+      }
+      if(r.flags & CHECKPOINT_HAS_NSSET) {
+	ns.nsset_id = r.nsset_id;
+	ns.fetched = (std::time_t) r.nsset_fetched;
+	nssets.push_back(std::make_pair((int) r.domain_id, ns));
+      }
+      num_restored++;
+    }
+    cp.close();
+    for(row_it = rows.begin(); row_it != rows.end(); row_it++) {
+      if(top_domains.find(row_it->first) != top_domains.end()) {
+	caches[shard_of(row_it->first)][row_it->first] = row_it->second;
+	num_newer++;
+      }
+    }
+    // the expired entries are looked up again by request_nssets
+    nsc.restore_entries(nsset_keys, nssets);
+    std::cout << "Restored " << num_restored << " domains (" << nssets.size()
+	      << " NS-set entries) from " << checkpoint_path << ", "
+	      << num_newer << " newer in the " << num_rows << " rows of domain_stats read" << std::endl;
+  }
+  else {
+    // no checkpoint (or a corrupt one): the whole domain_stats table
+    ddh.load_dns_stats();
+    if(n > 1) {
+      // hand every domain to the cache of its shard
+      std::map<int,cached_stats> stats;
+      ddh.swap_cached_stats(stats);
+      std::map<int,cached_stats>::const_iterator s_it;
+      for(s_it = stats.begin(); s_it != stats.end(); s_it++) {
+	caches[shard_of(s_it->first)].insert(caches[shard_of(s_it->first)].end(), *s_it);
+      }
+    }
+    else {
+      // the single shard uses ddh: back in it below
+      ddh.swap_cached_stats(caches[0]);
+    }
+    std::cout << "Loaded domain_stats";
+  }
+  for(size_t i = 0; i < n; i++) {
+    shards[i]->ddh->swap_cached_stats(caches[i]);
+  }
+  std::cout << " in " << (DnsProbeScheduler::now() - start) * 1000.0 << " ms" << std::endl;
+  // domains without a restored deadline are spread over one period
+  std::vector<std::map<int,std::string> > domains(n);
+  std::map<int,std::string>::const_iterator it;
+  for(it = top_domains.begin(); it != top_domains.end(); it++) {
+    domains[shard_of(it->first)].insert(*it);
+  }
+  for(size_t i = 0; i < n; i++) {
+    shards[i]->scheduler.add_domains(domains[i], DnsProbeScheduler::now(), &deadlines[i]);
+  }
+  last_checkpoint = DnsProbeScheduler::now();
+}
+
+
+void RecurrentDnsStatsMonitor::set_rate_limits(double global_rate,
+					       double destination_rate,
+					       double nsset_rate,
+					       unsigned int burst) {
+  limiter.configure(global_rate, destination_rate, nsset_rate, burst);
+}
+
+
+void RecurrentDnsStatsMonitor::set_nsset_dedup(bool enable, unsigned int sample_every) {
+  nsset_dedup = enable;
+  domain_sample_every = (sample_every > 0) ? sample_every : 1;
+}
+
+
+void RecurrentDnsStatsMonitor::set_io_backend(io_backend backend) {
+  // applied by create_shards
+  this->backend = backend;
+}
+
+
+void RecurrentDnsStatsMonitor::set_edns(uint16_t udp_size, bool dnssec_ok, bool validate) {
+  // applied by create_shards
+  edns_udp_size = udp_size;
+  edns_dnssec_ok = dnssec_ok;
+  edns_validate = validate;
+}
+
+
+void RecurrentDnsStatsMonitor::set_response_stats(bool enable) {
+  record_responses = enable;
+}
+
+
+void RecurrentDnsStatsMonitor::set_resolvers(const std::vector<std::string> &resolvers) {
+  try {
+    // every resolver keeps its id across runs (and list changes)
+    std::vector<int> ids;
+    std::vector<std::string> names;
+    // "system" is stored as the address it stands for
+    DnsResolver dr;
+    for(size_t i = 0; i < resolvers.size(); i++) {
+      names.push_back(dr.server_name(resolvers[i]));
+      ids.push_back(ddh.get_resolver_id(names[i]));
+    }
+    this->resolvers = names;
+    resolver_ids = ids;
+  }
+  catch(std::string s){
+    throw std::string("Error in set_resolvers() -> ") + s;
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::set_profiling(unsigned int stats_interval,
+					     const char * trace_path,
+					     unsigned int trace_sample) {
+  stage_stats_interval = (stats_interval > 0) ? stats_interval : 1;
+  try {
+    profiler.enable_trace(trace_path, trace_sample);
+  }
+  catch(std::string s){
+    throw std::string("Error in set_profiling() -> ") + s;
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::check_stage_stats() {
+  if(DnsProbeScheduler::now() - last_stage_stats < stage_stats_interval) {
+    return;
+  }
+  last_stage_stats = DnsProbeScheduler::now();
+  std::vector<stage_summary> stages;
+  profiler.snapshot(stages);
+  try {
+    ddh.insert_stage_stats(std::time(NULL), stages);
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+  }
+  if(nsset_dedup) {
+    report_query_volume();
+  }
+  // a partial block, so that a crash loses one interval at most
+  flush_samples();
+}
+
+
+void RecurrentDnsStatsMonitor::check_stats_batches() {
+  if(DnsProbeScheduler::now() - last_batch_flush < BATCH_FLUSH_INTERVAL) {
+    return;
+  }
+  last_batch_flush = DnsProbeScheduler::now();
+  flush_nsset_stats();
+  flush_resolver_stats();
+  flush_response_stats();
+}
+
+
+// the samples of every shard, through its own connection
+void RecurrentDnsStatsMonitor::flush_resolver_stats() {
+  int now = std::time(NULL);
+  for(size_t i = 0; i < shards.size(); i++) {
+    std::map<std::pair<int,int>,resolver_stats> batch;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&shards[i]->batch_mutex);
+#endif
+    batch.swap(shards[i]->resolver_batch);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&shards[i]->batch_mutex);
+#endif
+    if(batch.empty()) {
+      continue;
+    }
+    try {
+      shards[i]->ddh->update_resolver_stats(batch, now);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+  }
+}
+
+
+// the responses of every shard, through its own connection
+void RecurrentDnsStatsMonitor::flush_response_stats() {
+  int now = std::time(NULL);
+  for(size_t i = 0; i < shards.size(); i++) {
+    std::map<int,response_stats> batch;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&shards[i]->batch_mutex);
+#endif
+    batch.swap(shards[i]->response_batch);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&shards[i]->batch_mutex);
+#endif
+    if(batch.empty()) {
+      continue;
+    }
+    try {
+      shards[i]->ddh->update_response_stats(batch, now);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+  }
+}
+
+
+// the samples of every shard, merged, in one write per NS-set
+void RecurrentDnsStatsMonitor::flush_nsset_stats() {
+  std::map<int,dns_stats> merged;
+  for(size_t i = 0; i < shards.size(); i++) {
+    std::map<int,dns_stats> batch;
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&shards[i]->batch_mutex);
+#endif
+    batch.swap(shards[i]->nsset_batch);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&shards[i]->batch_mutex);
+#endif
+    std::map<int,dns_stats>::const_iterator it;
+    for(it = batch.begin(); it != batch.end(); it++) {
+      dns_stats &st = merged[it->first];
+      st = DnsDbHandler::merge_stats(st, it->second);
+    }
+  }
+  int now = std::time(NULL);
+  std::map<int,dns_stats>::const_iterator it;
+  for(it = merged.begin(); it != merged.end(); it++) {
+    try {
+      ddh.update_nsset_stats(nsc.get_nsset_hash(it->first), nsc.get_nsset_key(it->first),
+			     it->second, now);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::flush_samples() {
+  if(!record_samples) {
+    return;
+  }
+  try {
+    samples.flush();
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+  }
+}
+
+
+// queries saved by the NS-set dedup since the last report
+void RecurrentDnsStatsMonitor::report_query_volume() {
+  uint64_t sent = num_probes_sent.load(std::memory_order_relaxed);
+  uint64_t skipped = num_probes_skipped.load(std::memory_order_relaxed);
+  uint64_t lookups = num_ns_lookups.load(std::memory_order_relaxed);
+  uint64_t d_sent = sent - last_probes_sent;
+  uint64_t d_skipped = skipped - last_probes_skipped;
+  uint64_t d_lookups = lookups - last_ns_lookups;
+  last_probes_sent = sent;
+  last_probes_skipped = skipped;
+  last_ns_lookups = lookups;
+  /* without dedup every probe would have been sent, and the NS
+   * lookups would not be needed unless the NS-sets are limited */
+  uint64_t without = d_sent + d_skipped;
+  uint64_t added = limiter.limits_nssets() ? 0 : d_lookups;
+  uint64_t with = d_sent + added;
+  double reduction = (without > 0) ? 100.0 * ((double) without - (double) with) / without : 0;
+  std::cout << "NS-set dedup: " << d_sent << " probes sent, " << d_skipped << " skipped, "
+	    << d_lookups << " NS lookups (" << added << " for the dedup), "
+	    << nsc.num_nssets() << " NS-sets: "
+	    << reduction << "% fewer queries" << std::endl;
+}
+
+
+void RecurrentDnsStatsMonitor::request_reload() {
+  reload_requested = 1;
+}
+
+
+void RecurrentDnsStatsMonitor::check_reload() {
+  if(reload_requested) {
+    reload_requested = 0;
+    try {
+      reload_domains();
+    }
+    catch(std::string s) {
+      // keep probing the current list
+      std::cerr << s << std::endl;
+    }
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::reload_domains() {
+  double start = DnsProbeScheduler::now();
+  std::map<int,std::string> new_domains;
+  try {
+    // not on the connection of the probes: they keep writing meanwhile
+    if(reload_ddh == NULL) {
+      reload_ddh = new DnsDbHandler(db_name.c_str(), optional_str(db_server),
+				    optional_str(db_user), optional_str(db_password),
+				    optional_str(db_socket), db_port);
+    }
+    new_domains = reload_ddh->get_top_n_domains(max_num_domains);
+  }
+  catch(std::string s) {
+    throw std::string("Error in reload_domains() -> ") + s;
+  }
+  // diff the two (sorted) lists
+  std::vector<int> removed;
+  std::vector<int> added;
+  std::map<int,std::string> to_schedule; // added and renamed
+  std::map<int,std::string>::const_iterator old_it = top_domains.begin();
+  std::map<int,std::string>::const_iterator new_it = new_domains.begin();
+  while(old_it != top_domains.end() || new_it != new_domains.end()) {
+    if(new_it == new_domains.end() ||
+       (old_it != top_domains.end() && old_it->first < new_it->first)) {
+      removed.push_back(old_it->first);
+      old_it++;
+    }
+    else if(old_it == top_domains.end() || new_it->first < old_it->first) {
+      added.push_back(new_it->first);
+      to_schedule.insert(*new_it);
+      new_it++;
+    }
+    else {
+      if(old_it->second != new_it->second) {
+	to_schedule.insert(*new_it);
+      }
+      old_it++;
+      new_it++;
+    }
+  }
+  // every shard gets its part of the difference
+  size_t n = shards.size();
+  std::vector<std::vector<int> > shard_removed(n);
+  std::vector<std::vector<int> > shard_added(n);
+  std::vector<std::map<int,std::string> > shard_to_schedule(n);
+  std::vector<int>::const_iterator id_it;
+  for(id_it = removed.begin(); id_it != removed.end(); id_it++) {
+    shard_removed[shard_of(*id_it)].push_back(*id_it);
+  }
+  for(id_it = added.begin(); id_it != added.end(); id_it++) {
+    shard_added[shard_of(*id_it)].push_back(*id_it);
+  }
+  std::map<int,std::string>::const_iterator it;
+  for(it = to_schedule.begin(); it != to_schedule.end(); it++) {
+    shard_to_schedule[shard_of(it->first)].insert(*it);
+  }
+  nsc.remove_domains(removed);
+  for(size_t i = 0; i < n; i++) {
+    // stop scheduling the removed domains before dropping their state,
+    // and create the state of the new ones before scheduling them
+    shards[i]->scheduler.remove_domains(shard_removed[i]);
+    shards[i]->dad.remove_domains(shard_removed[i]);
+    shards[i]->dad.add_domains(shard_added[i]);
+    // new domains are spread over one period (no burst)
+    shards[i]->scheduler.add_domains(shard_to_schedule[i], DnsProbeScheduler::now());
+  }
+  top_domains.swap(new_domains);
+  std::cout << "Reloaded domains: " << added.size() << " added, "
+	    << removed.size() << " removed, "
+	    << to_schedule.size() - added.size() << " renamed ("
+	    << (DnsProbeScheduler::now() - start) * 1000.0 << " ms)" << std::endl;
+}
+
+
 // this function is not visible outside this code unit
 static std::string gen_random_string(const int len) {
   std::stringstream s;
@@ -63,87 +784,388 @@ static std::string gen_random_string(const int len) {
 }
 
 
-void RecurrentDnsStatsMonitor::run(unsigned int frequency, unsigned int cycles) {
-  dns_test_frequency = frequency;
-  max_num_cycles = cycles;
-  if(dns_test_frequency <= 0) { // minimum frequency is 1 second
-    return;
+void RecurrentDnsStatsMonitor::probe_domain(probe_shard &shard, const probe_task &task) {
+  probe_timing timing;
+  uint64_t t = DnsProbeProfiler::now_ns();
+  uint64_t due = (uint64_t) (task.deadline * 1000000000.0);
+  if(due < t) {
+    timing.set(STAGE_SCHEDULE, due, t);
   }
-  bool check_cycles = false; // default: no check on number of cycles executed
-  if(max_num_cycles > 0) {
-    check_cycles = true;
+  if(task.deferred_since > 0) {
+    timing.set(STAGE_RATE_LIMIT, (uint64_t) (task.deferred_since * 1000000000.0), t);
   }
-  std::string random_prepending;
+  // a random string is prepended to avoid the resolver cache
   std::stringstream domain_to_query;
+  domain_to_query << gen_random_string(10) << "." << task.domain_name;
+  std::time_t cur_time = std::time(NULL);
   double latency;
-  while(true) {
-    // we generate one random string to prepend per cycle
-    random_prepending = gen_random_string(10);
-    std::time_t cur_time = std::time(NULL);
-    std::map<int,std::string>::const_iterator it;
-    for(it = top_domains.begin(); it != top_domains.end(); it++) {
-      domain_to_query.str("");
-      domain_to_query << random_prepending << "." << it->second; // domain_name      
-      latency = dr.query_nameserver(domain_to_query.str());
-      ddh.update_dns_stats(it->first /*domain_id*/, latency, cur_time);	
-    }    
-    if(check_cycles) {
-      max_num_cycles--;
-      if(max_num_cycles == 0){
-	break;
+  std::vector<double> latencies;
+  response_metrics metrics;
+  // the sample log keeps the metrics too (read in place, no allocation)
+  response_metrics * rm = (record_responses || record_samples) ? &metrics : NULL;
+  if(resolvers.empty()) {
+    latency = shard.dr.query_nameserver(domain_to_query.str(), &timing, rm);
+  }
+  else {
+    // the same name to every resolver, the first one is the reference
+    shard.dr.query_servers(domain_to_query.str(), latencies, &timing, rm);
+    latency = latencies[0];
+  }
+  anomaly_event ev;
+  t = DnsProbeProfiler::now_ns();
+  bool alarm = shard.dad.update(task.domain_id, latency, cur_time, ev);
+  timing.set(STAGE_AGGREGATE, t, DnsProbeProfiler::now_ns());
+  if(alarm) {
+    t = DnsProbeProfiler::now_ns();
+    dan.notify(ev, task.domain_name);
+    timing.set(STAGE_ENQUEUE, t, DnsProbeProfiler::now_ns());
+  }
+  t = DnsProbeProfiler::now_ns();
+  // the sample is kept even if the database is unavailable
+  if(record_samples) {
+    try {
+      samples.append(task.domain_id, cur_time, latency, rm);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+  }
+  shard.ddh->update_dns_stats(task.domain_id, latency, cur_time);
+  if(record_responses && latency >= 0) {
+    // written by flush_response_stats, off the probe path
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&shard.batch_mutex);
+#endif
+    response_stats &rs = shard.response_batch[task.domain_id];
+    rs = DnsDbHandler::next_response_stats(rs, metrics, cur_time);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&shard.batch_mutex);
+#endif
+  }
+  if(!latencies.empty()) {
+    // written by flush_resolver_stats, off the probe path
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_lock(&shard.batch_mutex);
+#endif
+    for(size_t i = 0; i < latencies.size(); i++) {
+      resolver_stats &rs = shard.resolver_batch[std::make_pair(task.domain_id, resolver_ids[i])];
+      if(latencies[i] >= 0) {
+	rs.latency = DnsDbHandler::next_stats(rs.latency, latencies[i], cur_time);
       }
+      else {
+	rs.num_failures++;
+	if(rs.latency.first_ts == 0) {
+	  rs.latency.first_ts = cur_time;
+	}
+      }
+    }
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+    pthread_mutex_unlock(&shard.batch_mutex);
+#endif
+  }
+  if(nsset_dedup && latency >= 0) {
+    // any domain of the group measures the NS-set servers
+    int nsset_id = nsc.get_nsset(task.domain_id, task.domain_name, cur_time);
+    if(nsset_id >= 0) {
+      // written by flush_nsset_stats, off the probe path
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_lock(&shard.batch_mutex);
+#endif
+      dns_stats &st = shard.nsset_batch[nsset_id];
+      st = DnsDbHandler::next_stats(st, latency, cur_time);
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+      pthread_mutex_unlock(&shard.batch_mutex);
+#endif
     }
-    // wait for <frequency> seconds
-    sleep(dns_test_frequency);
   }
+  timing.set(STAGE_DB_FLUSH, t, DnsProbeProfiler::now_ns());
+  profiler.record_probe(timing, task.domain_name);
 }
 
 
-#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+int RecurrentDnsStatsMonitor::resolve_nsset(const probe_task &task) {
+  int nsset_id = nsc.get_nsset(task.domain_id, task.domain_name, std::time(NULL));
+  // not looked up yet (requested): probed on its own meanwhile
+  return (nsset_id == NSSET_NOT_CACHED) ? NSSET_NONE : nsset_id;
+}
+
+
+// the NS-sets of all the domains are looked up before they are due
+void RecurrentDnsStatsMonitor::request_nssets() {
+  if(!limiter.limits_nssets() && !nsset_dedup) {
+    return;
+  }
+  std::time_t now = std::time(NULL);
+  std::map<int,std::string>::const_iterator it;
+  for(it = top_domains.begin(); it != top_domains.end(); it++) {
+    nsc.get_nsset(it->first, it->second, now);
+  }
+}
 
-void RecurrentDnsStatsMonitor::single_domain_run(int domain_id, std::string domain_name) {
+
+void RecurrentDnsStatsMonitor::prefetch_nssets(DnsResolver &dr, bool wait,
+					       unsigned int max_lookups) {
+  int domain_id;
+  std::string domain_name;
+  unsigned int num_lookups = 0;
+  while((wait || num_lookups < max_lookups) &&
+	nsc.next_request(domain_id, domain_name, wait)) {
+    std::vector<std::string> ns_names;
+    // a failed lookup is cached as NSSET_NONE, for a short time
+    dr.lookup_ns(domain_name, ns_names);
+    num_lookups++;
+    num_ns_lookups.fetch_add(1, std::memory_order_relaxed);
+    std::time_t now = std::time(NULL);
+    int nsset_id = nsc.set_nsset(domain_id, ns_names, now);
+    if(nsset_dedup && nsset_id >= 0) {
+      try {
+	ddh.set_domain_nsset(domain_id, nsc.get_nsset_hash(nsset_id), now);
+      }
+      catch(std::string s) {
+	std::cerr << s << std::endl;
+      }
+    }
+  }
+}
+
+
+// true when the probe of this cycle is a sample of the domain itself
+bool RecurrentDnsStatsMonitor::domain_sample_due(const probe_task &task) const {
+  uint64_t cycle = (uint64_t) floor(task.deadline / dns_test_frequency);
+  // the domains of a group take their samples in different cycles
+  uint32_t phase = (uint32_t) task.domain_id * 2654435761U;
+  return (cycle + phase) % domain_sample_every == 0;
+}
+
+
+void RecurrentDnsStatsMonitor::serve_probe(probe_shard &shard, const probe_task &task) {
+  // a deferred probe already holds its tokens
+  if(task.deferred_since == 0) {
+    int nsset_id = NSSET_NONE;
+    if(limiter.limits_nssets() || nsset_dedup) {
+      nsset_id = resolve_nsset(task);
+    }
+    if(nsset_dedup && nsset_id >= 0) {
+      /* the first domain of the NS-set due in this period probes
+       * the servers for the whole group, the others only every
+       * domain_sample_every periods */
+      bool group_probe = nsc.claim_group_probe(nsset_id, task.deadline, dns_test_frequency);
+      if(!group_probe && !domain_sample_due(task)) {
+	num_probes_skipped.fetch_add(1, std::memory_order_relaxed);
+	shard.scheduler.probe_done(task);
+	return;
+      }
+    }
+    double wait = limiter.acquire(shard.destination_keys, nsset_id);
+    if(wait > 0) {
+      // over the limit: deferred, not dropped
+      shard.scheduler.defer_probe(task, DnsProbeScheduler::now() + wait);
+      return;
+    }
+  }
+  num_probes_sent.fetch_add(1, std::memory_order_relaxed);
+  try {
+    probe_domain(shard, task);
+  }
+  catch(std::string s) {
+    // a failed probe must not stop the other domains
+    std::cerr << s << std::endl;
+  }
+  shard.scheduler.probe_done(task);
+}
+
+
+void RecurrentDnsStatsMonitor::run(unsigned int frequency, unsigned int cycles) {
+  dns_test_frequency = frequency;
+  max_num_cycles = cycles;
   if(dns_test_frequency <= 0) { // minimum frequency is 1 second
     return;
   }
-  // we do not modify the class variable (it is shared)
-  int cycles = max_num_cycles;
-  bool check_cycles = false; // default: no check on number of cycles executed
-  if(cycles > 0) {
-    check_cycles = true;
+  // without threads there is a single shard
+  if(num_shards > 1) {
+    std::cerr << "Shards need threads, " << num_shards
+	      << " shards requested, probing with one" << std::endl;
   }
-  std::string random_prepending;
-  std::stringstream domain_to_query;
-  double latency;
-  while(true) {
-    // we generate one random string to prepend per cycle
-    random_prepending = gen_random_string(10);
-    std::time_t cur_time = std::time(NULL);
-    domain_to_query << random_prepending << "." << domain_name; 
-    latency = dr.query_nameserver(domain_to_query.str());
-    ddh.update_dns_stats(domain_id, latency, cur_time);	    
-    if(check_cycles) {
-      cycles--;
-      if(cycles == 0){
-	break;
+  num_shards = 1;
+  create_shards();
+  probe_shard &shard = *shards[0];
+  shard.scheduler.configure(dns_test_frequency, max_num_cycles);
+  schedule_domains();
+  request_nssets();
+  probe_task task;
+  // SIGHUP is held during a probe: it would interrupt its wait
+  sigset_t hup;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  while(shard.scheduler.next_probe(task)) {
+    sigprocmask(SIG_BLOCK, &hup, NULL);
+    serve_probe(shard, task);
+    // without threads, a few NS lookups between the probes
+    prefetch_nssets(shard.dr, false, NSSET_LOOKUPS_PER_PROBE);
+    sigprocmask(SIG_UNBLOCK, &hup, NULL);
+    check_reload();
+    check_checkpoint();
+    check_stage_stats();
+    check_stats_batches();
+  }
+  flush_nsset_stats();
+  flush_resolver_stats();
+  flush_response_stats();
+  flush_samples();
+  if(!checkpoint_path.empty()) {
+    save_checkpoint();
+  }
+}
+
+
+// the samples of every domain since the last flush, in one write each
+void RecurrentDnsStatsMonitor::flush_passive(probe_shard &shard,
+					     const DnsPassiveMatcher &matcher,
+					     std::vector<dns_stats> &batch,
+					     int current_ts) {
+  for(size_t i = 0; i < batch.size(); i++) {
+    if(batch[i].num_queries == 0) {
+      continue;
+    }
+    try {
+      shard.ddh->update_dns_stats(matcher.domain_id(i), batch[i], current_ts);
+    }
+    catch(std::string s) {
+      std::cerr << s << std::endl;
+    }
+    memset(&batch[i], 0, sizeof(dns_stats));
+  }
+}
+
+
+void RecurrentDnsStatsMonitor::passive_run(DnsCaptureReader &reader, unsigned int interval) {
+  dns_test_frequency = (interval > 0) ? interval : 1;
+  max_num_cycles = 0;
+  if(num_shards > 1) {
+    std::cerr << "Passive measurements use one shard, " << num_shards
+	      << " shards requested" << std::endl;
+  }
+  num_shards = 1;
+  create_shards();
+  probe_shard &shard = *shards[0];
+  shard.scheduler.configure(dns_test_frequency, max_num_cycles);
+  // stats and detector states are restored as for the probes
+  // (the schedule itself is not used)
+  schedule_domains();
+  DnsPassiveMatcher matcher;
+  matcher.set_domains(top_domains);
+  // by matcher domain index
+  dns_stats empty;
+  memset(&empty, 0, sizeof(empty));
+  std::vector<dns_stats> batch(matcher.num_domains(), empty);
+  uint64_t flush_ns = (uint64_t) dns_test_frequency * 1000000000ULL;
+  uint64_t last_flush = 0;
+  uint64_t capture_now = 0;
+  double start = DnsProbeScheduler::now();
+  captured_packet pkt;
+  dns_exchange ex;
+  int rc;
+  while((rc = reader.next(pkt)) >= 0) {
+    if(rc == 1) {
+      capture_now = pkt.ts_ns;
+      if(matcher.process(pkt, ex)) {
+	std::time_t ts = (std::time_t) (ex.ts_ns / 1000000000ULL);
+	anomaly_event ev;
+	if(shard.dad.update(ex.domain_id, ex.latency_ms, ts, ev)) {
+	  dan.notify(ev, top_domains[ex.domain_id]);
+	}
+	dns_stats &st = batch[ex.domain_index];
+	st = DnsDbHandler::next_stats(st, ex.latency_ms, ts);
+	if(record_samples) {
+	  try {
+	    samples.append(ex.domain_id, ts, ex.latency_ms);
+	  }
+	  catch(std::string s) {
+	    std::cerr << s << std::endl;
+	  }
+	}
       }
     }
-    // wait for <frequency> seconds
-    sleep(dns_test_frequency);
-    domain_to_query.str("");
+    else {
+      // live capture, nothing received: the time still goes on
+      capture_now = (uint64_t) (DnsStateCheckpoint::wall_clock() * 1000000000.0);
+    }
+    if(last_flush == 0) {
+      last_flush = capture_now;
+    }
+    if(capture_now >= last_flush + flush_ns) {
+      flush_passive(shard, matcher, batch, capture_now / 1000000000ULL);
+      last_flush = capture_now;
+      // the domain indexes change with the list
+      check_reload();
+      matcher.set_domains(top_domains);
+      batch.assign(matcher.num_domains(), empty);
+      check_checkpoint();
+    }
+  }
+  flush_passive(shard, matcher, batch, capture_now / 1000000000ULL);
+  const passive_counters &c = matcher.get_counters();
+  double elapsed = DnsProbeScheduler::now() - start;
+  std::cout << "Passive: " << c.packets << " packets, " << c.queries << " queries, "
+	    << c.responses << " responses, " << c.matched << " matched ("
+	    << c.matched - c.ignored << " monitored), " << c.unmatched << " unmatched, "
+	    << c.expired << " expired, " << c.dropped << " dropped in "
+	    << elapsed << " s" << std::endl;
+  flush_samples();
+  if(!checkpoint_path.empty()) {
+    save_checkpoint();
   }
 }
 
-struct thread_parameters {
-  int domain_id;
-  std::string domain_name;  
+
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+
+void RecurrentDnsStatsMonitor::worker_run(probe_shard &shard) {
+#if defined(__linux__)
+  if(shard.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard.cpu, &cpus);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if(rc != 0) {
+      std::cerr << "Can't pin shard " << shard.index << " to cpu " << shard.cpu
+		<< ": " << strerror(rc) << std::endl;
+    }
+  }
+#endif
+  probe_task task;
+  while(shard.scheduler.next_probe(task)) {
+    serve_probe(shard, task);
+  }
+}
+
+// what a probing thread serves
+struct worker_arg {
   RecurrentDnsStatsMonitor * monitor;
+  probe_shard * shard;
 };
 
+// this function is not visible outside this code unit
+static void * prefetch_run_wrapper(void * arg){
+  try {
+    // its own resolver, the shards' ones are busy probing
+    DnsResolver dr;
+    ((RecurrentDnsStatsMonitor *) arg)->prefetch_nssets(dr, true);
+  }
+  catch (std::string s) {
+    std::cerr << "Error in NS-set prefetch: " << s << std::endl;
+  }
+  catch (...) {
+    std::cerr << "Error in NS-set prefetch" << std::endl;
+  }
+  pthread_exit(NULL);
+}
+
 // this function is not visible outside this code unit
 static void * thread_run_wrapper(void * arg){
   try { 
-    struct thread_parameters * par = (struct thread_parameters *) arg;
-    par->monitor->single_domain_run(par->domain_id, par->domain_name);
+    worker_arg * w = (worker_arg *) arg;
+    w->monitor->worker_run(*w->shard);
   } 
   catch (...) { 
     std::cerr << "Error in thread run wrapper" << std::endl;
@@ -153,42 +1175,87 @@ static void * thread_run_wrapper(void * arg){
 }
 
 
-void RecurrentDnsStatsMonitor::parallel_run(unsigned int frequency, unsigned int cycles) {
+void RecurrentDnsStatsMonitor::parallel_run(unsigned int frequency,
+					    unsigned int cycles,
+					    unsigned int num_threads) {
   try {
   // initialize common parameter
   dns_test_frequency = frequency;
   max_num_cycles = cycles;
-  // create a thread for each domain
-  int num_domains = top_domains.size();
-  std::map<int,std::string>:: const_iterator d_it; // top_domains iterator
-  // initialize thread parameters for each domain
-  std::map<int,thread_parameters> domains_parameters;
-  std::map<int,thread_parameters>:: iterator p_it; // domains_parameters iterator
-  thread_parameters tp;
-  int i = 0;
-  for (d_it = top_domains.begin(), i=0; d_it != top_domains.end(); d_it++,i++) {
-    tp.domain_id = d_it->first;
-    tp.domain_name = d_it->second;
-    tp.monitor = this;
-    domains_parameters.insert(std::make_pair(i, tp));
-  }
-  // create a pthread_t structure for each domain
-  std::vector<pthread_t> threads(num_domains);
-  std::vector<pthread_t>::iterator t_it; // threads vector iterator
-  std::vector<int> pthread_error_vector(num_domains);
-  std::vector<int> :: iterator v;
+  if(dns_test_frequency <= 0) { // minimum frequency is 1 second
+    return;
+  }
+  create_shards();
+  // the threads are split among the shards (at least one each)
+  unsigned int threads_per_shard = num_threads / shards.size();
+  if(threads_per_shard == 0) {
+    threads_per_shard = 1;
+  }
+  num_threads = threads_per_shard * shards.size();
+  for(size_t s = 0; s < shards.size(); s++) {
+    shards[s]->scheduler.configure(dns_test_frequency, max_num_cycles);
+  }
+  // the first probes are spread over one period (or restored)
+  schedule_domains();
+  request_nssets();
+  // create a pool of threads serving the schedule of every shard
+  std::vector<pthread_t> threads(num_threads);
+  std::vector<int> pthread_error_vector(num_threads);
+  std::vector<worker_arg> args(num_threads);
+  unsigned int i;
   int rc;
+  int num_started = 0;
+  /* the workers inherit a mask blocking SIGHUP, hence it is always
+   * delivered to this thread and never interrupts a probe's wait */
+  sigset_t hup, old_mask;
+  sigemptyset(&hup);
+  sigaddset(&hup, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &hup, &old_mask);
   // launching threads
-  for (i=0, p_it = domains_parameters.begin(); i < num_domains; i++, p_it++) {
-    // int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start_routine) (void *), void *arg);
-    rc = pthread_create(&(threads[i]), NULL /*default attr*/, thread_run_wrapper, &(p_it->second));
+  for (i=0; i < num_threads; i++) {
+    args[i].monitor = this;
+    args[i].shard = shards[i / threads_per_shard];
+    rc = pthread_create(&(threads[i]), NULL /*default attr*/, thread_run_wrapper, &args[i]);
     pthread_error_vector[i] = (rc);
     if(rc){
       std::cerr << "Can't create thread: " << strerror(rc) << std::endl;
     }
+    else {
+      num_started++;
+    }
+  }
+  std::vector<pthread_t> prefetchers;
+  if((limiter.limits_nssets() || nsset_dedup) && num_started > 0) {
+    for (i=0; i < NSSET_PREFETCH_THREADS; i++) {
+      pthread_t t;
+      rc = pthread_create(&t, NULL /*default attr*/, prefetch_run_wrapper, this);
+      if(rc){
+	std::cerr << "Can't create thread: " << strerror(rc) << std::endl;
+      }
+      else {
+	prefetchers.push_back(t);
+      }
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if(num_started == 0) {
+    throw std::string("no probing thread");
+  }
+  // this thread takes care of the reloads and checkpoints
+  bool finished = false;
+  while(!finished) {
+    sleep(1); // interrupted by the signal, if delivered here
+    check_reload();
+    check_checkpoint();
+    check_stage_stats();
+    check_stats_batches();
+    finished = true;
+    for(size_t s = 0; s < shards.size(); s++) {
+      finished = finished && shards[s]->scheduler.finished();
+    }
   }
   // waiting for all threads to finish
-  for (i=0; i < num_domains; i++) {
+  for (i=0; i < num_threads; i++) {
     if(pthread_error_vector[i] != 0) {
       continue; // do not join pthreads that failed to create
     }
@@ -196,7 +1263,21 @@ void RecurrentDnsStatsMonitor::parallel_run(unsigned int frequency, unsigned int
       std::cerr << "Error joining thread" << std::endl;
     }
   }
-  pthread_exit(NULL);  
+  nsc.stop_requests();
+  for (i=0; i < prefetchers.size(); i++) {
+    if(pthread_join(prefetchers[i], NULL) != 0) {
+      std::cerr << "Error joining thread" << std::endl;
+    }
+  }
+  flush_nsset_stats();
+  flush_resolver_stats();
+  flush_response_stats();
+  flush_samples();
+  if(!checkpoint_path.empty()) {
+    save_checkpoint();
+  }
+  // return normally (instead of pthread_exit) so that the
+  // notifier can drain its queue in the destructors
   }
   catch (std::string s) { 
     throw std::string("Error in parallel_run() -> ") + s;
@@ -208,5 +1289,9 @@ void RecurrentDnsStatsMonitor::parallel_run(unsigned int frequency, unsigned int
 #endif
 
 RecurrentDnsStatsMonitor::~RecurrentDnsStatsMonitor() {
+  for(size_t i = 0; i < shards.size(); i++) {
+    delete shards[i];
+  }
+  delete reload_ddh;
   // internal object destructors are automatically called
 }
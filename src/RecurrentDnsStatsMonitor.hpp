@@ -27,39 +27,199 @@
 #include <iostream>
 #include <stdexcept>
 #include <exception>
+#include <atomic>
 
 #include "DnsDbHandler.hpp"
 #include "DnsResolver.hpp"
+#include "DnsAnomalyDetector.hpp"
+#include "DnsAnomalyNotifier.hpp"
+#include "DnsProbeScheduler.hpp"
+#include "DnsStateCheckpoint.hpp"
+#include "DnsProbeProfiler.hpp"
+#include "DnsRateLimiter.hpp"
+#include "DnsNsSetCache.hpp"
+#include "DnsCaptureReader.hpp"
+#include "DnsPassiveMatcher.hpp"
+#include "DnsSampleLog.hpp"
 
 
 
+/* probe_shard:
+ * the probe engine of a partition of the domains (see
+ * RecurrentDnsStatsMonitor::shard_of): its own resolver (i.e. its
+ * own socket and measuring_mutex), database connection (and
+ * domain_stats cache), schedule and anomaly detector states.
+ * Its worker threads are pinned to cpu (-1: not pinned).
+ * On the probe path the shards still share the rate limiter (lock
+ * free buckets), the NS-set cache (a rwlock and the probe_mutex of
+ * the NS-set groups, see test/bench_nsset_cache), the notifier (on
+ * alarms only), the sample log and the profiler; their state is
+ * merged to write a checkpoint
+ */
+struct probe_shard {
+  unsigned int index;
+  int cpu;
+  DnsResolver dr;
+  DnsDbHandler * ddh;
+  bool own_ddh;       // false: ddh is the monitor one (single shard)
+  DnsProbeScheduler scheduler;
+  DnsAnomalyDetector dad;
+  std::vector<uint32_t> destination_keys; // of every server probed
+  // samples since the last flush_nsset_stats / flush_resolver_stats / flush_response_stats
+  std::map<int,dns_stats> nsset_batch; // by nsset_id
+  std::map<std::pair<int,int>,resolver_stats> resolver_batch; // (domain_id, resolver_id)
+  std::map<int,response_stats> response_batch; // by domain_id
+#if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
+  pthread_mutex_t batch_mutex;
+#endif
+  probe_shard(unsigned int index, int cpu, DnsDbHandler * ddh, bool own_ddh);
+  ~probe_shard();
+};
+
+
 /* Recurrent Dns Stats Monitor:
- * this class manages a DnsDbHandler and DnsResolver
+ * this class manages a DnsDbHandler and one or more probe_shards
  * it provides a run function that initializes a db
  * and then collect dns query latency statistics (using the DnsResolver)
- * if pthreads are present every domain is analyzed in
- * a separate thread
- * otherwise operations are performed sequentially
+ * probes are timed by a DnsProbeScheduler: if pthreads are present
+ * a pool of threads serves the schedule, otherwise operations
+ * are performed sequentially
+ * with more than one shard (set_shards) the domains are partitioned
+ * by hash and every shard has its own pool of threads
+ * the domain list can be reloaded while running (reload_domains,
+ * e.g. on SIGHUP): only the difference is applied, the timers and
+ * the state of the domains that are kept are not touched
+ * if a checkpoint file is configured, the per-domain state (stats,
+ * detector, schedule phase) is saved to it periodically and
+ * restored from it at start, otherwise the stats are read
+ * from domain_stats
+ * every stage of every probe is timed by a DnsProbeProfiler, its
+ * statistics are written to probe_stage_stats periodically
+ * before a probe is sent the DnsRateLimiter is checked (globally,
+ * per destination and per NS-set of the domain), probes over the
+ * limit are handed back to the scheduler for later
+ * in NS-set dedup mode the domains sharing the same NS-set are
+ * probed as a group (see serve_probe)
+ * with a list of resolvers (set_resolvers) every probe is sent to
+ * all of them at once, each one has its own stats in resolver_stats
+ * while the first one also feeds domain_stats and the detector
+ * passive_run measures the DNS traffic of a capture (file or
+ * interface) instead of sending probes: the matched exchanges of the
+ * monitored domains go through the same detector and domain_stats
+ * the probes can carry an EDNS0 OPT record (set_edns), with response
+ * stats on the size, flags, section counts and validation time of
+ * every response go to response_stats (set_response_stats)
+ * if a sample file is configured every latency sample (probe or
+ * passive) is also appended to it, with the response metrics of the
+ * probes, for dns-latency-report
+ * every latency sample also feeds a streaming anomaly detector,
+ * the events it raises are handed to a DnsAnomalyNotifier
  */
 
 class RecurrentDnsStatsMonitor{
 private:
   DnsDbHandler ddh;
-  DnsResolver dr;
-  std::map<int,std::string> top_domains;
+  DnsDbHandler * reload_ddh; // connection of the reloads, opened at the first one
+  DnsAnomalyNotifier dan;
+  DnsProbeProfiler profiler;
+  DnsRateLimiter limiter;
+  DnsNsSetCache nsc;
+  DnsSampleLog samples;
+  bool record_samples;
+  std::vector<probe_shard *> shards; // created at the start of the run
+  std::map<int,std::string> top_domains; // owned by the thread that reloads
+  unsigned int max_num_domains;
   unsigned int dns_test_frequency; // initialized during the "run"
   unsigned int max_num_cycles;    // initialized during the "run"
+  std::string checkpoint_path;     // empty: no checkpoint
+  unsigned int checkpoint_interval; // seconds
+  double last_checkpoint;
+  unsigned int stage_stats_interval; // seconds
+  double last_stage_stats;
+  // applied to every shard by create_shards
+  std::string db_name, db_server, db_user, db_password, db_socket;
+  unsigned int db_port;
+  unsigned int num_shards;
+  bool pin_shards;
+  double anomaly_alpha, anomaly_slack, anomaly_threshold;
+  io_backend backend;
+  std::vector<std::string> resolvers;
+  std::vector<int> resolver_ids; // resolvers table id of every resolver
+  uint16_t edns_udp_size;
+  bool edns_dnssec_ok;
+  bool edns_validate;
+  bool record_responses;
+  bool nsset_dedup;
+  unsigned int domain_sample_every;
+  // query volume (NS-set dedup report)
+  std::atomic<uint64_t> num_probes_sent;
+  std::atomic<uint64_t> num_probes_skipped;
+  std::atomic<uint64_t> num_ns_lookups;
+  uint64_t last_probes_sent, last_probes_skipped, last_ns_lookups;
+  double last_batch_flush;
+  void create_shards();
+  unsigned int shard_of(int domain_id) const;
+  int resolve_nsset(const probe_task &task);
+  void request_nssets();
+  bool domain_sample_due(const probe_task &task) const;
+  void report_query_volume();
+  void flush_passive(probe_shard &shard, const DnsPassiveMatcher &matcher,
+		     std::vector<dns_stats> &batch, int current_ts);
+  void probe_domain(probe_shard &shard, const probe_task &task);
+  void serve_probe(probe_shard &shard, const probe_task &task);
+  void check_reload();
+  void schedule_domains();
+  void check_checkpoint();
+  void check_stage_stats();
+  void check_stats_batches();
+  void flush_nsset_stats();
+  void flush_resolver_stats();
+  void flush_response_stats();
+  void flush_samples();
 public:
   RecurrentDnsStatsMonitor(const char * db_name,
 			   const char * server = NULL,
 			   const char * user = NULL,
 			   const char * password = NULL,
 			   const char * socket = NULL,
-			   unsigned int port = 0);
+			   unsigned int port = 0,
+			   unsigned int num_domains = 10);
+  void set_anomaly_detection(double alpha, double slack, double threshold,
+			     const char * hook = NULL);
+  void set_checkpoint(const char * path, unsigned int interval = 60);
+  // append every latency sample to a columnar file (DnsSampleLog)
+  void set_sample_log(const char * path);
+  void save_checkpoint();
+  void set_rate_limits(double global_rate, double destination_rate,
+		       double nsset_rate, unsigned int burst = 10);
+  void set_io_backend(io_backend backend);
+  // EDNS0 payload size (0: plain queries), DO bit, RRSIG validation
+  void set_edns(uint16_t udp_size, bool dnssec_ok, bool validate = false);
+  void set_response_stats(bool enable);
+  // recursive resolvers to compare (empty: the system resolver only)
+  void set_resolvers(const std::vector<std::string> &resolvers);
+  /* probe every NS-set once per period, the domains themselves
+   * only once every sample_every periods */
+  void set_nsset_dedup(bool enable, unsigned int sample_every = 10);
+  /* num_shards probe engines (parallel_run only), optionally pinned
+   * to the cpus the process may run on (round robin) */
+  void set_shards(unsigned int num_shards, bool pin = false);
+  void set_profiling(unsigned int stats_interval = 60,
+		     const char * trace_path = NULL,
+		     unsigned int trace_sample = 1000);
+  // async-signal-safe, the reload happens in the run loop
+  static void request_reload();
+  void reload_domains();
+  /* NS lookups requested by the NS-set cache, done with dr: with
+   * wait until stop_requests, else at most max_lookups pending */
+  void prefetch_nssets(DnsResolver &dr, bool wait, unsigned int max_lookups = 0);
   void run(unsigned int frequency = 60, unsigned int cycles = 0);
+  // samples are written to domain_stats every interval (capture time)
+  void passive_run(DnsCaptureReader &reader, unsigned int interval = 60);
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
-  void single_domain_run(int domain_id, std::string domain_name);
-  void parallel_run(unsigned int frequency = 60, unsigned int cycles = 0);
+  void worker_run(probe_shard &shard);
+  void parallel_run(unsigned int frequency = 60, unsigned int cycles = 0,
+		    unsigned int num_threads = 8);
 #endif
   ~RecurrentDnsStatsMonitor();
 };
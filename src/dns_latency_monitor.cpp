@@ -25,6 +25,9 @@
 #include <iostream>
 #include <thread>
 #include <map>
+#include <vector>
+#include <string>
+#include <fstream>
 
 #include <mysql++.h>
 #include <ldns/ldns.h>
@@ -33,12 +36,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <signal.h>
      
 #include "RecurrentDnsStatsMonitor.hpp"
+#include "DnsLoadGenerator.hpp"
 
 
 /* Flag set by ‘--verbose’. */
 static int help_flag;
+static int pin_cpus_flag;
+static int nsset_dedup_flag;
+static int dnssec_flag;
+static int validate_flag;
+static int response_stats_flag;
+
+// SIGHUP: reload the domain list without restarting
+static void sighup_handler(int) {
+  RecurrentDnsStatsMonitor::request_reload();
+}
 
 static int usage() {
   std::cout << "NAME:" << std::endl;
@@ -48,11 +63,45 @@ static int usage() {
   std::cout << "\t" << "dns-latency-monitor\t --database mysql_database " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--frequency query_frequency] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--cycles max_cycles] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--num-domains max_domains] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--threads num_threads] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--shards num_shards] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--pin-cpus] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--checkpoint checkpoint_file] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--checkpoint-interval seconds] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--max-qps qps] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--max-qps-per-server qps] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--max-qps-per-nsset qps] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--rate-burst queries] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--nsset-dedup] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--domain-sample-every N] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--io-backend ldns|epoll|io_uring|auto] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--resolvers server1,server2,...] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--edns-size bytes] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--dnssec] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--validate] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--response-stats] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--pcap capture_file | --capture-interface ifname] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--sample-file samples_file] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--stage-stats-interval seconds] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--trace trace_file] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--trace-sample N] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--user mysql_user] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--password mysql_password] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--machine mysql_server_ip] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--socket mysql_socket] " << std::endl;
   std::cout << "\t" << "\t\t\t" << " [--port mysql_port] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--anomaly-alpha ewma_alpha] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--anomaly-slack cusum_k] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--anomaly-threshold cusum_h] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--anomaly-hook command] " << std::endl;
+  std::cout << "\t" << "dns-latency-monitor\t --load-qps qps [--load-duration seconds] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--load-threads num_threads] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--load-mix mix_file | --database mysql_database ...] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--load-random-prefix fraction] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--load-timeout ms] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--load-report report_file] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--resolvers server] [--edns-size bytes] [--dnssec] " << std::endl;
   std::cout << std::endl;
   std::cout << "OPTIONS:" << std::endl;
   std::cout << "\t" << "database - mysql database name (mandatory)" << std::endl;
@@ -63,28 +112,177 @@ static int usage() {
   std::cout << "\t" << "port - port used to access the mysql database " << std::endl;
   std::cout << "\t" << "frequency - DNS query frequency in seconds (default 60 s)" << std::endl;
   std::cout << "\t" << "cycles - maximum number of iterations (default 0, i.e. infinite process)" << std::endl;
+  std::cout << "\t" << "num-domains - number of top domains to monitor (default 10)" << std::endl;
+  std::cout << "\t" << "threads - number of probing threads (default 8)" << std::endl;
+  std::cout << "\t" << "shards - number of probe engines, the domains are partitioned among" << std::endl;
+  std::cout << "\t" << "         them and so are the threads (default 1)" << std::endl;
+  std::cout << "\t" << "pin-cpus - pin the threads of every shard to one cpu" << std::endl;
+  std::cout << "\t" << "checkpoint - file where the in-process state is saved, and restored at start" << std::endl;
+  std::cout << "\t" << "checkpoint-interval - seconds between two checkpoints (default 60)" << std::endl;
+  std::cout << "\t" << "max-qps - maximum queries per second overall (default 0, i.e. no limit)" << std::endl;
+  std::cout << "\t" << "max-qps-per-server - maximum queries per second to the resolver (default 0)" << std::endl;
+  std::cout << "\t" << "max-qps-per-nsset - maximum queries per second for the domains sharing" << std::endl;
+  std::cout << "\t" << "                    the same authoritative NS-set (default 0)" << std::endl;
+  std::cout << "\t" << "rate-burst - queries allowed in a burst by each limit (default 10)" << std::endl;
+  std::cout << "\t" << "nsset-dedup - probe the domains sharing an authoritative NS-set as a group:" << std::endl;
+  std::cout << "\t" << "              one probe per NS-set per period, results in nsset_stats" << std::endl;
+  std::cout << "\t" << "domain-sample-every - with nsset-dedup, probe every domain itself once" << std::endl;
+  std::cout << "\t" << "                      every N periods (default 10)" << std::endl;
+  std::cout << "\t" << "io-backend - how queries are sent: ldns (blocking, the default), epoll," << std::endl;
+  std::cout << "\t" << "             io_uring or auto, i.e. io_uring if supported, else epoll" << std::endl;
+  std::cout << "\t" << "resolvers - compare these recursive resolvers: every probe is sent to all of" << std::endl;
+  std::cout << "\t" << "            them at the same moment, results per resolver in resolver_stats;" << std::endl;
+  std::cout << "\t" << "            a server is \"system\" (resolv.conf) or address[#port], the first" << std::endl;
+  std::cout << "\t" << "            one also feeds domain_stats (default: system resolver only)" << std::endl;
+  std::cout << "\t" << "edns-size - send an EDNS0 OPT record with this UDP payload size (default 0," << std::endl;
+  std::cout << "\t" << "            i.e. plain queries; at most 4096)" << std::endl;
+  std::cout << "\t" << "dnssec - set the DO bit (EDNS0, payload size 1232 unless edns-size is given)" << std::endl;
+  std::cout << "\t" << "validate - with dnssec, time the verification of the RRSIGs of every" << std::endl;
+  std::cout << "\t" << "           response with the DNSKEYs of the signer zone" << std::endl;
+  std::cout << "\t" << "response-stats - keep the size, TC flag, section counts and validation time" << std::endl;
+  std::cout << "\t" << "                 of the responses per domain in response_stats (implied" << std::endl;
+  std::cout << "\t" << "                 by edns-size, dnssec and validate)" << std::endl;
+  std::cout << "\t" << "pcap - passive mode: measure the DNS exchanges of a pcap or pcapng file" << std::endl;
+  std::cout << "\t" << "       instead of sending probes (frequency: seconds between two writes)" << std::endl;
+  std::cout << "\t" << "capture-interface - passive mode on the live UDP port 53 traffic of an" << std::endl;
+  std::cout << "\t" << "                    interface (AF_PACKET ring, needs CAP_NET_RAW)" << std::endl;
+  std::cout << "\t" << "sample-file - also append every latency sample to this columnar file," << std::endl;
+  std::cout << "\t" << "              with the response metrics of the probes, for dns-latency-report" << std::endl;
+  std::cout << "\t" << "stage-stats-interval - seconds between two exports of the probe stage" << std::endl;
+  std::cout << "\t" << "                       statistics to probe_stage_stats (default 60)" << std::endl;
+  std::cout << "\t" << "trace - write a Chrome trace / perfetto JSON file of sampled probes" << std::endl;
+  std::cout << "\t" << "trace-sample - trace one probe every N (default 1000)" << std::endl;
+  std::cout << "\t" << "anomaly-alpha - smoothing factor of the EWMA latency baseline (default 0.05)" << std::endl;
+  std::cout << "\t" << "anomaly-slack - CUSUM slack, in baseline stdevs (default 0.5)" << std::endl;
+  std::cout << "\t" << "anomaly-threshold - CUSUM alarm threshold, in baseline stdevs (default 5)" << std::endl;
+  std::cout << "\t" << "anomaly-hook - shell command run for every anomaly, the event is" << std::endl;
+  std::cout << "\t" << "               passed in DNS_ANOMALY_* environment variables" << std::endl;
+  std::cout << "\t" << "load-qps - load test mode: send the probe queries to the first resolver at" << std::endl;
+  std::cout << "\t" << "           this fixed rate (open loop) and write an HDR latency report;" << std::endl;
+  std::cout << "\t" << "           the latency is measured from the intended send time" << std::endl;
+  std::cout << "\t" << "load-duration - seconds of load (default 10)" << std::endl;
+  std::cout << "\t" << "load-threads - number of sending threads, 1 to 256 (default 1); a thread" << std::endl;
+  std::cout << "\t" << "               has at most 256 sockets, i.e. qps x timeout / threads is" << std::endl;
+  std::cout << "\t" << "               at most 8388608 (ids of a socket kept for twice the timeout)" << std::endl;
+  std::cout << "\t" << "load-mix - file of \"domain [weight]\" lines, the domains to query and their" << std::endl;
+  std::cout << "\t" << "           relative frequencies (default: the num-domains top domains of" << std::endl;
+  std::cout << "\t" << "           the database, with the same weight)" << std::endl;
+  std::cout << "\t" << "load-random-prefix - fraction of the queries with a random first label," << std::endl;
+  std::cout << "\t" << "                     i.e. resolver cache misses (default 0)" << std::endl;
+  std::cout << "\t" << "load-timeout - milliseconds before a query is counted as lost (default 1000)" << std::endl;
+  std::cout << "\t" << "load-report - file of the report (default: standard output)" << std::endl;
 
+  std::cout << std::endl;
+  std::cout << "SIGNALS:" << std::endl;
+  std::cout << "\t" << "SIGHUP - reload the domain list (only the differences are applied)" << std::endl;
   std::cout << std::endl;
 
   return 0;
 }
 
 
+// load test mode (--load-qps): no monitoring, no database unless it lists the domains
+static int load_test(double qps, double duration, unsigned int num_threads,
+		     const char * mix, double random_prefix, unsigned int timeout,
+		     const char * report, const std::vector<std::string> &resolvers,
+		     unsigned int edns_size, bool dnssec_ok, const char * db_name,
+		     const char * server, const char * user, const char * password,
+		     const char * socket, unsigned int port, unsigned int num_domains) {
+  std::vector<std::string> names;
+  std::vector<double> weights;
+  try {
+    if(mix != NULL) {
+      DnsLoadGenerator::read_mix(mix, names, weights);
+    }
+    else if(db_name != NULL) {
+      DnsDbHandler ddh(db_name, server, user, password, socket, port);
+      std::map<int,std::string> top = ddh.get_top_n_domains(num_domains);
+      std::map<int,std::string>::iterator it;
+      for(it = top.begin(); it != top.end(); it++) {
+	names.push_back(it->second);
+      }
+    }
+    else {
+      std::cout << "load-qps needs a load-mix file or a database" << std::endl;
+      return usage();
+    }
+    DnsResolver dr;
+    dr.set_edns(edns_size, dnssec_ok);
+    DnsLoadGenerator lg;
+    lg.set_target(dr, resolvers.empty() ? std::string("system") : resolvers[0]);
+    lg.set_domains(dr, names, weights);
+    lg.set_random_prefix(random_prefix);
+    lg.set_timeout(timeout);
+    lg.run(qps, duration, num_threads);
+    if(report != NULL) {
+      std::ofstream out(report);
+      if(!out) {
+	throw std::string("Can't open load report ") + report;
+      }
+      lg.write_report(out);
+    }
+    else {
+      lg.write_report(std::cout);
+    }
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+
 int main(int argc, char * argv[]) {
 
   unsigned int frequency = 60;
   unsigned int cycles = 0;
+  unsigned int num_domains = 10;
+  unsigned int num_threads = 8;
+  unsigned int num_shards = 1;
+  char * checkpoint = NULL;
+  unsigned int checkpoint_interval = 60;
+  double max_qps = 0;
+  double max_qps_per_server = 0;
+  double max_qps_per_nsset = 0;
+  unsigned int rate_burst = 10;
+  unsigned int domain_sample_every = 10;
+  io_backend backend = IO_BACKEND_LDNS;
+  std::vector<std::string> resolvers;
+  unsigned int edns_size = 0;
+  char * pcap = NULL;
+  char * capture_interface = NULL;
+  char * sample_file = NULL;
+  unsigned int stage_stats_interval = 60;
+  char * trace = NULL;
+  unsigned int trace_sample = 1000;
   char * db_name = NULL;
   char * server = NULL;
   char * user = NULL;
   char * password = NULL;
   char * socket = NULL;
   unsigned int port = 0;
+  double anomaly_alpha = 0.05;
+  double anomaly_slack = 0.5;
+  double anomaly_threshold = 5.0;
+  char * anomaly_hook = NULL;
+  double load_qps = 0;
+  double load_duration = 10;
+  unsigned int load_threads = 1;
+  char * load_mix = NULL;
+  double load_random_prefix = 0;
+  unsigned int load_timeout = 1000;
+  char * load_report = NULL;
   int c;
 
   struct option long_options[] =  {
     /* These options set a flag. */
     {"help", no_argument, &help_flag, 1},
+    {"pin-cpus", no_argument, &pin_cpus_flag, 1},
+    {"nsset-dedup", no_argument, &nsset_dedup_flag, 1},
+    {"dnssec", no_argument, &dnssec_flag, 1},
+    {"validate", no_argument, &validate_flag, 1},
+    {"response-stats", no_argument, &response_stats_flag, 1},
     /* These options don't set a flag. */
     {"frequency", required_argument, 0, 'f'},
     {"database",  required_argument, 0, 'd'},
@@ -94,6 +292,36 @@ int main(int argc, char * argv[]) {
     {"socket",    required_argument, 0, 's'},
     {"port",      required_argument, 0, 'o'},
     {"cycles",    required_argument, 0, 'c'},
+    {"num-domains", required_argument, 0, 'n'},
+    {"threads",   required_argument, 0, 'j'},
+    {"shards",    required_argument, 0, 'P'},
+    {"checkpoint", required_argument, 0, 'C'},
+    {"checkpoint-interval", required_argument, 0, 'I'},
+    {"max-qps",   required_argument, 0, 'q'},
+    {"max-qps-per-server", required_argument, 0, 'Q'},
+    {"max-qps-per-nsset", required_argument, 0, 'N'},
+    {"rate-burst", required_argument, 0, 'B'},
+    {"domain-sample-every", required_argument, 0, 'G'},
+    {"io-backend", required_argument, 0, 'b'},
+    {"resolvers", required_argument, 0, 'R'},
+    {"edns-size", required_argument, 0, 'E'},
+    {"pcap",      required_argument, 0, 'F'},
+    {"capture-interface", required_argument, 0, 'i'},
+    {"sample-file", required_argument, 0, 'L'},
+    {"stage-stats-interval", required_argument, 0, 'S'},
+    {"trace",     required_argument, 0, 'T'},
+    {"trace-sample", required_argument, 0, 'r'},
+    {"anomaly-alpha",     required_argument, 0, 'a'},
+    {"anomaly-slack",     required_argument, 0, 'k'},
+    {"anomaly-threshold", required_argument, 0, 't'},
+    {"anomaly-hook",      required_argument, 0, 'x'},
+    {"load-qps",      required_argument, 0, 'g'},
+    {"load-duration", required_argument, 0, 'D'},
+    {"load-threads",  required_argument, 0, 'w'},
+    {"load-mix",      required_argument, 0, 'M'},
+    {"load-random-prefix", required_argument, 0, 'X'},
+    {"load-timeout",  required_argument, 0, 'W'},
+    {"load-report",   required_argument, 0, 'O'},
     // Terminate the array with an element containing all zero
       {0, 0, 0, 0}
     };
@@ -108,6 +336,84 @@ int main(int argc, char * argv[]) {
     case 'c':
       cycles = atoi(optarg);     
       break;     
+    case 'n':
+      num_domains = atoi(optarg);
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'P':
+      num_shards = atoi(optarg);
+      break;
+    case 'C':
+      checkpoint = strdup(optarg);
+      break;
+    case 'I':
+      checkpoint_interval = atoi(optarg);
+      break;
+    case 'q':
+      max_qps = atof(optarg);
+      break;
+    case 'Q':
+      max_qps_per_server = atof(optarg);
+      break;
+    case 'N':
+      max_qps_per_nsset = atof(optarg);
+      break;
+    case 'B':
+      rate_burst = atoi(optarg);
+      break;
+    case 'G':
+      domain_sample_every = atoi(optarg);
+      break;
+    case 'b':
+      if(!DnsUdpTransport::parse_backend(optarg, backend)) {
+	std::cout << "unknown io backend " << optarg << std::endl;
+	return usage();
+      }
+      break;
+    case 'R':
+      {
+	// comma separated list
+	std::string list(optarg);
+	size_t start = 0;
+	while(start <= list.size()) {
+	  size_t end = list.find(',', start);
+	  if(end == std::string::npos) {
+	    end = list.size();
+	  }
+	  if(end > start) {
+	    resolvers.push_back(list.substr(start, end - start));
+	  }
+	  start = end + 1;
+	}
+      }
+      break;
+    case 'E':
+      edns_size = atoi(optarg);
+      if(edns_size > 65535) {
+	std::cout << "edns-size out of range" << std::endl;
+	return usage();
+      }
+      break;
+    case 'F':
+      pcap = strdup(optarg);
+      break;
+    case 'i':
+      capture_interface = strdup(optarg);
+      break;
+    case 'L':
+      sample_file = strdup(optarg);
+      break;
+    case 'S':
+      stage_stats_interval = atoi(optarg);
+      break;
+    case 'T':
+      trace = strdup(optarg);
+      break;
+    case 'r':
+      trace_sample = atoi(optarg);
+      break;
     case 'd':
       db_name = strdup(optarg);
       break;     
@@ -126,6 +432,60 @@ int main(int argc, char * argv[]) {
     case 'o':
       port = atoi(optarg);     
       break;     
+    case 'a':
+      anomaly_alpha = atof(optarg);
+      break;
+    case 'k':
+      anomaly_slack = atof(optarg);
+      break;
+    case 't':
+      anomaly_threshold = atof(optarg);
+      break;
+    case 'x':
+      anomaly_hook = strdup(optarg);
+      break;
+    case 'g':
+      load_qps = atof(optarg);
+      if(!(load_qps > 0)) {
+	std::cout << "load-qps out of range" << std::endl;
+	return usage();
+      }
+      break;
+    case 'D':
+      load_duration = atof(optarg);
+      break;
+    case 'w':
+      {
+	int n = atoi(optarg);
+	if(n <= 0 || n > (int) DnsLoadGenerator::MAX_THREADS) {
+	  std::cout << "load-threads out of range" << std::endl;
+	  return usage();
+	}
+	load_threads = n;
+      }
+      break;
+    case 'M':
+      load_mix = strdup(optarg);
+      break;
+    case 'X':
+      load_random_prefix = atof(optarg);
+      break;
+    case 'W':
+      {
+	int ms = atoi(optarg);
+	if(ms <= 0) {
+	  std::cout << "load-timeout out of range" << std::endl;
+	  return usage();
+	}
+	load_timeout = ms;
+      }
+      break;
+    case 'O':
+      load_report = strdup(optarg);
+      break;
+    case 0:
+      // flag options (--help is handled below)
+      break;
     case '?':
     default:
       /* getopt_long already printed an error message. */
@@ -137,17 +497,62 @@ int main(int argc, char * argv[]) {
     }     
   }
 
+  if(load_qps > 0) {
+    int r = load_test(load_qps, load_duration, load_threads, load_mix, load_random_prefix,
+		      load_timeout, load_report, resolvers, edns_size, dnssec_flag, db_name,
+		      server, user, password, socket, port, num_domains);
+    if(db_name != NULL) { free(db_name); }
+    if(server != NULL) { free(server); }
+    if(user != NULL) { free(user); }
+    if(password != NULL) { free(password); }
+    if(socket != NULL) { free(socket); }
+    if(load_mix != NULL) { free(load_mix); }
+    if(load_report != NULL) { free(load_report); }
+    return r;
+  }
   if(db_name == NULL) {
     std::cout << "database name is a mandatory option" << std::endl;
     return usage();
   }
   try{
-    RecurrentDnsStatsMonitor rdsm(db_name, server, user, password, socket, port);
+    RecurrentDnsStatsMonitor rdsm(db_name, server, user, password, socket, port, num_domains);
+    rdsm.set_anomaly_detection(anomaly_alpha, anomaly_slack, anomaly_threshold, anomaly_hook);
+    rdsm.set_checkpoint(checkpoint, checkpoint_interval);
+    rdsm.set_rate_limits(max_qps, max_qps_per_server, max_qps_per_nsset, rate_burst);
+    rdsm.set_nsset_dedup(nsset_dedup_flag, domain_sample_every);
+    rdsm.set_io_backend(backend);
+    rdsm.set_edns(edns_size, dnssec_flag, validate_flag);
+    rdsm.set_response_stats(response_stats_flag || edns_size > 0 || dnssec_flag || validate_flag);
+    rdsm.set_resolvers(resolvers);
+    rdsm.set_shards(num_shards, pin_cpus_flag);
+    rdsm.set_profiling(stage_stats_interval, trace, trace_sample);
+    if(sample_file != NULL) {
+      rdsm.set_sample_log(sample_file);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sighup_handler;
+    // the system calls it interrupts are restarted
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    if(pcap != NULL || capture_interface != NULL) {
+      DnsCaptureReader reader;
+      if(pcap != NULL) {
+	reader.open_file(pcap);
+      }
+      else {
+	reader.open_interface(capture_interface);
+      }
+      rdsm.passive_run(reader, frequency);
+    }
+    else {
 #if defined(HAVE_PTHREAD_H) && HAVE_PTHREAD_H == 1
-    rdsm.parallel_run(frequency,cycles);
+      rdsm.parallel_run(frequency,cycles,num_threads);
 #else
-    rdsm.run(frequency,cycles);
+      rdsm.run(frequency,cycles);
 #endif
+    }
   } 
   catch(std::string s) {
     std::cerr << s << std::endl;
@@ -159,6 +564,14 @@ int main(int argc, char * argv[]) {
   if(user != NULL) { free(user); }
   if(password != NULL) { free(password); }
   if(socket != NULL) { free(socket); }
+  if(anomaly_hook != NULL) { free(anomaly_hook); }
+  if(checkpoint != NULL) { free(checkpoint); }
+  if(trace != NULL) { free(trace); }
+  if(pcap != NULL) { free(pcap); }
+  if(capture_interface != NULL) { free(capture_interface); }
+  if(sample_file != NULL) { free(sample_file); }
+  if(load_mix != NULL) { free(load_mix); }
+  if(load_report != NULL) { free(load_report); }
 
   return 0;
 }
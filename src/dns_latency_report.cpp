@@ -0,0 +1,242 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+
+#include "dns_latency_monitor-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "DnsLatencyReport.hpp"
+
+
+static int help_flag;
+static int response_metrics_flag;
+
+static int usage() {
+  std::cout << "NAME:" << std::endl;
+  std::cout << "\t" << "dns-latency-report - per-domain, per-window latency aggregates of recorded samples" << std::endl;
+  std::cout << std::endl;
+  std::cout << "SYNOPSIS:" << std::endl;
+  std::cout << "\t" << "dns-latency-report\t --samples samples_file | --csv csv_file " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--window seconds] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--from time] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--to time] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--percentiles p1,p2,...] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--threads num_threads] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--response-metrics] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--format csv|json] " << std::endl;
+  std::cout << "\t" << "\t\t\t" << " [--output output_file] " << std::endl;
+  std::cout << std::endl;
+  std::cout << "OPTIONS:" << std::endl;
+  std::cout << "\t" << "samples - sample file written by dns-latency-monitor --sample-file" << std::endl;
+  std::cout << "\t" << "          (can be repeated)" << std::endl;
+  std::cout << "\t" << "csv - samples exported from mysql, one domain_id,ts,latency per line," << std::endl;
+  std::cout << "\t" << "      comma or tab separated, NULL or \\N latency: failed query" << std::endl;
+  std::cout << "\t" << "      (can be repeated)" << std::endl;
+  std::cout << "\t" << "window - length of the windows in seconds, aligned to the epoch" << std::endl;
+  std::cout << "\t" << "         (default 3600, 0: one window for the whole range)" << std::endl;
+  std::cout << "\t" << "from, to - only the samples with from <= ts < to, a time is unix time" << std::endl;
+  std::cout << "\t" << "           or \"YYYY-MM-DD HH:MM:SS\" UTC (default: all the samples)" << std::endl;
+  std::cout << "\t" << "percentiles - percentiles to compute (default 50,90,99)" << std::endl;
+  std::cout << "\t" << "threads - number of scanning threads (default: number of cpus)" << std::endl;
+  std::cout << "\t" << "response-metrics - also the averages and counts of the responses (size, TC," << std::endl;
+  std::cout << "\t" << "                   EDNS, DO, rcodes, section counts, validation time)," << std::endl;
+  std::cout << "\t" << "                   recorded in the sample files of version 2 only" << std::endl;
+  std::cout << "\t" << "format - output format (default csv)" << std::endl;
+  std::cout << "\t" << "output - output file (default: standard output)" << std::endl;
+  std::cout << std::endl;
+
+  return 0;
+}
+
+
+static bool parse_time_option(const char * arg, uint32_t &ts) {
+  const char * end = DnsLatencyReport::parse_time(arg, ts);
+  return end != NULL && *end == '\0';
+}
+
+
+int main(int argc, char * argv[]) {
+
+  std::vector<std::string> sample_files;
+  std::vector<std::string> csv_files;
+  unsigned int window = 3600;
+  uint32_t from = 0;
+  uint32_t to = UINT32_MAX;
+  std::vector<double> percentiles;
+  unsigned int num_threads = 0;
+  std::string format = "csv";
+  char * output = NULL;
+  int c;
+
+  struct option long_options[] =  {
+    /* These options set a flag. */
+    {"help", no_argument, &help_flag, 1},
+    {"response-metrics", no_argument, &response_metrics_flag, 1},
+    /* These options don't set a flag. */
+    {"samples",   required_argument, 0, 'l'},
+    {"csv",       required_argument, 0, 'c'},
+    {"window",    required_argument, 0, 'w'},
+    {"from",      required_argument, 0, 'f'},
+    {"to",        required_argument, 0, 't'},
+    {"percentiles", required_argument, 0, 'p'},
+    {"threads",   required_argument, 0, 'j'},
+    {"format",    required_argument, 0, 'F'},
+    {"output",    required_argument, 0, 'o'},
+    // Terminate the array with an element containing all zero
+      {0, 0, 0, 0}
+    };
+
+  int option_index = 0;
+  while((c = getopt_long (argc, argv, "l:c:w:f:t:p:j:F:o:",
+			  long_options, &option_index)) != -1) {
+    switch (c){
+    case 'l':
+      sample_files.push_back(optarg);
+      break;
+    case 'c':
+      csv_files.push_back(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'f':
+      if(!parse_time_option(optarg, from)) {
+	std::cout << "bad time " << optarg << std::endl;
+	return usage();
+      }
+      break;
+    case 't':
+      if(!parse_time_option(optarg, to)) {
+	std::cout << "bad time " << optarg << std::endl;
+	return usage();
+      }
+      break;
+    case 'p':
+      {
+	// comma separated list
+	std::string list(optarg);
+	size_t start = 0;
+	while(start <= list.size()) {
+	  size_t end = list.find(',', start);
+	  if(end == std::string::npos) {
+	    end = list.size();
+	  }
+	  if(end > start) {
+	    percentiles.push_back(atof(list.substr(start, end - start).c_str()));
+	  }
+	  start = end + 1;
+	}
+      }
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'F':
+      format = optarg;
+      if(format != "csv" && format != "json") {
+	std::cout << "unknown format " << optarg << std::endl;
+	return usage();
+      }
+      break;
+    case 'o':
+      output = strdup(optarg);
+      break;
+    case 0:
+      // flag options (--help is handled below)
+      break;
+    case '?':
+    default:
+      /* getopt_long already printed an error message. */
+      // unrecognized option
+      return usage();
+    }
+    if(help_flag) {
+      return usage();
+    }
+  }
+
+  if(sample_files.empty() && csv_files.empty()) {
+    std::cout << "at least one samples or csv file is mandatory" << std::endl;
+    return usage();
+  }
+  int ret = 0;
+  try{
+    DnsLatencyReport dlr;
+    dlr.set_window(window);
+    dlr.set_range(from, to);
+    if(!percentiles.empty()) {
+      dlr.set_percentiles(percentiles);
+    }
+    if(num_threads > 0) {
+      dlr.set_threads(num_threads);
+    }
+    dlr.set_response_metrics(response_metrics_flag);
+    for(size_t i = 0; i < sample_files.size(); i++) {
+      dlr.add_sample_file(sample_files[i].c_str());
+    }
+    for(size_t i = 0; i < csv_files.size(); i++) {
+      dlr.add_csv_file(csv_files[i].c_str());
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    std::vector<report_row> rows;
+    dlr.compute(rows);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    std::cerr << dlr.num_samples() << " samples, " << rows.size() << " rows in "
+	      << elapsed << " s" << std::endl;
+    std::ofstream out;
+    if(output != NULL) {
+      out.open(output);
+      if(!out) {
+	throw std::string("Can't open ") + output;
+      }
+    }
+    std::ostream &os = (output != NULL) ? out : std::cout;
+    if(format == "json") {
+      dlr.write_json(os, rows);
+    }
+    else {
+      dlr.write_csv(os, rows);
+    }
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    ret = 1;
+  }
+
+  // cleaning up str parameters
+  if(output != NULL) { free(output); }
+
+  return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* bench_anomaly_detector:
+ * cost of DnsAnomalyDetector::update, the per-sample work on the
+ * probe path, with n domains (default 1M) updated in a random order
+ * usage: bench_anomaly_detector [num_domains] [num_updates] */
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "DnsAnomalyDetector.hpp"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char * argv[]) {
+  int num_domains = (argc > 1) ? atoi(argv[1]) : 1000000;
+  long num_updates = (argc > 2) ? atol(argv[2]) : 5000000;
+  if(num_domains <= 0 || num_updates <= 0) {
+    std::cerr << "usage: bench_anomaly_detector [num_domains] [num_updates]" << std::endl;
+    return 1;
+  }
+  DnsAnomalyDetector dad;
+  std::vector<int> ids(num_domains);
+  for(int i = 0; i < num_domains; i++) {
+    ids[i] = i;
+  }
+  dad.add_domains(ids);
+  // the domain ids and latencies are drawn beforehand
+  std::vector<int> order(1 << 20);
+  std::vector<double> latency(1 << 20);
+  srand(1);
+  for(size_t i = 0; i < order.size(); i++) {
+    order[i] = rand() % num_domains;
+    latency[i] = 10 + (rand() % 1000) / 100.0;
+  }
+  anomaly_event ev;
+  long alarms = 0;
+  double start = now();
+  for(long i = 0; i < num_updates; i++) {
+    size_t j = i & (order.size() - 1);
+    alarms += dad.update(order[j], latency[j], (int) (i >> 20), ev) ? 1 : 0;
+  }
+  double elapsed = now() - start;
+  printf("%d domains, %ld updates in %.3f s: %.1f ns/update, %ld alarms\n",
+	 num_domains, num_updates, elapsed, elapsed * 1e9 / num_updates, alarms);
+  return 0;
+}
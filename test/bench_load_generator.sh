@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# dns-latency-monitor
+#
+# Chiara Orsini
+# chiara@caida.org
+#
+# This file is part of dns-latency-monitor.
+#
+# dns-latency-monitor is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# dns-latency-monitor is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+#
+
+# bench_load_generator.sh:
+# checks that the load generator sustains a rate against a stand-in
+# server (dns_responder, every query answered at once, 127.0.0.1):
+# dns-latency-monitor --load-qps is run for the duration with the
+# domains of data/load_mix.txt (20% random first labels), the report
+# goes to load_report.hgrm and its summary to the standard output;
+# the exit status is 1 if less than 99% of the rate was sent
+# run in the test build directory after make check
+# usage: bench_load_generator.sh [qps] [load_threads] [duration] [port]
+# (default 200000 2 10 5353)
+
+QPS=${1:-200000}
+THREADS=${2:-2}
+DURATION=${3:-10}
+PORT=${4:-5353}
+SRCDIR=${srcdir:-$(dirname "$0")}
+MONITOR=${MONITOR:-../src/dns-latency-monitor}
+RESPONDER=${RESPONDER:-./dns_responder}
+REPORT=load_report.hgrm
+
+$RESPONDER $PORT $THREADS &
+RESPONDER_PID=$!
+trap 'kill $RESPONDER_PID 2>/dev/null' EXIT
+sleep 1
+
+$MONITOR --load-qps $QPS --load-threads $THREADS --load-duration $DURATION \
+    --load-mix "$SRCDIR/data/load_mix.txt" --load-random-prefix 0.2 \
+    --resolvers 127.0.0.1#$PORT --load-report $REPORT || exit 1
+grep '^# ' $REPORT
+
+# "# sent N in S s (Q qps), ..."
+SENT_QPS=$(sed -n 's/^# sent [0-9]* in [0-9.]* s (\([0-9]*\) qps).*/\1/p' $REPORT)
+if [ -z "$SENT_QPS" ] || [ $((SENT_QPS * 100)) -lt $((QPS * 99)) ]; then
+    echo "FAIL: $SENT_QPS qps sent, $QPS qps asked"
+    exit 1
+fi
+echo "OK: $SENT_QPS qps sent, $QPS qps asked"
@@ -0,0 +1,108 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *
+ */
+
+/* bench_nsset_cache:
+ * cost of the DnsNsSetCache calls on the probe path (get_nsset and
+ * claim_group_probe), the state all the shards share, with 1, 2, 4
+ * ... num_threads threads probing at the same time: the growth of
+ * the ns per call with the threads is the lock contention
+ * usage: bench_nsset_cache [num_threads] [num_domains] [calls_per_thread] */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "DnsNsSetCache.hpp"
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct bench_arg {
+  DnsNsSetCache * nsc;
+  const std::vector<std::string> * names;
+  long calls;
+  unsigned int seed;
+};
+
+static void * bench_run(void * arg) {
+  bench_arg * b = (bench_arg *) arg;
+  std::time_t t = std::time(NULL);
+  for(long i = 0; i < b->calls; i++) {
+    int domain_id = rand_r(&b->seed) % b->names->size();
+    int nsset_id = b->nsc->get_nsset(domain_id, (*b->names)[domain_id], t);
+    if(nsset_id >= 0) {
+      b->nsc->claim_group_probe(nsset_id, (double) (i / 1000), 1.0);
+    }
+  }
+  return NULL;
+}
+
+
+int main(int argc, char * argv[]) {
+  int max_threads = (argc > 1) ? atoi(argv[1]) : 8;
+  int num_domains = (argc > 2) ? atoi(argv[2]) : 100000;
+  long calls = (argc > 3) ? atol(argv[3]) : 2000000;
+  if(max_threads <= 0 || num_domains <= 0 || calls <= 0) {
+    std::cerr << "usage: bench_nsset_cache [num_threads] [num_domains] [calls_per_thread]"
+	      << std::endl;
+    return 1;
+  }
+  // 100 domains per NS-set, as with the large providers
+  DnsNsSetCache nsc;
+  std::vector<std::string> names(num_domains);
+  std::time_t t = std::time(NULL);
+  for(int i = 0; i < num_domains; i++) {
+    std::ostringstream name, ns;
+    name << "domain" << i << ".example.";
+    names[i] = name.str();
+    ns << "ns" << i / 100 << ".provider.example.";
+    std::vector<std::string> ns_names(1, ns.str());
+    nsc.set_nsset(i, ns_names, t);
+  }
+  for(int n = 1; n <= max_threads; n *= 2) {
+    std::vector<pthread_t> threads(n);
+    std::vector<bench_arg> args(n);
+    double start = now();
+    for(int i = 0; i < n; i++) {
+      args[i].nsc = &nsc;
+      args[i].names = &names;
+      args[i].calls = calls;
+      args[i].seed = i + 1;
+      pthread_create(&threads[i], NULL, bench_run, &args[i]);
+    }
+    for(int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    double elapsed = now() - start;
+    printf("%d threads, %d domains: %.1f ns/call per thread, %.2f M calls/s\n",
+	   n, num_domains, elapsed * 1e9 / calls, n * calls / elapsed / 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *
+ */
+
+/* dns_responder:
+ * a stand-in DNS server for the load tests (bench_load_generator.sh):
+ * every query is sent back as its own NOERROR response (QR and RA
+ * set, nothing added), in batches (recvmmsg/sendmmsg), so that the
+ * latency measured is the one of the generator and of the kernel
+ * every thread has its own socket on the same port (SO_REUSEPORT),
+ * the kernel spreads the generator sockets among them
+ * usage: dns_responder [port] [num_threads] (default 5353 1, 127.0.0.1) */
+
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BATCH_SIZE 64
+#define MAX_MESSAGE_SIZE 1232
+
+static void * respond(void * arg) {
+  int fd = *(int *) arg;
+  static __thread uint8_t buffers[BATCH_SIZE][MAX_MESSAGE_SIZE];
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iovs[BATCH_SIZE];
+  struct sockaddr_storage from[BATCH_SIZE];
+  while(true) {
+    memset(msgs, 0, sizeof(msgs));
+    for(int i = 0; i < BATCH_SIZE; i++) {
+      iovs[i].iov_base = buffers[i];
+      iovs[i].iov_len = MAX_MESSAGE_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &from[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+    }
+    int n = recvmmsg(fd, msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+    if(n <= 0) {
+      continue;
+    }
+    int m = 0;
+    for(int i = 0; i < n; i++) {
+      if(msgs[i].msg_len < 12) {
+	continue; // not even a header
+      }
+      buffers[i][2] |= 0x80; // QR
+      buffers[i][3] = 0x80;  // RA, NOERROR
+      iovs[i].iov_len = msgs[i].msg_len;
+      if(m != i) {
+	msgs[m] = msgs[i];
+      }
+      m++;
+    }
+    int sent = 0;
+    while(sent < m) {
+      int r = sendmmsg(fd, msgs + sent, m - sent, 0);
+      if(r < 0) {
+	break; // e.g. the generator has gone: the rest is lost
+      }
+      sent += r;
+    }
+  }
+  return NULL;
+}
+
+
+int main(int argc, char * argv[]) {
+  int port = (argc > 1) ? atoi(argv[1]) : 5353;
+  int num_threads = (argc > 2) ? atoi(argv[2]) : 1;
+  if(port <= 0 || port > 65535 || num_threads <= 0) {
+    std::cerr << "usage: dns_responder [port] [num_threads]" << std::endl;
+    return 1;
+  }
+  std::vector<int> fds(num_threads);
+  for(int t = 0; t < num_threads; t++) {
+    fds[t] = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    int size = 8 << 20;
+    setsockopt(fds[t], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    setsockopt(fds[t], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fds[t], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof(a));
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(fds[t] < 0 || bind(fds[t], (struct sockaddr *) &a, sizeof(a)) < 0) {
+      std::cerr << "Can't bind 127.0.0.1#" << port << ": " << strerror(errno) << std::endl;
+      return 1;
+    }
+  }
+  std::vector<pthread_t> threads(num_threads);
+  for(int t = 1; t < num_threads; t++) {
+    if(pthread_create(&threads[t], NULL, respond, &fds[t]) != 0) {
+      std::cerr << "Can't start thread " << t << std::endl;
+      return 1;
+    }
+  }
+  respond(&fds[0]);
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with dns-latency-monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* test_anomaly_detector:
+ * feeds DnsAnomalyDetector synthetic latency series and checks
+ * when it raises alarms and how it restarts the baseline after one */
+
+#include <iostream>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+
+#include "DnsAnomalyDetector.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+    if(!(cond)) {							\
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond << std::endl; \
+      failures++;							\
+    }									\
+  } while(0)
+
+
+// gaussian noise (Box-Muller) around avg
+static double sample(double avg, double stdev) {
+  double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+  return avg + stdev * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+
+static anomaly_state state_of(DnsAnomalyDetector &dad, int domain_id) {
+  std::vector<std::pair<int,anomaly_state> > states;
+  dad.export_states(states);
+  for(size_t i = 0; i < states.size(); i++) {
+    if(states[i].first == domain_id) {
+      return states[i].second;
+    }
+  }
+  anomaly_state none = anomaly_state();
+  return none;
+}
+
+
+int main() {
+  srand(1);
+  /* h = 10: with the default h = 5 CUSUM raises a false alarm
+   * every ~1000 stable samples, too often for exact checks */
+  DnsAnomalyDetector dad(0.05, 0.5, 10.0, 10);
+  dad.add_domain(1);
+  anomaly_event ev;
+  int ts = 0;
+
+  // a stable baseline: no alarm
+  int alarms = 0;
+  for(int i = 0; i < 2000; i++) {
+    alarms += dad.update(1, sample(20, 2), ts++, ev) ? 1 : 0;
+  }
+  CHECK(alarms == 0);
+  anomaly_state st = state_of(dad, 1);
+  CHECK(fabs(st.ewma - 20) < 1);
+  CHECK(sqrt(st.ewmvar) > 1 && sqrt(st.ewmvar) < 3);
+
+  // failed probes are not samples
+  CHECK(!dad.update(1, -1, ts++, ev));
+  CHECK(state_of(dad, 1).num_samples == st.num_samples);
+
+  // a single outlier does not raise an alarm
+  CHECK(!dad.update(1, 500, ts++, ev));
+
+  // a step up is detected within a few samples
+  int first_alarm = -1;
+  for(int i = 0; i < 50 && first_alarm < 0; i++) {
+    if(dad.update(1, sample(80, 2), ts++, ev)) {
+      first_alarm = i;
+    }
+  }
+  CHECK(first_alarm >= 0 && first_alarm < 15);
+  CHECK(ev.domain_id == 1);
+  CHECK(ev.direction == 1);
+  CHECK(fabs(ev.baseline_avg - 20) < 5);
+
+  // the baseline restarts from the new level, variance included
+  st = state_of(dad, 1);
+  CHECK(st.num_samples == 1);
+  CHECK(st.ewmvar == 0);
+  CHECK(st.num_alarms == 1);
+  alarms = 0;
+  for(int i = 0; i < 2000; i++) {
+    alarms += dad.update(1, sample(80, 2), ts++, ev) ? 1 : 0;
+  }
+  CHECK(alarms == 0);
+  st = state_of(dad, 1);
+  CHECK(fabs(st.ewma - 80) < 1);
+  // not inflated by the 20 -> 80 ms shift
+  CHECK(sqrt(st.ewmvar) < 3);
+
+  // a step down is detected as well
+  first_alarm = -1;
+  for(int i = 0; i < 50 && first_alarm < 0; i++) {
+    if(dad.update(1, sample(30, 2), ts++, ev)) {
+      first_alarm = i;
+    }
+  }
+  CHECK(first_alarm >= 0 && first_alarm < 15);
+  CHECK(ev.direction == -1);
+
+  // unknown domains are ignored
+  CHECK(!dad.update(2, 1000, ts++, ev));
+
+  // ids out of the direct index, removal and re-adding
+  std::vector<int> ids;
+  ids.push_back(-5);
+  ids.push_back(DnsAnomalyDetector::DIRECT_DOMAIN_IDS + 7);
+  ids.push_back(3);
+  dad.add_domains(ids);
+  for(size_t i = 0; i < ids.size(); i++) {
+    dad.update(ids[i], 42, ts, ev);
+    CHECK(state_of(dad, ids[i]).num_samples == 1);
+  }
+  std::vector<std::pair<int,anomaly_state> > states;
+  dad.export_states(states);
+  CHECK(states.size() == 4);
+  for(size_t i = 1; i < states.size(); i++) {
+    CHECK(states[i - 1].first < states[i].first);
+  }
+  std::vector<int> removed(1, 1);
+  dad.remove_domains(removed);
+  CHECK(!dad.update(1, 20, ts++, ev));
+  CHECK(state_of(dad, 1).num_samples == 0);
+  dad.add_domains(removed);
+  dad.update(1, 20, ts++, ev);
+  CHECK(state_of(dad, 1).num_samples == 1);
+  CHECK(state_of(dad, 3).num_samples == 1);
+
+  if(failures > 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *
+ */
+
+/* test_passive_matcher:
+ * reads data/passive.pcap (us timestamps) and data/passive.pcapng
+ * (ns timestamps) with DnsCaptureReader and matches them with
+ * DnsPassiveMatcher; both hold the same 9 Ethernet packets:
+ * - www.example.com query and response 12.5 ms later
+ * - other.org (not monitored) query and response 10 ms later
+ * - www.example.com query and response on port 5353 (not DNS)
+ * - a response without query
+ * - a.b.example.net query and response 3.25 ms later, over IPv6 */
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+
+#include "DnsCaptureReader.hpp"
+#include "DnsPassiveMatcher.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+    if(!(cond)) {							\
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond << std::endl; \
+      failures++;							\
+    }									\
+  } while(0)
+
+
+static void check_capture(const std::string &path) {
+  std::map<int,std::string> domains;
+  domains[1] = "example.com";
+  domains[2] = "example.net.";
+  DnsPassiveMatcher matcher;
+  matcher.set_domains(domains);
+  DnsCaptureReader reader;
+  try {
+    reader.open_file(path.c_str());
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    failures++;
+    return;
+  }
+  std::vector<dns_exchange> exchanges;
+  captured_packet pkt;
+  dns_exchange ex;
+  while(reader.next(pkt) == 1) {
+    if(matcher.process(pkt, ex)) {
+      exchanges.push_back(ex);
+    }
+  }
+  const passive_counters &c = matcher.get_counters();
+  CHECK(c.packets == 9);
+  CHECK(c.queries == 3);
+  CHECK(c.responses == 4);
+  CHECK(c.matched == 3);
+  CHECK(c.ignored == 1);
+  CHECK(c.unmatched == 1);
+  CHECK(c.dropped == 0);
+  CHECK(exchanges.size() == 2);
+  if(exchanges.size() == 2) {
+    CHECK(exchanges[0].domain_id == 1);
+    CHECK(fabs(exchanges[0].latency_ms - 12.5) < 1e-9);
+    CHECK(exchanges[0].ts_ns == 1000000000ULL * 1000);
+    CHECK(exchanges[1].domain_id == 2);
+    CHECK(fabs(exchanges[1].latency_ms - 3.25) < 1e-9);
+  }
+}
+
+
+int main() {
+  // set by make check, the fixtures are in the source tree
+  const char * srcdir = getenv("srcdir");
+  std::string dir = (srcdir != NULL) ? srcdir : ".";
+  check_capture(dir + "/data/passive.pcap");
+  check_capture(dir + "/data/passive.pcapng");
+  if(failures > 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
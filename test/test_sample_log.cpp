@@ -0,0 +1,196 @@
+/*
+ * dns-latency-monitor
+ *
+ * Chiara Orsini
+ * chiara@caida.org
+ *
+ * This file is part of dns-latency-monitor.
+ *
+ * dns-latency-monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * dns-latency-monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ *
+ */
+
+/* test_sample_log:
+ * writes a sample file with DnsSampleLog and reads it back, with the
+ * response columns (version 2), then aggregated by DnsLatencyReport;
+ * a version 1 file is still read, and appended to in version 1 */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "DnsSampleLog.hpp"
+#include "DnsLatencyReport.hpp"
+
+static int failures = 0;
+
+#define CHECK(cond) do {						\
+    if(!(cond)) {							\
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond << std::endl; \
+      failures++;							\
+    }									\
+  } while(0)
+
+#define SAMPLE_FILE "test_sample_log.smp"
+
+
+static response_metrics make_metrics(uint16_t size, uint16_t rcode, bool truncated,
+				     bool dnssec_ok, int validated, double validation_ms) {
+  response_metrics m;
+  memset(&m, 0, sizeof(m));
+  m.size = size;
+  m.rcode = rcode;
+  m.truncated = truncated;
+  m.edns = true;
+  m.dnssec_ok = dnssec_ok;
+  m.num_answers = 2;
+  m.num_additionals = 1;
+  m.validated = validated;
+  m.validation_ms = validation_ms;
+  return m;
+}
+
+
+static void check_version2() {
+  remove(SAMPLE_FILE);
+  DnsSampleLog log;
+  response_metrics m1 = make_metrics(100, 0, true, true, 1, 2.0);
+  response_metrics m2 = make_metrics(300, 2, false, false, -1, -1);
+  try {
+    log.open_append(SAMPLE_FILE);
+    log.append(1, 3600, 10, &m1);
+    log.append(1, 3601, 20, &m2);
+    log.append(1, 3602, -1, &m1); // failed: no metrics kept
+    log.append(2, 3603, 5);
+    log.close();
+    log.open_read(SAMPLE_FILE);
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    failures++;
+    return;
+  }
+  const std::vector<sample_block> &blocks = log.get_blocks();
+  CHECK(blocks.size() == 1);
+  if(blocks.size() != 1) {
+    return;
+  }
+  const sample_block &b = blocks[0];
+  CHECK(b.count == 4);
+  CHECK(b.min_ts == 3600 && b.max_ts == 3603);
+  CHECK(b.flags != NULL);
+  if(b.flags == NULL) {
+    return;
+  }
+  CHECK(b.flags[0] == (SAMPLE_HAS_METRICS | SAMPLE_TRUNCATED | SAMPLE_EDNS |
+		       SAMPLE_DNSSEC_OK | SAMPLE_VALIDATED));
+  CHECK(b.flags[1] == (SAMPLE_HAS_METRICS | SAMPLE_EDNS));
+  CHECK(b.flags[2] == 0);
+  CHECK(b.flags[3] == 0);
+  CHECK(b.sizes[1] == 300);
+  CHECK(b.rcodes[1] == 2);
+  CHECK(b.num_answers[0] == 2 && b.num_authorities[0] == 0 && b.num_additionals[0] == 1);
+  CHECK(b.validation_ms[0] == 2.0f);
+  CHECK(b.validation_ms[1] < 0);
+  CHECK(b.latencies[2] < 0);
+  log.close();
+
+  std::vector<report_row> rows;
+  try {
+    DnsLatencyReport dlr;
+    dlr.set_threads(2);
+    dlr.set_response_metrics(true);
+    dlr.add_sample_file(SAMPLE_FILE);
+    dlr.compute(rows);
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    failures++;
+    return;
+  }
+  CHECK(rows.size() == 2);
+  if(rows.size() == 2) {
+    const report_row &r = rows[0];
+    CHECK(r.domain_id == 1 && r.window_start == 3600);
+    CHECK(r.count == 2 && r.failures == 1);
+    CHECK(r.num_responses == 2);
+    CHECK(fabs(r.mean_size - 200) < 1e-9);
+    CHECK(r.max_size == 300);
+    CHECK(r.truncated == 1 && r.edns == 2 && r.dnssec_ok == 1);
+    CHECK(r.error_rcodes == 1);
+    CHECK(fabs(r.mean_answers - 2) < 1e-9 && fabs(r.mean_additionals - 1) < 1e-9);
+    CHECK(r.validated == 1 && r.validation_failures == 0);
+    CHECK(fabs(r.mean_validation_ms - 2) < 1e-9);
+    CHECK(rows[1].domain_id == 2 && rows[1].count == 1);
+    CHECK(rows[1].num_responses == 0);
+  }
+  remove(SAMPLE_FILE);
+}
+
+
+static void check_version1() {
+  // a version 1 file: magic, then one block of 2 samples
+  FILE * f = fopen(SAMPLE_FILE, "wb");
+  CHECK(f != NULL);
+  if(f == NULL) {
+    return;
+  }
+  uint32_t header[4] = {0x4b4c4253, 2, 7200, 7201};
+  int32_t ids[2] = {3, 3};
+  uint32_t ts[2] = {7200, 7201};
+  float latencies[2] = {1.5, -1};
+  fwrite("DNSSMPL1", 1, 8, f);
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(ids, sizeof(ids), 1, f);
+  fwrite(ts, sizeof(ts), 1, f);
+  fwrite(latencies, sizeof(latencies), 1, f);
+  fclose(f);
+  DnsSampleLog log;
+  response_metrics m = make_metrics(100, 0, false, false, -1, -1);
+  try {
+    log.open_append(SAMPLE_FILE);
+    log.append(3, 7202, 2.5, &m);
+    log.close();
+    log.open_read(SAMPLE_FILE);
+  }
+  catch(std::string s) {
+    std::cerr << s << std::endl;
+    failures++;
+    return;
+  }
+  const std::vector<sample_block> &blocks = log.get_blocks();
+  CHECK(blocks.size() == 2);
+  if(blocks.size() == 2) {
+    CHECK(blocks[0].count == 2 && blocks[0].flags == NULL);
+    CHECK(blocks[1].count == 1 && blocks[1].flags == NULL);
+    CHECK(blocks[1].domain_ids[0] == 3 && blocks[1].ts[0] == 7202);
+    CHECK(blocks[1].latencies[0] == 2.5f);
+  }
+  log.close();
+  remove(SAMPLE_FILE);
+}
+
+
+int main() {
+  check_version2();
+  check_version1();
+  if(failures > 0) {
+    std::cerr << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}